@@ -10,6 +10,9 @@
 from test_framework import BitcoinTestFramework
 from util import *
 import json
+import binascii
+import socket
+import struct
 
 try:
     import http.client as httplib
@@ -82,6 +85,53 @@ class RESTTest (BitcoinTestFramework):
         json_obj = json.loads(json_string)
         for tx in txs:
             assert_equal(tx in json_obj['tx'], True)
+
+        # check header ranges against /rest/headers/
+        height = self.nodes[0].getblockcount()
+        genesis_hash = self.nodes[0].getblockhash(0)
+        hex_string = http_get_call(url.hostname, url.port, '/rest/headers/'+str(height+1)+'/'+genesis_hash+self.FORMAT_SEPARATOR+'hex')
+        assert_equal(http_get_call(url.hostname, url.port, '/rest/headers/range/0/'+str(height+1)+self.FORMAT_SEPARATOR+'hex'), hex_string)
+        json_string = http_get_call(url.hostname, url.port, '/rest/headers/range/1/2'+self.FORMAT_SEPARATOR+'json')
+        json_obj = json.loads(json_string)
+        assert_equal([header['hash'] for header in json_obj], [self.nodes[0].getblockhash(1), self.nodes[0].getblockhash(2)])
+
+        # a range running past the tip is cut off there
+        json_string = http_get_call(url.hostname, url.port, '/rest/headers/range/'+str(height)+'/10'+self.FORMAT_SEPARATOR+'json')
+        assert_equal(len(json.loads(json_string)), 1)
+        json_string = http_get_call(url.hostname, url.port, '/rest/headers/range/'+str(height+1)+'/10'+self.FORMAT_SEPARATOR+'json')
+        assert_equal(len(json.loads(json_string)), 0)
+
+        # check block ranges against getblock, in both formats
+        blocks_hex = ''.join([self.nodes[0].getblock(self.nodes[0].getblockhash(h), False) for h in range(height+1)])
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/0/'+str(height+1)+self.FORMAT_SEPARATOR+'hex', True)
+        assert_equal(response.status, 200)
+        assert_equal(response.read(), blocks_hex+'\n')
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/0/'+str(height+10)+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 200)
+        assert_equal(binascii.hexlify(response.read()), blocks_hex)
+
+        # clients dropping the connection half way through a chunked range
+        # must not take the node down
+        assert(len(blocks_hex) > 64*1024)
+        for i in range(10):
+            sock = socket.create_connection((url.hostname, url.port))
+            sock.sendall('GET /rest/blockrange/0/'+str(height+1)+self.FORMAT_SEPARATOR+'hex HTTP/1.1\r\nHost: '+url.hostname+'\r\n\r\n')
+            assert(sock.recv(i * 1024 + 1))
+            # reset rather than close, so the node sees the connection fail
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+            sock.close()
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/0/'+str(height+1)+self.FORMAT_SEPARATOR+'hex', True)
+        assert_equal(response.read(), blocks_hex+'\n')
+        assert_equal(self.nodes[0].getblockcount(), height)
+
+        # bad ranges are refused
+        for path in ['/rest/blockrange/0/0.bin', '/rest/blockrange/-1/1.bin', '/rest/blockrange/0/1001.bin', '/rest/blockrange/0.bin', '/rest/headers/range/0/2001.hex']:
+            response = http_get_call(url.hostname, url.port, path, True)
+            assert_equal(response.status, 400)
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/'+str(height+1)+'/1.bin', True)
+        assert_equal(response.status, 404)
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/0/1.json', True)
+        assert_equal(response.status, 404)
                 
         
 
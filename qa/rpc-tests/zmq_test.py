@@ -7,10 +7,11 @@
 # Test ZMQ interface
 #
 
-from test_framework.test_framework import BitcoinTestFramework
-from test_framework.util import *
+from test_framework import BitcoinTestFramework
+from util import *
 import zmq
 import binascii
+import struct
 
 try:
     import http.client as httplib
@@ -21,18 +22,53 @@ try:
 except ImportError:
     import urlparse
 
+def bytes_to_hex_str(byte_str):
+    return binascii.hexlify(byte_str).decode('ascii')
+
+def hash_to_hex(body):
+    return bytes_to_hex_str(body[:32])
+
 class ZMQTest (BitcoinTestFramework):
 
     port = 28332
 
+    def subscribe(self, port, topics):
+        socket = self.zmqContext.socket(zmq.SUB)
+        socket.setsockopt(zmq.RCVTIMEO, 60000)
+        for topic in topics:
+            socket.setsockopt(zmq.SUBSCRIBE, topic)
+        socket.connect("tcp://127.0.0.1:%i" % port)
+        return socket
+
+    def receive(self, socket):
+        topic, body, seq = socket.recv_multipart()
+        # sequence numbers are counted per topic and must not skip
+        nSeq = struct.unpack('<I', seq)[-1]
+        if topic in self.lastSeq:
+            assert_equal(nSeq, self.lastSeq[topic] + 1)
+        self.lastSeq[topic] = nSeq
+        return topic, body
+
+    def receive_sequence(self):
+        topic, body = self.receive(self.zmqSeqSocket)
+        assert_equal(topic, b"sequence")
+        label = body[32:33]
+        if label in (b"A", b"R"):
+            assert_equal(len(body), 41)
+            return hash_to_hex(body), label, struct.unpack('<Q', body[33:])[0]
+        assert_equal(len(body), 33)
+        return hash_to_hex(body), label, None
+
     def setup_nodes(self):
         self.zmqContext = zmq.Context()
-        self.zmqSubSocket = self.zmqContext.socket(zmq.SUB)
-        self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, b"hashblock")
-        self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, b"hashtx")
-        self.zmqSubSocket.connect("tcp://127.0.0.1:%i" % self.port)
+        self.lastSeq = {}
+        self.zmqSubSocket = self.subscribe(self.port, [b"hashblock", b"hashtx"])
+        self.zmqSeqSocket = self.subscribe(self.port+1, [b"sequence"])
         return start_nodes(4, self.options.tmpdir, extra_args=[
-            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port)],
+            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port),
+             '-zmqpubsequence=tcp://127.0.0.1:'+str(self.port+1),
+             # a negative high water mark means no limit, a large one has to be accepted too
+             '-zmqpubhashblockhwm=-5', '-zmqpubsequencehwm=100000'],
             [],
             [],
             []
@@ -45,16 +81,12 @@ class ZMQTest (BitcoinTestFramework):
         self.sync_all()
 
         print "listen..."
-        msg = self.zmqSubSocket.recv_multipart()
-        topic = msg[0]
-        body = msg[1]
-
-        msg = self.zmqSubSocket.recv_multipart()
-        topic = msg[0]
-        body = msg[1]
-        blkhash = bytes_to_hex_str(body)
-
-        assert_equal(genhashes[0], blkhash) #blockhash from generate must be equal to the hash received over zmq
+        topic, body = self.receive(self.zmqSubSocket)
+        assert_equal(topic, b"hashtx")
+        topic, body = self.receive(self.zmqSubSocket)
+        assert_equal(topic, b"hashblock")
+        assert_equal(genhashes[0], hash_to_hex(body)) #blockhash from generate must be equal to the hash received over zmq
+        assert_equal(self.receive_sequence(), (genhashes[0], b"C", None))
 
         n = 10
         genhashes = self.nodes[1].generate(n)
@@ -62,28 +94,56 @@ class ZMQTest (BitcoinTestFramework):
 
         zmqHashes = []
         for x in range(0,n*2):
-            msg = self.zmqSubSocket.recv_multipart()
-            topic = msg[0]
-            body = msg[1]
+            topic, body = self.receive(self.zmqSubSocket)
             if topic == b"hashblock":
-                zmqHashes.append(bytes_to_hex_str(body))
+                zmqHashes.append(hash_to_hex(body))
 
         for x in range(0,n):
             assert_equal(genhashes[x], zmqHashes[x]) #blockhash from generate must be equal to the hash received over zmq
+            assert_equal(self.receive_sequence(), (genhashes[x], b"C", None))
 
         #test tx from a second node
         hashRPC = self.nodes[1].sendtoaddress(self.nodes[0].getnewaddress(), 1.0)
         self.sync_all()
 
         # now we should receive a zmq msg because the tx was broadcast
-        msg = self.zmqSubSocket.recv_multipart()
-        topic = msg[0]
-        body = msg[1]
-        hashZMQ = ""
-        if topic == b"hashtx":
-            hashZMQ = bytes_to_hex_str(body)
-
-        assert_equal(hashRPC, hashZMQ) #blockhash from generate must be equal to the hash received over zmq
+        topic, body = self.receive(self.zmqSubSocket)
+        assert_equal(topic, b"hashtx")
+        assert_equal(hashRPC, hash_to_hex(body)) #txid from sendtoaddress must be equal to the hash received over zmq
+
+        # the mempool acceptance is on the sequence topic, with its mempool sequence number
+        txid, label, nAdded = self.receive_sequence()
+        assert_equal((txid, label), (hashRPC, b"A"))
+
+        # mining it removes it from the mempool before the block is reported
+        genhashes = self.nodes[0].generate(1)
+        self.sync_all()
+        txid, label, nRemoved = self.receive_sequence()
+        assert_equal((txid, label), (hashRPC, b"R"))
+        assert(nRemoved > nAdded)
+        assert_equal(self.receive_sequence(), (genhashes[0], b"C", None))
+        hashBlockMined = genhashes[0]
+
+        # in a reorg the block is disconnected before its transaction returns
+        # to the mempool, and hashblock reports every block connected again
+        self.nodes[0].invalidateblock(hashBlockMined)
+        assert_equal(self.receive_sequence(), (hashBlockMined, b"D", None))
+        txid, label, nReadded = self.receive_sequence()
+        assert_equal((txid, label), (hashRPC, b"A"))
+        assert(nReadded > nRemoved)
+
+        self.nodes[0].reconsiderblock(hashBlockMined)
+        txid, label, nRemovedAgain = self.receive_sequence()
+        assert_equal((txid, label), (hashRPC, b"R"))
+        assert(nRemovedAgain > nReadded)
+        assert_equal(self.receive_sequence(), (hashBlockMined, b"C", None))
+
+        zmqHashes = []
+        while len(zmqHashes) < 2:
+            topic, body = self.receive(self.zmqSubSocket)
+            if topic == b"hashblock":
+                zmqHashes.append(hash_to_hex(body))
+        assert_equal(zmqHashes, [hashBlockMined, hashBlockMined])
 
 
 if __name__ == '__main__':
@@ -54,6 +54,11 @@ struct CDiskBlockPos {
         return !(a == b);
     }
 
+    friend bool operator<(const CDiskBlockPos& a, const CDiskBlockPos& b)
+    {
+        return (a.nFile < b.nFile || (a.nFile == b.nFile && a.nPos < b.nPos));
+    }
+
     void SetNull()
     {
         nFile = -1;
@@ -601,6 +606,46 @@ public:
     const CBlockIndex* FindFork(const CBlockIndex* pindex) const;
 };
 
+/**
+ * A read-only view of a chain as of one tip. Block index entries are never
+ * freed, and their height, ancestry and header fields don't change once they
+ * exist, so a snapshot can be queried without cs_main and stays consistent
+ * while the chain it was taken from moves on. Lookups by height walk the
+ * skip list, O(log n).
+ */
+class CChainSnapshot
+{
+private:
+    const CBlockIndex* pindexTip;
+
+public:
+    explicit CChainSnapshot(const CBlockIndex* pindexTipIn) : pindexTip(pindexTipIn) {}
+
+    const CBlockIndex* Tip() const { return pindexTip; }
+
+    int Height() const { return pindexTip ? pindexTip->nHeight : -1; }
+
+    const CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight > Height())
+            return NULL;
+        return pindexTip->GetAncestor(nHeight);
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    const CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        else
+            return NULL;
+    }
+};
+
 const CBlockIndex* GetLastBlockIndex_Legacy(const CBlockIndex* pindex, bool fProofOfStake);
 
 #endif // BITCOIN_CHAIN_H
@@ -11,7 +11,9 @@
 #include "init.h"
 #include "uint256.h"
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 #include "wallet.h"
@@ -213,6 +215,19 @@ bool CCryptoKeyStore::Lock()
     return true;
 }
 
+/** Decrypt a key and check it against its public key */
+static bool CheckCryptedKey(const CKeyingMaterial& vMasterKeyIn, const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret)
+{
+    CKeyingMaterial vchSecret;
+    if (!DecryptSecret(vMasterKeyIn, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+        return false;
+    if (vchSecret.size() != 32)
+        return false;
+    CKey key;
+    key.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+    return key.GetPubKey() == vchPubKey;
+}
+
 bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
 {
     {
@@ -220,30 +235,30 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (!SetCrypted())
             return false;
 
+        // One key tells whether the master key is right. The first time a
+        // sample spread over the wallet is checked as well; deriving every
+        // public key here would take minutes on large wallets, so the others
+        // are checked by GetKey when they are first used.
+        size_t nSample = fDecryptionThoroughlyChecked ? 1 : WALLET_CRYPTO_UNLOCK_SAMPLE;
+        size_t nStep = std::max(mapCryptedKeys.size() / nSample, (size_t)1);
+        size_t n = 0;
+        std::set<CKeyID> setUnchecked;
+
         bool keyPass = false;
         bool keyFail = false;
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi) {
-            const CPubKey& vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char>& vchCryptedSecret = (*mi).second.second;
-            CKeyingMaterial vchSecret;
-            if (!DecryptSecret(vMasterKeyIn, vchCryptedSecret, vchPubKey.GetHash(), vchSecret)) {
-                keyFail = true;
-                break;
-            }
-            if (vchSecret.size() != 32) {
-                keyFail = true;
-                break;
-            }
-            CKey key;
-            key.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
-            if (key.GetPubKey() != vchPubKey) {
-                keyFail = true;
+        for (; mi != mapCryptedKeys.end(); ++mi, ++n) {
+            if (n % nStep == 0 && n / nStep < nSample) {
+                if (!CheckCryptedKey(vMasterKeyIn, (*mi).second.first, (*mi).second.second)) {
+                    keyFail = true;
+                    break;
+                }
+                keyPass = true;
+            } else if (fDecryptionThoroughlyChecked) {
                 break;
+            } else {
+                setUnchecked.insert(setUnchecked.end(), (*mi).first);
             }
-            keyPass = true;
-            if (fDecryptionThoroughlyChecked)
-                break;
         }
         if (keyPass && keyFail) {
             LogPrintf("The wallet is probably corrupted: Some keys decrypt but not all.");
@@ -252,6 +267,8 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (keyFail || !keyPass)
             return false;
         vMasterKey = vMasterKeyIn;
+        if (!fDecryptionThoroughlyChecked)
+            setUncheckedKeys.swap(setUnchecked);
         fDecryptionThoroughlyChecked = true;
     }
 
@@ -310,6 +327,13 @@ bool CCryptoKeyStore::GetKey(const CKeyID& address, CKey& keyOut) const
             if (vchSecret.size() != 32)
                 return false;
             keyOut.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+            if (!setUncheckedKeys.empty() && setUncheckedKeys.count(address)) {
+                if (keyOut.GetPubKey() != vchPubKey) {
+                    LogPrintf("The wallet is probably corrupted: key %s doesn't decrypt.\n", address.ToString());
+                    return false;
+                }
+                setUncheckedKeys.erase(address);
+            }
             return true;
         }
     }
@@ -332,6 +356,41 @@ bool CCryptoKeyStore::GetPubKey(const CKeyID& address, CPubKey& vchPubKeyOut) co
     return false;
 }
 
+/** A plain key EncryptKeys encrypts, with the results of doing so */
+struct CKeyEncryption {
+    const CKey* pkey;
+    CPubKey vchPubKey;
+    std::vector<unsigned char> vchCryptedSecret;
+    bool fOk;
+};
+
+static void EncryptKeyRange(const CKeyingMaterial* pvMasterKey, std::vector<CKeyEncryption>* pvKeys, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        CKeyEncryption& enc = (*pvKeys)[i];
+        enc.vchPubKey = enc.pkey->GetPubKey();
+        CKeyingMaterial vchSecret(enc.pkey->begin(), enc.pkey->end());
+        enc.fOk = EncryptSecret(*pvMasterKey, vchSecret, enc.vchPubKey.GetHash(), enc.vchCryptedSecret);
+    }
+}
+
+/** Derive the public keys and encrypt, split over a few threads when there are enough keys to pay off */
+static void EncryptKeyBatch(const CKeyingMaterial& vMasterKeyIn, std::vector<CKeyEncryption>& vKeys)
+{
+    size_t nThreads = std::min<size_t>(std::max(boost::thread::hardware_concurrency(), 1u), WALLET_CRYPTO_MAX_THREADS);
+    nThreads = std::min(nThreads, vKeys.size() / WALLET_CRYPTO_MIN_KEYS_PER_THREAD);
+    if (nThreads <= 1) {
+        EncryptKeyRange(&vMasterKeyIn, &vKeys, 0, vKeys.size());
+        return;
+    }
+    boost::thread_group threads;
+    size_t nPerThread = (vKeys.size() + nThreads - 1) / nThreads;
+    for (size_t nBegin = nPerThread; nBegin < vKeys.size(); nBegin += nPerThread)
+        threads.create_thread(boost::bind(&EncryptKeyRange, &vMasterKeyIn, &vKeys, nBegin, std::min(nBegin + nPerThread, vKeys.size())));
+    EncryptKeyRange(&vMasterKeyIn, &vKeys, 0, nPerThread);
+    threads.join_all();
+}
+
 bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
 {
     {
@@ -340,14 +399,17 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
             return false;
 
         fUseCrypto = true;
-        BOOST_FOREACH (KeyMap::value_type& mKey, mapKeys) {
-            const CKey& key = mKey.second;
-            CPubKey vchPubKey = key.GetPubKey();
-            CKeyingMaterial vchSecret(key.begin(), key.end());
-            std::vector<unsigned char> vchCryptedSecret;
-            if (!EncryptSecret(vMasterKeyIn, vchSecret, vchPubKey.GetHash(), vchCryptedSecret))
+        std::vector<CKeyEncryption> vKeys(mapKeys.size());
+        size_t i = 0;
+        BOOST_FOREACH (KeyMap::value_type& mKey, mapKeys)
+            vKeys[i++].pkey = &mKey.second;
+        EncryptKeyBatch(vMasterKeyIn, vKeys);
+
+        // Stored one by one, AddCryptedKey writes to the wallet database
+        BOOST_FOREACH (const CKeyEncryption& enc, vKeys) {
+            if (!enc.fOk)
                 return false;
-            if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
+            if (!AddCryptedKey(enc.vchPubKey, enc.vchCryptedSecret))
                 return false;
         }
         mapKeys.clear();
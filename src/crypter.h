@@ -15,6 +15,12 @@ class uint256;
 
 const unsigned int WALLET_CRYPTO_KEY_SIZE = 32;
 const unsigned int WALLET_CRYPTO_SALT_SIZE = 8;
+//! Most threads EncryptKeys spreads the keys over
+const unsigned int WALLET_CRYPTO_MAX_THREADS = 16;
+//! Fewest keys per thread worth starting one for
+const unsigned int WALLET_CRYPTO_MIN_KEYS_PER_THREAD = 256;
+//! Keys the first Unlock checks up front, spread over the wallet
+const unsigned int WALLET_CRYPTO_UNLOCK_SAMPLE = 16;
 
 /**
  * Private key encryption is done based on a CMasterKey,
@@ -134,6 +140,9 @@ private:
     //! keeps track of whether Unlock has run a thorough check before
     bool fDecryptionThoroughlyChecked;
 
+    //! keys the first Unlock left out of its sample, GetKey checks them on first use
+    mutable std::set<CKeyID> setUncheckedKeys;
+
 protected:
     bool SetCrypted();
 
@@ -268,6 +268,46 @@ protected:
         return 0;
     }
 
+    /**
+     * Read the next run of records at the cursor in one DB_MULTIPLE_KEY call.
+     * The records are decoded in place: vRecords gets (key, value) pointers
+     * into vchBuffer, valid until the next call. The buffer grows if a single
+     * record does not fit; its allocator wipes what it held, key records
+     * included, when it grows or is freed. Returns 0, DB_NOTFOUND at the end, or a Berkeley DB
+     * error code.
+     */
+    int ReadAtCursorBulk(Dbc* pcursor, CSerializeData& vchBuffer, std::vector<std::pair<Dbt, Dbt> >& vRecords)
+    {
+        vRecords.clear();
+        Dbt datKey;
+        Dbt datValue;
+        int ret;
+        while (true) {
+            datValue.set_data(&vchBuffer[0]);
+            datValue.set_ulen(vchBuffer.size());
+            datValue.set_flags(DB_DBT_USERMEM);
+            ret = pcursor->get(&datKey, &datValue, DB_MULTIPLE_KEY | DB_NEXT);
+            if (ret != DB_BUFFER_SMALL)
+                break;
+            vchBuffer.resize(std::max(2 * vchBuffer.size(), (size_t)datValue.get_size()));
+        }
+        if (ret != 0)
+            return ret;
+
+        void* p;
+        DB_MULTIPLE_INIT(p, datValue.get_DBT());
+        while (true) {
+            void* pKey;
+            void* pValue;
+            uint32_t nKeySize, nValueSize;
+            DB_MULTIPLE_KEY_NEXT(p, datValue.get_DBT(), pKey, nKeySize, pValue, nValueSize);
+            if (p == NULL)
+                break;
+            vRecords.push_back(std::make_pair(Dbt(pKey, nKeySize), Dbt(pValue, nValueSize)));
+        }
+        return 0;
+    }
+
 public:
     bool TxnBegin()
     {
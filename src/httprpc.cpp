@@ -17,6 +17,7 @@
 #include "ui_interface.h"
 
 #include <boost/algorithm/string.hpp> // boost::trim
+#include <boost/bind.hpp>
 
 /** Simple one-shot callback timer to be used by the RPC mechanism to e.g.
  * re-lock the wellet.
@@ -127,6 +128,11 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
+            if (tableRPC.isStreamable(jreq.strMethod)) {
+                HTTPWriteJSONReply(req, HTTP_OK, boost::bind(&JSONRPCStreamReply, boost::cref(jreq), _1));
+                return true;
+            }
+
             UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
 
             // Send reply
@@ -134,7 +140,7 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
 
         // array of requests
         } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(jreq, valRequest.get_array());
+            strReply = JSONRPCExecBatch(jreq, valRequest.get_array(), &HTTPEnqueueWork, HTTPWorkerThreads() - 1);
         else
             throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
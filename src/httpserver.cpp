@@ -7,6 +7,7 @@
 
 #include "chainparamsbase.h"
 #include "compat.h"
+#include "jsonstream.h"
 #include "util.h"
 #include "netbase.h"
 #include "rpcprotocol.h" // For HTTP status codes
@@ -16,6 +17,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <atomic>
+#include <deque>
+#include <map>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,6 +29,7 @@
 #include <event2/http.h>
 #include <event2/thread.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 
@@ -36,6 +41,7 @@
 #endif
 
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
 
@@ -62,44 +68,117 @@ private:
     HTTPRequestHandler func;
 };
 
-/** Simple work queue for distributing work over multiple threads.
- * Work items are simply callable objects.
+/** Work item running an arbitrary function, see HTTPEnqueueWork */
+class HTTPFunctionWorkItem : public HTTPClosure
+{
+public:
+    HTTPFunctionWorkItem(const boost::function<void(void)>& func) : func(func)
+    {
+    }
+    void operator()()
+    {
+        func();
+    }
+
+private:
+    boost::function<void(void)> func;
+};
+
+/** Work queue for distributing work over a pool of threads.
+ * Work items are simply callable objects. Each item belongs to a client,
+ * clients take turns, so one with a long backlog does not hold up the
+ * others. At most maxDepth items wait in total, and at most maxClientDepth
+ * for any one client. The pool grows while work is waiting and no thread is idle, up to
+ * maxThreads, and threads above minThreads exit again after idling for
+ * HTTP_WORKER_IDLE_TIMEOUT seconds.
  */
 template <typename WorkItem>
 class WorkQueue
 {
+public:
+    typedef void (*ThreadFunc)(WorkQueue*);
+
 private:
     /** Mutex protects entire object */
     CWaitableCriticalSection cs;
     CConditionVariable cond;
     /* XXX in C++11 we can use std::unique_ptr here and avoid manual cleanup */
-    std::deque<WorkItem*> queue;
+    std::map<std::string, std::deque<WorkItem*> > mapQueues;
+    /** Clients with queued work, in the order they get their next turn */
+    std::deque<std::string> clientTurns;
+    size_t depth;
     bool running;
     size_t maxDepth;
+    size_t maxClientDepth;
     int numThreads;
+    //! threads that decided to exit on an idle timeout but are still counted in numThreads
+    int numRetiring;
+    int numIdle;
+    int minThreads;
+    int maxThreads;
+    ThreadFunc threadFunc;
+    uint64_t numRejected;
 
-    /** RAII object to keep track of number of running worker threads */
+    /** RAII object to keep track of number of running worker threads, counted from StartThread */
     class ThreadCounter
     {
     public:
         WorkQueue &wq;
-        ThreadCounter(WorkQueue &w): wq(w)
+        bool fRetiring;
+        ThreadCounter(WorkQueue &w): wq(w), fRetiring(false)
         {
-            boost::lock_guard<boost::mutex> lock(wq.cs);
-            wq.numThreads += 1;
         }
         ~ThreadCounter()
         {
             boost::lock_guard<boost::mutex> lock(wq.cs);
             wq.numThreads -= 1;
+            if (fRetiring)
+                wq.numRetiring -= 1;
             wq.cond.notify_all();
         }
     };
 
+    /** Start a worker thread. Requires cs. */
+    bool StartThread()
+    {
+        try {
+            boost::thread(boost::bind(threadFunc, this));
+        } catch (const boost::thread_resource_error& e) {
+            LogPrintf("HTTP: could not start worker thread: %s\n", e.what());
+            return false;
+        }
+        numThreads += 1;
+        return true;
+    }
+
+    /** Take the next client's oldest item. Requires cs and depth > 0. */
+    WorkItem* Pop()
+    {
+        std::string client = clientTurns.front();
+        clientTurns.pop_front();
+        typename std::map<std::string, std::deque<WorkItem*> >::iterator it = mapQueues.find(client);
+        WorkItem* i = it->second.front();
+        it->second.pop_front();
+        if (it->second.empty())
+            mapQueues.erase(it);
+        else
+            clientTurns.push_back(client);
+        depth -= 1;
+        return i;
+    }
+
 public:
-    WorkQueue(size_t maxDepth) : running(true),
-                                 maxDepth(maxDepth),
-                                 numThreads(0)
+    WorkQueue(size_t maxDepth, size_t maxClientDepth, int minThreads, int maxThreads, ThreadFunc threadFunc) : depth(0),
+                                                                                      running(true),
+                                                                                      maxDepth(maxDepth),
+                                                                                      maxClientDepth(maxClientDepth),
+                                                                                      numThreads(0),
+                                                                                      numRetiring(0),
+                                                                                      numIdle(0),
+                                                                                      minThreads(minThreads),
+                                                                                      maxThreads(maxThreads),
+                                                                                      threadFunc(threadFunc),
+                                                                                      numRejected(0)
     {
     }
     /*( Precondition: worker threads have all stopped
@@ -107,19 +186,39 @@ public:
      */
     ~WorkQueue()
     {
-        while (!queue.empty()) {
-            delete queue.front();
-            queue.pop_front();
+        for (typename std::map<std::string, std::deque<WorkItem*> >::iterator it = mapQueues.begin(); it != mapQueues.end(); ++it) {
+            BOOST_FOREACH (WorkItem* i, it->second)
+                delete i;
+        }
+    }
+    /** Start the minimum number of worker threads */
+    void Start()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (numThreads < minThreads && StartThread()) {
         }
     }
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
+    /** Enqueue a work item on behalf of client */
+    bool Enqueue(WorkItem* item, const std::string& client)
     {
         boost::unique_lock<boost::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
+        if (depth >= maxDepth) {
+            numRejected += 1;
+            return false;
+        }
+        std::deque<WorkItem*>& queue = mapQueues[client];
+        if (queue.size() >= maxClientDepth) {
+            if (queue.empty())
+                mapQueues.erase(client);
+            numRejected += 1;
             return false;
         }
+        if (queue.empty())
+            clientTurns.push_back(client);
         queue.push_back(item);
+        depth += 1;
+        if (numIdle == 0 && numThreads - numRetiring < maxThreads && running)
+            StartThread();
         cond.notify_one();
         return true;
     }
@@ -127,19 +226,29 @@ public:
     void Run()
     {
         ThreadCounter count(*this);
+        boost::unique_lock<boost::mutex> lock(cs);
         while (running) {
-            WorkItem* i = 0;
-            {
-                boost::unique_lock<boost::mutex> lock(cs);
-                while (running && queue.empty())
-                    cond.wait(lock);
-                if (!running)
+            if (depth == 0) {
+                boost::system_time idleUntil = boost::get_system_time() + boost::posix_time::seconds(HTTP_WORKER_IDLE_TIMEOUT);
+                bool fTimedOut = false;
+                numIdle += 1;
+                while (running && depth == 0 && !fTimedOut)
+                    fTimedOut = !cond.timed_wait(lock, idleUntil);
+                numIdle -= 1;
+                // Claim the exit under cs, so two threads timing out together
+                // can't both leave when only one is above minThreads
+                if (fTimedOut && depth == 0 && numThreads - numRetiring > minThreads) {
+                    numRetiring += 1;
+                    count.fRetiring = true;
                     break;
-                i = queue.front();
-                queue.pop_front();
+                }
+                continue;
             }
+            WorkItem* i = Pop();
+            lock.unlock();
             (*i)();
             delete i;
+            lock.lock();
         }
     }
     /** Interrupt and exit loops */
@@ -161,7 +270,28 @@ public:
     size_t Depth()
     {
         boost::unique_lock<boost::mutex> lock(cs);
-        return queue.size();
+        return depth;
+    }
+
+    /** Number of running worker threads */
+    int Threads()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return numThreads;
+    }
+
+    void GetStats(HTTPWorkQueueStats& stats)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        stats.nThreads = numThreads - numRetiring;
+        stats.nIdleThreads = numIdle;
+        stats.nMinThreads = minThreads;
+        stats.nMaxThreads = maxThreads;
+        stats.nDepth = depth;
+        stats.nClients = mapQueues.size();
+        stats.nMaxDepth = maxDepth;
+        stats.nMaxClientDepth = maxClientDepth;
+        stats.nRejected = numRejected;
     }
 };
 
@@ -181,6 +311,8 @@ struct HTTPPathHandler
 
 //! libevent event loop
 static struct event_base* eventBase = 0;
+//! Set on shutdown, so handlers waiting for slow clients give up
+static std::atomic<bool> fReplyFlowInterrupted(false);
 //! HTTP server
 struct evhttp* eventHTTP = 0;
 //! List of subnets to allow RPC connections from
@@ -288,12 +420,14 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
 
     // Dispatch to worker thread
     if (i != iend) {
+        // Requests take turns per client address, not per connection
+        std::string client = hreq->GetPeer().ToStringIP();
         std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(hreq.release(), path, i->handler));
         assert(workQueue);
-        if (workQueue->Enqueue(item.get()))
+        if (workQueue->Enqueue(item.get(), client))
             item.release(); /* if true, queue took ownership */
         else
-            item->req->WriteReply(HTTP_INTERNAL, "Work queue depth exceeded");
+            item->req->WriteReply(HTTP_SERVUNAVAIL, "Work queue depth exceeded");
     } else {
         hreq->WriteReply(HTTP_NOTFOUND);
     }
@@ -433,9 +567,12 @@ bool InitHTTPServer()
 
     LogPrint("http", "Initialized HTTP server\n");
     int workQueueDepth = std::max((long)GetArg("-rpcworkqueue", DEFAULT_HTTP_WORKQUEUE), 1L);
-    LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
+    int clientQueueDepth = std::min(std::max((long)GetArg("-rpcclientqueue", workQueueDepth), 1L), (long)workQueueDepth);
+    int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
+    int rpcMaxThreads = std::max((long)GetArg("-rpcmaxthreads", std::max(DEFAULT_HTTP_MAX_THREADS, rpcThreads)), (long)rpcThreads);
+    LogPrintf("HTTP: creating work queue of depth %d, %d per client\n", workQueueDepth, clientQueueDepth);
 
-    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
+    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth, clientQueueDepth, rpcThreads, rpcMaxThreads, &HTTPWorkQueueRun);
     eventBase = base;
     eventHTTP = http;
     return true;
@@ -446,12 +583,37 @@ boost::thread threadHTTP;
 bool StartHTTPServer()
 {
     LogPrint("http", "Starting HTTP server\n");
-    int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
-    LogPrintf("HTTP: starting %d worker threads\n", rpcThreads);
+    HTTPWorkQueueStats stats;
+    workQueue->GetStats(stats);
+    LogPrintf("HTTP: starting %d worker threads (up to %d under load)\n", stats.nMinThreads, stats.nMaxThreads);
     threadHTTP = boost::thread(boost::bind(&ThreadHTTP, eventBase, eventHTTP));
 
-    for (int i = 0; i < rpcThreads; i++)
-        boost::thread(boost::bind(&HTTPWorkQueueRun, workQueue));
+    workQueue->Start();
+    return true;
+}
+
+bool HTTPEnqueueWork(const boost::function<void(void)>& func)
+{
+    if (!workQueue)
+        return false;
+    std::unique_ptr<HTTPFunctionWorkItem> item(new HTTPFunctionWorkItem(func));
+    // Follow-up work of requests already admitted shares one lane
+    if (!workQueue->Enqueue(item.get(), ""))
+        return false;
+    item.release(); /* if true, queue took ownership */
+    return true;
+}
+
+int HTTPWorkerThreads()
+{
+    return workQueue ? workQueue->Threads() : 0;
+}
+
+bool HTTPGetWorkQueueStats(HTTPWorkQueueStats& stats)
+{
+    if (!workQueue)
+        return false;
+    workQueue->GetStats(stats);
     return true;
 }
 
@@ -466,6 +628,7 @@ void InterruptHTTPServer()
     }
     if (workQueue)
         workQueue->Interrupt();
+    fReplyFlowInterrupted = true;
 }
 
 void StopHTTPServer()
@@ -538,12 +701,17 @@ void HTTPEvent::trigger(struct timeval* tv)
         evtimer_add(ev, tv); // trigger after timeval passed
 }
 HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
-                                                       replySent(false)
+                                                       replySent(false),
+                                                       replyChunked(false)
 {
 }
 HTTPRequest::~HTTPRequest()
 {
-    if (!replySent) {
+    if (replyChunked && !replySent) {
+        // The handler gave up half way, don't let the body look complete
+        LogPrintf("%s: Unfinished chunked reply\n", __func__);
+        AbortReplyChunked();
+    } else if (!replySent) {
         // Keep track of whether reply was sent to avoid request leaks
         LogPrintf("%s: Unhandled request\n", __func__);
         WriteReply(HTTP_INTERNAL, "Unhandled request");
@@ -596,7 +764,7 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
 {
-    assert(!replySent && req);
+    assert(!replySent && !replyChunked && req);
     // Send event to main http thread to send reply message
     struct evbuffer* evb = evhttp_request_get_output_buffer(req);
     assert(evb);
@@ -608,6 +776,197 @@ void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
     req = 0; // transferred back to main thread
 }
 
+//! How often a held up chunked reply checks whether the client caught up, in milliseconds
+static const int HTTP_REPLY_POLL_MS = 20;
+
+/**
+ * Flow control of a chunked reply between the worker writing it and the
+ * event thread sending it. The worker counts what it handed over, the event
+ * thread measures what is still in the connection's output buffer.
+ *
+ * When the client drops the connection half way, libevent 2.1 keeps req but
+ * clears its connection, so everything on the event thread checks for that
+ * and frees req itself when the reply is ended or given up.
+ */
+struct HTTPReplyFlow
+{
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    size_t nInFlight; //!< handed to the event thread, not yet in the output buffer
+    size_t nOutput;   //!< in the output buffer, as last measured
+    bool fPolling;    //!< a timer is set to measure again
+    bool fClosed;     //!< the reply was ended or given up, req may be gone
+    bool fGone;       //!< the client went away
+
+    HTTPReplyFlow() : nInFlight(0), nOutput(0), fPolling(false), fClosed(false), fGone(false) {}
+};
+
+/** Measure what req still has to send and wake the worker. Runs on the main http thread. */
+static void HTTPMeasureReply(struct evhttp_request* req, boost::shared_ptr<HTTPReplyFlow> flow, bool fTimer)
+{
+    boost::unique_lock<boost::mutex> lock(flow->cs);
+    if (fTimer)
+        flow->fPolling = false;
+    if (flow->fClosed)
+        return;
+    evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (!evcon) {
+        flow->fGone = true;
+    } else {
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+        struct bufferevent* bev = evhttp_connection_get_bufferevent(evcon);
+        flow->nOutput = bev ? evbuffer_get_length(bufferevent_get_output(bev)) : 0;
+#endif
+        // libevent has no callback for this, so check again shortly until the client caught up
+        if (flow->nOutput >= HTTP_REPLY_BUFFER_MAX && !flow->fPolling) {
+            struct timeval tv = {0, HTTP_REPLY_POLL_MS * 1000};
+            HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(&HTTPMeasureReply, req, flow, true));
+            ev->trigger(&tv);
+            flow->fPolling = true;
+        }
+    }
+    flow->cond.notify_all();
+}
+
+/** Runs on the main http thread */
+static void HTTPStartReply(struct evhttp_request* req, int nStatus)
+{
+    if (evhttp_request_get_connection(req))
+        evhttp_send_reply_start(req, nStatus, NULL);
+}
+
+/** Runs on the main http thread */
+static void HTTPSendReplyChunk(struct evhttp_request* req, struct evbuffer* evb, boost::shared_ptr<HTTPReplyFlow> flow)
+{
+    size_t nSize = evbuffer_get_length(evb);
+    if (evhttp_request_get_connection(req))
+        evhttp_send_reply_chunk(req, evb);
+    evbuffer_free(evb);
+    {
+        boost::unique_lock<boost::mutex> lock(flow->cs);
+        flow->nInFlight -= nSize;
+    }
+    HTTPMeasureReply(req, flow, false);
+}
+
+/** Runs on the main http thread. Without a connection nothing else frees req. */
+static void HTTPEndReply(struct evhttp_request* req, boost::shared_ptr<HTTPReplyFlow> flow, bool fAbort)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(flow->cs);
+        flow->fClosed = true;
+    }
+    evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (!evcon)
+        evhttp_request_free(req);
+    else if (fAbort)
+        evhttp_connection_free(evcon); // frees req along with the connection
+    else
+        evhttp_send_reply_end(req);
+}
+
+void HTTPRequest::StartReplyChunked(int nStatus)
+{
+    assert(!replySent && !replyChunked && req);
+    replyFlow.reset(new HTTPReplyFlow());
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(&HTTPStartReply, req, nStatus));
+    ev->trigger(0);
+    replyChunked = true;
+}
+
+bool HTTPRequest::WriteReplyChunk(const std::string& strChunk)
+{
+    assert(replyChunked && !replySent && req);
+    {
+        boost::unique_lock<boost::mutex> lock(replyFlow->cs);
+        while (replyFlow->nInFlight + replyFlow->nOutput >= HTTP_REPLY_BUFFER_MAX && !replyFlow->fGone && !fReplyFlowInterrupted)
+            replyFlow->cond.timed_wait(lock, boost::posix_time::milliseconds(HTTP_REPLY_POLL_MS));
+        if (replyFlow->fGone || fReplyFlowInterrupted)
+            return false;
+        replyFlow->nInFlight += strChunk.size();
+    }
+    // Events are handled in the order they were triggered, so chunks go out in order
+    struct evbuffer* evb = evbuffer_new();
+    assert(evb);
+    evbuffer_add(evb, strChunk.data(), strChunk.size());
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(&HTTPSendReplyChunk, req, evb, replyFlow));
+    ev->trigger(0);
+    return true;
+}
+
+void HTTPRequest::EndReplyChunked()
+{
+    assert(replyChunked && !replySent && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(&HTTPEndReply, req, replyFlow, false));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // transferred back to main thread
+}
+
+void HTTPRequest::AbortReplyChunked()
+{
+    assert(replyChunked && !replySent && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(&HTTPEndReply, req, replyFlow, true));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // freed by the main thread
+}
+
+/**
+ * Writer sink for HTTPWriteJSONReply. Holds back the latest chunk, so the
+ * reply only turns chunked once a second one shows up.
+ */
+class HTTPJSONReplySink
+{
+public:
+    HTTPRequest* req;
+    int nStatus;
+    std::string strPending;
+    bool fChunked;
+
+    HTTPJSONReplySink(HTTPRequest* reqIn, int nStatusIn) : req(reqIn), nStatus(nStatusIn), fChunked(false) {}
+
+    void Write(const std::string& str)
+    {
+        if (!strPending.empty()) {
+            if (!fChunked) {
+                req->WriteHeader("Content-Type", "application/json");
+                req->StartReplyChunked(nStatus);
+                fChunked = true;
+            }
+            if (!req->WriteReplyChunk(strPending))
+                throw std::runtime_error("client went away");
+        }
+        strPending = str;
+    }
+};
+
+void HTTPWriteJSONReply(HTTPRequest* req, int nStatus, const boost::function<void(CJSONStreamWriter&)>& fill)
+{
+    HTTPJSONReplySink sink(req, nStatus);
+    CJSONStreamWriter writer(boost::bind(&HTTPJSONReplySink::Write, &sink, _1));
+    try {
+        fill(writer);
+        writer.Flush();
+    } catch (...) {
+        if (!sink.fChunked)
+            throw;
+        LogPrintf("%s: Reply cut short, dropping the connection\n", __func__);
+        req->AbortReplyChunked();
+        return;
+    }
+    if (!sink.fChunked) {
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(nStatus, sink.strPending);
+        return;
+    }
+    if (!req->WriteReplyChunk(sink.strPending)) {
+        req->AbortReplyChunked();
+        return;
+    }
+    req->EndReplyChunked();
+}
+
 CService HTTPRequest::GetPeer()
 {
     evhttp_connection* con = evhttp_request_get_connection(req);
@@ -9,16 +9,24 @@
 #include <stdint.h>
 #include <boost/thread.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
 
 static const int DEFAULT_HTTP_THREADS=4;
+static const int DEFAULT_HTTP_MAX_THREADS=16;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
+//! Seconds an HTTP worker above -rpcthreads stays idle before it exits
+static const int HTTP_WORKER_IDLE_TIMEOUT=60;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+//! Bytes of a chunked reply that may wait to be sent before the handler writing it is held up
+static const size_t HTTP_REPLY_BUFFER_MAX=4*1024*1024;
 
 struct evhttp_request;
 struct event_base;
+class CJSONStreamWriter;
 class CService;
 class HTTPRequest;
+struct HTTPReplyFlow;
 
 /** Initialize HTTP server.
  * Call this before RegisterHTTPHandler or EventBase().
@@ -49,6 +57,29 @@ void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
  */
 struct event_base* EventBase();
 
+/** Queue func to run on an HTTP worker thread.
+ * Returns false, without running it, if the work queue is full or stopped.
+ */
+bool HTTPEnqueueWork(const boost::function<void(void)>& func);
+/** Number of HTTP worker threads currently running */
+int HTTPWorkerThreads();
+
+/** State of the HTTP work queue, see HTTPGetWorkQueueStats */
+struct HTTPWorkQueueStats
+{
+    int nThreads;
+    int nIdleThreads;
+    int nMinThreads;
+    int nMaxThreads;
+    size_t nDepth;
+    size_t nClients;        //!< clients with queued requests
+    size_t nMaxDepth;       //!< -rpcworkqueue
+    size_t nMaxClientDepth; //!< -rpcclientqueue
+    uint64_t nRejected;     //!< requests turned away because the queue or their client's share was full
+};
+/** Fill stats; returns false if the HTTP server is not running */
+bool HTTPGetWorkQueueStats(HTTPWorkQueueStats& stats);
+
 /** In-flight HTTP request.
  * Thin C++ wrapper around evhttp_request.
  */
@@ -57,6 +88,9 @@ class HTTPRequest
 private:
     struct evhttp_request* req;
     bool replySent;
+    bool replyChunked;
+    //! Shared with the event thread while a chunked reply is being sent
+    boost::shared_ptr<HTTPReplyFlow> replyFlow;
 
 public:
     HTTPRequest(struct evhttp_request* req);
@@ -112,8 +146,45 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Start a chunked HTTP reply, for bodies produced piece by piece.
+     * Send the body with WriteReplyChunk and finish with EndReplyChunked;
+     * headers must be written before. Instead of WriteReply.
+     */
+    void StartReplyChunked(int nStatus);
+    /**
+     * Send the next piece of a chunked reply. Waits while more than
+     * HTTP_REPLY_BUFFER_MAX bytes are still to be sent to the client, so a
+     * slow reader holds up the handler instead of making the node buffer
+     * the whole reply. Returns false once the client went away; the reply
+     * should then be given up with AbortReplyChunked.
+     */
+    bool WriteReplyChunk(const std::string& strChunk);
+    /**
+     * Finish a chunked reply.
+     *
+     * @note As with WriteReply, do not call any other HTTPRequest methods after calling this.
+     */
+    void EndReplyChunked();
+    /**
+     * Give up on a chunked reply half way: the connection is dropped
+     * without the terminating chunk, so the client sees an incomplete
+     * reply instead of a short one that looks complete.
+     *
+     * @note As with WriteReply, do not call any other HTTPRequest methods after calling this.
+     */
+    void AbortReplyChunked();
 };
 
+/** Reply to req with the JSON document written by fill, as application/json.
+ * Documents that fit in one chunk go out as a normal reply, larger ones as a
+ * chunked reply while fill is still writing them. Exceptions thrown by fill
+ * propagate, without a reply sent, as long as nothing went out yet; later
+ * ones are logged and drop the connection, as the reply can't be completed.
+ */
+void HTTPWriteJSONReply(HTTPRequest* req, int nStatus, const boost::function<void(CJSONStreamWriter&)>& fill);
+
 /** Event handler closure.
  */
 class HTTPClosure
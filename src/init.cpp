@@ -57,6 +57,7 @@
 #include <openssl/crypto.h>
 
 #if ENABLE_ZMQ
+#include "zmq/zmqabstractnotifier.h"
 #include "zmq/zmqnotificationinterface.h"
 #endif
 
@@ -156,7 +157,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -198,6 +198,7 @@ void PrepareShutdown()
     if (pwalletMain)
         bitdb.Flush(false);
     GenerateKores(false, 0);
+    StakingCoins(false);
 #endif
     StopNode();
     StopTorControl();
@@ -229,6 +230,8 @@ void PrepareShutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsFlusher;
+        pcoinsFlusher = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -280,6 +283,7 @@ void Shutdown()
     globalVerifyHandle.reset();
     ECC_Stop();
     LogPrintf("%s: done\n", __func__);
+    StopDebugLogWriter();
 }
 
 /**
@@ -348,9 +352,15 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
+    strUsage += HelpMessageOpt("-backgroundflush", strprintf(_("Write periodic coin database flushes from a background thread; the coins being written count against -dbcache until they are (default: %u)"), DEFAULT_BACKGROUND_FLUSH));
+    strUsage += HelpMessageOpt("-blockcompression", strprintf(_("Deflate newly written block and undo data (default: %u)"), DEFAULT_BLOCK_COMPRESSION));
+    strUsage += HelpMessageOpt("-blockindexprofile=<preset>", strprintf(_("LevelDB tuning preset for the block index database: default, read or write (default: %s)"), DEFAULT_BLOCKINDEX_PROFILE));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-blocksizenotify=<cmd>", _("Execute command when the best block changes and its size is over (%s in cmd is replaced by block hash, %d with the block size)"));
+    strUsage += HelpMessageOpt("-chainstateprofile=<preset>", strprintf(_("LevelDB tuning preset for the chainstate database: default, read or write (default: %s)"), DEFAULT_CHAINSTATE_PROFILE));
+    strUsage += HelpMessageOpt("-checkblockindexhash=<n>", strprintf(_("Recompute the header hash of every n-th block index entry at startup and compare it with the stored one (default: %u, 0 = off)"), DEFAULT_CHECKBLOCKINDEXHASH));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 500));
+    strUsage += HelpMessageOpt("-compactblocks", _("Rewrite all finished block files in compressed form at startup"));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), "kore.conf"));
     if (mode == HMM_BITCOIND) {
 #if !defined(WIN32)
@@ -359,6 +369,8 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbcompression", strprintf(_("Compress database table blocks with Snappy, if available (default: %u)"), DEFAULT_DB_COMPRESSION));
+    strUsage += HelpMessageOpt("-dbmaxopenfiles=<n>", strprintf(_("Maximum number of table files each database keeps open (default: %u)"), DEFAULT_DB_MAX_OPEN_FILES));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).GetMaxReorganizationDepth()));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
@@ -422,7 +434,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-createwalletbackups=<n>", _("Number of automatic wallet backups (default: 10)"));
     strUsage += HelpMessageOpt("-custombackupthreshold=<n>", strprintf(_("Number of custom location backups to retain (default: %d)"), DEFAULT_CUSTOMBACKUPTHRESHOLD));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
-    strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), 100));
+    strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), DEFAULT_KEYPOOL_SIZE));
+    strUsage += HelpMessageOpt("-keypoolmin=<n>", _("Refill the key pool in the background once it holds fewer than <n> keys (default: half of -keypool)"));
     if (GetBoolArg("-help-debug", false))
         strUsage += HelpMessageOpt("-mintxfee=<amt>", strprintf(_("Fees (in KORE/Kb) smaller than this are considered zero fee for transaction creation (default: %s)"),
                                                           FormatMoney(CWallet::minTxFee.GetFeePerK())));
@@ -437,6 +450,8 @@ std::string HelpMessage(HelpMessageMode mode)
                                                       FormatMoney(maxTxFee)));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat"));
+    strUsage += HelpMessageOpt("-walletarchivedepth=<n>", strprintf(_("Move fully spent wallet transactions buried at least <n> blocks deep out of the live wallet, keeping a summary for the transaction history (0 = off, default: %u)"), DEFAULT_WALLET_ARCHIVE_DEPTH));
+    strUsage += HelpMessageOpt("-walletmaintenancebudget=<n>", strprintf(_("Spend at most <n> milliseconds per pass of the scheduled MultiSend and dust combining task (default: %u)"), DEFAULT_WALLET_MAINTENANCE_BUDGET));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     if (mode == HMM_BITCOIN_QT)
         strUsage += HelpMessageOpt("-windowtitle=<name>", _("Wallet window title"));
@@ -450,6 +465,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubhashtx=<address>", _("Enable publish hash transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubsequence=<address>", _("Enable publish block connects and disconnects and mempool additions and removals in <address>"));
+    strUsage += HelpMessageOpt("-zmqpub<type>hwm=<n>", strprintf(_("Set the outbound message high water mark of the -zmqpub<type> socket (default: %d)"), DEFAULT_ZMQ_SNDHWM));
 #endif
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
@@ -478,7 +495,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-genproclimit=<n>", strprintf(_("Set the number of threads for coin generation if enabled (-1 = all cores, default: %d)"), 1));
 #endif
     strUsage += HelpMessageOpt("-help-debug", _("Show all debugging options (usage: --help -help-debug)"));
+    strUsage += HelpMessageOpt("-logbuffer=<n>", strprintf(_("Queue up to <n> messages for a background thread writing debug.log, dropping messages past that (0 = write from the logging thread, default: %u)"), DEFAULT_LOG_BUFFER));
     strUsage += HelpMessageOpt("-logips", strprintf(_("Include IP addresses in debug output (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-lograte=<n>", strprintf(_("Log at most <n> messages per second of each -debug category (0 = unlimited, default: %u)"), DEFAULT_LOG_RATE));
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), 1));
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15));
@@ -529,8 +548,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-rpcport=<port>", strprintf(_("Listen for JSON-RPC connections on <port> (default: %u or testnet: %u)"), 10742, 11742));
     strUsage += HelpMessageOpt("-rpcallowip=<ip>", _("Allow JSON-RPC connections from specified source. Valid for <ip> are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24). This option can be specified multiple times"));
     strUsage += HelpMessageOpt("-rpcthreads=<n>", strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_HTTP_THREADS));
+    strUsage += HelpMessageOpt("-rpcmaxthreads=<n>", strprintf(_("Add threads to service RPC calls while requests are waiting, up to <n> (default: %d)"), DEFAULT_HTTP_MAX_THREADS));
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-rpcworkqueue=<n>", strprintf("Set the depth of the work queue to service RPC calls (default: %d)", DEFAULT_HTTP_WORKQUEUE));
+        strUsage += HelpMessageOpt("-rpcclientqueue=<n>", "Set how much of the work queue one client address may fill (default: -rpcworkqueue, no separate limit). Clients behind a proxy share its address");
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
     }
     return strUsage;
@@ -631,17 +652,23 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
+        // -compactblocks removes the files it has emptied, so the numbering
+        // can have gaps: reindex every block file that exists
+        std::set<int> setBlockFiles;
+        filesystem::path blocksdir = GetDataDir() / "blocks";
+        for (filesystem::directory_iterator it(blocksdir); it != filesystem::directory_iterator(); it++) {
+            std::string strName = it->path().filename().string();
+            if (filesystem::is_regular_file(*it) && strName.length() == 12 &&
+                strName.substr(0, 3) == "blk" && strName.substr(8, 4) == ".dat")
+                setBlockFiles.insert(atoi(strName.substr(3, 5)));
+        }
+        BOOST_FOREACH (int nFile, setBlockFiles) {
             CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
             FILE* file = OpenBlockFile(pos, true);
             if (!file)
                 break; // This error is logged in OpenBlockFile
             LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
             LoadExternalBlockFile(file, &pos);
-            nFile++;
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
@@ -784,6 +811,7 @@ bool AppInit2()
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
     fLogIPs = GetBoolArg("-logips", false);
+    nLogRateLimit = GetArg("-lograte", DEFAULT_LOG_RATE);
 
     if (mapArgs.count("-bind") || mapArgs.count("-whitebind")) {
         // when specifying an explicit binding address, you want to listen on it
@@ -878,11 +906,14 @@ bool AppInit2()
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
-    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
-    if (nFD < MIN_CORE_FILEDESCRIPTORS)
+    // MIN_CORE_FILEDESCRIPTORS covers the default open-file limit of both databases
+    int nDBMaxOpenFiles = std::max((int)GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES), 16);
+    int nCoreFD = MIN_CORE_FILEDESCRIPTORS + 2 * std::max(nDBMaxOpenFiles - DEFAULT_DB_MAX_OPEN_FILES, 0);
+    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - nCoreFD)), 0);
+    int nFD = RaiseFileDescriptorLimit(nMaxConnections + nCoreFD);
+    if (nFD < nCoreFD)
         return InitError(_("Not enough file descriptors available."));
-    nMaxConnections = std::min(nFD - MIN_CORE_FILEDESCRIPTORS, nMaxConnections);
+    nMaxConnections = std::min(nFD - nCoreFD, nMaxConnections);
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
@@ -914,6 +945,13 @@ bool AppInit2()
         mempool.setSanityCheck(1.0 / ratio);
     }
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().IsConsistencyChecksDefault());
+    fBlockCompression = GetBoolArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION);
+#ifndef USE_ZLIB
+    if (fBlockCompression) {
+        InitWarning(_("This build has no zlib support, ignoring -blockcompression."));
+        fBlockCompression = false;
+    }
+#endif
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
     // mempool limits
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE_LEGACY) * 1000000;
@@ -1015,6 +1053,8 @@ bool AppInit2()
     nTxConfirmTarget = GetArg("-txconfirmtarget", DEFAULT_TX_CONFIRM_TARGET);
     bdisableSystemnotifications = GetBoolArg("-disablesystemnotifications", false);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", DEFAULT_SEND_FREE_TRANSACTIONS);
+    nWalletArchiveDepth = GetArg("-walletarchivedepth", DEFAULT_WALLET_ARCHIVE_DEPTH);
+    nWalletMaintenanceBudget = std::max<int64_t>(1, GetArg("-walletmaintenancebudget", DEFAULT_WALLET_MAINTENANCE_BUDGET));
 
     std::string strWalletFile = GetArg("-wallet", "wallet.dat");
 #endif // ENABLE_WALLET
@@ -1072,6 +1112,7 @@ bool AppInit2()
 #endif
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    StartDebugLogWriter(std::max<int64_t>(0, GetArg("-logbuffer", DEFAULT_LOG_BUFFER)));
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("KORE version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L)
@@ -1095,6 +1136,8 @@ bool AppInit2()
     if (nScriptCheckThreads) {
         for (int i = 0; i < nScriptCheckThreads - 1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadMempoolScriptCheck);
     }
 
     // Start the lightweight task scheduler thread
@@ -1392,6 +1435,19 @@ bool AppInit2()
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
 
+    // per-database LevelDB tuning
+    CLevelDBProfile chainstateProfile, blockIndexProfile;
+    if (!ParseLevelDBProfile(GetArg("-chainstateprofile", DEFAULT_CHAINSTATE_PROFILE), chainstateProfile))
+        return InitError(strprintf(_("Unknown -chainstateprofile preset: '%s'"), GetArg("-chainstateprofile", "")));
+    if (!ParseLevelDBProfile(GetArg("-blockindexprofile", DEFAULT_BLOCKINDEX_PROFILE), blockIndexProfile))
+        return InitError(strprintf(_("Unknown -blockindexprofile preset: '%s'"), GetArg("-blockindexprofile", "")));
+    chainstateProfile.fCompression = blockIndexProfile.fCompression = GetBoolArg("-dbcompression", DEFAULT_DB_COMPRESSION);
+    if (chainstateProfile.fCompression && !LevelDBHasSnappy()) {
+        LogPrintf("LevelDB was built without Snappy, ignoring -dbcompression\n");
+        chainstateProfile.fCompression = blockIndexProfile.fCompression = false;
+    }
+    chainstateProfile.nMaxOpenFiles = blockIndexProfile.nMaxOpenFiles = nDBMaxOpenFiles;
+
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
@@ -1404,13 +1460,15 @@ bool AppInit2()
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsFlusher;
+                delete pcoinsdbview;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, blockIndexProfile);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex, chainstateProfile);
+                pcoinsFlusher = new CCoinsViewFlusher(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsFlusher);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
                 if (fReindex) {
@@ -1529,6 +1587,17 @@ bool AppInit2()
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    if (GetBoolArg("-compactblocks", false) && !fReindex) {
+#ifndef USE_ZLIB
+        return InitError(_("This build has no zlib support, -compactblocks is unavailable."));
+#endif
+        uiInterface.InitMessage(_("Compacting block files..."));
+        nStart = GetTimeMillis();
+        if (!CompactBlockFiles())
+            return InitError(_("Failed to compact the block files, see debug.log for details."));
+        LogPrintf(" compact blocks %12dms\n", GetTimeMillis() - nStart);
+    }
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
@@ -1760,6 +1829,16 @@ bool AppInit2()
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Keep the key pool filled without making callers wait for new keys
+        threadGroup.create_thread(boost::bind(&CWallet::ThreadKeyPoolRefill, pwalletMain));
+
+        // Periodically move spent, deeply buried transactions to the archive
+        if (nWalletArchiveDepth > 0)
+            scheduler.scheduleEvery(boost::bind(&CWallet::ArchiveSpentTransactions, pwalletMain), WALLET_ARCHIVE_INTERVAL);
+
+        // MultiSend and AutoCombineDust run here rather than after every connected block
+        scheduler.scheduleEvery(boost::bind(&CWallet::RunMaintenance, pwalletMain), WALLET_MAINTENANCE_INTERVAL);
     }
 #endif
 
@@ -0,0 +1,128 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonstream.h"
+
+#include <assert.h>
+
+#include <univalue.h>
+
+CJSONStreamWriter::CJSONStreamWriter(const Sink& sinkIn, size_t nChunkSizeIn) : sink(sinkIn), nChunkSize(nChunkSizeIn), fAfterKey(false), fStarted(false)
+{
+    strBuf.reserve(nChunkSize);
+}
+
+void CJSONStreamWriter::Separate()
+{
+    if (fAfterKey) {
+        fAfterKey = false;
+        return;
+    }
+    if (vHasMember.empty())
+        return;
+    if (vHasMember.back())
+        strBuf += ',';
+    vHasMember.back() = true;
+}
+
+void CJSONStreamWriter::Write(const std::string& str)
+{
+    strBuf += str;
+    if (strBuf.size() >= nChunkSize)
+        Flush();
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    Separate();
+    strBuf += '{';
+    vHasMember.push_back(false);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    assert(!vHasMember.empty() && !fAfterKey);
+    vHasMember.pop_back();
+    Write("}");
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    Separate();
+    strBuf += '[';
+    vHasMember.push_back(false);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    assert(!vHasMember.empty() && !fAfterKey);
+    vHasMember.pop_back();
+    Write("]");
+}
+
+void CJSONStreamWriter::Key(const std::string& strKey)
+{
+    assert(!vHasMember.empty() && !fAfterKey);
+    Separate();
+    strBuf += UniValue(strKey).write();
+    strBuf += ':';
+    fAfterKey = true;
+}
+
+void CJSONStreamWriter::Value(const UniValue& val)
+{
+    Separate();
+    Write(val.write());
+}
+
+void CJSONStreamWriter::Value(const std::string& str)
+{
+    Value(UniValue(str));
+}
+
+void CJSONStreamWriter::Value(const char* psz)
+{
+    Value(UniValue(psz));
+}
+
+void CJSONStreamWriter::Value(int64_t n)
+{
+    Value(UniValue(n));
+}
+
+void CJSONStreamWriter::Value(bool f)
+{
+    Separate();
+    Write(f ? "true" : "false");
+}
+
+void CJSONStreamWriter::Null()
+{
+    Separate();
+    Write("null");
+}
+
+void CJSONStreamWriter::Members(const UniValue& obj, size_t nBegin, size_t nEnd)
+{
+    const std::vector<std::string>& vKeys = obj.getKeys();
+    const std::vector<UniValue>& vValues = obj.getValues();
+    for (size_t i = nBegin; i < nEnd && i < vKeys.size(); i++) {
+        Key(vKeys[i]);
+        Value(vValues[i]);
+    }
+}
+
+void CJSONStreamWriter::Raw(const std::string& str)
+{
+    Write(str);
+}
+
+void CJSONStreamWriter::Flush()
+{
+    if (strBuf.empty())
+        return;
+    fStarted = true;
+    sink(strBuf);
+    strBuf.clear();
+}
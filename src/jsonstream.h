@@ -0,0 +1,72 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_JSONSTREAM_H
+#define BITCOIN_JSONSTREAM_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+class UniValue;
+
+//! Bytes CJSONStreamWriter collects before handing them to its sink
+static const size_t JSON_STREAM_CHUNK_SIZE = 64 * 1024;
+
+/**
+ * Writes a JSON document token by token, handing it to a sink in chunks of
+ * about nChunkSize bytes as it goes, so large replies don't need to exist
+ * as a UniValue tree and a string at the same time. Separators are added
+ * automatically; small subtrees can still be written as a UniValue.
+ */
+class CJSONStreamWriter
+{
+public:
+    typedef boost::function<void(const std::string&)> Sink;
+
+    explicit CJSONStreamWriter(const Sink& sinkIn, size_t nChunkSizeIn = JSON_STREAM_CHUNK_SIZE);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    //! Key of the next object member
+    void Key(const std::string& strKey);
+
+    void Value(const UniValue& val);
+    void Value(const std::string& str);
+    void Value(const char* psz);
+    void Value(int64_t n);
+    void Value(int n) { Value((int64_t)n); }
+    void Value(bool f);
+    void Null();
+
+    //! Members [nBegin, nEnd) of an object, as if written with Key() and Value()
+    void Members(const UniValue& obj, size_t nBegin, size_t nEnd);
+
+    //! Text added verbatim after the document, e.g. a trailing newline
+    void Raw(const std::string& str);
+
+    //! Hand what is left to the sink
+    void Flush();
+
+    //! Whether anything reached the sink yet
+    bool Started() const { return fStarted; }
+
+private:
+    Sink sink;
+    size_t nChunkSize;
+    std::string strBuf;
+    //! one entry per open object or array: whether it has a member yet
+    std::vector<bool> vHasMember;
+    bool fAfterKey;
+    bool fStarted;
+
+    void Separate();
+    void Write(const std::string& str);
+};
+
+#endif // BITCOIN_JSONSTREAM_H
@@ -28,14 +28,73 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+bool ParseLevelDBProfile(const std::string& strPreset, CLevelDBProfile& profile)
 {
+    if (strPreset == "default") {
+        profile.nBlockSize = 4096;
+        profile.nBloomBits = 10;
+        profile.nBlockCacheEighths = 4;
+    } else if (strPreset == "read") {
+        profile.nBlockSize = 16384;
+        profile.nBloomBits = 14;
+        profile.nBlockCacheEighths = 6;
+    } else if (strPreset == "write") {
+        profile.nBlockSize = 4096;
+        profile.nBloomBits = 10;
+        profile.nBlockCacheEighths = 2;
+    } else {
+        return false;
+    }
+    profile.strName = strPreset;
+    return true;
+}
+
+bool LevelDBHasSnappy()
+{
+    // LevelDB silently stores blocks uncompressed when it lacks Snappy, and
+    // doesn't export whether it has it. Write a very compressible value to
+    // an in-memory database and see whether its table comes out smaller.
+    static int nHasSnappy = -1;
+    if (nHasSnappy >= 0)
+        return nHasSnappy;
+
+    nHasSnappy = 0;
+    leveldb::Env* penvProbe = leveldb::NewMemEnv(leveldb::Env::Default());
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.env = penvProbe;
+    options.create_if_missing = true;
+    options.compression = leveldb::kSnappyCompression;
+    leveldb::DB* pdbProbe = NULL;
+    if (leveldb::DB::Open(options, "snappyprobe", &pdbProbe).ok()) {
+        const size_t nValueSize = 64 * 1024;
+        if (pdbProbe->Put(leveldb::WriteOptions(), "k", std::string(nValueSize, 'x')).ok()) {
+            pdbProbe->CompactRange(NULL, NULL);
+            leveldb::Range range("a", "z");
+            uint64_t nSize = 0;
+            pdbProbe->GetApproximateSizes(&range, 1, &nSize);
+            nHasSnappy = nSize > 0 && nSize < nValueSize / 2;
+        }
+        delete pdbProbe;
+    }
+    delete penvProbe;
+    return nHasSnappy;
+}
+
+static size_t GetBlockCacheSize(size_t nCacheSize, const CLevelDBProfile& profile)
+{
+    return nCacheSize / 8 * profile.nBlockCacheEighths;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBProfile& profile)
+{
+    leveldb::Options options;
+    size_t nBlockCacheSize = GetBlockCacheSize(nCacheSize, profile);
+    options.block_cache = leveldb::NewLRUCache(nBlockCacheSize);
+    options.write_buffer_size = (nCacheSize - nBlockCacheSize) / 2; // up to two write buffers may be held in memory simultaneously
+    options.block_size = profile.nBlockSize;
+    options.filter_policy = leveldb::NewBloomFilterPolicy(profile.nBloomBits);
+    options.compression = profile.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = profile.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -44,15 +103,16 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CLevelDBProfile& profile)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
+    nMemoryLimit = GetBlockCacheSize(nCacheSize, profile) + 2 * options.write_buffer_size;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
         options.env = penv;
@@ -62,7 +122,8 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
             leveldb::DestroyDB(path.string(), options);
         }
         TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrintf("Opening LevelDB in %s (profile %s, compression %s, max open files %d)\n", path.string(),
+            profile.strName, profile.fCompression ? "on" : "off", profile.nMaxOpenFiles);
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
@@ -123,6 +184,11 @@ std::vector<unsigned char> CLevelDBWrapper::CreateObfuscateKey() const
 
 }
 
+bool CLevelDBWrapper::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
 bool CLevelDBWrapper::IsEmpty()
 {
     boost::scoped_ptr<CLevelDBIterator> it(NewIterator());
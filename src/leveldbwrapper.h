@@ -25,6 +25,36 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/** Tuning knobs for one LevelDB database, selected per database at startup */
+struct CLevelDBProfile
+{
+    //! preset name, for logging
+    std::string strName;
+    //! compress table blocks with Snappy (ignored when LevelDB is built without it)
+    bool fCompression;
+    //! number of table files LevelDB may keep open
+    int nMaxOpenFiles;
+    //! approximate size of uncompressed data packed per table block
+    size_t nBlockSize;
+    //! bits per key of the Bloom filter
+    int nBloomBits;
+    //! share of the cache given to the block cache, in eighths; the rest goes to the two write buffers
+    int nBlockCacheEighths;
+
+    CLevelDBProfile() : strName("default"), fCompression(false), nMaxOpenFiles(64), nBlockSize(4096), nBloomBits(10), nBlockCacheEighths(4) {}
+};
+
+/**
+ * Fill profile with the preset named strPreset ("default", "read" or "write").
+ * "read" favours the block cache, larger blocks and a denser Bloom filter for
+ * lookup-heavy use; "write" favours the write buffers to cut compactions.
+ * Returns false for an unknown preset.
+ */
+bool ParseLevelDBProfile(const std::string& strPreset, CLevelDBProfile& profile);
+
+/** Whether LevelDB was built with Snappy, so kSnappyCompression compresses */
+bool LevelDBHasSnappy();
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -156,6 +186,9 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    //! bytes the block cache and the two write buffers may take up together
+    size_t nMemoryLimit;
+
     //! a key used for optional XOR-obfuscation of the database
     std::vector<unsigned char> obfuscate_key;
 
@@ -175,8 +208,9 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] profile     Compression, file and cache split settings for this database.
      */
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CLevelDBProfile& profile = CLevelDBProfile());
     ~CLevelDBWrapper();
 
     template <typename K, typename V>
@@ -258,6 +292,18 @@ public:
     {
         return new CLevelDBIterator(pdb->NewIterator(iteroptions), &obfuscate_key);
     }    
+    /**
+     * Read one of LevelDB's internal properties (e.g. "leveldb.stats").
+     * Returns false if the property is not known.
+     */
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+
+    /**
+     * Memory the database is configured to use at most for its block cache and
+     * write buffers. The vendored LevelDB can't report what they actually hold.
+     */
+    size_t GetMemoryLimit() const { return nMemoryLimit; }
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
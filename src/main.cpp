@@ -14,6 +14,7 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "crypto/common.h"
 #include "init.h"
 #include "invalid.h"
 #include "kernel.h"
@@ -31,6 +32,7 @@
 #include "validationinterface.h"
 #include "wallet.h"
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <sstream>
@@ -41,6 +43,10 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
 using namespace boost;
 using namespace std;
 
@@ -63,6 +69,8 @@ map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<unsigned int, unsigned int> mapHashedBlocks;
 CChain chainActive;
+//! chainActive.Tip(), republished after every SetTip for GetChainSnapshot
+static std::atomic<const CBlockIndex*> pindexTipSnapshot(NULL);
 CBlockIndex* pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 std::mutex csBestBlock;
@@ -75,6 +83,7 @@ bool fHavePruned = false;            // Legacy
 bool fPruneMode = false;             // Legacy
 uint64_t nPruneTarget = 0;           // Legacy
 bool fAddrIndex = false;             // Legacy
+bool fBlockCompression = DEFAULT_BLOCK_COMPRESSION;
 size_t nCoinCacheUsage = 5000 * 300; // Legacy
 // TODO: Remove?
 //bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED; // Legacy
@@ -670,6 +679,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache* pcoinsTip = NULL;
 CBlockTreeDB* pblocktree = NULL;
+CCoinsViewFlusher* pcoinsFlusher = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
 
 
 static const int32_t GetCurrentTransactionVersion()
@@ -1312,24 +1323,74 @@ std::string FormatStateMessage_Legacy(const CValidationState& state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, std::vector<uint256>& vHashTxnToUncache, bool ignoreFees, bool isLoadingTx)
+static CCheckQueue<CScriptCheck> mempoolcheckqueue(128);
+/** Serializes use of mempoolcheckqueue: callers that find it busy verify inline */
+static CCriticalSection cs_mempoolcheckqueue;
+
+void ThreadMempoolScriptCheck()
 {
-    AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
+    RenameThread("kore-mpscriptch");
+    mempoolcheckqueue.Thread();
+}
 
-    if (!CheckTransaction(tx, state))
-        return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
+/**
+ * Verify the scripts of a loose transaction, spreading its inputs over the
+ * mempool script check threads when they are available. Only the inputs
+ * cached in view are read, so no locks need to be held.
+ */
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags)
+{
+    if (nScriptCheckThreads && tx.vin.size() > 1) {
+        TRY_LOCK(cs_mempoolcheckqueue, lockQueue);
+        if (lockQueue) {
+            std::vector<CScriptCheck> vChecks;
+            CCheckQueueControl<CScriptCheck> control(&mempoolcheckqueue);
+            if (!CheckInputs(tx, state, view, true, flags, true, &vChecks))
+                return false;
+            control.Add(vChecks);
+            if (control.Wait())
+                return true;
+            // The queue only reports pass/fail; fall through so the serial
+            // check below fills in the proper reject reason and DoS score.
+        }
+    }
+    return CheckInputs(tx, state, view, true, flags, true);
+}
 
-    // Coinbase is only valid in a block, not as a loose transaction
-    if (tx.IsCoinBase())
-        return state.DoS(100, error("AcceptToMemoryPool: : coinbase as individual tx"),
-            REJECT_INVALID, "coinbase");
+/**
+ * Result of the locked stage of AcceptToMemoryPoolWorker. The spent coins are
+ * copied into a cache backed by a dummy view so script verification can run
+ * after cs_main and pool.cs have been released; pindexTip and nPoolUpdated
+ * record which chain and mempool state the remaining fields were computed for.
+ */
+struct CMempoolAcceptance {
+    CCoinsView dummy;
+    CCoinsViewCache view;
+    const CBlockIndex* pindexTip;
+    unsigned int nPoolUpdated;
+    boost::scoped_ptr<CTxMemPoolEntry> pentry;
+    CAmount nModifiedFees;
+    CAmount nConflictingFees;
+    size_t nConflictingSize;
+    CTxMemPool::setEntries allConflicting;
+    CTxMemPool::setEntries setAncestors;
+
+    CMempoolAcceptance() : view(&dummy), pindexTip(NULL), nPoolUpdated(0), nModifiedFees(0), nConflictingFees(0), nConflictingSize(0) {}
+};
 
-    // Coinstake is only valid in a block, not as a loose transaction
-    if (tx.IsCoinStake())
-        return state.DoS(100, error("AcceptToMemoryPool: coinstake as individual tx. txid=%s", tx.GetHash().GetHex()),
-            REJECT_INVALID, "coinstake");
+/**
+ * Contextual checks of AcceptToMemoryPoolWorker: input lookup, finality,
+ * standardness, fee policy, replacement and ancestor limits. Does not modify
+ * the pool, so it can be repeated when the chain or pool moved on while the
+ * scripts were being verified.
+ */
+static bool PrepareMempoolAcceptance(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool* pfMissingInputs, bool fRejectAbsurdFee, std::vector<uint256>& vHashTxnToUncache, bool ignoreFees, bool isLoadingTx, CMempoolAcceptance& accept)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(pool.cs);
+
+    accept.pindexTip = chainActive.Tip();
+    accept.nPoolUpdated = pool.GetTransactionsUpdated();
 
     // Rather not work on nonstandard transactions (unless -testnet/-regtest)
     string reason;
@@ -1352,347 +1413,381 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 
     // Check for conflicts with in-memory transactions
     set<uint256> setConflicts;
-    {
-        LOCK(pool.cs); // protect pool.mapNextTx
-        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            if (pool.mapNextTx.count(txin.prevout)) {
-                const CTransaction* ptxConflicting = pool.mapNextTx[txin.prevout].ptx;
-                if (!setConflicts.count(ptxConflicting->GetHash())) {
-                    // Allow opt-out of transaction replacement by setting
-                    // nSequence >= maxint-1 on all inputs.
-                    //
-                    // maxint-1 is picked to still allow use of nLockTime by
-                    // non-replacable transactions. All inputs rather than just one
-                    // is for the sake of multi-party protocols, where we don't
-                    // want a single party to be able to disable replacement.
-                    //
-                    // The opt-out ignores descendants as anyone relying on
-                    // first-seen mempool behavior should be checking all
-                    // unconfirmed ancestors anyway; doing otherwise is hopelessly
-                    // insecure.
-                    bool fReplacementOptOut = true;
-                    if (fEnableReplacement) {
-                        BOOST_FOREACH (const CTxIn& txin, ptxConflicting->vin) {
-                            if (txin.nSequence < std::numeric_limits<unsigned int>::max() - 1) {
-                                fReplacementOptOut = false;
-                                break;
-                            }
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        CTxMemPool::nexttxMap::const_iterator itConflicting = pool.mapNextTx.find(txin.prevout);
+        if (itConflicting != pool.mapNextTx.end()) {
+            const CTransaction* ptxConflicting = itConflicting->second.ptx;
+            if (!setConflicts.count(ptxConflicting->GetHash())) {
+                // Allow opt-out of transaction replacement by setting
+                // nSequence >= maxint-1 on all inputs.
+                //
+                // maxint-1 is picked to still allow use of nLockTime by
+                // non-replacable transactions. All inputs rather than just one
+                // is for the sake of multi-party protocols, where we don't
+                // want a single party to be able to disable replacement.
+                //
+                // The opt-out ignores descendants as anyone relying on
+                // first-seen mempool behavior should be checking all
+                // unconfirmed ancestors anyway; doing otherwise is hopelessly
+                // insecure.
+                bool fReplacementOptOut = true;
+                if (fEnableReplacement) {
+                    BOOST_FOREACH (const CTxIn& txin, ptxConflicting->vin) {
+                        if (txin.nSequence < std::numeric_limits<unsigned int>::max() - 1) {
+                            fReplacementOptOut = false;
+                            break;
                         }
                     }
-                    if (fReplacementOptOut)
-                        return state.Invalid(false, REJECT_CONFLICT, "txn-mempool-conflict");
-
-                    setConflicts.insert(ptxConflicting->GetHash());
                 }
+                if (fReplacementOptOut)
+                    return state.Invalid(false, REJECT_CONFLICT, "txn-mempool-conflict");
+
+                setConflicts.insert(ptxConflicting->GetHash());
             }
         }
     }
 
+    CCoinsViewCache& view = accept.view;
+    CAmount nValueIn = 0;
+    LockPoints lp;
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
-
-        CAmount nValueIn = 0;
-        LockPoints lp;
-        {
-            LOCK(pool.cs);
-            CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
-            view.SetBackend(viewMemPool);
-
-            // do we already have it?
-            bool fHadTxInCache = pcoinsTip->HaveCoinsInCache_Legacy(hash);
-            if (view.HaveCoins(hash)) {
-                if (!fHadTxInCache)
-                    vHashTxnToUncache.push_back(hash);
-                return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+
+        // do we already have it?
+        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache_Legacy(hash);
+        if (view.HaveCoins(hash)) {
+            if (!fHadTxInCache)
+                vHashTxnToUncache.push_back(hash);
+            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        }
+
+        // do all inputs exist?
+        // Note that this does not check for the presence of actual outputs (see the next check for that),
+        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
+        BOOST_FOREACH (const CTxIn txin, tx.vin) {
+            if (!pcoinsTip->HaveCoinsInCache_Legacy(txin.prevout.hash))
+                vHashTxnToUncache.push_back(txin.prevout.hash);
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                if (pfMissingInputs)
+                    *pfMissingInputs = true;
+                return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
             }
 
-            // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // and only helps with filling in pfMissingInputs (to determine missing vs spent).
-            BOOST_FOREACH (const CTxIn txin, tx.vin) {
-                if (!pcoinsTip->HaveCoinsInCache_Legacy(txin.prevout.hash))
-                    vHashTxnToUncache.push_back(txin.prevout.hash);
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    if (pfMissingInputs)
-                        *pfMissingInputs = true;
-                    return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
-                }
-
-                //Check for invalid/fraudulent inputs
-                if (!ValidOutPoint(txin.prevout, chainActive.Height())) {
-                    return state.Invalid(error("%s : tried to spend invalid input %s in tx %s", __func__, txin.prevout.ToString(),
-                                             tx.GetHash().GetHex()),
-                        REJECT_INVALID, "bad-txns-invalid-inputs");
-                }
+            //Check for invalid/fraudulent inputs
+            if (!ValidOutPoint(txin.prevout, chainActive.Height())) {
+                return state.Invalid(error("%s : tried to spend invalid input %s in tx %s", __func__, txin.prevout.ToString(),
+                                         tx.GetHash().GetHex()),
+                    REJECT_INVALID, "bad-txns-invalid-inputs");
             }
+        }
 
-            // are the actual inputs available?
-            if (!view.HaveInputs(tx))
-                return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
-                    REJECT_DUPLICATE, "bad-txns-inputs-spent");
+        // are the actual inputs available?
+        if (!view.HaveInputs(tx))
+            return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
+                REJECT_DUPLICATE, "bad-txns-inputs-spent");
 
-            // Bring the best block into scope
-            view.GetBestBlock();
+        // Bring the best block into scope
+        view.GetBestBlock();
 
-            nValueIn = view.GetValueIn(tx);
+        nValueIn = view.GetValueIn(tx);
 
-            // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-            view.SetBackend(dummy);
+        // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
+        view.SetBackend(accept.dummy);
 
-            // Only accept BIP68 sequence locked transactions that can be mined in the next
-            // block; we don't want our mempool filled up with transactions that can't
-            // be mined yet.
-            // Must keep pool.cs for this unless we change CheckSequenceLocks to take a
-            // CoinsViewCache instead of create its own
-            if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
-                return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
-        }
+        // Only accept BIP68 sequence locked transactions that can be mined in the next
+        // block; we don't want our mempool filled up with transactions that can't
+        // be mined yet.
+        // Must keep pool.cs for this unless we change CheckSequenceLocks to take a
+        // CoinsViewCache instead of create its own
+        if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
+            return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
+    }
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (Params().RequireStandard() && !AreInputsStandard(tx, view))
-            return state.Invalid(error("AcceptToMemoryPool: : nonstandard transaction input"), REJECT_NONSTANDARD, "bad-txns-nonstandard-inputs");
+    // Check for non-standard pay-to-script-hash in inputs
+    if (Params().RequireStandard() && !AreInputsStandard(tx, view))
+        return state.Invalid(error("AcceptToMemoryPool: : nonstandard transaction input"), REJECT_NONSTANDARD, "bad-txns-nonstandard-inputs");
 
-        CAmount nValueOut = tx.GetValueOut();
-        CAmount nFees = nValueIn - nValueOut;
-        // nModifiedFees includes any fee deltas from PrioritiseTransaction
-        CAmount nModifiedFees = nFees;
-        double nPriorityDummy = 0;
-        pool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
+    CAmount nValueOut = tx.GetValueOut();
+    CAmount nFees = nValueIn - nValueOut;
+    // nModifiedFees includes any fee deltas from PrioritiseTransaction
+    CAmount nModifiedFees = nFees;
+    double nPriorityDummy = 0;
+    pool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
+    accept.nModifiedFees = nModifiedFees;
 
-        CAmount inChainInputValue;
-        double dPriority = view.GetPriority(tx, chainActive.Height(), inChainInputValue);
+    CAmount inChainInputValue;
+    double dPriority = view.GetPriority(tx, chainActive.Height(), inChainInputValue);
 
-        // Keep track of transactions that spend a coinbase, which we re-scan
-        // during reorgs to ensure COINBASE_MATURITY is still met.
-        bool fSpendsCoinbase = false;
-        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
-                fSpendsCoinbase = true;
-                break;
-            }
+    // Keep track of transactions that spend a coinbase, which we re-scan
+    // during reorgs to ensure COINBASE_MATURITY is still met.
+    bool fSpendsCoinbase = false;
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+        if (coins->IsCoinBase()) {
+            fSpendsCoinbase = true;
+            break;
         }
+    }
 
-        unsigned int nSigOps = GetLegacySigOpCount(tx);
-        nSigOps += GetP2SHSigOpCount(tx, view);
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
-        unsigned int nSize = entry.GetTxSize();
+    unsigned int nSigOps = GetLegacySigOpCount(tx);
+    nSigOps += GetP2SHSigOpCount(tx, view);
+    accept.pentry.reset(new CTxMemPoolEntry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp));
+    const CTxMemPoolEntry& entry = *accept.pentry;
+    unsigned int nSize = entry.GetTxSize();
 
-        unsigned int nMaxSigOps = MAX_TX_SIGOPS_CURRENT;
-        if (nSigOps > nMaxSigOps || (nBytesPerSigOp && nSigOps > nSize / nBytesPerSigOp))
-            return state.DoS(0,
-                error("AcceptToMemoryPool : too many sigops %s, %d > %d",
-                    hash.ToString(), nSigOps, nMaxSigOps),
-                REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
-
-        // Don't accept it if it can't get into a block
-        // but prioritise dstx and don't check fees for it
-        if (!ignoreFees) {
-            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE_LEGACY) * 1000000).GetFee(nSize);
-            if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
-                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nFees, mempoolRejectFee));
-            } else if (GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY_LEGACY) && nModifiedFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(entry.GetPriority(chainActive.Height() + 1))) {
-                // Require that free transactions have sufficient priority to be mined in the next block.
+    unsigned int nMaxSigOps = MAX_TX_SIGOPS_CURRENT;
+    if (nSigOps > nMaxSigOps || (nBytesPerSigOp && nSigOps > nSize / nBytesPerSigOp))
+        return state.DoS(0,
+            error("AcceptToMemoryPool : too many sigops %s, %d > %d",
+                hash.ToString(), nSigOps, nMaxSigOps),
+            REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
+
+    // Don't accept it if it can't get into a block
+    // but prioritise dstx and don't check fees for it
+    if (!ignoreFees) {
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE_LEGACY) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nFees, mempoolRejectFee));
+        } else if (GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY_LEGACY) && nModifiedFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(entry.GetPriority(chainActive.Height() + 1))) {
+            // Require that free transactions have sufficient priority to be mined in the next block.
 
-                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
-            }
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
+        }
+
+        if (fRejectAbsurdFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
+            return state.Invalid(false,
+                REJECT_HIGHFEE_LEGACY, "absurdly-high-fee",
+                strprintf("%d > %d", nFees, ::minRelayTxFee.GetFee(nSize) * 10000));
+
+        // Check if it's economically rational to mine this transaction rather
+        // than the ones it replaces.
+        CAmount& nConflictingFees = accept.nConflictingFees;
+        size_t& nConflictingSize = accept.nConflictingSize;
+        uint64_t nConflictingCount = 0;
+        CTxMemPool::setEntries& allConflicting = accept.allConflicting;
+
+        if (setConflicts.size()) {
+            CFeeRate newFeeRate(nModifiedFees, nSize);
+            set<uint256> setConflictsParents;
+            const int maxDescendantsToVisit = 100;
+            CTxMemPool::setEntries setIterConflicting;
+            BOOST_FOREACH (const uint256& hashConflicting, setConflicts) {
+                CTxMemPool::txiter mi = pool.mapTx.find(hashConflicting);
+                if (mi == pool.mapTx.end())
+                    continue;
 
-            // Continuously rate-limit free (really, very-low-fee) transactions
-            // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-            // be annoying or make others' transactions take longer to confirm.
-            if (fLimitFree && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
-                static CCriticalSection csFreeLimiter;
-                static double dFreeCount;
-                static int64_t nLastTime;
-                int64_t nNow = GetTime();
+                // Save these to avoid repeated lookups
+                setIterConflicting.insert(mi);
+
+                // Don't allow the replacement to reduce the feerate of the
+                // mempool.
+                //
+                // We usually don't want to accept replacements with lower
+                // feerates than what they replaced as that would lower the
+                // feerate of the next block. Requiring that the feerate always
+                // be increased is also an easy-to-reason about way to prevent
+                // DoS attacks via replacements.
+                //
+                // The mining code doesn't (currently) take children into
+                // account (CPFP) so we only consider the feerates of
+                // transactions being directly replaced, not their indirect
+                // descendants. While that does mean high feerate children are
+                // ignored when deciding whether or not to replace, we do
+                // require the replacement to pay more overall fees too,
+                // mitigating most cases.
+                CFeeRate oldFeeRate(mi->GetModifiedFee(), mi->GetTxSize());
+                if (newFeeRate <= oldFeeRate) {
+                    return state.DoS(0, error("AcceptToMemoryPool: rejecting replacement %s; new feerate %s <= old feerate %s", hash.ToString(), newFeeRate.ToString(), oldFeeRate.ToString()), REJECT_INSUFFICIENTFEE, "insufficient fee");
+                }
 
-                LOCK(csFreeLimiter);
+                BOOST_FOREACH (const CTxIn& txin, mi->GetTx().vin) {
+                    setConflictsParents.insert(txin.prevout.hash);
+                }
 
-                // Use an exponentially decaying ~10-minute window:
-                dFreeCount *= pow(1.0 - 1.0 / 600.0, (double)(nNow - nLastTime));
-                nLastTime = nNow;
-                // -limitfreerelay unit is thousand-bytes-per-minute
-                // At default rate it would take over a month to fill 1GB
-                if (dFreeCount >= GetArg("-limitfreerelay", DEFAULT_LIMITFREERELAY_LEGACY) * 10 * 1000)
+                nConflictingCount += mi->GetCountWithDescendants();
+            }
+            // This potentially overestimates the number of actual descendants
+            // but we just want to be conservative to avoid doing too much
+            // work.
+            if (nConflictingCount <= maxDescendantsToVisit) {
+                // If not too many to replace, then calculate the set of
+                // transactions that would have to be evicted
+                BOOST_FOREACH (CTxMemPool::txiter it, setIterConflicting) {
+                    pool.CalculateDescendants(it, allConflicting);
+                }
+                BOOST_FOREACH (CTxMemPool::txiter it, allConflicting) {
+                    nConflictingFees += it->GetModifiedFee();
+                    nConflictingSize += it->GetTxSize();
+                }
+            } else {
+                return state.DoS(0, error("AcceptToMemoryPool: rejecting replacement %s; too many potential replacements (%d > %d)\n", hash.ToString(), nConflictingCount, maxDescendantsToVisit), REJECT_NONSTANDARD, "too many potential replacements");
+            }
 
-                    return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "rate limited free transaction");
-                LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
-                dFreeCount += nSize;
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                // We don't want to accept replacements that require low
+                // feerate junk to be mined first. Ideally we'd keep track of
+                // the ancestor feerates and make the decision based on that,
+                // but for now requiring all new inputs to be confirmed works.
+                if (!setConflictsParents.count(tx.vin[j].prevout.hash)) {
+                    // Rather than check the UTXO set - potentially expensive -
+                    // it's cheaper to just check if the new input refers to a
+                    // tx that's in the mempool.
+                    if (pool.mapTx.find(tx.vin[j].prevout.hash) != pool.mapTx.end())
+                        return state.DoS(0, error("AcceptToMemoryPool: replacement %s adds unconfirmed input, idx %d", hash.ToString(), j), REJECT_NONSTANDARD, "replacement-adds-unconfirmed");
+                }
             }
 
-            if (fRejectAbsurdFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
-                return state.Invalid(false,
-                    REJECT_HIGHFEE_LEGACY, "absurdly-high-fee",
-                    strprintf("%d > %d", nFees, ::minRelayTxFee.GetFee(nSize) * 10000));
-
-            // Check if it's economically rational to mine this transaction rather
-            // than the ones it replaces.
-            CAmount nConflictingFees = 0;
-            size_t nConflictingSize = 0;
-            uint64_t nConflictingCount = 0;
-            CTxMemPool::setEntries allConflicting;
-
-            // If we don't hold the lock allConflicting might be incomplete; the
-            // subsequent RemoveStaged() and addUnchecked() calls don't guarantee
-            // mempool consistency for us.
-            LOCK(pool.cs);
-            if (setConflicts.size()) {
-                CFeeRate newFeeRate(nModifiedFees, nSize);
-                set<uint256> setConflictsParents;
-                const int maxDescendantsToVisit = 100;
-                CTxMemPool::setEntries setIterConflicting;
-                BOOST_FOREACH (const uint256& hashConflicting, setConflicts) {
-                    CTxMemPool::txiter mi = pool.mapTx.find(hashConflicting);
-                    if (mi == pool.mapTx.end())
-                        continue;
+            // The replacement must pay greater fees than the transactions it
+            // replaces - if we did the bandwidth used by those conflicting
+            // transactions would not be paid for.
+            if (nModifiedFees < nConflictingFees) {
+                return state.DoS(0, error("AcceptToMemoryPool: rejecting replacement %s, less fees than conflicting txs; %s < %s", hash.ToString(), FormatMoney(nModifiedFees), FormatMoney(nConflictingFees)),
+                    REJECT_INSUFFICIENTFEE, "insufficient fee");
+            }
 
-                    // Save these to avoid repeated lookups
-                    setIterConflicting.insert(mi);
-
-                    // If this entry is "dirty", then we don't have descendant
-                    // state for this transaction, which means we probably have
-                    // lots of in-mempool descendants.
-                    // Don't allow replacements of dirty transactions, to ensure
-                    // that we don't spend too much time walking descendants.
-                    // This should be rare.
-                    if (mi->IsDirty()) {
-                        return state.DoS(0, error("AcceptToMemoryPool: rejecting replacement %s; cannot replace tx %s with untracked descendants", hash.ToString(), mi->GetTx().GetHash().ToString()), REJECT_NONSTANDARD, "too many potential replacements");
-                    }
+            // Finally in addition to paying more fees than the conflicts the
+            // new transaction must pay for its own bandwidth.
+            CAmount nDeltaFees = nModifiedFees - nConflictingFees;
+            if (nDeltaFees < ::minRelayTxFee.GetFee(nSize)) {
+                return state.DoS(0,
+                    error("AcceptToMemoryPool: rejecting replacement %s, not enough additional fees to relay; %s < %s",
+                        hash.ToString(), FormatMoney(nDeltaFees), FormatMoney(::minRelayTxFee.GetFee(nSize))),
+                    REJECT_INSUFFICIENTFEE, "insufficient fee");
+            }
+        }
+    }
 
-                    // Don't allow the replacement to reduce the feerate of the
-                    // mempool.
-                    //
-                    // We usually don't want to accept replacements with lower
-                    // feerates than what they replaced as that would lower the
-                    // feerate of the next block. Requiring that the feerate always
-                    // be increased is also an easy-to-reason about way to prevent
-                    // DoS attacks via replacements.
-                    //
-                    // The mining code doesn't (currently) take children into
-                    // account (CPFP) so we only consider the feerates of
-                    // transactions being directly replaced, not their indirect
-                    // descendants. While that does mean high feerate children are
-                    // ignored when deciding whether or not to replace, we do
-                    // require the replacement to pay more overall fees too,
-                    // mitigating most cases.
-                    CFeeRate oldFeeRate(mi->GetModifiedFee(), mi->GetTxSize());
-                    if (newFeeRate <= oldFeeRate) {
-                        return state.DoS(0, error("AcceptToMemoryPool: rejecting replacement %s; new feerate %s <= old feerate %s", hash.ToString(), newFeeRate.ToString(), oldFeeRate.ToString()), REJECT_INSUFFICIENTFEE, "insufficient fee");
-                    }
+    // Calculate in-mempool ancestors, up to a limit.
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT_LEGACY);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT_LEGACY) * 1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT_LEGACY);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT_LEGACY) * 1000;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, accept.setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
+    }
 
-                    BOOST_FOREACH (const CTxIn& txin, mi->GetTx().vin) {
-                        setConflictsParents.insert(txin.prevout.hash);
-                    }
+    // A transaction that spends outputs that would be replaced by it is invalid. Now
+    // that we have the set of all ancestors we can detect this
+    // pathological case by making sure setConflicts and setAncestors don't
+    // intersect.
+    BOOST_FOREACH (CTxMemPool::txiter ancestorIt, accept.setAncestors) {
+        const uint256& hashAncestor = ancestorIt->GetTx().GetHash();
+        if (setConflicts.count(hashAncestor)) {
+            return state.DoS(10, error("AcceptToMemoryPool: %s spends conflicting transaction %s", hash.ToString(), hashAncestor.ToString()), REJECT_INVALID, "bad-txns-spends-conflicting-tx");
+        }
+    }
 
-                    nConflictingCount += mi->GetCountWithDescendants();
-                }
-                // This potentially overestimates the number of actual descendants
-                // but we just want to be conservative to avoid doing too much
-                // work.
-                if (nConflictingCount <= maxDescendantsToVisit) {
-                    // If not too many to replace, then calculate the set of
-                    // transactions that would have to be evicted
-                    BOOST_FOREACH (CTxMemPool::txiter it, setIterConflicting) {
-                        pool.CalculateDescendants(it, allConflicting);
-                    }
-                    BOOST_FOREACH (CTxMemPool::txiter it, allConflicting) {
-                        nConflictingFees += it->GetModifiedFee();
-                        nConflictingSize += it->GetTxSize();
-                    }
-                } else {
-                    return state.DoS(0, error("AcceptToMemoryPool: rejecting replacement %s; too many potential replacements (%d > %d)\n", hash.ToString(), nConflictingCount, maxDescendantsToVisit), REJECT_NONSTANDARD, "too many potential replacements");
-                }
+    return true;
+}
 
-                for (unsigned int j = 0; j < tx.vin.size(); j++) {
-                    // We don't want to accept replacements that require low
-                    // feerate junk to be mined first. Ideally we'd keep track of
-                    // the ancestor feerates and make the decision based on that,
-                    // but for now requiring all new inputs to be confirmed works.
-                    if (!setConflictsParents.count(tx.vin[j].prevout.hash)) {
-                        // Rather than check the UTXO set - potentially expensive -
-                        // it's cheaper to just check if the new input refers to a
-                        // tx that's in the mempool.
-                        if (pool.mapTx.find(tx.vin[j].prevout.hash) != pool.mapTx.end())
-                            return state.DoS(0, error("AcceptToMemoryPool: replacement %s adds unconfirmed input, idx %d", hash.ToString(), j), REJECT_NONSTANDARD, "replacement-adds-unconfirmed");
-                    }
-                }
+/**
+ * Staged mempool acceptance. Context-free checks run without locks, the
+ * contextual checks run under cs_main and pool.cs, script verification runs
+ * with both released again, and the final stage re-takes them only to
+ * revalidate (if the tip or the pool changed in between) and insert. Callers
+ * that already hold cs_main keep it for the whole call.
+ */
+bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, std::vector<uint256>& vHashTxnToUncache, bool ignoreFees, bool isLoadingTx)
+{
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
 
-                // The replacement must pay greater fees than the transactions it
-                // replaces - if we did the bandwidth used by those conflicting
-                // transactions would not be paid for.
-                if (nModifiedFees < nConflictingFees) {
-                    return state.DoS(0, error("AcceptToMemoryPool: rejecting replacement %s, less fees than conflicting txs; %s < %s", hash.ToString(), FormatMoney(nModifiedFees), FormatMoney(nConflictingFees)),
-                        REJECT_INSUFFICIENTFEE, "insufficient fee");
-                }
+    if (!CheckTransaction(tx, state))
+        return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
 
-                // Finally in addition to paying more fees than the conflicts the
-                // new transaction must pay for its own bandwidth.
-                CAmount nDeltaFees = nModifiedFees - nConflictingFees;
-                if (nDeltaFees < ::minRelayTxFee.GetFee(nSize)) {
-                    return state.DoS(0,
-                        error("AcceptToMemoryPool: rejecting replacement %s, not enough additional fees to relay; %s < %s",
-                            hash.ToString(), FormatMoney(nDeltaFees), FormatMoney(::minRelayTxFee.GetFee(nSize))),
-                        REJECT_INSUFFICIENTFEE, "insufficient fee");
-                }
-            }
+    // Coinbase is only valid in a block, not as a loose transaction
+    if (tx.IsCoinBase())
+        return state.DoS(100, error("AcceptToMemoryPool: : coinbase as individual tx"),
+            REJECT_INVALID, "coinbase");
 
-            // Remove conflicting transactions from the mempool
-            BOOST_FOREACH (const CTxMemPool::txiter it, allConflicting) {
-                LogPrint("mempool", "replacing tx %s with %s for %s KORE additional fees, %d delta bytes\n",
-                    it->GetTx().GetHash().ToString(),
-                    hash.ToString(),
-                    FormatMoney(nModifiedFees - nConflictingFees),
-                    (int)nSize - (int)nConflictingSize);
-            }
-            pool.RemoveStaged(allConflicting);
-        }
+    // Coinstake is only valid in a block, not as a loose transaction
+    if (tx.IsCoinStake())
+        return state.DoS(100, error("AcceptToMemoryPool: coinstake as individual tx. txid=%s", tx.GetHash().GetHex()),
+            REJECT_INVALID, "coinstake");
 
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+    uint256 hash = tx.GetHash();
+    CMempoolAcceptance accept;
+    {
+        LOCK2(cs_main, pool.cs);
+        if (!PrepareMempoolAcceptance(pool, state, tx, pfMissingInputs, fRejectAbsurdFee, vHashTxnToUncache, ignoreFees, isLoadingTx, accept))
             return false;
+    }
 
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!CheckInputsForMempool(tx, state, accept.view, STANDARD_SCRIPT_VERIFY_FLAGS))
+        return false;
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
-                __func__, hash.ToString(), FormatStateMessage_Legacy(state));
-        }
-
-        // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
-
-        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT_LEGACY);
-        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT_LEGACY) * 1000;
-        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT_LEGACY);
-        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT_LEGACY) * 1000;
-        std::string errString;
-        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
-            return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
-        }
-
-        // A transaction that spends outputs that would be replaced by it is invalid. Now
-        // that we have the set of all ancestors we can detect this
-        // pathological case by making sure setConflicts and setAncestors don't
-        // intersect.
-        BOOST_FOREACH (CTxMemPool::txiter ancestorIt, setAncestors) {
-            const uint256& hashAncestor = ancestorIt->GetTx().GetHash();
-            if (setConflicts.count(hashAncestor)) {
-                return state.DoS(10, error("AcceptToMemoryPool: %s spends conflicting transaction %s", hash.ToString(), hashAncestor.ToString()), REJECT_INVALID, "bad-txns-spends-conflicting-tx");
-            }
+    // Check again against just the consensus-critical mandatory script
+    // verification flags, in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    if (!CheckInputsForMempool(tx, state, accept.view, MANDATORY_SCRIPT_VERIFY_FLAGS)) {
+        return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+            __func__, hash.ToString(), FormatStateMessage_Legacy(state));
+    }
+
+    {
+        LOCK2(cs_main, pool.cs);
+
+        CMempoolAcceptance acceptCurrent;
+        CMempoolAcceptance* paccept = &accept;
+        if (chainActive.Tip() != accept.pindexTip || pool.GetTransactionsUpdated() != accept.nPoolUpdated) {
+            // The tip or the pool moved while the scripts were verified, so the
+            // contextual checks are redone against the current state. The
+            // scripts themselves only depend on the spent outputs and need
+            // not be checked again.
+            if (!PrepareMempoolAcceptance(pool, state, tx, pfMissingInputs, fRejectAbsurdFee, vHashTxnToUncache, ignoreFees, isLoadingTx, acceptCurrent))
+                return false;
+            if (!CheckInputs(tx, state, acceptCurrent.view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+                return false;
+            paccept = &acceptCurrent;
         }
+        const CTxMemPoolEntry& entry = *paccept->pentry;
+        unsigned int nSize = entry.GetTxSize();
+
+        // Continuously rate-limit free (really, very-low-fee) transactions
+        // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
+        // be annoying or make others' transactions take longer to confirm.
+        if (!ignoreFees && fLimitFree && paccept->nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
+            static CCriticalSection csFreeLimiter;
+            static double dFreeCount;
+            static int64_t nLastTime;
+            int64_t nNow = GetTime();
+
+            LOCK(csFreeLimiter);
+
+            // Use an exponentially decaying ~10-minute window:
+            dFreeCount *= pow(1.0 - 1.0 / 600.0, (double)(nNow - nLastTime));
+            nLastTime = nNow;
+            // -limitfreerelay unit is thousand-bytes-per-minute
+            // At default rate it would take over a month to fill 1GB
+            if (dFreeCount >= GetArg("-limitfreerelay", DEFAULT_LIMITFREERELAY_LEGACY) * 10 * 1000)
+
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "rate limited free transaction");
+            LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
+            dFreeCount += nSize;
+        }
+
+        // Remove conflicting transactions from the mempool
+        BOOST_FOREACH (const CTxMemPool::txiter it, paccept->allConflicting) {
+            LogPrint("mempool", "replacing tx %s with %s for %s KORE additional fees, %d delta bytes\n",
+                it->GetTx().GetHash().ToString(),
+                hash.ToString(),
+                FormatMoney(paccept->nModifiedFees - paccept->nConflictingFees),
+                (int)nSize - (int)paccept->nConflictingSize);
+        }
+        pool.RemoveStaged(paccept->allConflicting);
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, paccept->setAncestors, !IsInitialBlockDownload());
         // trim mempool and check if tx was trimmed
         if (!fOverrideMempoolLimit) {
             LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE_LEGACY) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY_LEGACY) * 60 * 60);
@@ -1711,6 +1806,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     std::vector<uint256> vHashTxToUncache;
     bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vHashTxToUncache, ignoreFees, isLoadingTx);
     if (!res) {
+        LOCK(cs_main);
         BOOST_FOREACH (const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
     }
@@ -1900,6 +1996,93 @@ bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDisk
     return true;
 }
 
+unsigned int PackDiskRecord(CDataStream& ssData)
+{
+    unsigned int nRawSize = ssData.size();
+#ifdef USE_ZLIB
+    if (!fBlockCompression || nRawSize == 0)
+        return nRawSize;
+
+    uLongf nDeflatedSize = compressBound(nRawSize);
+    std::vector<char> vPacked(4 + nDeflatedSize);
+    WriteLE32((unsigned char*)&vPacked[0], nRawSize);
+    if (compress2((Bytef*)&vPacked[4], &nDeflatedSize, (const Bytef*)&ssData[0], nRawSize, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return nRawSize;
+    if (4 + nDeflatedSize >= nRawSize)
+        return nRawSize;
+
+    ssData.clear();
+    ssData.write(&vPacked[0], 4 + nDeflatedSize);
+    return ssData.size() | DISK_RECORD_COMPRESSED;
+#else
+    return nRawSize;
+#endif
+}
+
+bool UnpackDiskRecord(const std::vector<char>& vPacked, CDataStream& ssData)
+{
+#ifdef USE_ZLIB
+    if (vPacked.size() < 4)
+        return false;
+    uLongf nRawSize = ReadLE32((const unsigned char*)&vPacked[0]);
+    if (nRawSize == 0 || nRawSize > MAX_SIZE)
+        return false;
+    ssData.resize(nRawSize);
+    if (uncompress((Bytef*)&ssData[0], &nRawSize, (const Bytef*)&vPacked[4], vPacked.size() - 4) != Z_OK)
+        return false;
+    return nRawSize == ssData.size();
+#else
+    return error("%s: compressed record found, but this build has no zlib support", __func__);
+#endif
+}
+
+/**
+ * Read the size field of the record whose payload starts at pos; filein must
+ * be positioned on it. Plain records leave filein at the payload; compressed
+ * ones are inflated into ssData and fCompressed is set.
+ */
+static bool ReadDiskRecordHeader(CAutoFile& filein, CDataStream& ssData, bool& fCompressed)
+{
+    unsigned int nSize;
+    filein >> nSize;
+    fCompressed = (nSize & DISK_RECORD_COMPRESSED) != 0;
+    if (!fCompressed)
+        return true;
+    nSize &= ~DISK_RECORD_COMPRESSED;
+    if (nSize == 0 || nSize > MAX_SIZE)
+        return false;
+    std::vector<char> vPacked(nSize);
+    filein.read(&vPacked[0], nSize);
+    return UnpackDiskRecord(vPacked, ssData);
+}
+
+/** Position of the size field in the header of the record whose payload starts at pos */
+static CDiskBlockPos GetDiskRecordSizePos(const CDiskBlockPos& pos)
+{
+    return CDiskBlockPos(pos.nFile, pos.nPos - sizeof(unsigned int));
+}
+
+/** Look up the on-disk and uncompressed size of the block record at pos */
+static bool GetBlockRecordSize(const CDiskBlockPos& pos, unsigned int& nDiskSize, unsigned int& nRawSize)
+{
+    if (pos.nPos < 8)
+        return false;
+    CAutoFile filein(OpenBlockFile(GetDiskRecordSizePos(pos), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+    try {
+        filein >> nDiskSize;
+        nRawSize = nDiskSize;
+        if (nDiskSize & DISK_RECORD_COMPRESSED) {
+            nDiskSize &= ~DISK_RECORD_COMPRESSED;
+            filein >> nRawSize;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
 {
@@ -1915,14 +2098,27 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                if (postx.nPos < 8)
+                    return error("%s: invalid position %s", __func__, postx.ToString());
+                CAutoFile file(OpenBlockFile(GetDiskRecordSizePos(postx), true), SER_DISK, CLIENT_VERSION);
                 if (file.IsNull())
                     return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
                 try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
+                    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+                    bool fCompressed;
+                    if (!ReadDiskRecordHeader(file, ssBlock, fCompressed))
+                        return error("%s : corrupt compressed block at %s", __func__, postx.ToString());
+                    if (fCompressed) {
+                        // tx offsets count bytes of the uncompressed block
+                        ssBlock >> header;
+                        ssBlock.ignore(postx.nTxOffset);
+                        ssBlock >> txOut;
+                    } else {
+                        file >> header;
+                        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    }
                 } catch (std::exception& e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
@@ -1972,6 +2168,11 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
 //
 
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos)
+{
+    return WriteBlockToDisk(CDiskRecord(block), pos);
+}
+
+bool WriteBlockToDisk(const CDiskRecord& record, CDiskBlockPos& pos)
 {
     // Open history file to append
     CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
@@ -1979,15 +2180,14 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos)
         return error("WriteBlockToDisk : OpenBlockFile failed");
 
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
-    fileout << FLATDATA(Params().MessageStart()) << nSize;
+    fileout << FLATDATA(Params().MessageStart()) << record.nSizeField;
 
     // Write block
     long fileOutPos = ftell(fileout.Get());
     if (fileOutPos < 0)
         return error("WriteBlockToDisk : ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    fileout.write(&record.ssPayload[0], record.ssPayload.size());
 
     return true;
 }
@@ -1996,14 +2196,23 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    // Open history file to read, starting at the size field of the record header
+    if (pos.nPos < 8)
+        return error("ReadBlockFromDisk : invalid position %s", pos.ToString());
+    CAutoFile filein(OpenBlockFile(GetDiskRecordSizePos(pos), true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("ReadBlockFromDisk : OpenBlockFile failed");
 
     // Read block
     try {
-        filein >> block;
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        bool fCompressed;
+        if (!ReadDiskRecordHeader(filein, ssBlock, fCompressed))
+            return error("%s : corrupt compressed block at %s", __func__, pos.ToString());
+        if (fCompressed)
+            ssBlock >> block;
+        else
+            filein >> block;
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -2036,6 +2245,39 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CDiskBlockPos& pos)
+{
+    vchBlock.clear();
+
+    if (pos.nPos < 8)
+        return error("%s : invalid position %s", __func__, pos.ToString());
+    CAutoFile filein(OpenBlockFile(GetDiskRecordSizePos(pos), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed", __func__);
+
+    try {
+        unsigned int nSize;
+        filein >> nSize;
+        bool fCompressed = (nSize & DISK_RECORD_COMPRESSED) != 0;
+        nSize &= ~DISK_RECORD_COMPRESSED;
+        if (nSize == 0 || nSize > MAX_SIZE)
+            return error("%s : invalid record size at %s", __func__, pos.ToString());
+        std::vector<char> vchRecord(nSize);
+        filein.read(&vchRecord[0], nSize);
+        if (!fCompressed) {
+            vchBlock.swap(vchRecord);
+            return true;
+        }
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        if (!UnpackDiskRecord(vchRecord, ssBlock))
+            return error("%s : corrupt compressed block at %s", __func__, pos.ToString());
+        vchBlock.assign(ssBlock.begin(), ssBlock.end());
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -2086,6 +2328,11 @@ int GetBestPeerHeight()
     return std::max(cPeerBlockCounts.median(), Checkpoints::GetTotalBlocksEstimate());
 }
 
+CChainSnapshot GetChainSnapshot()
+{
+    return CChainSnapshot(pindexTipSnapshot.load());
+}
+
 bool IsInitialBlockDownload()
 {
     const CChainParams& chainParams = Params();
@@ -2542,15 +2789,24 @@ static bool ApplyTxInUndo_Legacy(const CTxInUndo& undo, CCoinsViewCache& view, c
 
 bool UndoReadFromDisk_Legacy(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    // Open history file to read, starting at the size field of the record header
+    if (pos.nPos < 8)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+    CAutoFile filein(OpenUndoFile(GetDiskRecordSizePos(pos), true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("%s: OpenBlockFile failed", __func__);
 
     // Read block
     uint256 hashChecksum;
     try {
-        filein >> blockundo;
+        CDataStream ssUndo(SER_DISK, CLIENT_VERSION);
+        bool fCompressed;
+        if (!ReadDiskRecordHeader(filein, ssUndo, fCompressed))
+            return error("%s: corrupt compressed undo data at %s", __func__, pos.ToString());
+        if (fCompressed)
+            ssUndo >> blockundo;
+        else
+            filein >> blockundo;
         filein >> hashChecksum;
     } catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s", __func__, e.what());
@@ -2661,8 +2917,8 @@ void static FlushBlockFile(bool fFinalize = false)
     }
 }
 
-bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
-bool FindUndoPos_Legacy(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
+bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize, unsigned int nRawAddSize);
+bool FindUndoPos_Legacy(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize, unsigned int nRawAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
@@ -2926,9 +3182,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            CDiskRecord record(blockundo);
+            if (!FindUndoPos(state, pindex->nFile, pos, record.GetDiskSize() + 40, record.nRawSize + 40))
                 return error("ConnectBlock(): FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash()))
+            if (!blockundo.WriteToDisk(record, pos, pindex->pprev->GetBlockHash()))
                 return state.Abort("Failed to write undo data");
 
             // update nUndoPos in block index
@@ -2990,7 +3247,7 @@ void static BuildAddrIndex_Legacy(const CScript& script, const CExtDiskTxPos& po
 }
 
 
-bool UndoWriteToDisk_Legacy(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
+bool UndoWriteToDisk_Legacy(const CBlockUndo& blockundo, const CDiskRecord& record, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
     CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
@@ -2998,15 +3255,14 @@ bool UndoWriteToDisk_Legacy(const CBlockUndo& blockundo, CDiskBlockPos& pos, con
         return error("%s: OpenUndoFile failed", __func__);
 
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(blockundo);
-    fileout << FLATDATA(messageStart) << nSize;
+    fileout << FLATDATA(messageStart) << record.nSizeField;
 
     // Write undo data
     long fileOutPos = ftell(fileout.Get());
     if (fileOutPos < 0)
         return error("%s: ftell failed", __func__);
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << blockundo;
+    fileout.write(&record.ssPayload[0], record.ssPayload.size());
 
     // calculate & write checksum
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
@@ -3234,9 +3490,10 @@ bool ConnectBlock_Legacy(const CBlock& block, CValidationState& state, CBlockInd
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos_Legacy(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            CDiskRecord record(blockundo);
+            if (!FindUndoPos_Legacy(state, pindex->nFile, pos, record.GetDiskSize() + 40, record.nRawSize + 40))
                 return error("ConnectBlock(): FindUndoPos failed");
-            if (!UndoWriteToDisk_Legacy(blockundo, pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
+            if (!UndoWriteToDisk_Legacy(blockundo, record, pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
                 return AbortNode(state, "Failed to write undo data");
 
             // update nUndoPos in block index
@@ -3320,10 +3577,13 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             nLastSetChain = nNow;
         }
         size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // Entries a background flush is still writing are held as well, so the
+        // cache and those together stay within -dbcache
+        size_t flushingSize = pcoinsFlusher ? pcoinsFlusher->DynamicMemoryUsage() : 0;
         // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
         bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0 / 9) > nCoinCacheUsage;
-        // The cache is over the limit, we have to write now.
-        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+        // The cache is over the limit, we have to write now, waiting for a background flush still running.
+        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize + flushingSize > nCoinCacheUsage;
         // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
         bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
         // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
@@ -3372,6 +3632,11 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             // Flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return AbortNode(state, "Failed to write to coin database");
+            // Periodic flushes are left to complete in the background while
+            // validation continues; everything else waits for the write.
+            bool fBackground = (fCacheLarge || fPeriodicFlush) && !fFlushForPrune && GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH);
+            if (pcoinsFlusher && !fBackground && !pcoinsFlusher->Sync())
+                return AbortNode(state, "Failed to write to coin database");
             nLastFlush = nNow;
         }
         if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -3526,6 +3791,7 @@ void static UpdateTip(CBlockIndex* pindexNew)
 {
     const CChainParams& chainParams = Params();
     chainActive.SetTip(pindexNew);
+    pindexTipSnapshot = chainActive.Tip();
 
     // New best block
     nChainHeight = pindexNew->nHeight;
@@ -3587,6 +3853,8 @@ bool static DisconnectTip(CValidationState& state, bool isLoadingTx = false)
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
+    // Before its transactions return to the mempool
+    GetMainSignals().BlockDisconnected(block, pindexDelete);
     // Resurrect mempool transactions from the disconnected block.
     std::vector<uint256> vHashUpdate;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
@@ -3680,6 +3948,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, const CB
     BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
         SyncWithWallets(tx, pblock);
     }
+    GetMainSignals().BlockConnected(*pblock, pindexNew);
     int64_t nTime6 = GetTimeMicros();
     nTimePostConnect += nTime6 - nTime5;
     nTimeTotal += nTime6 - nTime1;
@@ -4200,7 +4469,7 @@ bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBl
     return true;
 }
 
-bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
+bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAddSize, unsigned int nRawAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
 {
     LOCK(cs_LastBlockFile);
 
@@ -4229,10 +4498,16 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
     }
 
     vinfoBlockFile[nFile].AddBlock(nHeight, nTime);
-    if (fKnown)
-        vinfoBlockFile[nFile].nSize = std::max(pos.nPos + nAddSize, vinfoBlockFile[nFile].nSize);
-    else
+    if (fKnown) {
+        if (pos.nPos + nAddSize > vinfoBlockFile[nFile].nSize) {
+            // gaps before the record count towards both sizes
+            vinfoBlockFile[nFile].nRawSize += pos.nPos + nRawAddSize - vinfoBlockFile[nFile].nSize;
+            vinfoBlockFile[nFile].nSize = pos.nPos + nAddSize;
+        }
+    } else {
         vinfoBlockFile[nFile].nSize += nAddSize;
+        vinfoBlockFile[nFile].nRawSize += nRawAddSize;
+    }
 
     if (!fKnown) {
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
@@ -4259,7 +4534,7 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
 }
 
 
-bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize)
+bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize, unsigned int nRawAddSize)
 {
     pos.nFile = nFile;
 
@@ -4268,6 +4543,7 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     unsigned int nNewSize;
     pos.nPos = vinfoBlockFile[nFile].nUndoSize;
     nNewSize = vinfoBlockFile[nFile].nUndoSize += nAddSize;
+    vinfoBlockFile[nFile].nRawUndoSize += nRawAddSize;
     setDirtyFileInfo.insert(nFile);
 
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
@@ -4289,7 +4565,7 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     return true;
 }
 
-bool FindUndoPos_Legacy(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize)
+bool FindUndoPos_Legacy(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize, unsigned int nRawAddSize)
 {
     pos.nFile = nFile;
 
@@ -4298,6 +4574,7 @@ bool FindUndoPos_Legacy(CValidationState& state, int nFile, CDiskBlockPos& pos,
     unsigned int nNewSize;
     pos.nPos = vinfoBlockFile[nFile].nUndoSize;
     nNewSize = vinfoBlockFile[nFile].nUndoSize += nAddSize;
+    vinfoBlockFile[nFile].nRawUndoSize += nRawAddSize;
     setDirtyFileInfo.insert(nFile);
 
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
@@ -4907,15 +5184,21 @@ static bool AcceptBlock_Legacy(const CBlock& block, CValidationState& state, CBl
     }
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
+        if (dbp != NULL) {
             blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize + 8, nHeight, block.GetBlockTime(), dbp != NULL))
-            return error("AcceptBlock(): FindBlockPos failed");
-        if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos))
+            unsigned int nDiskSize, nRawSize;
+            if (!GetBlockRecordSize(blockPos, nDiskSize, nRawSize))
+                return error("AcceptBlock(): FindBlockPos failed");
+            if (!FindBlockPos(state, blockPos, nDiskSize + 8, nRawSize + 8, nHeight, block.GetBlockTime(), true))
+                return error("AcceptBlock(): FindBlockPos failed");
+        } else {
+            CDiskRecord record(block);
+            if (!FindBlockPos(state, blockPos, record.GetDiskSize() + 8, record.nRawSize + 8, nHeight, block.GetBlockTime()))
+                return error("AcceptBlock(): FindBlockPos failed");
+            if (!WriteBlockToDisk(record, blockPos))
                 AbortNode(state, "Failed to write block");
+        }
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
     } catch (const std::runtime_error& e) {
@@ -5021,15 +5304,21 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
+        if (dbp != NULL) {
             blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize + 8, nHeight, block.GetBlockTime(), dbp != NULL))
-            return error("AcceptBlock() : FindBlockPos failed");
-        if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos))
+            unsigned int nDiskSize, nRawSize;
+            if (!GetBlockRecordSize(blockPos, nDiskSize, nRawSize))
+                return error("AcceptBlock() : FindBlockPos failed");
+            if (!FindBlockPos(state, blockPos, nDiskSize + 8, nRawSize + 8, nHeight, block.GetBlockTime(), true))
+                return error("AcceptBlock() : FindBlockPos failed");
+        } else {
+            CDiskRecord record(block);
+            if (!FindBlockPos(state, blockPos, record.GetDiskSize() + 8, record.nRawSize + 8, nHeight, block.GetBlockTime()))
+                return error("AcceptBlock() : FindBlockPos failed");
+            if (!WriteBlockToDisk(record, blockPos))
                 return state.Abort("Failed to write block");
+        }
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock() : ReceivedBlockTransactions failed");
     } catch (std::runtime_error& e) {
@@ -5136,17 +5425,6 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     if (!ActivateBestChain(state, pblock))
         return error("%s : ActivateBestChain failed", __func__);
 
-
-    if (pwalletMain) {
-        // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
-        if (pwalletMain->isMultiSendEnabled())
-            pwalletMain->MultiSend();
-
-        // If turned on Auto Combine will scan wallet for dust to combine
-        if (pwalletMain->fCombineDust)
-            pwalletMain->AutoCombineDust();
-    }
-
     if (fDebug)
         LogPrintf("%s : ACCEPTED Block %ld in %ld milliseconds with size=%d\n", __func__, GetHeight(), GetTimeMillis() - nStartTime,
             pblock->GetSerializeSize(SER_DISK, CLIENT_VERSION));
@@ -5199,16 +5477,6 @@ bool ProcessNewBlock_Legacy(CValidationState& state, const CChainParams& chainpa
     if (!ActivateBestChain(state, pblock))
         return error("%s: ActivateBestChain failed", __func__);
 
-    if (pwalletMain) {
-        // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
-        if (pwalletMain->isMultiSendEnabled())
-            pwalletMain->MultiSend();
-
-        //If turned on Auto Combine will scan wallet for dust to combine
-        if (pwalletMain->fCombineDust)
-            pwalletMain->AutoCombineDust();
-    }
-
     if (fDebug)
         LogPrintf("%s : ACCEPTED\n", __func__);
 
@@ -5358,21 +5626,29 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
 
 bool static LoadBlockIndexDB()
 {
+    int64_t nStart = GetTimeMillis();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
+    int64_t nLoaded = GetTimeMillis();
 
     boost::this_thread::interruption_point();
 
     // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex) {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
-        CBlockIndex* pindex = item.second;
+    // Parents sit exactly one height below their children, so bucketing the
+    // entries by height (a counting sort) orders them topologically in
+    // linear time.
+    int nMaxHeight = 0;
+    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<unsigned int> vHeightOffsets(nMaxHeight + 2, 0);
+    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        vHeightOffsets[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightOffsets[nHeight] += vHeightOffsets[nHeight - 1];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        vSortedByHeight[vHeightOffsets[item.second->nHeight]++] = item.second;
+    BOOST_FOREACH (CBlockIndex* pindex, vSortedByHeight) {
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         bool check = UseLegacyCode(pindex->nHeight) ? pindex->nTx > 0 : pindex->nStatus & BLOCK_HAVE_DATA;
         if (check) {
@@ -5396,6 +5672,7 @@ bool static LoadBlockIndexDB()
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    int64_t nChainWorkDone = GetTimeMillis();
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -5460,11 +5737,15 @@ bool static LoadBlockIndexDB()
     // If this is written true before the next client init, then we know the shutdown process failed
     pblocktree->WriteFlag("shutdown", false);
 
+    LogPrintf("%s: block index %dms (entries %dms, chain work %dms, block files %dms)\n", __func__,
+        GetTimeMillis() - nStart, nLoaded - nStart, nChainWorkDone - nLoaded, GetTimeMillis() - nChainWorkDone);
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    pindexTipSnapshot = chainActive.Tip();
 
     PruneBlockIndexCandidates();
 
@@ -5575,6 +5856,7 @@ void UnloadBlockIndex_Legacy()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    pindexTipSnapshot = NULL;
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
@@ -5609,6 +5891,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    pindexTipSnapshot = NULL;
     pindexBestInvalid = NULL;
     versionbitscache.Clear();
     UnloadBlockIndex_Legacy();
@@ -5647,12 +5930,12 @@ bool InitBlockIndex()
         try {
             CBlock& block = const_cast<CBlock&>(Params().GenesisBlock());
             // Start new block file
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            CDiskRecord record(block);
             CDiskBlockPos blockPos;
             CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize + 8, 0, block.GetBlockTime()))
+            if (!FindBlockPos(state, blockPos, record.GetDiskSize() + 8, record.nRawSize + 8, 0, block.GetBlockTime()))
                 return error("LoadBlockIndex() : FindBlockPos failed");
-            if (!WriteBlockToDisk(block, blockPos))
+            if (!WriteBlockToDisk(record, blockPos))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
             CBlockIndex* pindex = AddToBlockIndex(block);
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
@@ -5669,6 +5952,127 @@ bool InitBlockIndex()
     return true;
 }
 
+/** Order blocks by their position in a block file */
+struct CompareBlockDataPos {
+    bool operator()(const CBlockIndex* a, const CBlockIndex* b) const
+    {
+        return a->nDataPos < b->nDataPos;
+    }
+};
+
+bool CompactBlockFiles()
+{
+    LOCK(cs_main);
+    const CChainParams& chainparams = Params();
+
+    int nLastFile;
+    {
+        LOCK(cs_LastBlockFile);
+        nLastFile = nLastBlockFile;
+    }
+
+    // The file currently being appended to is left alone
+    std::vector<std::vector<CBlockIndex*> > vFileBlocks(nLastFile);
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) && pindex->nFile < nLastFile)
+            vFileBlocks[pindex->nFile].push_back(pindex);
+    }
+
+    bool fOldBlockCompression = fBlockCompression;
+    fBlockCompression = true;
+    bool fOk = true;
+    for (int nFile = 0; nFile < nLastFile && fOk; nFile++) {
+        std::vector<CBlockIndex*>& vBlocks = vFileBlocks[nFile];
+        if (vBlocks.empty())
+            continue;
+        {
+            LOCK(cs_LastBlockFile);
+            if (vinfoBlockFile[nFile].IsCompressed())
+                continue;
+        }
+        boost::this_thread::interruption_point();
+        std::sort(vBlocks.begin(), vBlocks.end(), CompareBlockDataPos());
+
+        // Rewrite each block and its undo data at the end of the block files
+        int64_t nStart = GetTimeMillis();
+        CValidationState state;
+        std::vector<std::pair<uint256, CDiskTxPos> > vPosTxid;
+        std::map<CDiskBlockPos, CDiskBlockPos> mapMoved;
+        BOOST_FOREACH (CBlockIndex* pindex, vBlocks) {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindex)) {
+                fOk = error("%s: failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+                break;
+            }
+            CBlockUndo blockundo;
+            bool fUndo = (pindex->nStatus & BLOCK_HAVE_UNDO) && pindex->pprev;
+            if (fUndo && !UndoReadFromDisk_Legacy(blockundo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash())) {
+                fOk = error("%s: failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+                break;
+            }
+
+            CDiskRecord record(block);
+            CDiskBlockPos blockPos;
+            if (!FindBlockPos(state, blockPos, record.GetDiskSize() + 8, record.nRawSize + 8, pindex->nHeight, block.GetBlockTime()) ||
+                !WriteBlockToDisk(record, blockPos)) {
+                fOk = error("%s: failed to write block %s", __func__, pindex->GetBlockHash().ToString());
+                break;
+            }
+            CDiskBlockPos posOld = pindex->GetBlockPos();
+            mapMoved[posOld] = blockPos;
+            pindex->nFile = blockPos.nFile;
+            pindex->nDataPos = blockPos.nPos;
+            if (fUndo) {
+                CDiskRecord undoRecord(blockundo);
+                CDiskBlockPos undoPos;
+                if (!FindUndoPos_Legacy(state, blockPos.nFile, undoPos, undoRecord.GetDiskSize() + 40, undoRecord.nRawSize + 40) ||
+                    !UndoWriteToDisk_Legacy(blockundo, undoRecord, undoPos, pindex->pprev->GetBlockHash(), chainparams.MessageStart())) {
+                    fOk = error("%s: failed to write undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+                    break;
+                }
+                pindex->nUndoPos = undoPos.nPos;
+            }
+            setDirtyBlockIndex.insert(pindex);
+
+            if (fTxIndex) {
+                // Stale blocks can own txindex entries too (e.g. transactions
+                // that were never confirmed again after a reorg), so repoint
+                // every entry that refers to this copy of the block
+                CDiskTxPos pos(blockPos, GetSizeOfCompactSize(block.vtx.size()));
+                BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+                    CDiskTxPos postx;
+                    if (pblocktree->ReadTxIndex(tx.GetHash(), postx) && postx.nFile == posOld.nFile && postx.nPos == posOld.nPos)
+                        vPosTxid.push_back(std::make_pair(tx.GetHash(), pos));
+                    pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+                }
+            }
+        }
+        if (!fOk)
+            break;
+
+        // Point the block index and then the transaction and address indexes
+        // at the new copies before the old file goes away
+        {
+            LOCK(cs_LastBlockFile);
+            LogPrintf("%s: compacted block file %05u: %s\n", __func__, nFile, vinfoBlockFile[nFile].ToString());
+            vinfoBlockFile[nFile].SetNull();
+            setDirtyFileInfo.insert(nFile);
+        }
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS) || (fTxIndex && !pblocktree->WriteTxIndex(vPosTxid)) ||
+            (fAddrIndex && !pblocktree->MoveAddrIndex(nFile, mapMoved)) || !pblocktree->Sync()) {
+            fOk = error("%s: failed to update the block index", __func__);
+            break;
+        }
+        std::set<int> setFilesToRemove;
+        setFilesToRemove.insert(nFile);
+        UnlinkPrunedFiles(setFilesToRemove);
+        LogPrintf("%s: moved %u blocks out of blk%05u.dat in %dms\n", __func__, vBlocks.size(), nFile, GetTimeMillis() - nStart);
+    }
+    fBlockCompression = fOldBlockCompression;
+    return fOk;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -5688,6 +6092,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
             nRewind++;         // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            bool fCompressed = false;
             try {
                 // locate a header
                 unsigned char buf[MESSAGE_START_SIZE];
@@ -5698,7 +6103,9 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                     continue;
                 // read size
                 blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                fCompressed = (nSize & DISK_RECORD_COMPRESSED) != 0;
+                nSize &= ~DISK_RECORD_COMPRESSED;
+                if (nSize < (fCompressed ? 4 : 80) || nSize > MAX_BLOCK_SIZE)
                     continue;
             } catch (const std::exception&) {
                 // no valid block header found; don't complain
@@ -5712,7 +6119,16 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
                 CBlock block;
-                blkdat >> block;
+                if (fCompressed) {
+                    std::vector<char> vPacked(nSize);
+                    blkdat.read(&vPacked[0], nSize);
+                    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+                    if (!UnpackDiskRecord(vPacked, ssBlock))
+                        continue;
+                    ssBlock >> block;
+                } else {
+                    blkdat >> block;
+                }
                 nRewind = blkdat.GetPos();
 
                 // detect out of order blocks, and store them for later
@@ -6677,15 +7093,23 @@ bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv
     CInv inv(MSG_TX, tx.GetHash());
     pfrom->AddInventoryKnown(inv);
 
-    LOCK(cs_main);
-
     bool fMissingInputs = false;
     CValidationState state;
+    bool fAlreadyHave;
+    {
+        LOCK(cs_main);
+        pfrom->setAskFor.erase(inv.hash);
+        mapAlreadyAskedFor.erase(inv.hash);
+        fAlreadyHave = AlreadyHave(inv);
+    }
 
-    pfrom->setAskFor.erase(inv.hash);
-    mapAlreadyAskedFor.erase(inv.hash);
+    // Called without cs_main so script verification doesn't hold up block
+    // processing; AcceptToMemoryPool takes the locks for the stages needing them.
+    bool fAccepted = !fAlreadyHave && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs);
 
-    if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
+    LOCK(cs_main);
+
+    if (fAccepted) {
         mempool.check(pcoinsTip);
         RelayTransaction(tx);
         vWorkQueue.push_back(inv.hash);
@@ -7645,7 +8069,7 @@ bool SendMessages(CNode* pto)
     return true;
 }
 
-bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
+bool CBlockUndo::WriteToDisk(const CDiskRecord& record, CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to append
     CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
@@ -7653,15 +8077,14 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
         return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
 
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(*this);
-    fileout << FLATDATA(Params().MessageStart()) << nSize;
+    fileout << FLATDATA(Params().MessageStart()) << record.nSizeField;
 
     // Write undo data
     long fileOutPos = ftell(fileout.Get());
     if (fileOutPos < 0)
         return error("CBlockUndo::WriteToDisk : ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << *this;
+    fileout.write(&record.ssPayload[0], record.ssPayload.size());
 
     // calculate & write checksum
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
@@ -7674,15 +8097,24 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    // Open history file to read, starting at the size field of the record header
+    if (pos.nPos < 8)
+        return error("CBlockUndo::ReadFromDisk : invalid position %s", pos.ToString());
+    CAutoFile filein(OpenUndoFile(GetDiskRecordSizePos(pos), true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
 
     // Read block
     uint256 hashChecksum;
     try {
-        filein >> *this;
+        CDataStream ssUndo(SER_DISK, CLIENT_VERSION);
+        bool fCompressed;
+        if (!ReadDiskRecordHeader(filein, ssUndo, fCompressed))
+            return error("CBlockUndo::ReadFromDisk : corrupt compressed undo data at %s", pos.ToString());
+        if (fCompressed)
+            ssUndo >> *this;
+        else
+            filein >> *this;
         filein >> hashChecksum;
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -7700,7 +8132,7 @@ bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock
 
 std::string CBlockFileInfo::ToString() const
 {
-    return strprintf("CBlockFileInfo(blocks=%u, size=%u, heights=%u...%u, time=%s...%s)", nBlocks, nSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst), DateTimeStrFormat("%Y-%m-%d", nTimeLast));
+    return strprintf("CBlockFileInfo(blocks=%u, size=%u, rawsize=%u, heights=%u...%u, time=%s...%s)", nBlocks, nSize, nRawSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst), DateTimeStrFormat("%Y-%m-%d", nTimeLast));
 }
 
 
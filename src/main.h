@@ -15,6 +15,7 @@
 #include "amount.h"
 #include "chain.h"
 #include "chainparams.h"
+#include "clientversion.h"
 #include "coins.h"
 #include "legacy/policy/policy.h"
 #include "net.h"
@@ -24,6 +25,7 @@
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
+#include "streams.h"
 #include "sync.h"
 #include "tinyformat.h"
 #include "txmempool.h"
@@ -47,7 +49,10 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
+class CCoinsViewFlusher;
 class CBloomFilter;
+class CDiskRecord;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
@@ -96,6 +101,8 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Flag in the size field of a blk/rev record header marking a deflated payload */
+static const unsigned int DISK_RECORD_COMPRESSED = 0x80000000;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 //static const int COINBASE_MATURITY = 25;
 /** Maximum number of script-checking threads allowed */
@@ -185,6 +192,7 @@ extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fAddrIndex;
+extern bool fBlockCompression;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern unsigned int nBytesPerSigOp;
@@ -238,6 +246,12 @@ static const unsigned int MIN_BLOCKS_TO_KEEP = 500;
 
 static const signed int DEFAULT_CHECKBLOCKS = MIN_BLOCKS_TO_KEEP;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+/** Write periodic coin cache flushes from a background thread */
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
+/** Rehash every n-th block index entry when loading it (0 = never) */
+static const unsigned int DEFAULT_CHECKBLOCKINDEXHASH = 0;
+/** Deflate new block and undo records */
+static const bool DEFAULT_BLOCK_COMPRESSION = false;
 
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
@@ -290,6 +304,8 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** Move the blocks of finished, uncompressed block files to the end in compressed form and delete the emptied files (-compactblocks) */
+bool CompactBlockFiles();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -309,6 +325,8 @@ bool SendMessages(CNode* pto);
 
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the script checking thread used for loose transactions */
+void ThreadMempoolScriptCheck();
 
 int GetBestPeerHeight();
 
@@ -558,7 +576,7 @@ public:
         READWRITE(vtxundo);
     }
 
-    bool WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock);
+    bool WriteToDisk(const CDiskRecord& record, CDiskBlockPos& pos, const uint256& hashBlock);
     bool ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock);
 };
 
@@ -597,10 +615,46 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Turn the serialized block or undo data in ssData into its on-disk payload.
+ * With -blockcompression it is replaced by its uncompressed size followed by
+ * the deflated bytes, unless that does not save space. Returns the size field
+ * for the record header.
+ */
+unsigned int PackDiskRecord(CDataStream& ssData);
+
+/**
+ * Inflate a compressed record payload (uncompressed size, then the deflated
+ * bytes) into ssData. Fails on corrupt data or if built without zlib.
+ */
+bool UnpackDiskRecord(const std::vector<char>& vPacked, CDataStream& ssData);
+
+/** Block or undo data in the form written after a blk/rev record header */
+class CDiskRecord
+{
+public:
+    CDataStream ssPayload;   //! bytes following the record header
+    unsigned int nRawSize;   //! size of the uncompressed serialization
+    unsigned int nSizeField; //! size field of the record header
+
+    template <typename T>
+    explicit CDiskRecord(const T& obj) : ssPayload(SER_DISK, CLIENT_VERSION)
+    {
+        ssPayload << obj;
+        nRawSize = ssPayload.size();
+        nSizeField = PackDiskRecord(ssPayload);
+    }
+
+    unsigned int GetDiskSize() const { return ssPayload.size(); }
+};
+
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos);
+bool WriteBlockToDisk(const CDiskRecord& record, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read the serialized block at pos without deserializing it; compressed records are inflated */
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CDiskBlockPos& pos);
 
 /* This function will return the nHeight from an pIndex, 
   if pIndex is Null it will return the 
@@ -675,6 +729,8 @@ public:
     unsigned int nHeightLast;  //! highest height of block in file
     uint64_t nTimeFirst;       //! earliest time of block in file
     uint64_t nTimeLast;        //! latest time of block in file
+    unsigned int nRawSize;     //! bytes the block file would use without compression
+    unsigned int nRawUndoSize; //! bytes the undo file would use without compression
 
     ADD_SERIALIZE_METHODS;
 
@@ -688,6 +744,8 @@ public:
         READWRITE(VARINT(nHeightLast));
         READWRITE(VARINT(nTimeFirst));
         READWRITE(VARINT(nTimeLast));
+        READWRITE(VARINT(nRawSize));
+        READWRITE(VARINT(nRawUndoSize));
     }
 
     void SetNull()
@@ -699,6 +757,8 @@ public:
         nHeightLast = 0;
         nTimeFirst = 0;
         nTimeLast = 0;
+        nRawSize = 0;
+        nRawUndoSize = 0;
     }
 
     CBlockFileInfo()
@@ -708,6 +768,12 @@ public:
 
     std::string ToString() const;
 
+    /** true if any record in this file's blk or rev file is compressed */
+    bool IsCompressed() const
+    {
+        return nRawSize != nSize || nRawUndoSize != nUndoSize;
+    }
+
     /** update statistics (does not update nSize) */
     void AddBlock(unsigned int nHeightIn, uint64_t nTimeIn)
     {
@@ -821,12 +887,21 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/** chainActive as of its last tip change, for readers that don't hold cs_main */
+CChainSnapshot GetChainSnapshot();
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
+/** Background writer below pcoinsTip, if any (protected by cs_main) */
+extern CCoinsViewFlusher* pcoinsFlusher;
+
+/** The chainstate database at the bottom of the pcoinsTip stack (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+
 struct CBlockTemplate {
     CBlock block;
     std::vector<CAmount> vTxFees;
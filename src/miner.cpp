@@ -29,7 +29,6 @@
 #include "validationinterface.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options/detail/config_file.hpp>
 
@@ -43,52 +42,577 @@ using namespace std;
 //
 // KOREMiner
 //
-//
+
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+const char* pszLastBlockSelection = "";
+
 // Unconfirmed transactions in the memory pool often depend on other
 // transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// pool, we select by highest ancestor feerate, so the whole package of
+// unconfirmed parents is added before a child that pays for them.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+// CTxMemPoolModifiedEntry tracks an entry whose ancestor state has changed
+// because some of its ancestors were already included in the block.
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
+    }
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
+
+// A comparator that sorts transactions by package feerate, the same way
+// CompareTxMemPoolEntryByAncestorFee does for mapTx.
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
     {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        }
+        return f1 > f2;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+// Sort a set of entries so that ancestors always come before descendants.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+// extracts the txiter of a CTxMemPoolModifiedEntry
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        // sorted by txiter
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash>,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::nth_index<1>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
+    }
+
+    CTxMemPool::txiter iter;
+};
+
+/**
+ * The transactions picked for the most recent template. While the tip does
+ * not change, the next template starts from this selection and only considers
+ * what entered the mempool since, unless the block was already full.
+ * Protected by cs_main.
+ */
+struct CTxSelectionCache {
+    uint256 hashPrevBlock;
+    unsigned int nTransactionsUpdated;
+    bool fBlockLimited; //! a package was skipped for size or sigops
+    std::vector<uint256> vHashes;
+
+    CTxSelectionCache() : nTransactionsUpdated(0), fBlockLimited(true) {}
+    void SetNull()
+    {
+        hashPrevBlock.SetNull();
+        vHashes.clear();
+    }
+};
+static CTxSelectionCache txSelectionCache;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+/** Selects mempool transactions for a new block by ancestor feerate. */
+class BlockAssembler
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+    bool fBlockLimited;
+
+    // Chain context for the block
+    int nHeight;
+    bool fPrintPriority;
+
+    // Stats
+    int nPackagesSelected;
+    int nDescendantsUpdated;
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    BlockAssembler(CBlockTemplate* pblocktemplateIn, int nHeightIn);
+
+    /** Add transactions by priority and then by package feerate. */
+    void AddTransactions();
+    /** Continue from the selection of a previous template at the same height.
+     *  Returns false if that selection is no longer entirely in the mempool. */
+    bool AddCachedTransactions(const std::vector<uint256>& vHashes);
+    /** Fill the remaining space by package feerate. */
+    void AddPackageTxs();
+
+    CAmount GetFees() const { return nFees; }
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    unsigned int GetBlockSigOps() const { return nBlockSigOps; }
+    bool IsBlockLimited() const { return fBlockLimited; }
+    int GetPackagesSelected() const { return nPackagesSelected; }
+    int GetDescendantsUpdated() const { return nDescendantsUpdated; }
+
+private:
+    void AddPriorityTxs();
+    void AddToBlock(CTxMemPool::txiter iter);
+    bool IsStillDependent(CTxMemPool::txiter iter);
+    bool TestForBlock(CTxMemPool::txiter iter);
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps);
+    bool TestPackageTransactions(const CTxMemPool::setEntries& package);
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx);
+    void SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries);
+    int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx);
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+BlockAssembler::BlockAssembler(CBlockTemplate* pblocktemplateIn, int nHeightIn) : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), nHeight(nHeightIn)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE;
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    // Reserve space for coinbase and coinstake
+    nBlockSize = 1000;
+    nBlockTx = 0;
+    nBlockSigOps = 100;
+    nFees = 0;
+    fBlockLimited = false;
+
+    fPrintPriority = GetBoolArg("-printpriority", false);
+
+    nPackagesSelected = 0;
+    nDescendantsUpdated = 0;
+}
+
+void BlockAssembler::AddTransactions()
+{
+    AddPriorityTxs();
+    AddPackageTxs();
+}
+
+bool BlockAssembler::AddCachedTransactions(const std::vector<uint256>& vHashes)
+{
+    std::vector<CTxMemPool::txiter> vEntries;
+    vEntries.reserve(vHashes.size());
+    BOOST_FOREACH (const uint256& hash, vHashes) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end())
+            return false;
+        vEntries.push_back(it);
+    }
+
+    // The cached order is already a valid block order: every tx was added
+    // after all of its in-mempool ancestors.
+    BOOST_FOREACH (CTxMemPool::txiter it, vEntries) {
+        AddToBlock(it);
+    }
+    return true;
+}
+
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
+{
+    pblock->vtx.push_back(iter->GetTx());
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += iter->GetSigOpCount();
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    if (fPrintPriority && fDebug) {
+        double dPriority = iter->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n", dPriority,
+            CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(),
+            iter->GetTx().GetHash().ToString());
+    }
+}
+
+bool BlockAssembler::IsStillDependent(CTxMemPool::txiter iter)
+{
+    BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BlockAssembler::TestPackage(uint64_t packageSize, unsigned int packageSigOps)
+{
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + packageSigOps >= MAX_BLOCK_SIGOPS_CURRENT)
+        return false;
+    return true;
+}
+
+// Block size and sigops have already been tested. Check that all transactions
+// are final, are not coinstakes and do not spend invalid outpoints.
+bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package)
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, package) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (invalid_out::ContainsOutPoint(txin.prevout)) {
+                if (fDebug)
+                    LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
+{
+    if (!TestPackage(iter->GetTxSize(), iter->GetSigOpCount()))
+        return false;
+
+    CTxMemPool::setEntries package;
+    package.insert(iter);
+    return TestPackageTransactions(package);
+}
+
+void BlockAssembler::AddPriorityTxs()
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // This vector will be sorted into a priority queue:
+    vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    double actualPriority = -1;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi) {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    CTxMemPool::txiter iter;
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue:
+        iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        if (inBlock.count(iter))
+            continue;
+
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (IsStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        // If this tx fits in the block add it, otherwise keep looping
+        if (TestForBlock(iter)) {
+            AddToBlock(iter);
+
+            // If now that this txs is added we've surpassed our desired priority size
+            // or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority))
+                break;
+
+            // This tx was successfully added, so add transactions that depend
+            // on this one to the priority queue to try again
+            BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+        }
+    }
+}
+
+int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
+{
+    int nDescendants = 0;
+    BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            ++nDescendants;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+    return nDescendants;
+}
+
+// Skip entries in mapTx that are already in a block or are present
+// in mapModifiedTx (which implies that the mapTx ancestor state is
+// stale due to ancestor inclusion in the block).
+// Also skip transactions that we've already failed to add.
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx)
+{
+    assert(it != mempool.mapTx.end());
+    if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it))
+        return true;
+    return false;
+}
+
+void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries)
+{
+    // Sort package by ancestor count
+    // If a transaction A depends on transaction B, then A's ancestor count
+    // must be greater than B's.  So this is sufficient to validly order the
+    // transactions for block inclusion.
+    sortedEntries.clear();
+    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
+    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+}
+
+// This transaction selection algorithm orders the mempool based
+// on feerate of a transaction including all unconfirmed ancestors.
+// Since we don't remove transactions from the mempool as we select them
+// for block inclusion, we need an alternate method of updating the feerate
+// of a transaction with its not-yet-selected ancestors as we go.
+// This is accomplished by walking the in-mempool descendants of selected
+// transactions and storing a temporary modified state in mapModifiedTx.
+// Each time through the loop, we compare the best transaction in
+// mapModifiedTx with the next transaction in the mempool to decide what
+// transaction package to work on next.
+void BlockAssembler::AddPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    nDescendantsUpdated += UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::nth_index<4>::type::iterator mi = mempool.mapTx.get<4>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<4>().end() || !mapModifiedTx.empty()) {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<4>().end() &&
+            SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<1>().begin();
+        if (mi == mempool.mapTx.get<4>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<1>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpCountWithAncestors;
         }
+
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        if (!TestPackage(packageSize, packageSigOps)) {
+            fBlockLimited = true;
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<1>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+        // Only consider the ancestors that are not already in the block
+        for (CTxMemPool::setEntries::iterator iit = ancestors.begin(); iit != ancestors.end();) {
+            if (inBlock.count(*iit))
+                ancestors.erase(iit++);
+            else
+                iit++;
+        }
+        ancestors.insert(iter);
+
+        // Test if all tx's are final and spend valid outpoints
+        if (!TestPackageTransactions(ancestors)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<1>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        // Package can be added. Sort the entries in a valid order.
+        vector<CTxMemPool::txiter> sortedEntries;
+        SortForBlock(ancestors, sortedEntries);
+
+        for (size_t i = 0; i < sortedEntries.size(); ++i) {
+            AddToBlock(sortedEntries[i]);
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(sortedEntries[i]);
+        }
+
+        ++nPackagesSelected;
+
+        // Update transactions that depend on each of these
+        nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
     }
-};
+}
+
+// Fill the block from the cached selection where possible, see CTxSelectionCache.
+// Returns a short description of what was done, for the bench log.
+static const char* SelectBlockTransactions(BlockAssembler& assembler, const CBlockIndex* pindexPrev, unsigned int nTransactionsUpdated)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    // While the tip stays the same, continue from the previous selection:
+    // reuse it as is when the mempool did not change, or only look at the
+    // new arrivals if the previous block still had room for everything.
+    if (txSelectionCache.hashPrevBlock == pindexPrev->GetBlockHash() &&
+        (txSelectionCache.nTransactionsUpdated == nTransactionsUpdated || !txSelectionCache.fBlockLimited) &&
+        assembler.AddCachedTransactions(txSelectionCache.vHashes)) {
+        if (txSelectionCache.nTransactionsUpdated == nTransactionsUpdated)
+            return "cached";
+        assembler.AddPackageTxs();
+        return "incremental";
+    }
+    assembler.AddTransactions();
+    return "full";
+}
+
+// Remember the selection for the next template at this height
+static void CacheBlockTransactions(const BlockAssembler& assembler, const CBlock& block, const CBlockIndex* pindexPrev, unsigned int nTransactionsUpdated)
+{
+    AssertLockHeld(cs_main);
+
+    size_t nFirstTx = block.vtx.size() - assembler.GetBlockTx();
+    txSelectionCache.hashPrevBlock = pindexPrev->GetBlockHash();
+    txSelectionCache.nTransactionsUpdated = nTransactionsUpdated;
+    txSelectionCache.fBlockLimited = assembler.IsBlockLimited();
+    txSelectionCache.vHashes.clear();
+    txSelectionCache.vHashes.reserve(assembler.GetBlockTx());
+    for (size_t i = nFirstTx; i < block.vtx.size(); i++)
+        txSelectionCache.vHashes.push_back(block.vtx[i].GetHash());
+}
 
 class ScoreCompare //Legacy class
 {
@@ -295,207 +819,27 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     } else 
         pblock->nTime = GetAdjustedTime();
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE;
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
     {
         LOCK2(cs_main, mempool.cs);
 
+        int64_t nTimeStart = GetTimeMicros();
+
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)) {
-                continue;
-            }
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            uint256 txid = tx.GetHash();
-            for (const CTxIn& txin : tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
-                if (invalid_out::ContainsOutPoint(txin.prevout)) {
-                    if (fDebug)
-                        LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
-
-                    fMissingInputs = true;
-                    break;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+        const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        BlockAssembler assembler(pblocktemplate.get(), nHeight);
+        const char* strSelection = SelectBlockTransactions(assembler, pindexPrev, nTransactionsUpdated);
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee && ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority && fDebug)
-                LogPrintf("priority %.1f fee %s txid %s\n", dPriority, feeRate.ToString(), tx.GetHash().ToString());
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        int64_t nTime1 = GetTimeMicros();
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+        nFees = assembler.GetFees();
+        nLastBlockTx = assembler.GetBlockTx();
+        nLastBlockSize = assembler.GetBlockSize();
+        pszLastBlockSelection = strSelection;
         // Compute final coinbase transaction.
         pblocktemplate->vTxFees[0] = -nFees;
 
@@ -515,9 +859,18 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CValidationState state;
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
+            txSelectionCache.SetNull();
             mempool.clear();
             return NULL;
         }
+
+        CacheBlockTransactions(assembler, *pblock, pindexPrev, nTransactionsUpdated);
+
+        int64_t nTime2 = GetTimeMicros();
+
+        LogPrint("bench", "CreateNewBlock() %s selection: %.2fms (%d packages, %d updated descendants, %u txs, %u bytes), validity: %.2fms (total %.2fms)\n",
+            strSelection, 0.001 * (nTime1 - nTimeStart), assembler.GetPackagesSelected(), assembler.GetDescendantsUpdated(),
+            assembler.GetBlockTx(), assembler.GetBlockSize(), 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
         if (fDebug)
             LogPrintf("CreateNewBlock() : Block is VALID !!! \n");
     }
@@ -1158,6 +1511,96 @@ void KoreMiner()
         LogPrintf("Exiting kore-pow at block: %d", GetnHeight(chainActive.Tip()));
 }
 
+/**
+ * Bring the cached transaction selection up to date with the current tip and
+ * mempool, so that the next CreateNewBlock only has to copy it. Used by the
+ * staking thread's template builder between kernel hits.
+ */
+void UpdateTxSelectionCache()
+{
+    LOCK2(cs_main, mempool.cs);
+
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    if (!pindexPrev)
+        return;
+    const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    if (txSelectionCache.hashPrevBlock == pindexPrev->GetBlockHash() &&
+        txSelectionCache.nTransactionsUpdated == nTransactionsUpdated)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Scratch template with room for the coinbase, the coinstake is merged
+    // into the real template once a kernel is found
+    CBlockTemplate blocktemplate(CBlockHeader::POS_FORK_VERSION);
+    blocktemplate.block.vtx.push_back(CTransaction());
+    blocktemplate.vTxFees.push_back(-1);
+    blocktemplate.vTxSigOps.push_back(-1);
+
+    BlockAssembler assembler(&blocktemplate, pindexPrev->nHeight + 1);
+    const char* strSelection = SelectBlockTransactions(assembler, pindexPrev, nTransactionsUpdated);
+    CacheBlockTransactions(assembler, blocktemplate.block, pindexPrev, nTransactionsUpdated);
+
+    LogPrint("bench", "%s: %s selection: %.2fms (%d packages, %u txs, %u bytes)\n", __func__,
+        strSelection, 0.001 * (GetTimeMicros() - nTimeStart), assembler.GetPackagesSelected(),
+        assembler.GetBlockTx(), assembler.GetBlockSize());
+}
+
+/**
+ * Keeps the transaction selection for the next staked block ready. Tip and
+ * mempool changes only mark it stale; the builder thread then recomputes it
+ * outside the time-critical path between a kernel hit and the broadcast.
+ */
+class CStakeTemplateBuilder : public CValidationInterface
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fStale;
+
+public:
+    CStakeTemplateBuilder() : fStale(true) {}
+
+    void MarkStale()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStale = true;
+        }
+        cond.notify_one();
+    }
+
+    /** Block until the selection is stale, then clear the flag. */
+    void WaitForStale()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStale)
+            cond.wait(lock);
+        fStale = false;
+    }
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex) { MarkStale(); }
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock) { MarkStale(); }
+};
+
+static CStakeTemplateBuilder stakeTemplateBuilder;
+static boost::thread_group* stakingThreads = NULL;
+static CCriticalSection cs_stakingThreads;
+
+void ThreadStakeTemplateBuilder()
+{
+    RenameThread("kore-stake-tmpl");
+    while (true) {
+        stakeTemplateBuilder.WaitForStale();
+        // Give bursts of transactions a moment to settle before rebuilding
+        MilliSleep(100);
+        if (IsInitialBlockDownload())
+            continue;
+        UpdateTxSelectionCache();
+    }
+}
+
 // ppcoin: stake minter thread
 void ThreadStakeMinter()
 {
@@ -1169,13 +1612,26 @@ void ThreadStakeMinter()
     try {
         KoreMinter(pwallet);
         boost::this_thread::interruption_point();
+    } catch (const boost::thread_interrupted&) {
+        // Stopped by StakingCoins, which joins this thread
+        LogPrintf("StakeMinter interrupted\n");
+        throw;
     } catch (std::exception& e) {
         LogPrintf("StakeMinter() exception \n");
     } catch (...) {
         LogPrintf("StakeMinter() error \n");
     }
     LogPrintf("StakeMinter exiting,\n");
-    StakingCoins(false);
+
+    // The minter gave up on its own. It cannot join its own group, so only
+    // stop the template builder here; the next StakingCoins call joins and
+    // frees both. If that call is already running, it is joining us.
+    TRY_LOCK(cs_stakingThreads, lockStaking);
+    if (lockStaking && stakingThreads != NULL) {
+        UnregisterValidationInterface(&stakeTemplateBuilder);
+        stakingThreads->interrupt_all();
+    }
+    mapArgs["-staking"] = "0";
 }
 
 void updateStaking2KoreConf( bool staking )
@@ -1227,7 +1683,7 @@ void updateStaking2KoreConf( bool staking )
 
 void StakingCoins(bool fStaking)
 {
-    static boost::thread_group* stakingThreads = NULL;
+    LOCK(cs_stakingThreads);
     if (fDebug) {
         LogPrintf("---------------------------------------------------- \n");
         LogPrintf("StakingCoins: %s \n", fStaking ? "Enable" : "Disable");
@@ -1235,7 +1691,9 @@ void StakingCoins(bool fStaking)
     }
 
     if (stakingThreads != NULL) {
+        UnregisterValidationInterface(&stakeTemplateBuilder);
         stakingThreads->interrupt_all();
+        stakingThreads->join_all();
         delete stakingThreads;
         stakingThreads = NULL;
     }
@@ -1246,6 +1704,9 @@ void StakingCoins(bool fStaking)
     }
 
     stakingThreads = new boost::thread_group();
+    RegisterValidationInterface(&stakeTemplateBuilder);
+    stakeTemplateBuilder.MarkStale();
+    stakingThreads->create_thread(boost::bind(&TraceThread<void (*)()>, "staketmpl", &ThreadStakeTemplateBuilder));
     stakingThreads->create_thread(boost::bind(&TraceThread<void (*)()>, "stakemint", &ThreadStakeMinter));
 }
 
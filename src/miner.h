@@ -35,11 +35,15 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Run the miner threads */
 void GenerateKores(bool fGenerate, int nThreads);
-/** Run the staking thread */
+/** Run the staking thread. Waits for the old threads to stop, so never call it holding cs_main */
 void StakingCoins(bool fStaking);
+/** Refresh the cached transaction selection, as the staking template builder does */
+void UpdateTxSelectionCache();
 
 void updateStaking2KoreConf( bool staking );
 
+/** How CreateNewBlock picked the last template's transactions: "cached", "incremental" or "full" */
+extern const char* pszLastBlockSelection;
 extern double dHashesPerMin;
 extern int64_t nHPSTimerStart;
 
@@ -198,7 +198,10 @@ void MultiSendDialog::on_activateButton_clicked()
     else if (!(ui->multiSendStakeCheckBox->isChecked())) {
         strRet = "Need to select to send on stake rewards\n";
     } else if (CBitcoinAddress(pwalletMain->vMultiSend[0].first).IsValid()) {
-        pwalletMain->fMultiSendStake = ui->multiSendStakeCheckBox->isChecked();
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            pwalletMain->setMultiSendEnabled();
+        }
 
         CWalletDB walletdb(pwalletMain->strWalletFile);
         if (!walletdb.WriteMSettings(pwalletMain->fMultiSendStake, pwalletMain->nLastMultiSendHeight))
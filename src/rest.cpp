@@ -9,6 +9,7 @@
 #include "primitives/transaction.h"
 #include "main.h"
 #include "httpserver.h"
+#include "jsonstream.h"
 #include "rpcserver.h"
 #include "streams.h"
 #include "sync.h"
@@ -17,6 +18,7 @@
 #include "version.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/dynamic_bitset.hpp>
 
 #include <univalue.h>
@@ -24,6 +26,9 @@
 using namespace std;
 
 static const size_t MAX_GETUTXOS_OUTPOINTS = 15; //allow a max of 15 outpoints to be queried at once
+static const int MAX_REST_HEADERS = 2000; //allow a max of 2000 headers to be queried at once
+static const int MAX_REST_BLOCKRANGE = 1000; //allow a max of 1000 blocks to be queried at once
+static const size_t REST_RANGE_CHUNK_SIZE = 64 * 1024; //bytes collected before sending a chunk of a block range
 
 enum RetFormat {
     RF_UNDEF,
@@ -59,9 +64,9 @@ struct CCoin {
 };
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
-extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
 extern UniValue mempoolInfoToJSON();
-extern UniValue mempoolToJSON(bool fVerbose = false);
+extern void blockToJSONStream(CJSONStreamWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool txDetails);
+extern void mempoolToJSONStream(CJSONStreamWriter& writer, bool fVerbose);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
 
@@ -117,6 +122,46 @@ static bool CheckWarmup(HTTPRequest* req)
     return true;
 }
 
+static bool WriteHeaders(HTTPRequest* req, const RetFormat rf, const std::vector<const CBlockIndex*>& headers)
+{
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH(const CBlockIndex *pindex, headers) {
+        ssHeader << pindex->GetBlockHeader();
+    }
+
+    switch (rf) {
+    case RF_BINARY: {
+        string binaryHeader = ssHeader.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryHeader);
+        return true;
+    }
+
+    case RF_HEX: {
+        string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+    case RF_JSON: {
+        UniValue jsonHeaders(UniValue::VARR);
+        BOOST_FOREACH(const CBlockIndex *pindex, headers) {
+            jsonHeaders.push_back(blockheaderToJSON(pindex));
+        }
+        string strJSON = jsonHeaders.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: .bin, .hex)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static bool rest_headers(HTTPRequest* req,
                          const std::string& strURIPart)
 {
@@ -131,7 +176,7 @@ static bool rest_headers(HTTPRequest* req,
         return RESTERR(req, HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>.<ext>.");
 
     long count = strtol(path[0].c_str(), NULL, 10);
-    if (count < 1 || count > 2000)
+    if (count < 1 || count > MAX_REST_HEADERS)
         return RESTERR(req, HTTP_BAD_REQUEST, "Header count out of range: " + path[0]);
 
     string hashStr = path[1];
@@ -153,42 +198,155 @@ static bool rest_headers(HTTPRequest* req,
         }
     }
 
-    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
-    BOOST_FOREACH(const CBlockIndex *pindex, headers) {
-        ssHeader << pindex->GetBlockHeader();
+    return WriteHeaders(req, rf, headers);
+}
+
+/** Parse the <start>/<count> of a height range, replying with an error if it is not valid */
+static bool ParseHeightRange(HTTPRequest* req, const vector<string>& path, int nMaxCount, int& nStart, int& nCount)
+{
+    if (!ParseInt32(path[0], &nStart) || nStart < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid start height: " + path[0]);
+    if (!ParseInt32(path[1], &nCount) || nCount < 1 || nCount > nMaxCount)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Count out of range: " + path[1]);
+    return true;
+}
+
+static bool rest_headers_range(HTTPRequest* req,
+                               const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "No range specified. Use /rest/headers/range/<start>/<count>.<ext>.");
+
+    int nStart, nCount;
+    if (!ParseHeightRange(req, path, MAX_REST_HEADERS, nStart, nCount))
+        return false;
+
+    std::vector<const CBlockIndex *> headers;
+    {
+        LOCK(cs_main);
+        // Like /rest/headers/, a range past the tip gives fewer or no headers
+        int nEnd = nStart > chainActive.Height() ? nStart - 1 : std::min(nStart + nCount - 1, chainActive.Height());
+        for (int nHeight = nStart; nHeight <= nEnd; nHeight++)
+            headers.push_back(chainActive[nHeight]);
     }
 
-    switch (rf) {
-    case RF_BINARY: {
-        string binaryHeader = ssHeader.str();
-        req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryHeader);
-        return true;
+    return WriteHeaders(req, rf, headers);
+}
+
+/**
+ * Reply with the serialized blocks at vPos, one after the other, reading
+ * them from disk as they are sent. Replies larger than one chunk go out as
+ * a chunked reply. Writing a chunk waits while more than HTTP_REPLY_BUFFER_MAX
+ * bytes are still to be sent, so a slow client holds up reading rather than
+ * buffering the whole range; at most that plus one chunk and one block are
+ * held at a time.
+ */
+static bool WriteBlockRange(HTTPRequest* req, const vector<CDiskBlockPos>& vPos, int nStart, bool fHex)
+{
+    const char* pszContentType = fHex ? "text/plain" : "application/octet-stream";
+    std::string strChunk;
+    bool fChunked = false;
+    vector<char> vchBlock;
+    for (unsigned int i = 0; i < vPos.size(); i++) {
+        if (!ReadRawBlockFromDisk(vchBlock, vPos[i])) {
+            if (!fChunked)
+                return RESTERR(req, HTTP_INTERNAL_SERVER_ERROR, strprintf("Can't read block at height %d from disk", nStart + i));
+            // The status line is out already; ending the body normally would pass
+            // a truncated range off as complete, so drop the connection instead
+            LogPrintf("%s: Can't read block at height %d from disk, dropping the connection\n", __func__, nStart + i);
+            req->AbortReplyChunked();
+            return false;
+        }
+        if (fHex)
+            strChunk += HexStr(vchBlock.begin(), vchBlock.end());
+        else
+            strChunk.append(vchBlock.begin(), vchBlock.end());
+
+        if (strChunk.size() >= REST_RANGE_CHUNK_SIZE) {
+            if (!fChunked) {
+                req->WriteHeader("Content-Type", pszContentType);
+                req->StartReplyChunked(HTTP_OK);
+                fChunked = true;
+            }
+            if (!req->WriteReplyChunk(strChunk)) {
+                LogPrint("http", "%s: Client went away at height %d\n", __func__, nStart + i);
+                req->AbortReplyChunked();
+                return false;
+            }
+            strChunk.clear();
+        }
     }
+    if (fHex)
+        strChunk += "\n";
 
-    case RF_HEX: {
-        string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
-        req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+    if (!fChunked) {
+        req->WriteHeader("Content-Type", pszContentType);
+        req->WriteReply(HTTP_OK, strChunk);
         return true;
     }
-    case RF_JSON: {
-        UniValue jsonHeaders(UniValue::VARR);
-        BOOST_FOREACH(const CBlockIndex *pindex, headers) {
-            jsonHeaders.push_back(blockheaderToJSON(pindex));
-        }
-        string strJSON = jsonHeaders.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
-        return true;
+    if (!req->WriteReplyChunk(strChunk)) {
+        req->AbortReplyChunked();
+        return false;
     }
-    default: {
+    req->EndReplyChunked();
+    return true;
+}
+
+static bool rest_blockrange(HTTPRequest* req,
+                            const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    if (rf != RF_BINARY && rf != RF_HEX)
         return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: .bin, .hex)");
-    }
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "No range specified. Use /rest/blockrange/<start>/<count>.<ext>.");
+
+    int nStart, nCount;
+    if (!ParseHeightRange(req, path, MAX_REST_BLOCKRANGE, nStart, nCount))
+        return false;
+
+    // Only the positions are looked up under cs_main, the blocks are read while sending
+    vector<CDiskBlockPos> vPos;
+    {
+        LOCK(cs_main);
+        if (nStart > chainActive.Height())
+            return RESTERR(req, HTTP_NOT_FOUND, "Start height beyond chain tip: " + path[0]);
+
+        int nEnd = std::min(nStart + nCount - 1, chainActive.Height());
+        for (int nHeight = nStart; nHeight <= nEnd; nHeight++) {
+            const CBlockIndex* pindex = chainActive[nHeight];
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                return RESTERR(req, HTTP_NOT_FOUND, strprintf("Block at height %d not available (pruned data)", nHeight));
+            vPos.push_back(pindex->GetBlockPos());
+        }
     }
 
-    // not reached
-    return true; // continue to process further HTTP reqs on this cxn
+    return WriteBlockRange(req, vPos, nStart, rf == RF_HEX);
+}
+
+static void WriteBlockJSON(CJSONStreamWriter& writer, const CBlock& block, const CBlockIndex* pblockindex, bool showTxDetails)
+{
+    blockToJSONStream(writer, block, pblockindex, showTxDetails);
+    writer.Raw("\n");
+}
+
+static void WriteMempoolJSON(CJSONStreamWriter& writer)
+{
+    mempoolToJSONStream(writer, true);
+    writer.Raw("\n");
 }
 
 static bool rest_block(HTTPRequest* req,
@@ -205,44 +363,44 @@ static bool rest_block(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
-    CBlock block;
     CBlockIndex* pblockindex = NULL;
+    CDiskBlockPos pos;
     {
         LOCK(cs_main);
         if (mapBlockIndex.count(hash) == 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
 
         pblockindex = mapBlockIndex[hash];
-        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
-            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
-
-        if (!ReadBlockFromDisk(block, pblockindex))
+        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA)) {
+            if (pblockindex->nTx > 0)
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        }
+        pos = pblockindex->GetBlockPos();
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
-
-    switch (rf) {
-    case RF_BINARY: {
-        string binaryBlock = ssBlock.str();
-        req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryBlock);
+    if (rf == RF_BINARY || rf == RF_HEX) {
+        // Serve the stored bytes, there is no need to deserialize the block
+        vector<char> vchBlock;
+        if (!ReadRawBlockFromDisk(vchBlock, pos))
+            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        if (rf == RF_BINARY) {
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, string(vchBlock.begin(), vchBlock.end()));
+        } else {
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK, HexStr(vchBlock.begin(), vchBlock.end()) + "\n");
+        }
         return true;
     }
 
-    case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
-        req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
-        return true;
-    }
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pos) || block.GetHash() != hash)
+        return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
 
+    switch (rf) {
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        HTTPWriteJSONReply(req, HTTP_OK, boost::bind(&WriteBlockJSON, _1, boost::cref(block), pblockindex, showTxDetails));
         return true;
     }
 
@@ -324,11 +482,7 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
 
     switch (rf) {
     case RF_JSON: {
-        UniValue mempoolObject = mempoolToJSON(true);
-
-        string strJSON = mempoolObject.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        HTTPWriteJSONReply(req, HTTP_OK, &WriteMempoolJSON);
         return true;
     }
     default: {
@@ -599,7 +753,9 @@ static const struct {
       {"/rest/chaininfo", rest_chaininfo},
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
+      {"/rest/headers/range/", rest_headers_range},
       {"/rest/headers/", rest_headers},
+      {"/rest/blockrange/", rest_blockrange},
       {"/rest/getutxos", rest_getutxos},
 };
 
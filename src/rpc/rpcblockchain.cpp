@@ -8,6 +8,7 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "clientversion.h"
+#include "jsonstream.h"
 #include "main.h"
 #include "rpcserver.h"
 #include "sync.h"
@@ -51,14 +52,23 @@ double GetDifficulty(const CBlockIndex* blockindex)
     return dDiff;
 }
 
+/** Find a block index entry, holding cs_main for the lookup only */
+static const CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    LOCK(cs_main);
+    BlockMap::const_iterator it = mapBlockIndex.find(hash);
+    return it == mapBlockIndex.end() ? NULL : it->second;
+}
+
 UniValue blockheaderToJSON(const CBlockIndex* blockindex)
 {
+    CChainSnapshot chain = GetChainSnapshot();
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
+    if (chain.Contains(blockindex))
+        confirmations = chain.Height() - blockindex->nHeight + 1;
     result.push_back(Pair("confirmations", confirmations));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", blockindex->nVersion));
@@ -71,35 +81,30 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex* pnext = chainActive.Next(blockindex);
+    const CBlockIndex* pnext = chain.Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     return result;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+//! Position of "tx" among the members of a block object
+static const size_t BLOCK_JSON_TX_POS = 6;
+
+/** Block object without its "tx" member, which belongs at BLOCK_JSON_TX_POS */
+static UniValue blockSummaryToJSON(const CBlock& block, const CBlockIndex* blockindex)
 {
+    CChainSnapshot chain = GetChainSnapshot();
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", block.GetHash().GetHex()));
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
+    if (chain.Contains(blockindex))
+        confirmations = chain.Height() - blockindex->nHeight + 1;
     result.push_back(Pair("confirmations", confirmations));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    UniValue txs(UniValue::VARR);
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        if (txDetails) {
-            UniValue objTx(UniValue::VOBJ);
-            TxToJSON(tx, uint256(0), objTx);
-            txs.push_back(objTx);
-        } else
-            txs.push_back(tx.GetHash().GetHex());
-    }
-    result.push_back(Pair("tx", txs));
     result.push_back(Pair("time", block.GetBlockTime()));
     result.push_back(Pair("nonce", (uint64_t)block.nNonce));
     result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
@@ -108,15 +113,63 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex* pnext = chainActive.Next(blockindex);
+    const CBlockIndex* pnext = chain.Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
 
-    result.push_back(Pair("moneysupply", ValueFromAmount(blockindex->nMoneySupply)));
+    // Set when the block is connected, unlike the header fields above
+    CAmount nMoneySupply;
+    {
+        LOCK(cs_main);
+        nMoneySupply = blockindex->nMoneySupply;
+    }
+    result.push_back(Pair("moneysupply", ValueFromAmount(nMoneySupply)));
 
     return result;
 }
 
+static UniValue blockTxToJSON(const CTransaction& tx, bool txDetails)
+{
+    if (!txDetails)
+        return tx.GetHash().GetHex();
+    UniValue objTx(UniValue::VOBJ);
+    TxToJSON(tx, uint256(0), objTx);
+    return objTx;
+}
+
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    UniValue summary = blockSummaryToJSON(block, blockindex);
+    UniValue txs(UniValue::VARR);
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+        txs.push_back(blockTxToJSON(tx, txDetails));
+
+    UniValue result(UniValue::VOBJ);
+    const std::vector<std::string>& vKeys = summary.getKeys();
+    const std::vector<UniValue>& vValues = summary.getValues();
+    for (size_t i = 0; i < vKeys.size(); i++) {
+        if (i == BLOCK_JSON_TX_POS)
+            result.push_back(Pair("tx", txs));
+        result.push_back(Pair(vKeys[i], vValues[i]));
+    }
+    return result;
+}
+
+/** As blockToJSON, one transaction at a time */
+void blockToJSONStream(CJSONStreamWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool txDetails)
+{
+    UniValue summary = blockSummaryToJSON(block, blockindex);
+    writer.BeginObject();
+    writer.Members(summary, 0, BLOCK_JSON_TX_POS);
+    writer.Key("tx");
+    writer.BeginArray();
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+        writer.Value(blockTxToJSON(tx, txDetails));
+    writer.EndArray();
+    writer.Members(summary, BLOCK_JSON_TX_POS, summary.size());
+    writer.EndObject();
+}
+
 UniValue getblockcount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -170,36 +223,39 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
 }
 
 
+/** Requires mempool.cs */
+static UniValue mempoolEntryToJSON(const CTxMemPoolEntry& e)
+{
+    UniValue info(UniValue::VOBJ);
+    info.push_back(Pair("size", (int)e.GetTxSize()));
+    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+    info.push_back(Pair("time", e.GetTime()));
+    info.push_back(Pair("height", (int)e.GetHeight()));
+    info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+    info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+    const CTransaction& tx = e.GetTx();
+    set<string> setDepends;
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (mempool.exists(txin.prevout.hash))
+            setDepends.insert(txin.prevout.hash.ToString());
+    }
+
+    UniValue depends(UniValue::VARR);
+    BOOST_FOREACH (const string& dep, setDepends) {
+        depends.push_back(dep);
+    }
+
+    info.push_back(Pair("depends", depends));
+    return info;
+}
+
 UniValue mempoolToJSON(bool fVerbose = false)
 {
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH (const CTxMemPoolEntry& e, mempool.mapTx) {
-            const uint256& hash = e.GetTx().GetHash();
-            ;
-            UniValue info(UniValue::VOBJ);
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
-            set<string> setDepends;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-
-            UniValue depends(UniValue::VARR);
-            BOOST_FOREACH (const string& dep, setDepends) {
-                depends.push_back(dep);
-            }
-
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
-        }
+        BOOST_FOREACH (const CTxMemPoolEntry& e, mempool.mapTx)
+            o.push_back(Pair(e.GetTx().GetHash().ToString(), mempoolEntryToJSON(e)));
         return o;
     } else {
         vector<uint256> vtxid;
@@ -213,6 +269,50 @@ UniValue mempoolToJSON(bool fVerbose = false)
     }
 }
 
+/** Verbose mempool entries looked up per lock of cs_main and mempool.cs when streaming */
+static const size_t MEMPOOL_STREAM_BATCH = 1000;
+
+/**
+ * As mempoolToJSON, one entry at a time. The locks are only held while a
+ * batch of entries is collected, not while the client reads the reply;
+ * transactions that left the pool in between are skipped.
+ */
+void mempoolToJSONStream(CJSONStreamWriter& writer, bool fVerbose)
+{
+    if (fVerbose) {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        writer.BeginObject();
+        vector<pair<uint256, UniValue> > vBatch;
+        for (size_t nBegin = 0; nBegin < vtxid.size(); nBegin += MEMPOOL_STREAM_BATCH) {
+            size_t nEnd = std::min(vtxid.size(), nBegin + MEMPOOL_STREAM_BATCH);
+            vBatch.clear();
+            {
+                LOCK2(cs_main, mempool.cs);
+                for (size_t i = nBegin; i < nEnd; i++) {
+                    CTxMemPool::txiter it = mempool.mapTx.find(vtxid[i]);
+                    if (it != mempool.mapTx.end())
+                        vBatch.push_back(make_pair(vtxid[i], mempoolEntryToJSON(*it)));
+                }
+            }
+            for (size_t i = 0; i < vBatch.size(); i++) {
+                writer.Key(vBatch[i].first.ToString());
+                writer.Value(vBatch[i].second);
+            }
+        }
+        writer.EndObject();
+    } else {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        writer.BeginArray();
+        BOOST_FOREACH (const uint256& hash, vtxid)
+            writer.Value(hash.ToString());
+        writer.EndArray();
+    }
+}
+
 UniValue getchaintxstats(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -330,6 +430,18 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     return mempoolToJSON(fVerbose);
 }
 
+void getrawmempool_stream(const UniValue& params, CJSONStreamWriter& writer)
+{
+    if (params.size() > 1)
+        getrawmempool(params, true);
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    mempoolToJSONStream(writer, fVerbose);
+}
+
 UniValue getblockhash(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -346,16 +458,37 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("getblockhash", "1000") + HelpExampleRpc("getblockhash", "1000"));
 
-    LOCK(cs_main);
+    CChainSnapshot chain = GetChainSnapshot();
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > chainActive.Height())
+    if (nHeight < 0 || nHeight > chain.Height())
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
 
-    CBlockIndex* pblockindex = chainActive[nHeight];
+    const CBlockIndex* pblockindex = chain[nHeight];
     return pblockindex->GetBlockHash().GetHex();
 }
 
+/** Read the block with the given hash from disk. Only the lookup needs cs_main, the disk read and JSON don't. */
+static const CBlockIndex* ReadBlockForRPC(const uint256& hash, CBlock& block)
+{
+    const CBlockIndex* pblockindex;
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        if (it == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = it->second;
+        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        pos = pblockindex->GetBlockPos();
+    }
+
+    if (!ReadBlockFromDisk(block, pos) || block.GetHash() != hash)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    return pblockindex;
+}
+
 UniValue getblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -396,8 +529,6 @@ UniValue getblock(const UniValue& params, bool fHelp)
             HelpExampleCli("getblock", "\"00000000000fd08c2fb661d2fcb0d49abb3a91e5f27082ce64feed3b4dede2e2\"") +
             HelpExampleRpc("getblock", "\"00000000000fd08c2fb661d2fcb0d49abb3a91e5f27082ce64feed3b4dede2e2\""));
 
-    LOCK(cs_main);
-
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
@@ -405,14 +536,8 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    const CBlockIndex* pblockindex = ReadBlockForRPC(hash, block);
 
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -424,6 +549,31 @@ UniValue getblock(const UniValue& params, bool fHelp)
     return blockToJSON(block, pblockindex);
 }
 
+void getblock_stream(const UniValue& params, CJSONStreamWriter& writer)
+{
+    if (params.size() < 1 || params.size() > 2)
+        getblock(params, true);
+
+    std::string strHash = params[0].get_str();
+    uint256 hash(strHash);
+
+    bool fVerbose = true;
+    if (params.size() > 1)
+        fVerbose = params[1].get_bool();
+
+    CBlock block;
+    const CBlockIndex* pblockindex = ReadBlockForRPC(hash, block);
+
+    if (!fVerbose) {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        writer.Value(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
+    }
+
+    blockToJSONStream(writer, block, pblockindex, false);
+}
+
 UniValue getblockheader(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -460,11 +610,10 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
+    const CBlockIndex* pblockindex = LookupBlockIndex(hash);
+    if (pblockindex == NULL)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << pblockindex->GetBlockHeader();
@@ -515,6 +664,55 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+/** Collect LevelDB's internal properties of a database (CLevelDBWrapper or CCoinsViewDB) */
+template <typename DB>
+static UniValue LevelDBStatsToJSON(const DB& db)
+{
+    UniValue ret(UniValue::VOBJ);
+    std::string strValue;
+    ret.push_back(Pair("memory_usage", (int64_t)db.GetMemoryLimit()));
+    UniValue files(UniValue::VARR);
+    for (int nLevel = 0; db.GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), strValue); nLevel++)
+        files.push_back(atoi64(strValue));
+    ret.push_back(Pair("files_per_level", files));
+    if (db.GetProperty("leveldb.stats", strValue))
+        ret.push_back(Pair("stats", strValue));
+    if (db.GetProperty("leveldb.sstables", strValue))
+        ret.push_back(Pair("sstables", strValue));
+    return ret;
+}
+
+UniValue getleveldbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getleveldbstats\n"
+            "\nReturns LevelDB's internal statistics for the chainstate and block index databases.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {             (json object) chainstate/ database\n"
+            "    \"memory_usage\": n,        (numeric) bytes the block cache and the write buffers may use at most\n"
+            "    \"files_per_level\": [n,...], (array) number of table files at each level\n"
+            "    \"stats\": \"str\",           (string) compaction statistics per level\n"
+            "    \"sstables\": \"str\"         (string) table files at each level with their key ranges\n"
+            "  },\n"
+            "  \"blockindex\": { ... }       (json object) blocks/index/ database, same fields\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getleveldbstats", "") + HelpExampleRpc("getleveldbstats", ""));
+
+    LOCK(cs_main);
+
+    UniValue ret(UniValue::VOBJ);
+    if (pcoinsdbview)
+        ret.push_back(Pair("chainstate", LevelDBStatsToJSON(*pcoinsdbview)));
+    if (pblocktree)
+        ret.push_back(Pair("blockindex", LevelDBStatsToJSON(*pblocktree)));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -554,8 +752,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "\nAs a json rpc call\n" +
             HelpExampleRpc("gettxout", "\"txid\", 1"));
 
-    LOCK(cs_main);
-
     UniValue ret(UniValue::VOBJ);
 
     std::string strHash = params[0].get_str();
@@ -565,22 +761,27 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
+    // Copy the coins and the tip they are valid at under cs_main, then build the reply without it
     CCoins coins;
-    if (fMempool) {
-        LOCK(mempool.cs);
-        CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
-            return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
-    } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
-            return NullUniValue;
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        if (fMempool) {
+            LOCK(mempool.cs);
+            CCoinsViewMemPool view(pcoinsTip, mempool);
+            if (!view.GetCoins(hash, coins))
+                return NullUniValue;
+            mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        } else {
+            if (!pcoinsTip->GetCoins(hash, coins))
+                return NullUniValue;
+        }
+        BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+        pindex = it->second;
     }
     if (n < 0 || (unsigned int)n >= coins.vout.size() || coins.vout[n].IsNull())
         return NullUniValue;
 
-    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
-    CBlockIndex* pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
     if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
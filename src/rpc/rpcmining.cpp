@@ -118,9 +118,8 @@ UniValue setstaking(const UniValue& params, bool fHelp)
     
     if (pwalletMain == NULL)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
-        
-    LOCK(cs_main);
 
+    // No cs_main here: StakingCoins joins threads that take it
     bool fStaking = true;
     bool isStaking = GetBoolArg("-staking", false);
 
@@ -68,6 +68,27 @@ void WalletTxToJSON(const CWalletTx& wtx, UniValue& entry)
         entry.push_back(Pair(item.first, item.second));
 }
 
+void WalletTxToJSON(const CArchivedWalletTx& atx, UniValue& entry)
+{
+    int confirms = atx.GetDepthInMainChain();
+    entry.push_back(Pair("confirmations", confirms));
+    entry.push_back(Pair("bcconfirmations", confirms));
+    if (atx.IsCoinBase() || atx.IsCoinStake())
+        entry.push_back(Pair("generated", true));
+    if (confirms > 0) {
+        entry.push_back(Pair("blockhash", atx.hashBlock.GetHex()));
+        entry.push_back(Pair("blockheight", atx.nHeight));
+        entry.push_back(Pair("blocktime", mapBlockIndex[atx.hashBlock]->GetBlockTime()));
+    }
+    entry.push_back(Pair("txid", atx.GetHash().GetHex()));
+    entry.push_back(Pair("walletconflicts", UniValue(UniValue::VARR)));
+    entry.push_back(Pair("time", atx.GetTxTime()));
+    entry.push_back(Pair("timereceived", (int64_t)atx.nTimeReceived));
+    entry.push_back(Pair("archived", true));
+    BOOST_FOREACH (const PAIRTYPE(string, string) & item, atx.mapValue)
+        entry.push_back(Pair(item.first, item.second));
+}
+
 string AccountFromValue(const UniValue& value)
 {
     string strAccount = value.get_str();
@@ -102,8 +123,7 @@ UniValue getnewaddress(const UniValue& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+    pwalletMain->KeepKeyPoolFilled();
 
     // Generate a new key that is added to wallet
     CPubKey newKey;
@@ -130,8 +150,7 @@ UniValue getnewpubkey(const UniValue& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+    pwalletMain->KeepKeyPoolFilled();
 
     // Generate a new key that is added to wallet
     CPubKey newKey;
@@ -224,8 +243,7 @@ UniValue getrawchangeaddress(const UniValue& params, bool fHelp)
 
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+    pwalletMain->KeepKeyPoolFilled();
 
     CReserveKey reservekey(pwalletMain);
     CPubKey vchPubKey;
@@ -632,6 +650,15 @@ UniValue getreceivedbyaddress(const UniValue& params, bool fHelp)
                 if (wtx.GetDepthInMainChain() >= nMinDepth)
                     nAmount += txout.nValue;
     }
+    for (map<uint256, CArchivedWalletTx>::iterator it = pwalletMain->mapArchived.begin(); it != pwalletMain->mapArchived.end(); ++it) {
+        const CArchivedWalletTx& atx = (*it).second;
+        if (atx.IsCoinBase() || atx.GetDepthInMainChain() < nMinDepth)
+            continue;
+
+        BOOST_FOREACH (const CTxOut& txout, atx.vout)
+            if (txout.scriptPubKey == scriptPubKey)
+                nAmount += txout.nValue;
+    }
 
     return ValueFromAmount(nAmount);
 }
@@ -686,6 +713,17 @@ UniValue getreceivedbyaccount(const UniValue& params, bool fHelp)
                     nAmount += txout.nValue;
         }
     }
+    for (map<uint256, CArchivedWalletTx>::iterator it = pwalletMain->mapArchived.begin(); it != pwalletMain->mapArchived.end(); ++it) {
+        const CArchivedWalletTx& atx = (*it).second;
+        if (atx.IsCoinBase() || atx.GetDepthInMainChain() < nMinDepth)
+            continue;
+
+        BOOST_FOREACH (const CTxOut& txout, atx.vout) {
+            CTxDestination address;
+            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
+                nAmount += txout.nValue;
+        }
+    }
 
     return (double)nAmount / (double)COIN;
 }
@@ -708,6 +746,15 @@ CAmount GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMi
             nBalance += nReceived;
         nBalance -= nSent + nFee;
     }
+    for (map<uint256, CArchivedWalletTx>::iterator it = pwalletMain->mapArchived.begin(); it != pwalletMain->mapArchived.end(); ++it) {
+        const CArchivedWalletTx& atx = (*it).second;
+        CAmount nReceived, nSent, nFee;
+        atx.GetAccountAmounts(strAccount, nReceived, nSent, nFee, filter);
+
+        if (nReceived != 0 && atx.GetDepthInMainChain() >= nMinDepth)
+            nBalance += nReceived;
+        nBalance -= nSent + nFee;
+    }
 
     // Tally internal accounting entries
     nBalance += walletdb.GetAccountCreditDebit(strAccount);
@@ -812,6 +859,21 @@ UniValue getbalance(const UniValue& params, bool fHelp)
                 nBalance -= s.amount;
             nBalance -= allFee;
         }
+        for (map<uint256, CArchivedWalletTx>::iterator it = pwalletMain->mapArchived.begin(); it != pwalletMain->mapArchived.end(); ++it) {
+            const CArchivedWalletTx& atx = (*it).second;
+            CAmount allFee;
+            string strSentAccount;
+            list<COutputEntry> listReceived;
+            list<COutputEntry> listSent;
+            atx.GetAmounts(listReceived, listSent, allFee, strSentAccount, filter);
+            if (atx.GetDepthInMainChain() >= nMinDepth) {
+                BOOST_FOREACH (const COutputEntry& r, listReceived)
+                    nBalance += r.amount;
+            }
+            BOOST_FOREACH (const COutputEntry& s, listSent)
+                nBalance -= s.amount;
+            nBalance -= allFee;
+        }
         return ValueFromAmount(nBalance);
     }
 
@@ -1161,6 +1223,33 @@ UniValue ListReceived(const UniValue& params, bool fByAccounts)
                 item.fIsWatchonly = true;
         }
     }
+    for (map<uint256, CArchivedWalletTx>::iterator it = pwalletMain->mapArchived.begin(); it != pwalletMain->mapArchived.end(); ++it) {
+        const CArchivedWalletTx& atx = (*it).second;
+
+        if (atx.IsCoinBase())
+            continue;
+
+        int nDepth = atx.GetDepthInMainChain();
+        if (nDepth < nMinDepth)
+            continue;
+
+        BOOST_FOREACH (const CTxOut& txout, atx.vout) {
+            CTxDestination address;
+            if (!ExtractDestination(txout.scriptPubKey, address))
+                continue;
+
+            isminefilter mine = IsMine(*pwalletMain, address);
+            if (!(mine & filter))
+                continue;
+
+            tallyitem& item = mapTally[address];
+            item.nAmount += txout.nValue;
+            item.nConf = min(item.nConf, nDepth);
+            item.txids.push_back(atx.GetHash());
+            if (mine & ISMINE_WATCH_ONLY)
+                item.fIsWatchonly = true;
+        }
+    }
 
     // Reply
     UniValue ret(UniValue::VARR);
@@ -1296,7 +1385,8 @@ static void MaybePushAddress(UniValue& entry, const CTxDestination& dest)
         entry.push_back(Pair("address", addr.ToString()));
 }
 
-void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, UniValue& ret, const isminefilter& filter)
+template <typename WalletTx>
+void ListTransactions(const WalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, UniValue& ret, const isminefilter& filter)
 {
     CAmount nFee;
     string strSentAccount;
@@ -1459,15 +1549,33 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
     UniValue ret(UniValue::VARR);
 
     const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
-        CWalletTx* const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
-        CAccountingEntry* const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+    const CWallet::ArchivedItems& archivedOrdered = pwalletMain->archivedOrdered;
+
+    // For all accounts and spendable outputs the wallet knows where the
+    // entries to skip end, so only the last position with some of them is walked
+    int64_t nStartPos = std::numeric_limits<int64_t>::max();
+    int nSkipAtPos;
+    if (strAccount == "*" && filter == ISMINE_SPENDABLE && nFrom > 0 &&
+        pwalletMain->SeekHistory(nFrom, nStartPos, nSkipAtPos))
+        nFrom = nSkipAtPos;
+
+    // iterate backwards until we have nCount items to return, merging in
+    // archived transactions by their order position:
+    CWallet::TxItems::const_reverse_iterator it(txOrdered.upper_bound(nStartPos));
+    CWallet::ArchivedItems::const_reverse_iterator ait(archivedOrdered.upper_bound(nStartPos));
+    while (it != txOrdered.rend() || ait != archivedOrdered.rend()) {
+        if (ait != archivedOrdered.rend() && (it == txOrdered.rend() || ait->first > it->first)) {
+            ListTransactions(*ait->second, strAccount, 0, true, ret, filter);
+            ++ait;
+        } else {
+            CWalletTx* const pwtx = (*it).second.first;
+            if (pwtx != 0)
+                ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
+            CAccountingEntry* const pacentry = (*it).second.second;
+            if (pacentry != 0)
+                AcentryToJSON(*pacentry, strAccount, ret);
+            ++it;
+        }
 
         if ((int)ret.size() >= (nCount + nFrom)) break;
     }
@@ -1561,6 +1669,24 @@ UniValue listaccounts(const UniValue& params, bool fHelp)
                     mapAccountBalances[""] += r.amount;
         }
     }
+    for (map<uint256, CArchivedWalletTx>::iterator it = pwalletMain->mapArchived.begin(); it != pwalletMain->mapArchived.end(); ++it) {
+        const CArchivedWalletTx& atx = (*it).second;
+        CAmount nFee;
+        string strSentAccount;
+        list<COutputEntry> listReceived;
+        list<COutputEntry> listSent;
+        atx.GetAmounts(listReceived, listSent, nFee, strSentAccount, includeWatchonly);
+        mapAccountBalances[strSentAccount] -= nFee;
+        BOOST_FOREACH (const COutputEntry& s, listSent)
+            mapAccountBalances[strSentAccount] -= s.amount;
+        if (atx.GetDepthInMainChain() >= nMinDepth) {
+            BOOST_FOREACH (const COutputEntry& r, listReceived)
+                if (pwalletMain->mapAddressBook.count(r.destination))
+                    mapAccountBalances[pwalletMain->mapAddressBook[r.destination].name] += r.amount;
+                else
+                    mapAccountBalances[""] += r.amount;
+        }
+    }
 
     const list<CAccountingEntry>& acentries = pwalletMain->laccentries;
     BOOST_FOREACH (const CAccountingEntry& entry, acentries)
@@ -1661,6 +1787,25 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
     return ret;
 }
 
+template <typename WalletTx>
+static void WalletTxSummaryToJSON(const WalletTx& wtx, const isminefilter& filter, UniValue& entry)
+{
+    CAmount nCredit = wtx.GetCredit(filter);
+    CAmount nDebit = wtx.GetDebit(filter);
+    CAmount nNet = nCredit - nDebit;
+    CAmount nFee = (wtx.IsFromMe(filter) ? wtx.GetValueOut() - nDebit : 0);
+
+    entry.push_back(Pair("amount", ValueFromAmount(nNet - nFee)));
+    if (wtx.IsFromMe(filter))
+        entry.push_back(Pair("fee", ValueFromAmount(nFee)));
+
+    WalletTxToJSON(wtx, entry);
+
+    UniValue details(UniValue::VARR);
+    ListTransactions(wtx, "*", 0, false, details, filter);
+    entry.push_back(Pair("details", details));
+}
+
 UniValue gettransaction(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -1684,6 +1829,7 @@ UniValue gettransaction(const UniValue& params, bool fHelp)
             "  \"walletconflicts\" : []                 (array)     Wallet Conflicts \n"
             "  \"time\" : ttt,                          (numeric) The transaction time in seconds since epoch (1 Jan 1970 GMT)\n"
             "  \"timereceived\" : ttt,                  (numeric) The time received in seconds since epoch (1 Jan 1970 GMT)\n"
+            "  \"archived\" : true,                     (boolean) Only present for transactions moved out of the live wallet (see -walletarchivedepth)\n"
             "  \"details\" : [\n"
             "    {\n"
             "      \"account\" : \"accountname\",       (string) The account name involved in the transaction, can be \"\" for the default account.\n"
@@ -1694,7 +1840,7 @@ UniValue gettransaction(const UniValue& params, bool fHelp)
             "    }\n"
             "    ,...\n"
             "  ],\n"
-            "  \"hex\" : \"data\"                       (string) Raw data for transaction\n"
+            "  \"hex\" : \"data\"                       (string) Raw data for transaction, not available when archived\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -1713,24 +1859,17 @@ UniValue gettransaction(const UniValue& params, bool fHelp)
             filter = filter | ISMINE_WATCH_ONLY;
 
     UniValue entry(UniValue::VOBJ);
-    if (!pwalletMain->mapWallet.count(hash))
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid or non-wallet transaction id");
+    if (!pwalletMain->mapWallet.count(hash)) {
+        // Archived transactions keep no inputs, so there is no hex to return
+        const CArchivedWalletTx* patx = pwalletMain->GetArchivedTx(hash);
+        if (!patx)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid or non-wallet transaction id");
+        WalletTxSummaryToJSON(*patx, filter, entry);
+        return entry;
+    }
     const CWalletTx& wtx = pwalletMain->mapWallet[hash];
 
-    CAmount nCredit = wtx.GetCredit(filter);
-    CAmount nDebit = wtx.GetDebit(filter);
-    CAmount nNet = nCredit - nDebit;
-    CAmount nFee = (wtx.IsFromMe(filter) ? wtx.GetValueOut() - nDebit : 0);
-
-    entry.push_back(Pair("amount", ValueFromAmount(nNet - nFee)));
-    if (wtx.IsFromMe(filter))
-        entry.push_back(Pair("fee", ValueFromAmount(nFee)));
-
-    WalletTxToJSON(wtx, entry);
-
-    UniValue details(UniValue::VARR);
-    ListTransactions(wtx, "*", 0, false, details, filter);
-    entry.push_back(Pair("details", details));
+    WalletTxSummaryToJSON(wtx, filter, entry);
 
     string strHex = EncodeHexTx(static_cast<CTransaction>(wtx));
     entry.push_back(Pair("hex", strHex));
@@ -2247,6 +2386,8 @@ UniValue autocombinerewards(const UniValue& params, bool fHelp)
             "autocombinerewards enable ( threshold )\n"
             "\nWallet will automatically monitor for any coins with value below the threshold amount, and combine them if they reside with the same KORE address\n"
             "When autocombinerewards runs it will create a transaction, and therefore will be subject to transaction fees.\n"
+            "The coins of several addresses may be combined in one transaction, each address receiving its own coins back.\n"
+            "It runs in the background every " + strprintf("%d", WALLET_MAINTENANCE_INTERVAL) + " seconds, see getwalletmaintenanceinfo.\n"
 
             "\nArguments:\n"
             "1. enable          (boolean, required) Enable auto combine (true) or disable (false)\n"
@@ -2270,6 +2411,64 @@ UniValue autocombinerewards(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+UniValue getwalletmaintenanceinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getwalletmaintenanceinfo\n"
+            "\nReturns what the last pass of the background MultiSend and autocombinerewards task did.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"autocombine\": true|false,     (boolean) if autocombinerewards is enabled\n"
+            "  \"multisend\": true|false,       (boolean) if MultiSend of stakes is enabled\n"
+            "  \"interval\": n,                 (numeric) seconds between two passes\n"
+            "  \"budget\": n,                   (numeric) milliseconds of work allowed per pass (-walletmaintenancebudget)\n"
+            "  \"runs\": n,                     (numeric) passes run since startup\n"
+            "  \"skippedbusy\": n,              (numeric) passes given up because the chain or wallet was busy\n"
+            "  \"lastrun\": ttt,                (numeric) the time of the last pass in seconds since epoch (Jan 1 1970 GMT)\n"
+            "  \"lastduration\": n,             (numeric) milliseconds the last pass took\n"
+            "  \"budgetexhausted\": true|false, (boolean) if the last pass stopped early, leaving work for the next one\n"
+            "  \"combinetxs\": n,               (numeric) dust combining transactions sent by the last pass\n"
+            "  \"combinedinputs\": n,           (numeric) inputs they spent\n"
+            "  \"combinedaddresses\": n,        (numeric) addresses whose dust they combined\n"
+            "  \"multisendtxs\": n,             (numeric) MultiSend transactions sent by the last pass\n"
+            "  \"multisendstakes\": n,          (numeric) matured stakes they forwarded\n"
+            "  \"lasterror\": \"text\"            (string) the last failure of the last pass, if any\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getwalletmaintenanceinfo", "") + HelpExampleRpc("getwalletmaintenanceinfo", ""));
+
+    // The stats have a lock of their own. The settings need cs_wallet, which
+    // a running pass holds for at most -walletmaintenancebudget milliseconds
+    CWalletMaintenanceStats stats = pwalletMain->GetMaintenanceStats();
+    bool fCombineDust, fMultiSend;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        fCombineDust = pwalletMain->fCombineDust;
+        fMultiSend = pwalletMain->isMultiSendEnabled();
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("autocombine", fCombineDust));
+    obj.push_back(Pair("multisend", fMultiSend));
+    obj.push_back(Pair("interval", WALLET_MAINTENANCE_INTERVAL));
+    obj.push_back(Pair("budget", nWalletMaintenanceBudget));
+    obj.push_back(Pair("runs", stats.nRuns));
+    obj.push_back(Pair("skippedbusy", stats.nSkippedBusy));
+    obj.push_back(Pair("lastrun", stats.nLastRun));
+    obj.push_back(Pair("lastduration", stats.nLastDurationMs));
+    obj.push_back(Pair("budgetexhausted", stats.fBudgetExhausted));
+    obj.push_back(Pair("combinetxs", stats.nCombineTxs));
+    obj.push_back(Pair("combinedinputs", stats.nCombineInputs));
+    obj.push_back(Pair("combinedaddresses", stats.nCombineAddresses));
+    obj.push_back(Pair("multisendtxs", stats.nMultiSendTxs));
+    obj.push_back(Pair("multisendstakes", stats.nMultiSendStakes));
+    obj.push_back(Pair("lasterror", stats.strLastError));
+    return obj;
+}
+
 UniValue printMultiSend()
 {
     UniValue ret(UniValue::VARR);
@@ -2369,7 +2568,8 @@ UniValue multisend(const UniValue& params, bool fHelp)
                 throw JSONRPCError(RPC_INVALID_REQUEST, "Unable to activate MultiSend, check MultiSend vector");
 
             if (CBitcoinAddress(pwalletMain->vMultiSend[0].first).IsValid()) {
-                pwalletMain->fMultiSendStake = true;
+                LOCK2(cs_main, pwalletMain->cs_wallet);
+                pwalletMain->setMultiSendEnabled();
                 if (!walletdb.WriteMSettings(true, pwalletMain->nLastMultiSendHeight)) {
                     UniValue obj(UniValue::VOBJ);
                     obj.push_back(Pair("error", "MultiSend activated but writing settings to DB failed"));
@@ -8,7 +8,9 @@
 #include "rpcserver.h"
 
 #include "base58.h"
+#include "httpserver.h"
 #include "init.h"
+#include "jsonstream.h"
 #include "main.h"
 #include "random.h"
 #include "sync.h"
@@ -16,6 +18,8 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_upper()
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
@@ -49,6 +53,81 @@ static struct CRPCSignals {
     boost::signals2::signal<void(const CRPCCommand&)> PostCommand;
 } g_rpcSignals;
 
+/**
+ * Call count and latency distribution of one RPC method. Latencies are
+ * counted in buckets of powers of two microseconds: bucket 0 holds calls
+ * under 2us, bucket i those from 2^i up to 2^(i+1)us.
+ */
+class CRPCMethodStats
+{
+public:
+    static const int BUCKETS = 32;
+
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    uint64_t vBuckets[BUCKETS];
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nTotalMicros(0), nMaxMicros(0)
+    {
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+
+    void Record(int64_t nMicros, bool fError)
+    {
+        nCalls++;
+        if (fError)
+            nErrors++;
+        nTotalMicros += nMicros;
+        nMaxMicros = std::max(nMaxMicros, nMicros);
+        int nBucket = 0;
+        while (nBucket < BUCKETS - 1 && (nMicros >> (nBucket + 1)) > 0)
+            nBucket++;
+        vBuckets[nBucket]++;
+    }
+
+    /** Upper bound of bucket nBucket, in microseconds */
+    static int64_t BucketLimit(int nBucket) { return (int64_t)2 << nBucket; }
+
+    /** Upper bound of the latency under which a fraction dQuantile of the calls completed */
+    int64_t Quantile(double dQuantile) const
+    {
+        uint64_t nTarget = std::max<uint64_t>(1, (uint64_t)(dQuantile * nCalls + 0.5));
+        uint64_t nSeen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            nSeen += vBuckets[i];
+            if (nSeen >= nTarget)
+                return std::min(BucketLimit(i), nMaxMicros);
+        }
+        return nMaxMicros;
+    }
+};
+
+static CCriticalSection cs_rpcStats;
+static std::map<std::string, CRPCMethodStats> mapRPCStats GUARDED_BY(cs_rpcStats);
+
+/** Records the duration of an RPC call in mapRPCStats when it goes out of scope */
+class CRPCCallTimer
+{
+public:
+    explicit CRPCCallTimer(const std::string& strMethodIn) : strMethod(strMethodIn), nStart(GetTimeMicros()), fSucceeded(false) {}
+
+    ~CRPCCallTimer()
+    {
+        int64_t nMicros = GetTimeMicros() - nStart;
+        LOCK(cs_rpcStats);
+        mapRPCStats[strMethod].Record(nMicros, !fSucceeded);
+    }
+
+    void Succeeded() { fSucceeded = true; }
+
+private:
+    std::string strMethod;
+    int64_t nStart;
+    bool fSucceeded;
+};
+
 void RPCServer::OnStarted(boost::function<void()> slot)
 {
     g_rpcSignals.Started.connect(slot);
@@ -277,6 +356,102 @@ UniValue stop(const UniValue& params, bool fHelp)
     return "KORE server stopping";
 }
 
+static double MicrosToMillis(int64_t nMicros)
+{
+    return nMicros / 1000.0;
+}
+
+UniValue getrpcstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcstats\n"
+            "\nReturns the state of the RPC work queue and the number and latency of calls per method since startup.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"workqueue\": {\n"
+            "    \"threads\": n,          (numeric) Worker threads running\n"
+            "    \"idlethreads\": n,      (numeric) Worker threads waiting for work\n"
+            "    \"minthreads\": n,       (numeric) Worker threads kept when idle (-rpcthreads)\n"
+            "    \"maxthreads\": n,       (numeric) Most worker threads started under load (-rpcmaxthreads)\n"
+            "    \"depth\": n,            (numeric) Requests waiting for a worker\n"
+            "    \"clients\": n,          (numeric) Client addresses with waiting requests\n"
+            "    \"maxdepth\": n,         (numeric) Most waiting requests in total (-rpcworkqueue)\n"
+            "    \"clientdepth\": n,      (numeric) Most waiting requests per client address (-rpcclientqueue)\n"
+            "    \"rejected\": n          (numeric) Requests turned away because the queue or their client's share was full\n"
+            "  },\n"
+            "  \"methods\": {\n"
+            "    \"method\": {            (string) Name of the method\n"
+            "      \"calls\": n,          (numeric) Number of calls\n"
+            "      \"errors\": n,         (numeric) Number of calls that returned an error\n"
+            "      \"mean_ms\": x.xxx,    (numeric) Mean latency in milliseconds\n"
+            "      \"p50_ms\": x.xxx,     (numeric) Latency under which 50% of the calls completed, rounded up to a power of two microseconds\n"
+            "      \"p90_ms\": x.xxx,     (numeric) The same for 90% of the calls\n"
+            "      \"p99_ms\": x.xxx,     (numeric) The same for 99% of the calls\n"
+            "      \"max_ms\": x.xxx,     (numeric) Highest latency\n"
+            "      \"histogram\": [       (array) Calls per latency bucket, empty buckets left out\n"
+            "        {\n"
+            "          \"le_ms\": x.xxx,  (numeric) Upper bound of the bucket in milliseconds\n"
+            "          \"calls\": n       (numeric) Calls in the bucket\n"
+            "        }, ...\n"
+            "      ]\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getrpcstats", "") + HelpExampleRpc("getrpcstats", ""));
+
+    UniValue ret(UniValue::VOBJ);
+
+    HTTPWorkQueueStats queueStats;
+    if (HTTPGetWorkQueueStats(queueStats)) {
+        UniValue queue(UniValue::VOBJ);
+        queue.push_back(Pair("threads", queueStats.nThreads));
+        queue.push_back(Pair("idlethreads", queueStats.nIdleThreads));
+        queue.push_back(Pair("minthreads", queueStats.nMinThreads));
+        queue.push_back(Pair("maxthreads", queueStats.nMaxThreads));
+        queue.push_back(Pair("depth", (uint64_t)queueStats.nDepth));
+        queue.push_back(Pair("clients", (uint64_t)queueStats.nClients));
+        queue.push_back(Pair("maxdepth", (uint64_t)queueStats.nMaxDepth));
+        queue.push_back(Pair("clientdepth", (uint64_t)queueStats.nMaxClientDepth));
+        queue.push_back(Pair("rejected", queueStats.nRejected));
+        ret.push_back(Pair("workqueue", queue));
+    }
+
+    std::map<std::string, CRPCMethodStats> mapStats;
+    {
+        LOCK(cs_rpcStats);
+        mapStats = mapRPCStats;
+    }
+
+    UniValue methods(UniValue::VOBJ);
+    for (std::map<std::string, CRPCMethodStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CRPCMethodStats& stats = it->second;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("calls", stats.nCalls));
+        obj.push_back(Pair("errors", stats.nErrors));
+        obj.push_back(Pair("mean_ms", MicrosToMillis(stats.nTotalMicros / std::max<int64_t>(1, stats.nCalls))));
+        obj.push_back(Pair("p50_ms", MicrosToMillis(stats.Quantile(0.5))));
+        obj.push_back(Pair("p90_ms", MicrosToMillis(stats.Quantile(0.9))));
+        obj.push_back(Pair("p99_ms", MicrosToMillis(stats.Quantile(0.99))));
+        obj.push_back(Pair("max_ms", MicrosToMillis(stats.nMaxMicros)));
+        UniValue histogram(UniValue::VARR);
+        for (int i = 0; i < CRPCMethodStats::BUCKETS; i++) {
+            if (stats.vBuckets[i] == 0)
+                continue;
+            UniValue bucket(UniValue::VOBJ);
+            bucket.push_back(Pair("le_ms", MicrosToMillis(CRPCMethodStats::BucketLimit(i))));
+            bucket.push_back(Pair("calls", stats.vBuckets[i]));
+            histogram.push_back(bucket);
+        }
+        obj.push_back(Pair("histogram", histogram));
+        methods.push_back(Pair(it->first, obj));
+    }
+    ret.push_back(Pair("methods", methods));
+
+    return ret;
+}
+
 
 /**
  * Call Table
@@ -288,13 +463,14 @@ static const CRPCCommand vRPCCommands[] =
     /* Overall control/query calls */
     {"control",               "getinfo",                    &getinfo,                   true,     false,    false}, /* uses wallet if enabled */
     {"control",               "help",                       &help,                      true,     true,     false},
-    {"control",               "stop",                       &stop,                      true,     true,     false},
+    {"control",               "stop",                       &stop,                      true,     false,    false},
+    {"control",               "getrpcstats",                &getrpcstats,               true,     true,     false},
     {"control",               "getforkstatus",              &getforkstatus,             true,     false,    false},
 
     /* P2P networking */
-    {"network",               "addnode",                    &addnode,                   true,     true,     false},
+    {"network",               "addnode",                    &addnode,                   true,     false,    false},
     {"network",               "clearbanned",                &clearbanned,               true,     false,    false},
-    {"network",               "disconnectnode",             &disconnectnode,            true,     true,     false},
+    {"network",               "disconnectnode",             &disconnectnode,            true,     false,    false},
     {"network",               "listbanned",                 &listbanned,                true,     false,    false},
     {"network",               "getaddednodeinfo",           &getaddednodeinfo,          true,     true,     false},
     {"network",               "getconnectioncount",         &getconnectioncount,        true,     false,    false},
@@ -307,20 +483,21 @@ static const CRPCCommand vRPCCommands[] =
 
     /* Block chain and UTXO */
     {"blockchain",            "getblockchaininfo",          &getblockchaininfo,         true,     false,    false},
-    {"blockchain",            "getbestblockhash",           &getbestblockhash,          true,     false,    false},
-    {"blockchain",            "getblockcount",              &getblockcount,             true,     false,    false},
-    {"blockchain",            "getblock",                   &getblock,                  true,     false,    false},
-    {"blockchain",            "getblockhash",               &getblockhash,              true,     false,    false},
-    {"blockchain",            "getblockheader",             &getblockheader,            false,    false,    false},
+    {"blockchain",            "getbestblockhash",           &getbestblockhash,          true,     true,     false},
+    {"blockchain",            "getblockcount",              &getblockcount,             true,     true,     false},
+    {"blockchain",            "getblock",                   &getblock,                  true,     true,     false},
+    {"blockchain",            "getblockhash",               &getblockhash,              true,     true,     false},
+    {"blockchain",            "getblockheader",             &getblockheader,            false,    true,     false},
     {"blockchain",            "getchaintips",               &getchaintips,              true,     false,    false},
     {"blockchain",            "getdifficulty",              &getdifficulty,             true,     false,    false},
     {"blockchain",            "getfeeinfo",                 &getfeeinfo,                true,     false,    false},
+    {"blockchain",            "getleveldbstats",            &getleveldbstats,           true,     false,    false},
     {"blockchain",            "getmempoolinfo",             &getmempoolinfo,            true,     true,     false},
     {"blockchain",            "getrawmempool",              &getrawmempool,             true,     false,    false},
-    {"blockchain",            "gettxout",                   &gettxout,                  true,     false,    false},
+    {"blockchain",            "gettxout",                   &gettxout,                  true,     true,     false},
     {"blockchain",            "gettxoutsetinfo",            &gettxoutsetinfo,           true,     false,    false},
-    {"blockchain",            "invalidateblock",            &invalidateblock,           true,     true,     false},
-    {"blockchain",            "reconsiderblock",            &reconsiderblock,           true,     true,     false},
+    {"blockchain",            "invalidateblock",            &invalidateblock,           true,     false,    false},
+    {"blockchain",            "reconsiderblock",            &reconsiderblock,           true,     false,    false},
     {"blockchain",            "verifychain",                &verifychain,               true,     false,    false},
     {"blockchain",            "getchaintxstats",            &getchaintxstats,           true,     false,    false},
 
@@ -329,15 +506,15 @@ static const CRPCCommand vRPCCommands[] =
     {"mining",                "getmininginfo",              &getmininginfo,             true,     false,    false},
     {"mining",                "getnetworkhashps",           &getnetworkhashps,          true,     false,    false},
     {"mining",                "prioritisetransaction",      &prioritisetransaction,     true,     false,    false},
-    {"mining",                "submitblock",                &submitblock,               true,     true,     false},
-    {"mining",                "reservebalance",             &reservebalance,            true,     true,     false},
+    {"mining",                "submitblock",                &submitblock,               true,     false,    false},
+    {"mining",                "reservebalance",             &reservebalance,            true,     false,    false},
 
 #ifdef ENABLE_WALLET
     /* Coin generation */
     {"generating",            "getgenerate",                &getgenerate,               true,     false,    false},
     {"generating",            "gethashespersec",            &gethashespersec,           true,     false,    false},
-    {"generating",            "setgenerate",                &setgenerate,               true,     true,     false},
-    {"generating",            "setstaking",                 &setstaking,                true,     true,     false},
+    {"generating",            "setgenerate",                &setgenerate,               true,     false,    false},
+    {"generating",            "setstaking",                 &setstaking,                true,     false,    false},
 
 #endif
 
@@ -357,8 +534,8 @@ static const CRPCCommand vRPCCommands[] =
     {"util",                  "estimatepriority",           &estimatepriority,          true,     true,     false},
 
     /* Not shown in help */
-    {"hidden",                "invalidateblock",            &invalidateblock,           true,     true,     false},
-    {"hidden",                "reconsiderblock",            &reconsiderblock,           true,     true,     false},
+    {"hidden",                "invalidateblock",            &invalidateblock,           true,     false,    false},
+    {"hidden",                "reconsiderblock",            &reconsiderblock,           true,     false,    false},
     {"hidden",                "setmocktime",                &setmocktime,               true,     false,    false},
 
 #ifdef ENABLE_WALLET
@@ -383,6 +560,7 @@ static const CRPCCommand vRPCCommands[] =
     {"wallet",                "getstakingstatus",           &getstakingstatus,          false,    false,    true},
     {"wallet",                "gettransaction",             &gettransaction,            false,    false,    true},
     {"wallet",                "getwalletinfo",              &getwalletinfo,             false,    false,    true},
+    {"wallet",                "getwalletmaintenanceinfo",   &getwalletmaintenanceinfo,  true,     false,    true},
     {"wallet",                "importprivkey",              &importprivkey,             true,     false,    true},
     {"wallet",                "importwallet",               &importwallet,              true,     false,    true},
     {"wallet",                "importaddress",              &importaddress,             true,     false,    true},
@@ -411,6 +589,21 @@ static const CRPCCommand vRPCCommands[] =
 #endif // ENABLE_WALLET
 };
 
+/**
+ * Streaming implementations, used for single requests over HTTP. Each name
+ * must also be in vRPCCommands, which provides help, safe mode and batches.
+ */
+static const CRPCStreamCommand vRPCStreamCommands[] =
+    {
+        //  name                      actor (function)
+        //  ---------------------     -----------------------
+        {"getblock",                  &getblock_stream},
+        {"getrawmempool",             &getrawmempool_stream},
+#ifdef ENABLE_WALLET
+        {"listunspent",               &listunspent_stream},
+#endif // ENABLE_WALLET
+};
+
 CRPCTable::CRPCTable()
 {
     unsigned int vcidx;
@@ -420,6 +613,10 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++) {
+        assert(mapCommands.count(vRPCStreamCommands[vcidx].name));
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = vRPCStreamCommands[vcidx].actor;
+    }
 }
 
 const CRPCCommand* CRPCTable::operator[](const std::string& name) const
@@ -528,16 +725,109 @@ static UniValue JSONRPCExecOne(JSONRequest& jreq, const UniValue& req)
     return rpc_result;
 }
 
-std::string JSONRPCExecBatch(JSONRequest& jreq, const UniValue& vReq)
+/** Whether a batch item may run concurrently with its neighbours */
+static bool IsThreadSafeRequest(const UniValue& req)
+{
+    if (!req.isObject())
+        return false;
+    const UniValue& valMethod = find_value(req.get_obj(), "method");
+    if (!valMethod.isStr())
+        return false;
+    const CRPCCommand* pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->threadSafe;
+}
+
+/**
+ * A run of threadSafe batch items. The thread executing the batch and any
+ * helpers it could get claim items through nNext until there are none
+ * left, so the run completes even if no helper ever starts; a helper that
+ * starts late finds nothing to claim and returns.
+ */
+class CRPCBatchRun
+{
+public:
+    const UniValue& vReq;
+    const unsigned int nBegin;
+    const unsigned int nEnd;
+    std::atomic<unsigned int> nNext;
+    std::vector<UniValue> vResults;
+
+    CRPCBatchRun(const UniValue& vReqIn, unsigned int nBeginIn, unsigned int nEndIn) : vReq(vReqIn), nBegin(nBeginIn), nEnd(nEndIn), nNext(nBeginIn), vResults(nEndIn - nBeginIn), nDone(0) {}
+
+    void Run()
+    {
+        unsigned int nIdx;
+        while ((nIdx = nNext++) < nEnd) {
+            JSONRequest jreq;
+            UniValue result = JSONRPCExecOne(jreq, vReq[nIdx]);
+
+            boost::unique_lock<boost::mutex> lock(cs);
+            vResults[nIdx - nBegin] = result;
+            if (++nDone == nEnd - nBegin)
+                cond.notify_all();
+        }
+    }
+
+    void WaitDone()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nDone < nEnd - nBegin)
+            cond.wait(lock);
+    }
+
+private:
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    unsigned int nDone;
+};
+
+std::string JSONRPCExecBatch(JSONRequest& jreq, const UniValue& vReq, const RPCTaskRunner& runTask, int nHelpers)
 {
     UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(jreq, vReq[reqIdx]));
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size()) {
+        unsigned int nEnd = reqIdx;
+        if (runTask && nHelpers > 0) {
+            while (nEnd < vReq.size() && IsThreadSafeRequest(vReq[nEnd]))
+                nEnd++;
+        }
+
+        if (nEnd - reqIdx <= 1) {
+            ret.push_back(JSONRPCExecOne(jreq, vReq[reqIdx]));
+            reqIdx++;
+            continue;
+        }
+
+        boost::shared_ptr<CRPCBatchRun> run(new CRPCBatchRun(vReq, reqIdx, nEnd));
+        for (unsigned int i = 0; i < std::min<unsigned int>(nHelpers, nEnd - reqIdx - 1); i++) {
+            if (!runTask(boost::bind(&CRPCBatchRun::Run, run)))
+                break;
+        }
+        run->Run();
+        run->WaitDone();
+        BOOST_FOREACH (const UniValue& result, run->vResults)
+            ret.push_back(result);
+        reqIdx = nEnd;
+    }
 
     return ret.write() + "\n";
 }
 
-UniValue CRPCTable::execute(const std::string& strMethod, const UniValue& params) const
+void JSONRPCStreamReply(const JSONRequest& jreq, CJSONStreamWriter& writer)
+{
+    // Same layout as JSONRPCReplyObj, with the result streamed in place
+    writer.BeginObject();
+    writer.Key("result");
+    tableRPC.executeStream(jreq.strMethod, jreq.params, writer);
+    writer.Key("error");
+    writer.Null();
+    writer.Key("id");
+    writer.Value(jreq.id);
+    writer.EndObject();
+    writer.Raw("\n");
+}
+
+void CRPCTable::dispatch(const std::string& strMethod, const boost::function<void(const CRPCCommand&)>& call) const
 {
     // Return immediately if in warmup
     {
@@ -553,9 +843,11 @@ UniValue CRPCTable::execute(const std::string& strMethod, const UniValue& params
 
     g_rpcSignals.PreCommand(*pcmd);
 
+    CRPCCallTimer timer(pcmd->name);
     try {
         // Execute
-        return pcmd->actor(params, false);
+        call(*pcmd);
+        timer.Succeeded();
     } catch (std::exception& e) {
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
@@ -563,6 +855,36 @@ UniValue CRPCTable::execute(const std::string& strMethod, const UniValue& params
     g_rpcSignals.PostCommand(*pcmd);
 }
 
+static void CallRPCActor(const CRPCCommand& cmd, const UniValue& params, UniValue& result)
+{
+    result = cmd.actor(params, false);
+}
+
+UniValue CRPCTable::execute(const std::string& strMethod, const UniValue& params) const
+{
+    UniValue result;
+    dispatch(strMethod, boost::bind(&CallRPCActor, _1, boost::cref(params), boost::ref(result)));
+    return result;
+}
+
+bool CRPCTable::isStreamable(const std::string& strMethod) const
+{
+    return mapStreamCommands.count(strMethod) > 0;
+}
+
+static void CallRPCStreamActor(const CRPCCommand& cmd, rpcstreamfn_type actor, const UniValue& params, CJSONStreamWriter& writer)
+{
+    actor(params, writer);
+}
+
+void CRPCTable::executeStream(const std::string& strMethod, const UniValue& params, CJSONStreamWriter& writer) const
+{
+    std::map<std::string, rpcstreamfn_type>::const_iterator it = mapStreamCommands.find(strMethod);
+    if (it == mapStreamCommands.end())
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    dispatch(strMethod, boost::bind(&CallRPCStreamActor, _1, it->second, boost::cref(params), boost::ref(writer)));
+}
+
 std::vector<std::string> CRPCTable::listCommands() const
 {
     std::vector<std::string> commandList;
@@ -31,6 +31,7 @@ namespace RPCServer
 }
 
 class CBlockIndex;
+class CJSONStreamWriter;
 class CNetAddr;
 
 /** Wrapper for UniValue::VType, which includes typeAny:
@@ -135,10 +136,23 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
-    bool threadSafe;
+    bool threadSafe; //!< read-only, may run concurrently with the other threadSafe items of a JSON-RPC batch
     bool reqWallet;
 };
 
+typedef void(*rpcstreamfn_type)(const UniValue& params, CJSONStreamWriter& writer);
+
+/**
+ * Alternative implementation of a command that writes its result to a
+ * stream as it goes, for results too large to build as a UniValue first.
+ */
+class CRPCStreamCommand
+{
+public:
+    std::string name;
+    rpcstreamfn_type actor;
+};
+
 /**
  * KORE RPC command dispatcher.
  */
@@ -146,6 +160,10 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, rpcstreamfn_type> mapStreamCommands;
+
+    /** Warmup check, lookup, signals and timing around call, shared by execute and executeStream */
+    void dispatch(const std::string& method, const boost::function<void(const CRPCCommand&)>& call) const;
 
 public:
     CRPCTable();
@@ -161,6 +179,15 @@ public:
      */
     UniValue execute(const std::string &method, const UniValue &params) const;
 
+    /** Whether method has a streaming implementation */
+    bool isStreamable(const std::string& method) const;
+
+    /**
+     * Execute a method, writing its result to writer.
+     * @throws an exception (UniValue) when an error happens, as execute().
+     */
+    void executeStream(const std::string& method, const UniValue& params, CJSONStreamWriter& writer) const;
+
     /**
     * Returns a list of registered commands
     * @returns List of registered commands.
@@ -259,6 +286,7 @@ extern UniValue getnetworkinfo(const UniValue& params, bool fHelp);
 extern UniValue reservebalance(const UniValue& params, bool fHelp);
 extern UniValue multisend(const UniValue& params, bool fHelp);
 extern UniValue autocombinerewards(const UniValue& params, bool fHelp);
+extern UniValue getwalletmaintenanceinfo(const UniValue& params, bool fHelp);
 extern UniValue getzerocoinbalance(const UniValue& params, bool fHelp);
 extern UniValue listmintedzerocoins(const UniValue& params, bool fHelp);
 extern UniValue listspentzerocoins(const UniValue& params, bool fHelp);
@@ -276,6 +304,7 @@ extern UniValue generatemintlist(const UniValue& params, bool fHelp);
 
 extern UniValue getrawtransaction(const UniValue& params, bool fHelp); // in rcprawtransaction.cpp
 extern UniValue listunspent(const UniValue& params, bool fHelp);
+extern void listunspent_stream(const UniValue& params, CJSONStreamWriter& writer);
 extern UniValue lockunspent(const UniValue& params, bool fHelp);
 extern UniValue listlockunspent(const UniValue& params, bool fHelp);
 extern UniValue createrawtransaction(const UniValue& params, bool fHelp);
@@ -291,11 +320,14 @@ extern UniValue getdifficulty(const UniValue& params, bool fHelp);
 extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getmempoolinfo(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
+extern void getrawmempool_stream(const UniValue& params, CJSONStreamWriter& writer);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
 extern UniValue getblock(const UniValue& params, bool fHelp);
+extern void getblock_stream(const UniValue& params, CJSONStreamWriter& writer);
 extern UniValue getblockheader(const UniValue& params, bool fHelp);
 extern UniValue getfeeinfo(const UniValue& params, bool fHelp);
 extern UniValue gettxoutsetinfo(const UniValue& params, bool fHelp);
+extern UniValue getleveldbstats(const UniValue& params, bool fHelp);
 extern UniValue gettxout(const UniValue& params, bool fHelp);
 extern UniValue verifychain(const UniValue& params, bool fHelp);
 extern UniValue getchaintips(const UniValue& params, bool fHelp);
@@ -316,6 +348,15 @@ extern UniValue getforkstatus(const UniValue& params, bool fHelp);
 bool StartRPC();
 void InterruptRPC();
 void StopRPC();
-std::string JSONRPCExecBatch(JSONRequest & jreq, const UniValue& vReq);
+/** Hands a task to another thread; returns false if it could not */
+typedef boost::function<bool(const boost::function<void(void)>&)> RPCTaskRunner;
+/**
+ * Execute a JSON-RPC batch. Runs of consecutive threadSafe commands are
+ * spread over up to nHelpers extra threads obtained from runTask; the other
+ * commands run one at a time, in order.
+ */
+std::string JSONRPCExecBatch(JSONRequest& jreq, const UniValue& vReq, const RPCTaskRunner& runTask = RPCTaskRunner(), int nHelpers = 0);
+/** Write the JSON-RPC reply to a request for a streamable method, see CRPCTable::executeStream */
+void JSONRPCStreamReply(const JSONRequest& jreq, CJSONStreamWriter& writer);
 
 #endif // BITCOIN_RPCSERVER_H
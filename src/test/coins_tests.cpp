@@ -5,6 +5,7 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 
 #include <vector>
@@ -176,4 +177,68 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Flush through CCoinsViewFlusher, read back while the write may still be in
+// flight, and again from fresh views once it completed.
+BOOST_AUTO_TEST_CASE(coins_background_flush_test)
+{
+    CCoinsViewDB db(1 << 20, true);
+    uint256 txidKept = GetRandHash();
+    uint256 txidSpent = GetRandHash();
+    uint256 hashBlock1 = GetRandHash();
+    uint256 hashBlock2 = GetRandHash();
+
+    {
+        CCoinsViewFlusher flusher(&db);
+        CCoinsViewCache cache(&flusher);
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txidKept);
+            coins->vout.resize(2);
+            coins->vout[0].nValue = 1000;
+            coins->vout[1].nValue = 2000;
+            coins->nHeight = 1;
+        }
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txidSpent);
+            coins->vout.resize(1);
+            coins->vout[0].nValue = 3000;
+            coins->nHeight = 1;
+        }
+        cache.SetBestBlock(hashBlock1);
+        BOOST_CHECK(cache.Flush());
+
+        // The cache was emptied by the flush, so these come from the flusher
+        BOOST_CHECK(cache.HaveCoins(txidKept));
+        BOOST_CHECK(cache.HaveCoins(txidSpent));
+        BOOST_CHECK(cache.GetBestBlock() == hashBlock1);
+
+        // Spend one output and the whole second transaction
+        cache.ModifyCoins(txidKept)->Spend(0);
+        cache.ModifyCoins(txidSpent)->Clear();
+        cache.SetBestBlock(hashBlock2);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(!flusher.HaveCoins(txidSpent));
+        CCoins coins;
+        BOOST_CHECK(flusher.GetCoins(txidKept, coins));
+        BOOST_CHECK(!coins.IsAvailable(0));
+        BOOST_CHECK(coins.IsAvailable(1));
+        BOOST_CHECK(flusher.GetBestBlock() == hashBlock2);
+
+        BOOST_CHECK(flusher.Sync());
+        BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+        BOOST_CHECK(!db.HaveCoins(txidSpent));
+    }
+
+    // Reload on top of the database alone
+    CCoinsViewFlusher flusher(&db);
+    CCoinsViewCache cache(&flusher);
+    BOOST_CHECK(cache.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(!cache.HaveCoins(txidSpent));
+    const CCoins* pcoins = cache.AccessCoins(txidKept);
+    BOOST_REQUIRE(pcoins);
+    BOOST_CHECK(!pcoins->IsAvailable(0));
+    BOOST_CHECK(pcoins->IsAvailable(1));
+    BOOST_CHECK_EQUAL(pcoins->vout[1].nValue, 2000);
+    BOOST_CHECK_EQUAL(pcoins->nHeight, 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,120 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypter.h"
+
+#include "key.h"
+#include "random.h"
+#include "script/standard.h"
+#include "utilstrencodings.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+/** Key store with the protected encryption calls opened up */
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    using CCryptoKeyStore::EncryptKeys;
+    using CCryptoKeyStore::Unlock;
+};
+
+static CKeyingMaterial RandomMasterKey()
+{
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vMasterKey[0], WALLET_CRYPTO_KEY_SIZE);
+    return vMasterKey;
+}
+
+//! nKeys new keys, in the order the key store keeps them
+static map<CKeyID, CKey> MakeKeys(size_t nKeys)
+{
+    map<CKeyID, CKey> mapKeys;
+    while (mapKeys.size() < nKeys) {
+        CKey key;
+        key.MakeNewKey(mapKeys.size() % 2 == 0);
+        mapKeys[key.GetPubKey().GetID()] = key;
+    }
+    return mapKeys;
+}
+
+BOOST_AUTO_TEST_SUITE(crypter_tests)
+
+BOOST_AUTO_TEST_CASE(encrypt_unlock_many_keys)
+{
+    // Enough keys for EncryptKeys to split the work over threads
+    map<CKeyID, CKey> mapKeys = MakeKeys(4 * WALLET_CRYPTO_MIN_KEYS_PER_THREAD + 3);
+    CTestCryptoKeyStore store;
+    BOOST_FOREACH (const PAIRTYPE(CKeyID, CKey) & item, mapKeys)
+        BOOST_CHECK(store.AddKeyPubKey(item.second, item.second.GetPubKey()));
+
+    CKeyingMaterial vMasterKey = RandomMasterKey();
+    BOOST_CHECK(store.EncryptKeys(vMasterKey));
+    BOOST_CHECK(store.IsCrypted());
+    BOOST_CHECK(store.IsLocked());
+    BOOST_CHECK(!store.EncryptKeys(vMasterKey));
+
+    BOOST_CHECK(!store.Unlock(RandomMasterKey()));
+    BOOST_CHECK(store.IsLocked());
+    BOOST_CHECK(store.Unlock(vMasterKey));
+    BOOST_CHECK(!store.IsLocked());
+
+    // Every key comes back from whichever thread encrypted it
+    BOOST_FOREACH (const PAIRTYPE(CKeyID, CKey) & item, mapKeys) {
+        CPubKey pubkey;
+        BOOST_CHECK(store.GetPubKey(item.first, pubkey));
+        BOOST_CHECK(pubkey == item.second.GetPubKey());
+        CKey key;
+        BOOST_CHECK(store.GetKey(item.first, key));
+        BOOST_CHECK(key == item.second);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(unlock_unsampled_corrupt_key)
+{
+    // With 100 keys the first Unlock checks every 6th one, starting at the first
+    map<CKeyID, CKey> mapKeys = MakeKeys(100);
+    vector<CKeyID> vOrder;
+    BOOST_FOREACH (const PAIRTYPE(CKeyID, CKey) & item, mapKeys)
+        vOrder.push_back(item.first);
+    const CKeyID idCorrupt = vOrder[1];
+
+    // The corrupted key decrypts fine, but to the secret of another key
+    CKeyingMaterial vMasterKey = RandomMasterKey();
+    CTestCryptoKeyStore store;
+    BOOST_FOREACH (const PAIRTYPE(CKeyID, CKey) & item, mapKeys) {
+        const CPubKey pubkey = item.second.GetPubKey();
+        const CKey& secret = item.first == idCorrupt ? mapKeys[vOrder[2]] : item.second;
+        vector<unsigned char> vchCryptedSecret;
+        BOOST_CHECK(EncryptSecret(vMasterKey, CKeyingMaterial(secret.begin(), secret.end()), pubkey.GetHash(), vchCryptedSecret));
+        BOOST_CHECK(store.AddCryptedKey(pubkey, vchCryptedSecret));
+    }
+
+    BOOST_CHECK(store.Unlock(vMasterKey));
+    CKey key;
+    BOOST_CHECK(!store.GetKey(idCorrupt, key));
+    BOOST_CHECK(!store.GetKey(idCorrupt, key));
+    BOOST_CHECK(store.GetKey(vOrder[2], key));
+    BOOST_CHECK(key == mapKeys[vOrder[2]]);
+    BOOST_CHECK(store.GetKey(vOrder[3], key));
+    BOOST_CHECK(key == mapKeys[vOrder[3]]);
+
+    // Later unlocks still check a key against the master key, and the
+    // corrupted one stays refused
+    BOOST_CHECK(store.Lock());
+    BOOST_CHECK(store.IsLocked());
+    BOOST_CHECK(!store.Unlock(RandomMasterKey()));
+    BOOST_CHECK(store.IsLocked());
+    BOOST_CHECK(store.Unlock(vMasterKey));
+    BOOST_CHECK(!store.GetKey(idCorrupt, key));
+    BOOST_CHECK(store.GetKey(vOrder[4], key));
+    BOOST_CHECK(key == mapKeys[vOrder[4]]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,166 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonstream.h"
+
+#include <limits>
+#include <stdint.h>
+#include <string>
+#include <univalue.h>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(jsonstream_tests)
+
+static void AppendChunk(string* pstrOut, int* pnChunks, const string& strChunk)
+{
+    BOOST_CHECK(!strChunk.empty());
+    *pstrOut += strChunk;
+    (*pnChunks)++;
+}
+
+/** Write val token by token, the way the streaming RPC calls do */
+static void WriteTokens(CJSONStreamWriter& writer, const UniValue& val)
+{
+    switch (val.getType()) {
+    case UniValue::VOBJ:
+        writer.BeginObject();
+        for (size_t i = 0; i < val.size(); i++) {
+            writer.Key(val.getKeys()[i]);
+            WriteTokens(writer, val.getValues()[i]);
+        }
+        writer.EndObject();
+        break;
+    case UniValue::VARR:
+        writer.BeginArray();
+        for (size_t i = 0; i < val.size(); i++)
+            WriteTokens(writer, val[i]);
+        writer.EndArray();
+        break;
+    case UniValue::VSTR:
+        writer.Value(val.get_str());
+        break;
+    case UniValue::VBOOL:
+        writer.Value(val.get_bool());
+        break;
+    case UniValue::VNULL:
+        writer.Null();
+        break;
+    case UniValue::VNUM:
+        writer.Value(val);
+        break;
+    }
+}
+
+static UniValue TestDocument()
+{
+    UniValue strings(UniValue::VARR);
+    strings.push_back("");
+    strings.push_back("plain");
+    strings.push_back("quote \" and backslash \\ and slash /");
+    strings.push_back("control \n\r\t\b\f and \x01\x1f");
+    strings.push_back("utf-8 \xc3\xa9\xe2\x82\xac");
+
+    UniValue numbers(UniValue::VARR);
+    numbers.push_back(0);
+    numbers.push_back(-1);
+    numbers.push_back(std::numeric_limits<int64_t>::max());
+    numbers.push_back(std::numeric_limits<int64_t>::min());
+    numbers.push_back(UniValue(0.5));
+    UniValue amount;
+    amount.setNumStr("21000000.00000000");
+    numbers.push_back(amount);
+
+    UniValue nested(UniValue::VOBJ);
+    nested.push_back(Pair("empty object", UniValue(UniValue::VOBJ)));
+    nested.push_back(Pair("empty array", UniValue(UniValue::VARR)));
+    UniValue inner(UniValue::VARR);
+    inner.push_back(UniValue(UniValue::VOBJ));
+    UniValue deep(UniValue::VARR);
+    deep.push_back(inner);
+    nested.push_back(Pair("deep", deep));
+
+    UniValue doc(UniValue::VOBJ);
+    doc.push_back(Pair("strings", strings));
+    doc.push_back(Pair("numbers", numbers));
+    doc.push_back(Pair("key \"with\" \\escapes\n", true));
+    doc.push_back(Pair("false", false));
+    doc.push_back(Pair("null", NullUniValue));
+    doc.push_back(Pair("nested", nested));
+    return doc;
+}
+
+BOOST_AUTO_TEST_CASE(jsonstream_matches_univalue)
+{
+    UniValue doc = TestDocument();
+
+    // Chunk sizes from one byte to more than the whole document
+    const size_t vChunkSizes[] = {1, 7, 64, JSON_STREAM_CHUNK_SIZE};
+    BOOST_FOREACH (size_t nChunkSize, vChunkSizes) {
+        string strOut;
+        int nChunks = 0;
+        CJSONStreamWriter writer(boost::bind(&AppendChunk, &strOut, &nChunks, _1), nChunkSize);
+        WriteTokens(writer, doc);
+        writer.Raw("\n");
+        writer.Flush();
+        BOOST_CHECK_EQUAL(strOut, doc.write() + "\n");
+        BOOST_CHECK(writer.Started());
+        if (nChunkSize < 64)
+            BOOST_CHECK(nChunks > 1);
+        else if (nChunkSize == JSON_STREAM_CHUNK_SIZE)
+            BOOST_CHECK_EQUAL(nChunks, 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(jsonstream_values)
+{
+    string strOut;
+    int nChunks = 0;
+    CJSONStreamWriter writer(boost::bind(&AppendChunk, &strOut, &nChunks, _1));
+    BOOST_CHECK(!writer.Started());
+
+    // Scalars, subtrees and partial members mixed in one array
+    UniValue doc = TestDocument();
+    writer.BeginArray();
+    writer.Value((int64_t)std::numeric_limits<int64_t>::min());
+    writer.Value(-42);
+    writer.Value("c string \"escaped\"");
+    writer.Value(doc["nested"]);
+    writer.BeginObject();
+    writer.Members(doc, 1, 3);
+    writer.EndObject();
+    writer.BeginObject();
+    writer.Members(doc, 4, 100);
+    writer.EndObject();
+    writer.EndArray();
+    BOOST_CHECK(!writer.Started());
+    writer.Flush();
+    BOOST_CHECK(writer.Started());
+    BOOST_CHECK_EQUAL(nChunks, 1);
+
+    UniValue expected(UniValue::VARR);
+    expected.push_back(std::numeric_limits<int64_t>::min());
+    expected.push_back(-42);
+    expected.push_back("c string \"escaped\"");
+    expected.push_back(doc["nested"]);
+    UniValue partial(UniValue::VOBJ);
+    partial.push_back(Pair("numbers", doc["numbers"]));
+    partial.push_back(Pair("key \"with\" \\escapes\n", true));
+    expected.push_back(partial);
+    UniValue tail(UniValue::VOBJ);
+    tail.push_back(Pair("null", NullUniValue));
+    tail.push_back(Pair("nested", doc["nested"]));
+    expected.push_back(tail);
+    BOOST_CHECK_EQUAL(strOut, expected.write());
+
+    // Nothing is handed to the sink twice
+    writer.Flush();
+    BOOST_CHECK_EQUAL(nChunks, 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
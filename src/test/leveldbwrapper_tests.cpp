@@ -0,0 +1,77 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(leveldbwrapper_tests)
+
+BOOST_AUTO_TEST_CASE(leveldb_profile_presets)
+{
+    CLevelDBProfile profile;
+    BOOST_CHECK(ParseLevelDBProfile("read", profile));
+    BOOST_CHECK_EQUAL(profile.strName, "read");
+    BOOST_CHECK_EQUAL(profile.nBlockSize, 16384U);
+    BOOST_CHECK_EQUAL(profile.nBloomBits, 14);
+    BOOST_CHECK_EQUAL(profile.nBlockCacheEighths, 6);
+
+    BOOST_CHECK(ParseLevelDBProfile("write", profile));
+    BOOST_CHECK_EQUAL(profile.strName, "write");
+    BOOST_CHECK_EQUAL(profile.nBlockSize, 4096U);
+    BOOST_CHECK_EQUAL(profile.nBloomBits, 10);
+    BOOST_CHECK_EQUAL(profile.nBlockCacheEighths, 2);
+
+    // "default" matches a default constructed profile
+    CLevelDBProfile profileDefault;
+    BOOST_CHECK(ParseLevelDBProfile("default", profile));
+    BOOST_CHECK_EQUAL(profile.strName, profileDefault.strName);
+    BOOST_CHECK_EQUAL(profile.nBlockSize, profileDefault.nBlockSize);
+    BOOST_CHECK_EQUAL(profile.nBloomBits, profileDefault.nBloomBits);
+    BOOST_CHECK_EQUAL(profile.nBlockCacheEighths, profileDefault.nBlockCacheEighths);
+
+    // Settings outside the presets are left alone
+    profile.fCompression = true;
+    profile.nMaxOpenFiles = 1000;
+    BOOST_CHECK(ParseLevelDBProfile("read", profile));
+    BOOST_CHECK(profile.fCompression);
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_profile_unknown)
+{
+    CLevelDBProfile profile;
+    BOOST_CHECK(ParseLevelDBProfile("write", profile));
+    BOOST_CHECK(!ParseLevelDBProfile("", profile));
+    BOOST_CHECK(!ParseLevelDBProfile("Read", profile));
+    BOOST_CHECK(!ParseLevelDBProfile("read ", profile));
+    BOOST_CHECK(!ParseLevelDBProfile("fast", profile));
+    // A failed parse doesn't touch the profile
+    BOOST_CHECK_EQUAL(profile.strName, "write");
+    BOOST_CHECK_EQUAL(profile.nBlockCacheEighths, 2);
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_profile_memory_limit)
+{
+    // Every preset splits the whole cache between the block cache and the two write buffers
+    const size_t nCacheSize = 8 << 20;
+    const char* vPresets[] = {"default", "read", "write"};
+    for (unsigned int i = 0; i < sizeof(vPresets) / sizeof(vPresets[0]); i++) {
+        CLevelDBProfile profile;
+        BOOST_CHECK(ParseLevelDBProfile(vPresets[i], profile));
+        CLevelDBWrapper db(boost::filesystem::path("leveldb_profile") / vPresets[i], nCacheSize, true, false, false, profile);
+        BOOST_CHECK_EQUAL(db.GetMemoryLimit(), nCacheSize);
+
+        // and the database works with its settings
+        BOOST_CHECK(db.Write('k', std::string(vPresets[i])));
+        std::string strValue;
+        BOOST_CHECK(db.Read('k', strValue));
+        BOOST_CHECK_EQUAL(strValue, vPresets[i]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -7,11 +7,42 @@
 #include "main.h"
 #include "miner.h"
 #include "primitives/transaction.h"
-
+#include "random.h"
+#include "txdb.h"
+#include "undo.h"
 #include "utilmoneystr.h"
 
+#include <map>
+#include <set>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
+extern CCriticalSection cs_LastBlockFile;
+extern std::vector<CBlockFileInfo> vinfoBlockFile;
+extern int nLastBlockFile;
+extern std::set<CBlockIndex*> setDirtyBlockIndex;
+extern std::set<int> setDirtyFileInfo;
+
+/** The genesis block padded with a compressible transaction; the header still passes ReadBlockFromDisk */
+static CBlock CompressibleBlock()
+{
+    CBlock block = Params().GenesisBlock();
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(200, CTxOut(1, CScript() << OP_TRUE));
+    block.vtx.push_back(tx);
+    return block;
+}
+
+static std::string SerializedBlock(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return ss.str();
+}
+
 BOOST_AUTO_TEST_SUITE(main_tests)
 
 // We are unable to test pre-fork supply beacause it doesn't use a fixed amount.
@@ -51,4 +82,202 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test_post_fork)
     BOOST_ASSERT(nSubsidy == 0);
 }
 
+BOOST_AUTO_TEST_CASE(disk_record_pack_test)
+{
+    SelectParams(CBaseChainParams::UNITTEST);
+    CBlock block = CompressibleBlock();
+
+    fBlockCompression = false;
+    CDiskRecord plain(block);
+    BOOST_CHECK_EQUAL(plain.nSizeField, plain.nRawSize);
+    BOOST_CHECK_EQUAL(plain.GetDiskSize(), plain.nRawSize);
+    BOOST_CHECK(plain.ssPayload.str() == SerializedBlock(block));
+
+#ifdef USE_ZLIB
+    fBlockCompression = true;
+    CDiskRecord packed(block);
+    BOOST_CHECK(packed.nSizeField & DISK_RECORD_COMPRESSED);
+    BOOST_CHECK_EQUAL(packed.nSizeField & ~DISK_RECORD_COMPRESSED, packed.GetDiskSize());
+    BOOST_CHECK_EQUAL(packed.nRawSize, plain.nRawSize);
+    BOOST_CHECK(packed.GetDiskSize() < packed.nRawSize);
+
+    std::vector<char> vPacked(packed.ssPayload.begin(), packed.ssPayload.end());
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(UnpackDiskRecord(vPacked, ssBlock));
+    BOOST_CHECK(ssBlock.str() == SerializedBlock(block));
+
+    // Corrupt or truncated payloads are refused
+    std::vector<char> vCorrupt(vPacked);
+    vCorrupt[vCorrupt.size() / 2] ^= 0x55;
+    BOOST_CHECK(!UnpackDiskRecord(vCorrupt, ssBlock));
+    BOOST_CHECK(!UnpackDiskRecord(std::vector<char>(vPacked.begin(), vPacked.end() - 1), ssBlock));
+    BOOST_CHECK(!UnpackDiskRecord(std::vector<char>(3), ssBlock));
+
+    // Data that does not shrink is stored as is
+    std::vector<unsigned char> vRandom(1000);
+    GetRandBytes(&vRandom[0], vRandom.size());
+    CDiskRecord random(vRandom);
+    BOOST_CHECK_EQUAL(random.nSizeField, random.nRawSize);
+    BOOST_CHECK_EQUAL(random.GetDiskSize(), random.nRawSize);
+#endif
+    fBlockCompression = DEFAULT_BLOCK_COMPRESSION;
+}
+
+BOOST_AUTO_TEST_CASE(compressed_block_read_test)
+{
+    SelectParams(CBaseChainParams::UNITTEST);
+    CBlock block = CompressibleBlock();
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.resize(50, CTxInUndo(CTxOut(1, CScript() << OP_TRUE), false, false, 1, 1));
+    uint256 hashPrev = GetRandHash();
+
+    // A scratch file number well past anything the chain uses
+    CDiskBlockPos posPlain(9999, 0), posPacked, undoPlain(9999, 0), undoPacked;
+    fBlockCompression = false;
+    BOOST_CHECK(WriteBlockToDisk(block, posPlain));
+    BOOST_CHECK(blockundo.WriteToDisk(CDiskRecord(blockundo), undoPlain, hashPrev));
+
+    fBlockCompression = true;
+    CDiskRecord record(block);
+    posPacked = CDiskBlockPos(9999, posPlain.nPos + record.nRawSize);
+    BOOST_CHECK(WriteBlockToDisk(record, posPacked));
+    CDiskRecord undoRecord(blockundo);
+    undoPacked = CDiskBlockPos(9999, undoPlain.nPos + undoRecord.nRawSize + 32);
+    BOOST_CHECK(blockundo.WriteToDisk(undoRecord, undoPacked, hashPrev));
+    fBlockCompression = DEFAULT_BLOCK_COMPRESSION;
+#ifdef USE_ZLIB
+    BOOST_CHECK(record.nSizeField & DISK_RECORD_COMPRESSED);
+    BOOST_CHECK(undoRecord.nSizeField & DISK_RECORD_COMPRESSED);
+#endif
+
+    // Both forms read back to the same block and undo data
+    CBlock blockPlain, blockPacked;
+    BOOST_CHECK(ReadBlockFromDisk(blockPlain, posPlain));
+    BOOST_CHECK(ReadBlockFromDisk(blockPacked, posPacked));
+    BOOST_CHECK(SerializedBlock(blockPlain) == SerializedBlock(block));
+    BOOST_CHECK(SerializedBlock(blockPacked) == SerializedBlock(block));
+
+    CBlockUndo undo1, undo2;
+    BOOST_CHECK(undo1.ReadFromDisk(undoPlain, hashPrev));
+    BOOST_CHECK(undo2.ReadFromDisk(undoPacked, hashPrev));
+    BOOST_CHECK_EQUAL(undo1.vtxundo[0].vprevout.size(), 50U);
+    BOOST_CHECK_EQUAL(undo2.vtxundo[0].vprevout.size(), 50U);
+    BOOST_CHECK(!undo2.ReadFromDisk(undoPacked, GetRandHash()));
+
+    boost::filesystem::remove(GetBlockPosFilename(posPlain, "blk"));
+    boost::filesystem::remove(GetBlockPosFilename(undoPlain, "rev"));
+}
+
+#ifdef USE_ZLIB
+BOOST_AUTO_TEST_CASE(compact_block_files_test)
+{
+    SelectParams(CBaseChainParams::UNITTEST);
+    CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex);
+    CDiskBlockPos posOld = pindex->GetBlockPos();
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex));
+
+    // Save what the compaction changes, so later tests find the block files as they were
+    LOCK(cs_main);
+    int nOldLastBlockFile;
+    std::vector<CBlockFileInfo> vinfoOld;
+    {
+        LOCK(cs_LastBlockFile);
+        nOldLastBlockFile = nLastBlockFile;
+        vinfoOld = vinfoBlockFile;
+    }
+    std::map<CBlockIndex*, CDiskBlockPos> mapOldPos;
+    std::map<CBlockIndex*, unsigned int> mapOldUndoPos;
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        mapOldPos[it->second] = it->second->GetBlockPos();
+        mapOldUndoPos[it->second] = it->second->nUndoPos;
+    }
+    std::vector<boost::filesystem::path> vSaved;
+    for (int nFile = 0; nFile <= nOldLastBlockFile; nFile++) {
+        const char* vPrefix[] = {"blk", "rev"};
+        BOOST_FOREACH (const char* prefix, vPrefix) {
+            boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), prefix);
+            if (!boost::filesystem::exists(path))
+                continue;
+            boost::filesystem::copy_file(path, path.string() + ".saved", boost::filesystem::copy_option::overwrite_if_exists);
+            vSaved.push_back(path);
+        }
+    }
+
+    // Only finished files are compacted: start a new one after the genesis file
+    {
+        LOCK(cs_LastBlockFile);
+        if (nLastBlockFile <= posOld.nFile) {
+            nLastBlockFile = posOld.nFile + 1;
+            vinfoBlockFile.resize(nLastBlockFile + 1);
+        }
+    }
+
+    // A txindex entry the active chain would not rewrite must follow the block too
+    bool fOldTxIndex = fTxIndex;
+    fTxIndex = true;
+    std::vector<std::pair<uint256, CDiskTxPos> > vPosTxid;
+    vPosTxid.push_back(std::make_pair(block.vtx[0].GetHash(), CDiskTxPos(posOld, GetSizeOfCompactSize(block.vtx.size()))));
+    BOOST_CHECK(pblocktree->WriteTxIndex(vPosTxid));
+
+    BOOST_CHECK(CompactBlockFiles());
+
+    CDiskBlockPos posNew = pindex->GetBlockPos();
+    BOOST_CHECK(posNew.nFile != posOld.nFile);
+    BOOST_CHECK(!boost::filesystem::exists(GetBlockPosFilename(posOld, "blk")));
+    {
+        LOCK(cs_LastBlockFile);
+        BOOST_CHECK_EQUAL(vinfoBlockFile[posOld.nFile].nBlocks, 0U);
+    }
+
+    CBlock blockMoved;
+    BOOST_CHECK(ReadBlockFromDisk(blockMoved, pindex));
+    BOOST_CHECK(SerializedBlock(blockMoved) == SerializedBlock(block));
+
+    CDiskTxPos postx;
+    BOOST_CHECK(pblocktree->ReadTxIndex(block.vtx[0].GetHash(), postx));
+    BOOST_CHECK_EQUAL(postx.nFile, posNew.nFile);
+    BOOST_CHECK_EQUAL(postx.nPos, posNew.nPos);
+    CTransaction tx;
+    uint256 hashBlock;
+    BOOST_CHECK(GetTransaction(block.vtx[0].GetHash(), tx, hashBlock, false));
+    BOOST_CHECK(tx.GetHash() == block.vtx[0].GetHash());
+    BOOST_CHECK(hashBlock == block.GetHash());
+
+    // A second run finds nothing left to do
+    BOOST_CHECK(CompactBlockFiles());
+    BOOST_CHECK(pindex->GetBlockPos() == posNew);
+
+    // Put the old files, positions and file bookkeeping back
+    BOOST_FOREACH (const boost::filesystem::path& path, vSaved)
+        boost::filesystem::rename(path.string() + ".saved", path);
+    {
+        LOCK(cs_LastBlockFile);
+        for (int nFile = nOldLastBlockFile + 1; nFile <= nLastBlockFile; nFile++) {
+            boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+            boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "rev"));
+        }
+        for (int nFile = 0; nFile < (int)vinfoOld.size(); nFile++)
+            setDirtyFileInfo.insert(nFile);
+        nLastBlockFile = nOldLastBlockFile;
+        vinfoBlockFile = vinfoOld;
+    }
+    for (std::map<CBlockIndex*, CDiskBlockPos>::iterator it = mapOldPos.begin(); it != mapOldPos.end(); ++it) {
+        it->first->nFile = it->second.nFile;
+        it->first->nDataPos = it->second.nPos;
+        it->first->nUndoPos = mapOldUndoPos[it->first];
+        setDirtyBlockIndex.insert(it->first);
+    }
+    BOOST_CHECK(pblocktree->WriteTxIndex(vPosTxid));
+    FlushStateToDisk();
+    BOOST_CHECK(pindex->GetBlockPos() == posOld);
+    CBlock blockRestored;
+    BOOST_CHECK(ReadBlockFromDisk(blockRestored, pindex));
+    BOOST_CHECK(SerializedBlock(blockRestored) == SerializedBlock(block));
+    fTxIndex = fOldTxIndex;
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,7 +2,12 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "key.h"
+#include "keystore.h"
 #include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -99,4 +104,235 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    // Chain of three transactions: a low fee parent, a zero fee child and a
+    // high fee grandchild that pays for both.
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 33000LL;
+
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout.hash = txChild.GetHash();
+    txGrandChild.vin[0].prevout.n = 0;
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 20000LL;
+
+    // Unrelated transaction with a medium fee
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 33000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0LL, 0, 0.0, 1));
+    testPool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 100000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 10000LL, 0, 0.0, 1));
+
+    CTxMemPool::txiter itParent = testPool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = testPool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = testPool.mapTx.find(txGrandChild.GetHash());
+    uint64_t nParentSize = itParent->GetTxSize();
+    uint64_t nChainSize = nParentSize + itChild->GetTxSize() + itGrandChild->GetTxSize();
+
+    BOOST_CHECK_EQUAL(itParent->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nChainSize);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 101000LL);
+
+    // The grandchild package pays the best feerate, ahead of txOther
+    CTxMemPool::indexed_transaction_set::nth_index<4>::type::iterator it = testPool.mapTx.get<4>().begin();
+    BOOST_CHECK(it->GetTx().GetHash() == txGrandChild.GetHash());
+    it++;
+    BOOST_CHECK(it->GetTx().GetHash() == txOther.GetHash());
+
+    // Prioritising the parent is reflected in the state of its descendants
+    testPool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0.0, 5000LL);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithAncestors(), 6000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 106000LL);
+
+    // Mining the parent leaves the descendants with updated ancestor state
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    std::list<CTransaction> conflicts;
+    testPool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(testPool.size(), 3);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nChainSize - nParentSize);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 100000LL);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitChainTest)
+{
+    // Fill a pool with chains of dependent transactions and trim it down,
+    // timing both so regressions in package eviction show up in the log.
+    const int nChains = 40;
+    const int nChainLength = 25;
+
+    CTxMemPool testPool(CFeeRate(1000));
+    std::vector<uint256> vRoots;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nChains; i++) {
+        uint256 hashPrev;
+        for (int j = 0; j < nChainLength; j++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            if (j == 0)
+                tx.vin[0].scriptSig = CScript() << i;
+            else
+                tx.vin[0].prevout = COutPoint(hashPrev, 0);
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[0].nValue = 1000000LL - j;
+            hashPrev = tx.GetHash();
+            if (j == 0)
+                vRoots.push_back(hashPrev);
+            // Fees rise with the chain index, so the first chains are evicted first
+            testPool.addUnchecked(hashPrev, CTxMemPoolEntry(tx, 1000LL * (i + 1), 0, 0.0, 1));
+        }
+    }
+    int64_t nAdded = GetTimeMicros();
+    BOOST_CHECK_EQUAL(testPool.size(), nChains * nChainLength);
+
+    size_t nLimit = testPool.DynamicMemoryUsage() / 2;
+    std::vector<uint256> vNoSpendsRemaining;
+    testPool.TrimToSize(nLimit, &vNoSpendsRemaining);
+    int64_t nTrimmed = GetTimeMicros();
+    BOOST_TEST_MESSAGE(strprintf("added %d chained txn in %.2fms, trimmed to %d txn in %.2fms",
+        nChains * nChainLength, 0.001 * (nAdded - nStart), testPool.size(), 0.001 * (nTrimmed - nAdded)));
+
+    BOOST_CHECK(testPool.DynamicMemoryUsage() <= nLimit);
+    BOOST_CHECK(testPool.size() > 0);
+    BOOST_CHECK(!testPool.exists(vRoots.front()));
+    BOOST_CHECK(testPool.exists(vRoots.back()));
+    BOOST_CHECK(testPool.GetMinFee(nLimit).GetFeePerK() > 0);
+
+    // Every surviving entry's descendant state matches what is left below it
+    for (CTxMemPool::txiter it = testPool.mapTx.begin(); it != testPool.mapTx.end(); ++it) {
+        CTxMemPool::setEntries setDescendants;
+        testPool.CalculateDescendants(it, setDescendants);
+        int64_t nSize = 0;
+        CAmount nFees = 0;
+        BOOST_FOREACH (CTxMemPool::txiter dit, setDescendants) {
+            nSize += dit->GetTxSize();
+            nFees += dit->GetModifiedFee();
+        }
+        BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), setDescendants.size());
+        BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), nSize);
+        BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), nFees);
+    }
+}
+
+// Credit the outputs of a made-up confirmed transaction to the coins tip
+static CMutableTransaction AddSpendableCoins(CBasicKeyStore& keystore, int nOutputs)
+{
+    CMutableTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        txFund.vout[i].nValue = 10 * CENT;
+        txFund.vout[i].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    }
+    LOCK(cs_main);
+    pcoinsTip->ModifyCoins(txFund.GetHash())->FromTx(txFund, chainActive.Height());
+    return txFund;
+}
+
+static CMutableTransaction SpendCoins(const CBasicKeyStore& keystore, const CMutableTransaction& txFund, unsigned int nFirst, unsigned int nInputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+        tx.vin[i].prevout = COutPoint(txFund.GetHash(), nFirst + i);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nInputs * 10 * CENT - CENT;
+    tx.vout[0].scriptPubKey = txFund.vout[0].scriptPubKey;
+    for (unsigned int i = 0; i < nInputs; i++)
+        BOOST_CHECK(SignSignature(keystore, txFund, tx, i));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAcceptTest)
+{
+    ModifiableParams()->setHeightToFork(0);
+
+    CBasicKeyStore keystore;
+    CMutableTransaction txFund = AddSpendableCoins(keystore, 8);
+    CTxMemPool testPool(CFeeRate(0));
+    CValidationState state;
+    bool fMissingInputs;
+
+    // Several inputs go through the mempool script check queue
+    CMutableTransaction txSpend = SpendCoins(keystore, txFund, 0, 3);
+    BOOST_CHECK(AcceptToMemoryPool(testPool, state, txSpend, false, &fMissingInputs, false, false, true));
+    BOOST_CHECK(testPool.exists(txSpend.GetHash()));
+    BOOST_CHECK(!fMissingInputs);
+
+    // Known already
+    BOOST_CHECK(!AcceptToMemoryPool(testPool, state, txSpend, false, &fMissingInputs, false, false, true));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "txn-already-in-mempool");
+
+    // Spends an output the pool spends already
+    CMutableTransaction txConflict = SpendCoins(keystore, txFund, 2, 2);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptToMemoryPool(testPool, state, txConflict, false, &fMissingInputs, false, false, true));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "txn-mempool-conflict");
+    BOOST_CHECK(!testPool.exists(txConflict.GetHash()));
+
+    // Unknown input: not invalid, just an orphan
+    CMutableTransaction txOrphan = SpendCoins(keystore, txFund, 3, 1);
+    txOrphan.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptToMemoryPool(testPool, state, txOrphan, false, &fMissingInputs, false, false, true));
+    BOOST_CHECK(fMissingInputs);
+    BOOST_CHECK(state.IsValid());
+
+    // One bad signature among several inputs fails the parallel check,
+    // the serial recheck then reports it with the proper reject reason
+    CMutableTransaction txBadSig = SpendCoins(keystore, txFund, 3, 4);
+    txBadSig.vin[2].scriptSig = txBadSig.vin[1].scriptSig;
+    state = CValidationState();
+    BOOST_CHECK(!AcceptToMemoryPool(testPool, state, txBadSig, false, &fMissingInputs, false, false, true));
+    BOOST_CHECK(!fMissingInputs);
+    int nDoS = 0;
+    BOOST_CHECK(state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK(state.GetRejectReason().find("mandatory-script-verify-flag-failed") == 0);
+    BOOST_CHECK(!testPool.exists(txBadSig.GetHash()));
+
+    // The inputs of the rejected transaction are still free to spend
+    CMutableTransaction txGood = SpendCoins(keystore, txFund, 3, 4);
+    state = CValidationState();
+    BOOST_CHECK(AcceptToMemoryPool(testPool, state, txGood, false, &fMissingInputs, false, false, true));
+    BOOST_CHECK(testPool.exists(txGood.GetHash()));
+    BOOST_CHECK_EQUAL(testPool.size(), 2);
+
+    LOCK(cs_main);
+    pcoinsTip->ModifyCoins(txFund.GetHash())->Clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
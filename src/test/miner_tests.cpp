@@ -10,6 +10,7 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(miner_tests)
@@ -258,4 +259,122 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     Checkpoints::fEnabled = true;
 }
 
+// Spend the coinbase of block nHeight, built on the chain left by CreateNewBlock_validity
+static CMutableTransaction SpendCoinbase(int nHeight)
+{
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, chainActive[nHeight]));
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(block.vtx[0].GetHash(), 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 490000000LL;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+static bool TemplateHas(const CBlockTemplate* pblocktemplate, const CTransaction& tx)
+{
+    BOOST_FOREACH (const CTransaction& txBlock, pblocktemplate->block.vtx)
+        if (txBlock.GetHash() == tx.GetHash())
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_selection_cache)
+{
+    CScript scriptPubKey = CScript() << OP_1;
+    CBlockTemplate *pblocktemplate;
+    std::list<CTransaction> removed;
+
+    LOCK(cs_main);
+    Checkpoints::fEnabled = false;
+    mempool.clear();
+    // Only fees decide, so a tx below the relay fee stays out
+    mapArgs["-blockprioritysize"] = "0";
+
+    CTransaction tx0 = SpendCoinbase(1), tx1 = SpendCoinbase(2), tx2 = SpendCoinbase(3);
+    mempool.addUnchecked(tx0.GetHash(), CTxMemPoolEntry(tx0, 1000000, GetTime(), 111.0, 11));
+    mempool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 0, GetTime(), 111.0, 11));
+
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(TemplateHas(pblocktemplate, tx0));
+    delete pblocktemplate;
+
+    // Nothing changed: the previous selection is reused as is
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(std::string(pszLastBlockSelection), "cached");
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    delete pblocktemplate;
+
+    // A fee delta makes the skipped tx worth including
+    mempool.PrioritiseTransaction(tx1.GetHash(), tx1.GetHash().ToString(), 0.0, 1000000);
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(std::string(pszLastBlockSelection), "incremental");
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(TemplateHas(pblocktemplate, tx1));
+    delete pblocktemplate;
+
+    // New arrivals are added to the previous selection
+    mempool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 1000000, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(std::string(pszLastBlockSelection), "incremental");
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 4);
+    BOOST_CHECK(TemplateHas(pblocktemplate, tx2));
+    delete pblocktemplate;
+
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(std::string(pszLastBlockSelection), "cached");
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 4);
+    delete pblocktemplate;
+
+    // A selected tx left the mempool: start over
+    mempool.remove(tx0, removed);
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(std::string(pszLastBlockSelection), "full");
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(!TemplateHas(pblocktemplate, tx0));
+    delete pblocktemplate;
+
+    mempool.clear();
+    mapArgs.erase("-blockprioritysize");
+    Checkpoints::fEnabled = true;
+}
+
+BOOST_AUTO_TEST_CASE(stake_template_builder)
+{
+    CScript scriptPubKey = CScript() << OP_1;
+    CBlockTemplate *pblocktemplate;
+
+    LOCK(cs_main);
+    Checkpoints::fEnabled = false;
+    mempool.clear();
+
+    CTransaction tx0 = SpendCoinbase(4), tx1 = SpendCoinbase(5);
+    mempool.addUnchecked(tx0.GetHash(), CTxMemPoolEntry(tx0, 1000000, GetTime(), 111.0, 11));
+    mempool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000000, GetTime(), 111.0, 11));
+
+    // What the builder prepared between kernel hits is only copied
+    UpdateTxSelectionCache();
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(std::string(pszLastBlockSelection), "cached");
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(TemplateHas(pblocktemplate, tx0));
+    BOOST_CHECK(TemplateHas(pblocktemplate, tx1));
+    delete pblocktemplate;
+
+    // A stale preparation is brought up to date again
+    mempool.PrioritiseTransaction(tx0.GetHash(), tx0.GetHash().ToString(), 0.0, 1000000);
+    UpdateTxSelectionCache();
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(std::string(pszLastBlockSelection), "cached");
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    delete pblocktemplate;
+
+    mempool.clear();
+    Checkpoints::fEnabled = true;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
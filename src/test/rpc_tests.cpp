@@ -11,7 +11,9 @@
 #include "util.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 #include <univalue.h>
 
@@ -264,4 +266,76 @@ BOOST_AUTO_TEST_CASE(rpc_ban)
     BOOST_CHECK_EQUAL(adr.get_str(), "2001:4d48:ac57:400:cacf:e9ff:fe1d:9c63/128");
 }
 
+BOOST_AUTO_TEST_CASE(rpc_stats)
+{
+    if (RPCIsInWarmup(NULL))
+        SetRPCWarmupFinished();
+
+    UniValue params(UniValue::VARR);
+    BOOST_CHECK_NO_THROW(tableRPC.execute("help", params));
+    params.push_back("help");
+    params.push_back("extra");
+    BOOST_CHECK_THROW(tableRPC.execute("help", params), UniValue);
+
+    UniValue r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("getrpcstats"));
+    UniValue help = find_value(find_value(r, "methods").get_obj(), "help");
+    BOOST_CHECK_EQUAL(find_value(help, "calls").get_int(), 2);
+    BOOST_CHECK_EQUAL(find_value(help, "errors").get_int(), 1);
+    BOOST_CHECK(find_value(help, "p50_ms").get_real() <= find_value(help, "max_ms").get_real());
+
+    const UniValue& histogram = find_value(help, "histogram").get_array();
+    int nCalls = 0;
+    for (unsigned int i = 0; i < histogram.size(); i++)
+        nCalls += find_value(histogram[i], "calls").get_int();
+    BOOST_CHECK_EQUAL(nCalls, 2);
+}
+
+static bool RunOnNewThread(boost::thread_group* threads, const boost::function<void(void)>& task)
+{
+    threads->create_thread(task);
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch_order)
+{
+    if (RPCIsInWarmup(NULL))
+        SetRPCWarmupFinished();
+
+    // Runs of threadSafe calls, some failing, split by calls that aren't
+    UniValue vReq(UniValue::VARR);
+    for (int i = 0; i < 60; i++) {
+        UniValue req(UniValue::VOBJ);
+        UniValue params(UniValue::VARR);
+        if (i % 17 == 16) {
+            req.push_back(Pair("method", "nosuchmethod"));
+        } else if (i % 3 == 0) {
+            req.push_back(Pair("method", "getblockcount"));
+        } else {
+            req.push_back(Pair("method", "getblockhash"));
+            params.push_back(i % 3 == 1 ? 0 : 1000 + i);
+        }
+        req.push_back(Pair("params", params));
+        req.push_back(Pair("id", i));
+        vReq.push_back(req);
+    }
+
+    JSONRequest jreq;
+    UniValue serial;
+    BOOST_CHECK(serial.read(JSONRPCExecBatch(jreq, vReq)));
+    BOOST_CHECK_EQUAL(serial.size(), vReq.size());
+
+    for (int nHelpers = 1; nHelpers <= 4; nHelpers++) {
+        boost::thread_group threads;
+        UniValue parallel;
+        BOOST_CHECK(parallel.read(JSONRPCExecBatch(jreq, vReq, boost::bind(&RunOnNewThread, &threads, _1), nHelpers)));
+        threads.join_all();
+        // Every response in the slot of its request, the same as one at a time
+        BOOST_REQUIRE_EQUAL(parallel.size(), vReq.size());
+        for (unsigned int i = 0; i < parallel.size(); i++)
+            BOOST_CHECK_EQUAL(find_value(parallel[i], "id").get_int(), (int)i);
+        BOOST_CHECK_EQUAL(parallel.write(), serial.write());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
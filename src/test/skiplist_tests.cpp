@@ -100,4 +100,43 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(chainsnapshot_test)
+{
+    // A main chain of 10000 blocks and a branch off block 4999
+    std::vector<CBlockIndex> vBlocksMain(10000);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].BuildSkip();
+    }
+    std::vector<CBlockIndex> vBlocksSide(1000);
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vBlocksSide[i].nHeight = i + 5000;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[4999];
+        vBlocksSide[i].BuildSkip();
+    }
+
+    CChain chain;
+    chain.SetTip(&vBlocksMain.back());
+    CChainSnapshot snapshot(&vBlocksMain.back());
+    BOOST_CHECK_EQUAL(snapshot.Height(), chain.Height());
+    BOOST_CHECK(snapshot[-1] == NULL);
+    BOOST_CHECK(snapshot[chain.Height() + 1] == NULL);
+    for (int n=0; n<1000; n++) {
+        int r = insecure_rand() % vBlocksMain.size();
+        BOOST_CHECK(snapshot[r] == chain[r]);
+        BOOST_CHECK(snapshot.Next(&vBlocksMain[r]) == chain.Next(&vBlocksMain[r]));
+        r = insecure_rand() % vBlocksSide.size();
+        BOOST_CHECK(!snapshot.Contains(&vBlocksSide[r]));
+        BOOST_CHECK(snapshot.Next(&vBlocksSide[r]) == NULL);
+    }
+
+    // The snapshot keeps its view when the chain switches to the branch
+    chain.SetTip(&vBlocksSide.back());
+    BOOST_CHECK(snapshot.Contains(&vBlocksMain[7000]));
+    BOOST_CHECK(!chain.Contains(&vBlocksMain[7000]));
+    BOOST_CHECK(snapshot.Tip() == &vBlocksMain.back());
+    BOOST_CHECK(CChainSnapshot(NULL).Height() == -1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -45,8 +45,10 @@ struct TestingSetup {
         mapArgs["-printstakemodifier"] = "1";
         InitializeDBTest(pathTemp);
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadMempoolScriptCheck);
+        }
         RegisterNodeSignals(GetNodeSignals());
     }
     ~TestingSetup()
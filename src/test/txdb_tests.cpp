@@ -0,0 +1,134 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txdb.h"
+
+#include "chain.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+/** A chain of nBlocks version 1 headers, keyed by their real hashes */
+static void MakeChain(int nBlocks, std::vector<uint256>& vHashes, std::vector<CBlockIndex>& vIndex)
+{
+    vHashes.resize(nBlocks);
+    vIndex.resize(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        CBlock block;
+        block.nVersion = 1;
+        block.hashPrevBlock = i ? vHashes[i - 1] : uint256();
+        block.hashMerkleRoot = GetRandHash();
+        block.nTime = 1500000000 + 60 * i;
+        block.nBits = 0x1e0ffff0;
+        block.nNonce = i;
+        block.nBirthdayA = i;
+        block.nBirthdayB = 2 * i;
+        vHashes[i] = block.GetHash();
+        vIndex[i] = CBlockIndex(block);
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nStatus = BLOCK_VALID_TREE;
+        vIndex[i].nTx = 1;
+    }
+}
+
+static std::string Serialized(const CBlockIndex* pindex)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CDiskBlockIndex(pindex);
+    return ss.str();
+}
+
+/** Run LoadBlockIndexGuts on nThreads loaders against an empty mapBlockIndex */
+static std::map<uint256, std::string> LoadIndex(CBlockTreeDB& db, int nThreads, bool fExpectLoaded = true)
+{
+    std::map<uint256, std::string> mapLoaded;
+    const int nOldThreads = nScriptCheckThreads;
+    nScriptCheckThreads = nThreads;
+    BlockMap mapSaved;
+    mapSaved.swap(mapBlockIndex);
+    BOOST_CHECK_EQUAL(db.LoadBlockIndexGuts(), fExpectLoaded);
+    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex) {
+        BOOST_CHECK(item.second->GetBlockHash() == item.first);
+        mapLoaded[item.first] = Serialized(item.second);
+        delete item.second;
+    }
+    mapBlockIndex.swap(mapSaved);
+    nScriptCheckThreads = nOldThreads;
+    return mapLoaded;
+}
+
+BOOST_AUTO_TEST_CASE(block_index_parallel_load)
+{
+    LOCK(cs_main);
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+    MakeChain(600, vHashes, vIndex);
+    std::vector<const CBlockIndex*> vBlocks;
+    std::map<uint256, std::string> mapExpected;
+    BOOST_FOREACH (const CBlockIndex& index, vIndex) {
+        vBlocks.push_back(&index);
+        mapExpected[index.GetBlockHash()] = Serialized(&index);
+    }
+    CBlockTreeDB db(1 << 20, true);
+    BOOST_CHECK(db.WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vBlocks));
+
+    // A serial walk over the whole key space, then partitions that split the
+    // first key byte unevenly
+    std::map<uint256, std::string> mapSerial = LoadIndex(db, 1);
+    BOOST_CHECK_EQUAL(mapSerial.size(), vIndex.size());
+    BOOST_CHECK(mapSerial == mapExpected);
+    const int vThreads[] = {2, 3, 7, 16};
+    BOOST_FOREACH (int nThreads, vThreads)
+        BOOST_CHECK(LoadIndex(db, nThreads) == mapSerial);
+}
+
+BOOST_AUTO_TEST_CASE(block_index_key_hash)
+{
+    LOCK(cs_main);
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+    MakeChain(50, vHashes, vIndex);
+    std::vector<const CBlockIndex*> vBlocks;
+    BOOST_FOREACH (const CBlockIndex& index, vIndex)
+        vBlocks.push_back(&index);
+    CBlockTreeDB db(1 << 20, true);
+    BOOST_CHECK(db.WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vBlocks));
+
+    // The loader takes the hash from the key, it has to be the hash of the
+    // header stored under it
+    mapArgs["-checkblockindexhash"] = "1";
+    std::map<uint256, std::string> mapLoaded = LoadIndex(db, 2);
+    BOOST_CHECK_EQUAL(mapLoaded.size(), vIndex.size());
+    BOOST_FOREACH (const PAIRTYPE(uint256, std::string) & item, mapLoaded) {
+        CDataStream ss(item.second.data(), item.second.data() + item.second.size(), SER_DISK, CLIENT_VERSION);
+        CDiskBlockIndex diskindex;
+        ss >> diskindex;
+        BOOST_CHECK(diskindex.GetBlockHash() == item.first);
+    }
+
+    // An entry stored under another hash is loaded under that key unless
+    // the check is on
+    uint256 hashWrong = GetRandHash();
+    CBlockIndex indexWrong = vIndex.back();
+    indexWrong.phashBlock = &hashWrong;
+    BOOST_CHECK(db.WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, std::vector<const CBlockIndex*>(1, &indexWrong)));
+    BOOST_CHECK(LoadIndex(db, 2, false).empty());
+    mapArgs.erase("-checkblockindexhash");
+    BOOST_CHECK_EQUAL(LoadIndex(db, 2).count(hashWrong), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -12,10 +12,13 @@
 #include "utilstrencodings.h"
 #include "utilmoneystr.h"
 
+#include <deque>
 #include <stdint.h>
 #include <vector>
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -425,4 +428,109 @@ BOOST_AUTO_TEST_CASE(test_FormatSubVersion)
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments),std::string("/Test:0.9.99(comment1)/"));
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments2),std::string("/Test:0.9.99(comment1; comment2)/"));
 }
+
+BOOST_AUTO_TEST_CASE(util_LogRing)
+{
+    // A full ring refuses messages until the consumer makes room
+    CLogRing ring(4);
+    int64_t nTime;
+    std::string str;
+    BOOST_CHECK(!ring.Ready());
+    BOOST_CHECK(!ring.Pop(nTime, str));
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(ring.Push(i, strprintf("%d", i)));
+    BOOST_CHECK(!ring.Push(4, "4"));
+    BOOST_CHECK(ring.Ready());
+    BOOST_CHECK(ring.Pop(nTime, str));
+    BOOST_CHECK_EQUAL(nTime, 0);
+    BOOST_CHECK_EQUAL(str, "0");
+    BOOST_CHECK(ring.Push(5, "5"));
+    BOOST_CHECK(!ring.Push(6, "6"));
+
+    // Messages keep their order over many laps around the ring
+    std::deque<int> expected;
+    expected.push_back(1);
+    expected.push_back(2);
+    expected.push_back(3);
+    expected.push_back(5);
+    for (int i = 6; i < 200; i++) {
+        // Fill up on some rounds, drain on others
+        if (i % 7 < 4) {
+            BOOST_CHECK_EQUAL(ring.Push(i, strprintf("%d", i)), expected.size() < 4);
+            if (expected.size() < 4)
+                expected.push_back(i);
+        } else {
+            BOOST_CHECK_EQUAL(ring.Pop(nTime, str), !expected.empty());
+            if (!expected.empty()) {
+                BOOST_CHECK_EQUAL(nTime, expected.front());
+                BOOST_CHECK_EQUAL(str, strprintf("%d", expected.front()));
+                expected.pop_front();
+            }
+        }
+    }
+}
+
+static void PushLogMessages(CLogRing* pring, int nProducer, int nMessages)
+{
+    for (int i = 0; i < nMessages; i++) {
+        while (!pring->Push(nProducer, strprintf("%d", i)))
+            boost::this_thread::yield();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(util_LogRing_producers)
+{
+    // Concurrent producers through a small ring: nothing is lost and each
+    // producer's messages come out in the order it pushed them
+    const int nProducers = 4;
+    const int nMessages = 5000;
+    CLogRing ring(16);
+    boost::thread_group threads;
+    for (int i = 0; i < nProducers; i++)
+        threads.create_thread(boost::bind(&PushLogMessages, &ring, i, nMessages));
+
+    std::vector<int> vNext(nProducers, 0);
+    int nPopped = 0;
+    while (nPopped < nProducers * nMessages) {
+        int64_t nProducer;
+        std::string str;
+        if (!ring.Pop(nProducer, str)) {
+            boost::this_thread::yield();
+            continue;
+        }
+        BOOST_REQUIRE(nProducer >= 0 && nProducer < nProducers);
+        BOOST_CHECK_EQUAL(str, strprintf("%d", vNext[nProducer]));
+        vNext[nProducer]++;
+        nPopped++;
+    }
+    threads.join_all();
+    BOOST_CHECK(!ring.Ready());
+}
+
+BOOST_AUTO_TEST_CASE(util_LogRateAccept)
+{
+    int nLimitSaved = nLogRateLimit;
+
+    // The budget of each category is used up, then starts over the next second
+    nLogRateLimit = 3;
+    for (int i = 0; i < 3; i++) {
+        BOOST_CHECK(LogRateAccept("utiltest_a", 100));
+        BOOST_CHECK(LogRateAccept("utiltest_b", 100));
+    }
+    BOOST_CHECK(!LogRateAccept("utiltest_a", 100));
+    BOOST_CHECK(!LogRateAccept("utiltest_a", 100));
+    BOOST_CHECK(!LogRateAccept("utiltest_b", 100));
+    BOOST_CHECK(LogRateAccept("utiltest_a", 101));
+    BOOST_CHECK(LogRateAccept("utiltest_a", 101));
+    BOOST_CHECK(LogRateAccept("utiltest_a", 101));
+    BOOST_CHECK(!LogRateAccept("utiltest_a", 101));
+
+    // No limit at all
+    nLogRateLimit = 0;
+    for (int i = 0; i < 10; i++)
+        BOOST_CHECK(LogRateAccept("utiltest_a", 101));
+
+    nLogRateLimit = nLimitSaved;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
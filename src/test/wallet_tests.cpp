@@ -4,12 +4,21 @@
 
 #include "wallet.h"
 
+#include "base58.h"
+#include "main.h"
+#include "random.h"
+#include "txmempool.h"
+#include "utiltime.h"
+#include "walletdb.h"
+
+#include <algorithm>
 #include <set>
 #include <stdint.h>
 #include <utility>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 #include <boost/test/unit_test.hpp>
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
@@ -332,6 +341,683 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+static void add_bnb_coin(vector<CInputCoin>& vPool, const CAmount& nValue)
+{
+    vPool.push_back(CInputCoin(NULL, vPool.size(), nValue, nValue));
+}
+
+BOOST_AUTO_TEST_CASE(bnb_search_test)
+{
+    vector<CInputCoin> vPool, vSelection;
+    CAmount nValueRet;
+
+    // with no coins there is nothing to find
+    BOOST_CHECK(!SelectCoinsBnB(vPool, 1 * CENT, 0, vSelection, nValueRet));
+
+    add_bnb_coin(vPool, 4 * CENT);
+    add_bnb_coin(vPool, 3 * CENT);
+    add_bnb_coin(vPool, 2 * CENT);
+    add_bnb_coin(vPool, 1 * CENT);
+
+    // exact matches
+    BOOST_CHECK(SelectCoinsBnB(vPool, 1 * CENT, 0, vSelection, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
+    BOOST_CHECK_EQUAL(vSelection.size(), 1U);
+    BOOST_CHECK(SelectCoinsBnB(vPool, 5 * CENT, 0, vSelection, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vPool, 10 * CENT, 0, vSelection, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+    BOOST_CHECK_EQUAL(vSelection.size(), 4U);
+
+    // more than the pool holds
+    BOOST_CHECK(!SelectCoinsBnB(vPool, 11 * CENT, 0, vSelection, nValueRet));
+
+    // 4 and 2 cannot make 5 exactly, but 6 is inside a 1 cent window
+    vPool.clear();
+    add_bnb_coin(vPool, 4 * CENT);
+    add_bnb_coin(vPool, 2 * CENT);
+    BOOST_CHECK(!SelectCoinsBnB(vPool, 5 * CENT, 0, vSelection, nValueRet));
+    BOOST_CHECK(SelectCoinsBnB(vPool, 5 * CENT, 1 * CENT, vSelection, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 6 * CENT);
+
+    // the smallest excess wins: 7 + 3 beats 8 + 4 inside a 3 cent window
+    vPool.clear();
+    add_bnb_coin(vPool, 8 * CENT);
+    add_bnb_coin(vPool, 7 * CENT);
+    add_bnb_coin(vPool, 4 * CENT);
+    add_bnb_coin(vPool, 3 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vPool, 10 * CENT, 3 * CENT, vSelection, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+
+    // the selection reports the raw value, not the effective one
+    vPool.clear();
+    vPool.push_back(CInputCoin(NULL, 0, 5 * CENT, 4 * CENT));
+    BOOST_CHECK(SelectCoinsBnB(vPool, 4 * CENT, 0, vSelection, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5 * CENT);
+
+    // an odd target from even coins has no solution; the search stops at the budget
+    vPool.clear();
+    for (int i = 100; i > 0; i--)
+        add_bnb_coin(vPool, 1000 + 2 * i);
+    BOOST_CHECK(!SelectCoinsBnB(vPool, 50001, 0, vSelection, nValueRet, 1000));
+}
+
+BOOST_AUTO_TEST_CASE(bnb_large_wallet_test)
+{
+    // A payout-style pool of many small coins: the search must stay bounded and any match be exact
+    seed_insecure_rand(true);
+    const CAmount nTarget = 50 * COIN + 12345;
+    const CAmount nCostOfChange = 100000;
+    vector<CInputCoin> vPool, vSelection;
+    for (size_t i = 0; i < 2000; i++)
+        add_bnb_coin(vPool, CENT + insecure_rand() % COIN);
+
+    CAmount nValueRet;
+    std::sort(vPool.begin(), vPool.end(), std::greater<CInputCoin>());
+    if (SelectCoinsBnB(vPool, nTarget, nCostOfChange, vSelection, nValueRet)) {
+        BOOST_CHECK(nValueRet >= nTarget);
+        BOOST_CHECK(nValueRet <= nTarget + nCostOfChange);
+        CAmount nTotal = 0;
+        BOOST_FOREACH (const CInputCoin& coin, vSelection)
+            nTotal += coin.nValue;
+        BOOST_CHECK_EQUAL(nTotal, nValueRet);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(history_counts_tests)
+{
+    // Prefix sums against a plain vector, with the tree growing as positions come in
+    seed_insecure_rand(true);
+    CHistoryCounts counts;
+    vector<int> vCount;
+    BOOST_CHECK_EQUAL(counts.Prefix(10), 0);
+    for (int i = 0; i < 2000; i++) {
+        int64_t nPos = insecure_rand() % (i + 1);
+        int nDelta = insecure_rand() % 5;
+        if (nPos < (int64_t)vCount.size() && vCount[nPos] > 0 && insecure_rand() % 3 == 0)
+            nDelta = -vCount[nPos];
+        counts.Add(nPos, nDelta);
+        if (nPos >= (int64_t)vCount.size())
+            vCount.resize(nPos + 1, 0);
+        vCount[nPos] += nDelta;
+
+        int64_t nCheck = insecure_rand() % (vCount.size() + 5);
+        int64_t nExpected = 0;
+        for (int64_t j = 0; j <= nCheck && j < (int64_t)vCount.size(); j++)
+            nExpected += vCount[j];
+        BOOST_CHECK_EQUAL(counts.Prefix(nCheck), nExpected);
+    }
+    int64_t nTotal = 0;
+    BOOST_FOREACH (int n, vCount)
+        nTotal += n;
+    BOOST_CHECK_EQUAL(counts.Total(), nTotal);
+    BOOST_CHECK_EQUAL(counts.Prefix(counts.Size() - 1), nTotal);
+
+    counts.Clear();
+    BOOST_CHECK_EQUAL(counts.Total(), 0);
+    BOOST_CHECK_EQUAL(counts.Size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(archived_tx_spends_test)
+{
+    CWallet w;
+    LOCK(w.cs_wallet);
+
+    CMutableTransaction txParent;
+    txParent.vout.resize(2);
+    txParent.vout[0].nValue = 5 * COIN;
+    txParent.vout[1].nValue = 3 * COIN;
+    CWalletTx wtxParent(&w, txParent);
+    w.AddToWallet(wtxParent, true, NULL);
+    const uint256 hashParent = wtxParent.GetHash();
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(hashParent, 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 4 * COIN;
+    CArchivedWalletTx atx(CWalletTx(&w, txChild), 1);
+    atx.hash = CTransaction(txChild).GetHash();
+    BOOST_CHECK_EQUAL(atx.vSpent.size(), 1U);
+
+    // Write and read back the archive record as a restart would
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << atx;
+    CArchivedWalletTx atxLoaded;
+    ss >> atxLoaded;
+    atxLoaded.hash = atx.hash;
+    BOOST_CHECK_EQUAL(atxLoaded.nVersion, CArchivedWalletTx::CURRENT_VERSION);
+    BOOST_CHECK(atxLoaded.vSpent == atx.vSpent);
+
+    BOOST_CHECK(!w.IsSpent(hashParent, 0));
+    BOOST_CHECK(w.LoadArchivedTx(atxLoaded));
+    BOOST_CHECK(w.IsSpent(hashParent, 0));
+    BOOST_CHECK(!w.IsSpent(hashParent, 1));
+    BOOST_CHECK(!w.LoadArchivedTx(atxLoaded));
+    BOOST_CHECK(w.IsSpent(hashParent, 0));
+
+    // Nothing is left over once the record was read
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(atxLoaded.vout == atx.vout);
+}
+
+BOOST_AUTO_TEST_CASE(spend_state_tests)
+{
+    CWallet w;
+    w.strWalletFile = "spend_state_tests.dat";
+    CWalletDB wdb(w.strWalletFile, "crw");
+    LOCK2(cs_main, w.cs_wallet);
+
+    CMutableTransaction txParent;
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = 5 * COIN;
+    CWalletTx wtxParent(&w, txParent);
+    w.AddToWallet(wtxParent, true, NULL);
+    const uint256 hashParent = wtxParent.GetHash();
+    BOOST_CHECK(!w.IsSpent(hashParent, 0));
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(hashParent, 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 4 * COIN;
+    const CTransaction child(txChild);
+    std::list<CTransaction> removed;
+
+    // Unconfirmed: spent while the child is in the mempool
+    mempool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, 0, 0, 0.0, 1));
+    CWalletTx wtxChild(&w, txChild);
+    w.AddToWallet(wtxChild, false, &wdb);
+    BOOST_CHECK(w.IsSpent(hashParent, 0));
+    mempool.remove(child, removed);
+    BOOST_CHECK(!w.IsSpent(hashParent, 0));
+    mempool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, 0, 0, 0.0, 1));
+    BOOST_CHECK(w.IsSpent(hashParent, 0));
+
+    // Confirmed: the state holds without consulting the mempool
+    wtxChild.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtxChild.nIndex = 0;
+    w.AddToWallet(wtxChild, false, &wdb);
+    w.mapWallet[child.GetHash()].fMerkleVerified = true;
+    mempool.remove(child, removed);
+    BOOST_CHECK(w.IsSpent(hashParent, 0));
+    BOOST_CHECK(w.IsSpent(hashParent, 0));
+
+    // Disconnected: synced again with a block off the active chain
+    CBlockIndex indexStale;
+    uint256 hashStale = GetRandHash();
+    indexStale.phashBlock = &hashStale;
+    mapBlockIndex[hashStale] = &indexStale;
+    wtxChild.hashBlock = hashStale;
+    w.AddToWallet(wtxChild, false, &wdb);
+    BOOST_CHECK(!w.IsSpent(hashParent, 0)); // conflicted: neither in a block nor in the mempool
+    mempool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, 0, 0, 0.0, 1));
+    BOOST_CHECK(w.IsSpent(hashParent, 0)); // back in the mempool
+    mempool.remove(child, removed);
+    BOOST_CHECK(!w.IsSpent(hashParent, 0));
+
+    mapBlockIndex.erase(hashStale);
+}
+
+BOOST_AUTO_TEST_CASE(multisend_window_test)
+{
+    {
+        CWallet w;
+        w.strWalletFile = "multisend_window_test.dat";
+        CWalletDB wdb(w.strWalletFile, "crw");
+        LOCK2(cs_main, w.cs_wallet);
+        CKey key, keyDest;
+        key.MakeNewKey(true);
+        keyDest.MakeNewKey(true);
+        w.AddKeyPubKey(key, key.GetPubKey());
+        w.vMultiSend.push_back(make_pair(CBitcoinAddress(keyDest.GetPubKey().GetID()).ToString(), 10));
+
+        // Switching MultiSend on leaves stakes that matured earlier alone
+        w.nLastMultiSendHeight = 0;
+        w.setMultiSendEnabled();
+        BOOST_CHECK(w.isMultiSendEnabled());
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, chainActive.Height());
+        CWalletMaintenanceStats stats;
+        BOOST_CHECK(!w.MultiSend(vector<COutput>(), GetTimeMillis() + 1000, stats));
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, chainActive.Height());
+
+        // A matured stake that cannot be forwarded keeps the window where it was
+        CMutableTransaction txStake;
+        txStake.vin.resize(1);
+        txStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        txStake.vout.resize(2);
+        txStake.vout[0].SetEmpty();
+        txStake.vout[1] = CTxOut(10 * COIN, GetScriptForDestination(key.GetPubKey().GetID()));
+        CWalletTx wtxStake(&w, txStake);
+        BOOST_REQUIRE(wtxStake.IsCoinStake());
+        vector<COutput> vCoins;
+        vCoins.push_back(COutput(&wtxStake, 1, Params().GetCoinMaturity() + 1, true));
+
+        // Any height below the tip, other than the unset 0
+        const int nOpen = -1;
+        w.nLastMultiSendHeight = nOpen;
+        BOOST_CHECK(!w.MultiSend(vCoins, GetTimeMillis() + 1000, stats));
+        BOOST_CHECK(!stats.strLastError.empty());
+        BOOST_CHECK_EQUAL(stats.nMultiSendTxs, 0);
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, nOpen);
+
+        // With nothing left to forward the window moves to the tip
+        BOOST_CHECK(!w.MultiSend(vector<COutput>(), GetTimeMillis() + 1000, stats));
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, chainActive.Height());
+
+        // A stake that keeps failing holds the window for a few passes only
+        w.nLastMultiSendHeight = nOpen;
+        for (int i = 1; i < MULTISEND_MAX_ATTEMPTS; i++) {
+            BOOST_CHECK(!w.MultiSend(vCoins, GetTimeMillis() + 1000, stats));
+            BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, nOpen);
+        }
+        BOOST_CHECK(!w.MultiSend(vCoins, GetTimeMillis() + 1000, stats));
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, chainActive.Height());
+        BOOST_CHECK_EQUAL(stats.nMultiSendTxs, 0);
+
+        // Once the window moved, a later failure counts from the start again
+        w.nLastMultiSendHeight = nOpen;
+        BOOST_CHECK(!w.MultiSend(vCoins, GetTimeMillis() + 1000, stats));
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, nOpen);
+
+        // Turning it off and on again restarts the window at the tip
+        w.nLastMultiSendHeight = nOpen;
+        w.setMultiSendEnabled();
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, nOpen);
+        w.setMultiSendDisabled();
+        w.setMultiSendEnabled();
+        BOOST_CHECK_EQUAL(w.nLastMultiSendHeight, chainActive.Height());
+    }
+    BOOST_CHECK(bitdb.RemoveDb("multisend_window_test.dat"));
+}
+
+BOOST_AUTO_TEST_CASE(pending_txs_test)
+{
+    {
+        CWallet w("pending_txs_test.dat");
+        CWalletDB wdb(w.strWalletFile);
+        LOCK2(cs_main, w.cs_wallet);
+
+        // Mempool transactions received a minute apart join when synced without a block
+        vector<uint256> vHashes;
+        for (int i = 0; i < 6; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vout.push_back(CTxOut(COIN, CScript() << OP_1));
+            const CTransaction txConst(tx);
+            mempool.addUnchecked(txConst.GetHash(), CTxMemPoolEntry(txConst, 0, 0, 0.0, 1));
+            CWalletTx wtx(&w, tx);
+            wtx.nTimeReceived = 1500000000 + 60 * i;
+            BOOST_CHECK(w.AddToWallet(wtx, false, &wdb));
+            vHashes.push_back(wtx.GetHash());
+            BOOST_CHECK(w.IsPendingTx(vHashes.back()));
+        }
+
+        // Resending stops at the first transaction too young for it
+        vector<uint256> vResent = w.ResendWalletTransactionsBefore(1500000000 + 60 * 3);
+        BOOST_CHECK(vResent == vector<uint256>(vHashes.begin(), vHashes.begin() + 3));
+        BOOST_CHECK(w.ResendWalletTransactionsBefore(1500000000).empty());
+        BOOST_CHECK_EQUAL(w.ResendWalletTransactionsBefore(1500000000 + 60 * 6).size(), 6U);
+
+        // Confirmed: leaves, and joins again when the block is disconnected
+        CWalletTx wtxConfirmed = w.mapWallet[vHashes[0]];
+        wtxConfirmed.hashBlock = chainActive.Tip()->GetBlockHash();
+        wtxConfirmed.nIndex = 0;
+        BOOST_CHECK(w.AddToWallet(wtxConfirmed, false, &wdb));
+        BOOST_CHECK(!w.IsPendingTx(vHashes[0]));
+        BOOST_CHECK(w.AddToWallet(CWalletTx(&w, w.mapWallet[vHashes[0]]), false, &wdb));
+        BOOST_CHECK(w.IsPendingTx(vHashes[0]));
+
+        // Conflicted: loading a spend of a transaction a block conflicts with marks it too
+        CMutableTransaction txParent;
+        txParent.vin.resize(1);
+        txParent.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        txParent.vout.push_back(CTxOut(COIN, CScript() << OP_1));
+        CWalletTx wtxParent(&w, txParent);
+        wtxParent.hashBlock = chainActive.Tip()->GetBlockHash();
+        wtxParent.nIndex = -1;
+        BOOST_CHECK(w.AddToWallet(wtxParent, false, &wdb));
+        CMutableTransaction txChild;
+        txChild.vin.resize(1);
+        txChild.vin[0].prevout = COutPoint(wtxParent.GetHash(), 0);
+        txChild.vout.push_back(CTxOut(COIN / 2, CScript() << OP_1));
+        const CTransaction child(txChild);
+        mempool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, 0, 0, 0.0, 1));
+        BOOST_CHECK(w.AddToWallet(CWalletTx(&w, txChild), false, &wdb));
+        BOOST_CHECK(w.IsPendingTx(child.GetHash()));
+        BOOST_CHECK(w.AddToWallet_Legacy(CWalletTx(w.mapWallet[child.GetHash()]), true, &wdb));
+        BOOST_CHECK_EQUAL(w.mapWallet[child.GetHash()].nIndex, -1);
+        BOOST_CHECK(!w.IsPendingTx(child.GetHash()));
+
+        // Erased: leaves
+        w.EraseFromWallet(vHashes[1]);
+        BOOST_CHECK(!w.IsPendingTx(vHashes[1]));
+
+        // Archived: leaves, even if it never synced as confirmed. Bury a block
+        // deep enough for archiving; the chain is restored at the end.
+        CBlockIndex* pindexOldTip = chainActive.Tip();
+        const int nBury = Params().GetMaxReorganizationDepth() + 1;
+        vector<uint256> vBuryHashes(nBury);
+        vector<CBlockIndex> vBury(nBury);
+        for (int i = 0; i < nBury; i++) {
+            vBuryHashes[i] = GetRandHash();
+            vBury[i].phashBlock = &vBuryHashes[i];
+            vBury[i].pprev = i ? &vBury[i - 1] : pindexOldTip;
+            vBury[i].nHeight = vBury[i].pprev->nHeight + 1;
+            mapBlockIndex[vBuryHashes[i]] = &vBury[i];
+        }
+        chainActive.SetTip(&vBury.back());
+        CWalletTx& wtxBuried = w.mapWallet[vHashes[2]];
+        wtxBuried.hashBlock = vBuryHashes[0];
+        wtxBuried.nIndex = 0;
+        wtxBuried.fMerkleVerified = true;
+        const int nOldArchiveDepth = nWalletArchiveDepth;
+        nWalletArchiveDepth = 1;
+        BOOST_CHECK_EQUAL(w.ArchiveSpentTransactions(), 1);
+        BOOST_CHECK(!w.IsPendingTx(vHashes[2]));
+        BOOST_CHECK(!w.mapWallet.count(vHashes[2]));
+        nWalletArchiveDepth = nOldArchiveDepth;
+        chainActive.SetTip(pindexOldTip);
+        BOOST_FOREACH (const uint256& hash, vBuryHashes)
+            mapBlockIndex.erase(hash);
+
+        // Only what is left pending is resent
+        vResent = w.ResendWalletTransactionsBefore(1500000000 + 60 * 6);
+        BOOST_CHECK_EQUAL(vResent.size(), 4U);
+        BOOST_CHECK(std::find(vResent.begin(), vResent.end(), vHashes[0]) != vResent.end());
+        BOOST_CHECK(std::find(vResent.begin(), vResent.end(), child.GetHash()) == vResent.end());
+
+        mempool.clear();
+    }
+    BOOST_CHECK(bitdb.RemoveDb("pending_txs_test.dat"));
+}
+
+//! Entries listtransactions shows for wtx over all accounts and spendable outputs
+static int ListedEntries(const CWalletTx& wtx)
+{
+    list<COutputEntry> listReceived;
+    list<COutputEntry> listSent;
+    CAmount nFee;
+    string strSentAccount;
+    wtx.GetAmounts(listReceived, listSent, nFee, strSentAccount, ISMINE_SPENDABLE);
+    return listSent.size() + (wtx.GetDepthInMainChain() >= 0 ? listReceived.size() : 0);
+}
+
+//! SeekHistory against a newest-first walk over the whole wallet, for every nSkip
+static void CheckSeekHistory(CWallet& w)
+{
+    vector<pair<int64_t, int> > vWalk;
+    int nTotal = 0;
+    for (CWallet::TxItems::const_reverse_iterator it = w.wtxOrdered.rbegin(); it != w.wtxOrdered.rend(); ++it) {
+        if (!it->second.first)
+            continue;
+        int nEntries = ListedEntries(*it->second.first);
+        vWalk.push_back(make_pair(it->first, nEntries));
+        nTotal += nEntries;
+    }
+
+    for (int nSkip = 0; nSkip <= nTotal + 1; nSkip++) {
+        int64_t nOrderPos;
+        int nSkipAtPos;
+        BOOST_REQUIRE(w.SeekHistory(nSkip, nOrderPos, nSkipAtPos));
+        if (nSkip >= nTotal) {
+            BOOST_CHECK_EQUAL(nOrderPos, -1);
+            continue;
+        }
+        int nAbove = 0, nAtPos = 0;
+        for (size_t i = 0; i < vWalk.size(); i++) {
+            if (vWalk[i].first > nOrderPos)
+                nAbove += vWalk[i].second;
+            else if (vWalk[i].first == nOrderPos)
+                nAtPos = vWalk[i].second;
+        }
+        BOOST_CHECK_EQUAL(nAbove + nSkipAtPos, nSkip);
+        BOOST_CHECK(nSkipAtPos >= 0 && nSkipAtPos < nAtPos);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(history_seek_test)
+{
+    CWallet w;
+    w.strWalletFile = "history_seek_test.dat";
+    CWalletDB wdb(w.strWalletFile, "crw");
+    LOCK2(cs_main, w.cs_wallet);
+    CKey key, keyOwn, keyOther;
+    key.MakeNewKey(true);
+    keyOwn.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    w.AddKeyPubKey(key, key.GetPubKey());
+    w.AddKeyPubKey(keyOwn, keyOwn.GetPubKey());
+
+    // Receives with one to three outputs, and spends paying out with change
+    // to keyOwn; some in the mempool, the rest hide their received entries
+    vector<CTransaction> vInMempool;
+    uint256 hashLastReceive;
+    for (int i = 0; i < 40; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        if (i % 4 == 3) {
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(hashLastReceive, 0);
+            tx.vout.push_back(CTxOut(COIN, GetScriptForDestination(keyOther.GetPubKey().GetID())));
+            tx.vout.push_back(CTxOut(COIN / 2, GetScriptForDestination(keyOwn.GetPubKey().GetID())));
+        } else {
+            for (int j = 0; j <= i % 3; j++)
+                tx.vout.push_back(CTxOut(2 * COIN, GetScriptForDestination(key.GetPubKey().GetID())));
+            hashLastReceive = CTransaction(tx).GetHash();
+        }
+        const CTransaction txNew(tx);
+        if (i % 3 == 0) {
+            mempool.addUnchecked(txNew.GetHash(), CTxMemPoolEntry(txNew, 0, 0, 0.0, 1));
+            vInMempool.push_back(txNew);
+        }
+        CWalletTx wtx(&w, tx);
+        w.AddToWallet(wtx, false, &wdb);
+
+        // Once built, the index is kept up as transactions come in
+        if (i == 20)
+            CheckSeekHistory(w);
+    }
+    CheckSeekHistory(w);
+
+    // Leaving the mempool hides received entries again
+    std::list<CTransaction> removed;
+    mempool.remove(vInMempool.back(), removed);
+    vInMempool.pop_back();
+    CheckSeekHistory(w);
+
+    // Naming the change address turns change outputs into listed payments, and back
+    w.SetAddressBook(keyOwn.GetPubKey().GetID(), "own", "receive");
+    CheckSeekHistory(w);
+    w.DelAddressBook(keyOwn.GetPubKey().GetID());
+    CheckSeekHistory(w);
+
+    BOOST_FOREACH (const CTransaction& tx, vInMempool)
+        mempool.remove(tx, removed);
+}
+
+static size_t ReceivedEntries(const CWalletTx& wtx, const isminefilter& filter)
+{
+    list<COutputEntry> listReceived;
+    list<COutputEntry> listSent;
+    CAmount nFee;
+    string strSentAccount;
+    wtx.GetAmounts(listReceived, listSent, nFee, strSentAccount, filter);
+    return listReceived.size();
+}
+
+BOOST_AUTO_TEST_CASE(import_marks_dirty_test)
+{
+    CWallet w;
+    LOCK2(cs_main, w.cs_wallet);
+    CKey key, keyWatched;
+    key.MakeNewKey(true);
+    keyWatched.MakeNewKey(true);
+    CScript scriptKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptWatched = GetScriptForDestination(keyWatched.GetPubKey().GetID());
+
+    // Pays a key, a script around it and a watched address, none of them ours yet
+    CMutableTransaction tx;
+    tx.vout.push_back(CTxOut(COIN, scriptKey));
+    tx.vout.push_back(CTxOut(COIN, GetScriptForDestination(CScriptID(scriptKey))));
+    tx.vout.push_back(CTxOut(COIN, scriptWatched));
+    CWalletTx wtx(&w, tx);
+    w.AddToWallet(wtx, false, NULL);
+    const CWalletTx& wtxIn = w.mapWallet[wtx.GetHash()];
+    BOOST_CHECK_EQUAL(ReceivedEntries(wtxIn, ISMINE_SPENDABLE), 0U);
+    BOOST_CHECK_EQUAL(ReceivedEntries(wtxIn, ISMINE_WATCH_ONLY), 0U);
+
+    // Each import shows up in the amounts cached before it
+    BOOST_CHECK(w.AddKeyPubKey(key, key.GetPubKey()));
+    BOOST_CHECK_EQUAL(ReceivedEntries(wtxIn, ISMINE_SPENDABLE), 1U);
+    BOOST_CHECK(w.AddCScript(scriptKey));
+    BOOST_CHECK_EQUAL(ReceivedEntries(wtxIn, ISMINE_SPENDABLE), 2U);
+    BOOST_CHECK(w.AddWatchOnly(scriptWatched));
+    BOOST_CHECK_EQUAL(ReceivedEntries(wtxIn, ISMINE_WATCH_ONLY), 1U);
+    BOOST_CHECK_EQUAL(ReceivedEntries(wtxIn, ISMINE_SPENDABLE), 2U);
+
+    // Generated keys own nothing, the cache is kept
+    w.GenerateNewKey();
+    BOOST_CHECK_EQUAL(ReceivedEntries(wtxIn, ISMINE_ALL), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_load_test)
+{
+    // Enough transactions for LoadWallet to decode them on more than one thread
+    map<CKeyID, CKey> mapKeys;
+    map<CKeyID, int64_t> mapCreateTimes;
+    map<uint256, CWalletTx> mapTxs;
+    {
+        CWallet w("wallet_load_test.dat");
+        CWalletDB wdb(w.strWalletFile);
+        LOCK2(cs_main, w.cs_wallet);
+        for (int i = 0; i < 40; i++) {
+            CKey key;
+            key.MakeNewKey(i % 2 == 0);
+            w.mapKeyMetadata[key.GetPubKey().GetID()] = CKeyMetadata(1000000 + i);
+            BOOST_CHECK(w.AddKeyPubKey(key, key.GetPubKey()));
+            mapKeys[key.GetPubKey().GetID()] = key;
+            mapCreateTimes[key.GetPubKey().GetID()] = 1000000 + i;
+        }
+        map<CKeyID, CKey>::const_iterator itKey = mapKeys.begin();
+        for (int i = 0; i < 2000; i++) {
+            CMutableTransaction tx;
+            tx.nLockTime = i;
+            tx.vout.push_back(CTxOut(i + 1, GetScriptForDestination(itKey->first)));
+            if (++itKey == mapKeys.end())
+                itKey = mapKeys.begin();
+            CWalletTx wtx(&w, tx);
+            wtx.mapValue["comment"] = strprintf("tx %d", i);
+            wtx.nTimeReceived = 1500000000 + i;
+            BOOST_CHECK(w.AddToWallet(wtx, false, &wdb));
+            mapTxs[wtx.GetHash()] = w.mapWallet[wtx.GetHash()];
+        }
+    }
+
+    CWallet w("wallet_load_test.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(w.LoadWallet(fFirstRun), DB_LOAD_OK);
+    LOCK(w.cs_wallet);
+    BOOST_CHECK_EQUAL(w.mapWallet.size(), mapTxs.size());
+    BOOST_FOREACH (const PAIRTYPE(uint256, CWalletTx) & item, mapTxs) {
+        map<uint256, CWalletTx>::const_iterator it = w.mapWallet.find(item.first);
+        BOOST_REQUIRE(it != w.mapWallet.end());
+        BOOST_CHECK(it->second.GetHash() == item.first);
+        BOOST_CHECK(it->second.mapValue == item.second.mapValue);
+        BOOST_CHECK_EQUAL(it->second.nTimeReceived, item.second.nTimeReceived);
+        BOOST_CHECK_EQUAL(it->second.nOrderPos, item.second.nOrderPos);
+    }
+    BOOST_CHECK_EQUAL(w.wtxOrdered.size(), mapTxs.size());
+    BOOST_FOREACH (const PAIRTYPE(CKeyID, CKey) & item, mapKeys) {
+        CKey key;
+        BOOST_CHECK(w.GetKey(item.first, key));
+        BOOST_CHECK(key == item.second);
+        BOOST_CHECK_EQUAL(w.mapKeyMetadata[item.first].nCreateTime, mapCreateTimes[item.first]);
+    }
+}
+
+static bool WaitForKeyPoolSize(CWallet& w, size_t nSize)
+{
+    for (int i = 0; i < 1000; i++) {
+        {
+            LOCK(w.cs_wallet);
+            if (w.setKeyPool.size() == nSize)
+                return true;
+        }
+        MilliSleep(10);
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup_test)
+{
+    // The batch of keys and pool entries written in one transaction reads back
+    CWallet w("keypool_topup_test.dat");
+    BOOST_CHECK(w.TopUpKeyPool(25));
+    BOOST_CHECK(w.TopUpKeyPool(10)); // already full enough, nothing written
+    std::set<int64_t> setPool;
+    {
+        LOCK(w.cs_wallet);
+        BOOST_CHECK_EQUAL(w.setKeyPool.size(), 26U);
+        setPool = w.setKeyPool;
+    }
+
+    CWallet wReloaded("keypool_topup_test.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(wReloaded.LoadWallet(fFirstRun), DB_LOAD_OK);
+    LOCK(wReloaded.cs_wallet);
+    BOOST_CHECK(wReloaded.setKeyPool == setPool);
+    CWalletDB walletdb(wReloaded.strWalletFile);
+    BOOST_FOREACH (int64_t nIndex, setPool) {
+        CKeyPool keypool;
+        BOOST_CHECK(walletdb.ReadPool(nIndex, keypool));
+        BOOST_CHECK(wReloaded.HaveKey(keypool.vchPubKey.GetID()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(keypool_refill_thread_test)
+{
+    mapArgs["-keypool"] = "20"; // refilled below the default -keypoolmin of 10
+    CWallet w("keypool_refill_thread_test.dat");
+    boost::thread threadRefill(boost::bind(&CWallet::ThreadKeyPoolRefill, &w));
+
+    // The thread catches up on its own when it starts
+    BOOST_CHECK(WaitForKeyPoolSize(w, 21));
+
+    // Keys are handed out without a refill until the pool drops below -keypoolmin
+    for (int i = 0; i < 12; i++) {
+        int64_t nIndex;
+        CKeyPool keypool;
+        w.ReserveKeyFromKeyPool(nIndex, keypool);
+        BOOST_CHECK(nIndex >= 0);
+        w.KeepKey(nIndex);
+    }
+    {
+        LOCK(w.cs_wallet);
+        BOOST_CHECK_EQUAL(w.setKeyPool.size(), 9U);
+    }
+    w.KeepKeyPoolFilled();
+    BOOST_CHECK(WaitForKeyPoolSize(w, 21));
+
+    // Without the thread the pool is topped up on the spot again
+    threadRefill.interrupt();
+    threadRefill.join();
+    {
+        boost::unique_lock<boost::mutex> lock(w.cs_keypoolrefill);
+        BOOST_CHECK(!w.fKeyPoolRefillThread);
+    }
+    for (int i = 0; i < 15; i++) {
+        int64_t nIndex;
+        CKeyPool keypool;
+        w.ReserveKeyFromKeyPool(nIndex, keypool);
+        w.KeepKey(nIndex);
+        LOCK(w.cs_wallet);
+        BOOST_CHECK_EQUAL(w.setKeyPool.size(), 20U);
+    }
+    mapArgs.erase("-keypool");
+}
+
 BOOST_AUTO_TEST_CASE(test)
 {
     BOOST_CHECK(true);
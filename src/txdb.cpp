@@ -8,6 +8,7 @@
 #include "arith_uint256.h" // Legacy code
 #include "chain.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
 #include "support/csviterator.h"
 #include "uint256.h"
@@ -16,6 +17,7 @@
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -43,10 +45,15 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write(DB_BEST_BLOCK, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, false, profile)
 {
 }
 
+bool CCoinsViewDB::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return db.GetProperty(strProperty, strValue);
+}
+
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
     return db.Read(make_pair(DB_COINS, txid), coins);
@@ -86,7 +93,139 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
+bool CCoinsViewDB::WriteSnapshot(const CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    CLevelDBBatch batch(&db.GetObfuscateKey());
+    size_t changed = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            BatchWriteCoins(batch, it->first, it->second.coins);
+            changed++;
+        }
+    }
+    if (hashBlock != uint256(0))
+        BatchWriteHashBestChain(batch, hashBlock);
+
+    LogPrintf("Committing %u changed transactions (out of %u) to coin database in the background...\n", (unsigned int)changed, (unsigned int)mapCoins.size());
+    return db.WriteBatch(batch);
+}
+
+CCoinsViewFlusher::CCoinsViewFlusher(CCoinsViewDB* pdbIn) : CCoinsViewBacked(pdbIn), pdb(pdbIn), nFlushingUsage(0), hashFlushing(0), fFlushing(false), fFailed(false)
+{
+}
+
+CCoinsViewFlusher::~CCoinsViewFlusher()
+{
+    Sync();
+}
+
+bool CCoinsViewFlusher::GetCoins(const uint256& txid, CCoins& coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapFlushing.find(txid);
+        if (it != mapFlushing.end()) {
+            if (it->second.coins.IsPruned())
+                return false;
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewFlusher::HaveCoins(const uint256& txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapFlushing.find(txid);
+        if (it != mapFlushing.end())
+            return !it->second.coins.IsPruned();
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewFlusher::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fFlushing && hashFlushing != uint256(0))
+            return hashFlushing;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewFlusher::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    // Only one flush is in flight at a time
+    if (!Sync())
+        return false;
+
+    size_t nUsage = memusage::DynamicUsage(mapCoins);
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+        nUsage += it->second.coins.DynamicMemoryUsage();
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    mapFlushing.swap(mapCoins);
+    mapCoins.clear();
+    nFlushingUsage = nUsage;
+    hashFlushing = hashBlock;
+    fFlushing = true;
+    threadFlush = boost::thread(boost::bind(&CCoinsViewFlusher::ThreadFlush, this));
+    return true;
+}
+
+bool CCoinsViewFlusher::GetStats(CCoinsStats& stats) const
+{
+    // Statistics are read straight from the database, which has to be
+    // complete first.
+    if (!const_cast<CCoinsViewFlusher*>(this)->Sync())
+        return false;
+    return base->GetStats(stats);
+}
+
+void CCoinsViewFlusher::ThreadFlush()
+{
+    RenameThread("kore-coinsflush");
+    int64_t nStart = GetTimeMillis();
+    // mapFlushing is only read here and by lookups, and not modified until
+    // fFlushing is cleared, so the write runs without holding cs.
+    bool fOk = false;
+    try {
+        fOk = pdb->WriteSnapshot(mapFlushing, hashFlushing);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    LogPrint("bench", "    - Background coins flush: %.2fms\n", (double)(GetTimeMillis() - nStart));
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fOk) {
+        mapFlushing.clear();
+        nFlushingUsage = 0;
+        fFlushing = false;
+    } else {
+        // Keep serving the entries so the view stays consistent; the next
+        // BatchWrite or Sync reports the failure.
+        error("%s: failed to write to coin database", __func__);
+        fFailed = true;
+    }
+}
+
+size_t CCoinsViewFlusher::DynamicMemoryUsage() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return nFlushingUsage;
+}
+
+bool CCoinsViewFlusher::Sync()
+{
+    if (threadFlush.joinable())
+        threadFlush.join();
+    boost::unique_lock<boost::mutex> lock(cs);
+    return !fFailed;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, profile)
 {
     // Legacy code, using salt
     if (!Read('S', salt)) {
@@ -105,9 +244,40 @@ bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo& info)
     return Write(make_pair(DB_BLOCK_FILES, nFile), info);
 }
 
+/** Block file info as written before uncompressed sizes were tracked */
+class CLegacyBlockFileInfo
+{
+public:
+    CBlockFileInfo& info;
+
+    CLegacyBlockFileInfo(CBlockFileInfo& infoIn) : info(infoIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(VARINT(info.nBlocks));
+        READWRITE(VARINT(info.nSize));
+        READWRITE(VARINT(info.nUndoSize));
+        READWRITE(VARINT(info.nHeightFirst));
+        READWRITE(VARINT(info.nHeightLast));
+        READWRITE(VARINT(info.nTimeFirst));
+        READWRITE(VARINT(info.nTimeLast));
+    }
+};
+
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo& info)
 {
-    return Read(make_pair(DB_BLOCK_FILES, nFile), info);
+    if (Read(make_pair(DB_BLOCK_FILES, nFile), info))
+        return true;
+    // Older records end before the uncompressed sizes; their files hold no compressed records
+    CLegacyBlockFileInfo legacy(info);
+    if (!Read(make_pair(DB_BLOCK_FILES, nFile), legacy))
+        return false;
+    info.nRawSize = info.nSize;
+    info.nRawUndoSize = info.nUndoSize;
+    return true;
 }
 
 bool CBlockTreeDB::WriteLastBlockFile(int nFile)
@@ -237,13 +407,37 @@ bool CBlockTreeDB::ReadAddrIndex(uint160 addrid, std::vector<CExtDiskTxPos>& lis
 
 bool CBlockTreeDB::AddAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxPos> >& list)
 {
-    unsigned char foo[0];
     CLevelDBBatch batch(&GetObfuscateKey());
     for (std::vector<std::pair<uint160, CExtDiskTxPos> >::const_iterator it = list.begin(); it != list.end(); it++) {
         CHashWriter ss(SER_GETHASH, 0);
         ss << salt;
         ss << it->first;
-        batch.Write(make_pair(make_pair('a', UintToArith256(ss.GetHash()).GetLow64()), it->second), FLATDATA(foo));
+        batch.Write(make_pair(make_pair('a', UintToArith256(ss.GetHash()).GetLow64()), it->second), CFlatData(NULL, NULL));
+    }
+    return WriteBatch(batch, true);
+}
+
+bool CBlockTreeDB::MoveAddrIndex(int nFile, const std::map<CDiskBlockPos, CDiskBlockPos>& mapMoved)
+{
+    CLevelDBBatch batch(&GetObfuscateKey());
+    boost::scoped_ptr<CLevelDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair('a', (uint64_t)0));
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<std::pair<char, uint64_t>, CExtDiskTxPos> key;
+        if (!pcursor->GetKey(key) || key.first.first != 'a')
+            break;
+        if (key.second.nFile == nFile) {
+            std::map<CDiskBlockPos, CDiskBlockPos>::const_iterator it = mapMoved.find(CDiskBlockPos(key.second.nFile, key.second.nPos));
+            if (it != mapMoved.end()) {
+                CExtDiskTxPos pos = key.second;
+                pos.nFile = it->second.nFile;
+                pos.nPos = it->second.nPos;
+                batch.Erase(key);
+                batch.Write(make_pair(key.first, pos), CFlatData(NULL, NULL));
+            }
+        }
+        pcursor->Next();
     }
     return WriteBatch(batch, true);
 }
@@ -272,78 +466,181 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
-{    
-    boost::scoped_ptr<CLevelDBIterator> pcursor(NewIterator());
+/** A block index entry decoded by LoadBlockIndexRange, waiting to be linked */
+struct CBlockIndexRecord {
+    uint256 hash;
+    uint256 hashPrev;
+    uint256 hashNext;
+    CBlockIndex* pindex;
+};
+
+/**
+ * Decode the block index entries whose hash starts with a byte in
+ * [nBegin, nEnd). The key space is uniformly distributed, so splitting it by
+ * the first byte gives every loader thread a similar share of the work.
+ */
+static void LoadBlockIndexRange(CBlockTreeDB* pdb, int nBegin, int nEnd, int64_t nCheckHashInterval, std::vector<CBlockIndexRecord>* pvRecords, std::string* pstrError)
+{
+    boost::scoped_ptr<CLevelDBIterator> pcursor(pdb->NewIterator());
 
-    pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
+    uint256 hashStart;
+    *hashStart.begin() = (unsigned char)nBegin;
+    pcursor->Seek(make_pair(DB_BLOCK_INDEX, hashStart));
 
-    // Load mapBlockIndex
+    int64_t nEntries = 0;
     while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
+        // LoadBlockIndexGuts interrupts the loaders when it is interrupted itself
+        if (nEntries % 1000 == 0)
+            boost::this_thread::interruption_point();
         try {
             std::pair<char, uint256> key;
-            if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-                CDiskBlockIndex diskindex;
-                if (pcursor->GetValue(diskindex)) {
-                    // Construct block index object=
-                    bool useLegacyCode = UseLegacyCode(diskindex.nHeight);
-                    if (fDebug)
-                        LogPrintf("%s(): Reading Block: %d \n", __func__,  diskindex.nHeight);
-                    
-                    CBlockIndex* pindexNew    = InsertBlockIndex(diskindex.GetBlockHash());
-                    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                    pindexNew->pnext          = useLegacyCode ? NULL : InsertBlockIndex(diskindex.hashNext);
-                    pindexNew->nHeight        = diskindex.nHeight;
-                    pindexNew->nFile          = diskindex.nFile;
-                    pindexNew->nDataPos       = diskindex.nDataPos;
-                    pindexNew->nUndoPos       = diskindex.nUndoPos;
-                    pindexNew->nVersion       = diskindex.nVersion;
-                    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                    pindexNew->nTime          = diskindex.nTime;
-                    pindexNew->nBits          = diskindex.nBits;
-                    pindexNew->nNonce         = diskindex.nNonce;
-                    pindexNew->nBirthdayA     = diskindex.nBirthdayA;
-                    pindexNew->nBirthdayB     = diskindex.nBirthdayB;
-                    pindexNew->nStatus        = diskindex.nStatus;
-                    pindexNew->nTx            = diskindex.nTx;
-
-                    //Proof Of Stake
-                    pindexNew->nMint             = diskindex.nMint;
-                    pindexNew->nMoneySupply      = diskindex.nMoneySupply;
-                    pindexNew->nFlags            = diskindex.nFlags;
-                    pindexNew->nStakeModifier    = diskindex.nStakeModifier;
-                    pindexNew->nStakeModifierOld = diskindex.nStakeModifierOld;
-                    pindexNew->prevoutStake      = diskindex.prevoutStake;
-                    pindexNew->nStakeTime        = diskindex.nStakeTime;
-                    pindexNew->hashProofOfStake  = diskindex.hashProofOfStake;
-                    bool isProofOfStake = pindexNew->IsProofOfStake(); 
-
-                    if (!isProofOfStake && (pindexNew->nStatus & BLOCK_HAVE_DATA)) {
-                        if (useLegacyCode) {
-                            if (!CheckProofOfWork_Legacy(pindexNew->GetBlockHash(), pindexNew->nBits))
-                                return error("LoadBlockIndexGuts() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                        } else {
-                            if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                                return error("LoadBlockIndexGuts() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                        }
-                    }
-                    // ppcoin: build setStakeSeen
-                    if (!useLegacyCode && isProofOfStake)
-                        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            if (!pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX || *key.second.begin() >= nEnd)
+                break; // finished loading this part of the block index
+            CDiskBlockIndex diskindex;
+            if (!pcursor->GetValue(diskindex)) {
+                *pstrError = "failed to read value";
+                return;
+            }
+            if (fDebug)
+                LogPrintf("%s(): Reading Block: %d \n", __func__,  diskindex.nHeight);
 
-                    pcursor->Next();
-               } else {
-                    return error("LoadBlockIndexGuts() : failed to read value");
-                }
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if (nCheckHashInterval > 0 && nEntries % nCheckHashInterval == 0 && diskindex.GetBlockHash() != key.second) {
+                *pstrError = strprintf("block index entry does not match its hash %s", key.second.ToString());
+                return;
             }
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = new CBlockIndex();
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nBirthdayA     = diskindex.nBirthdayA;
+            pindexNew->nBirthdayB     = diskindex.nBirthdayB;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            //Proof Of Stake
+            pindexNew->nMint             = diskindex.nMint;
+            pindexNew->nMoneySupply      = diskindex.nMoneySupply;
+            pindexNew->nFlags            = diskindex.nFlags;
+            pindexNew->nStakeModifier    = diskindex.nStakeModifier;
+            pindexNew->nStakeModifierOld = diskindex.nStakeModifierOld;
+            pindexNew->prevoutStake      = diskindex.prevoutStake;
+            pindexNew->nStakeTime        = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake  = diskindex.hashProofOfStake;
+
+            CBlockIndexRecord record;
+            record.hash = key.second;
+            record.hashPrev = diskindex.hashPrev;
+            record.hashNext = diskindex.hashNext;
+            record.pindex = pindexNew;
+            pvRecords->push_back(record);
+            nEntries++;
+
+            pcursor->Next();
         } catch (std::exception& e) {
-            LogPrintf("LoadBlockIndexGuts Error !!!");
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            *pstrError = strprintf("Deserialize or I/O error - %s", e.what());
+            return;
+        }
+    }
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // The key already holds the block hash, so it isn't recomputed (a full
+    // Yescrypt evaluation for PoW headers). -checkblockindexhash=<n> rehashes
+    // every n-th entry to audit that the stored index matches its key.
+    const int64_t nCheckHashInterval = GetArg("-checkblockindexhash", DEFAULT_CHECKBLOCKINDEXHASH);
+
+    // Decode the entries on one thread per script verification thread
+    const int nThreads = std::max(1, nScriptCheckThreads);
+    std::vector<std::vector<CBlockIndexRecord> > vRecords(nThreads);
+    std::vector<std::string> vErrors(nThreads);
+    {
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++) {
+            int nBegin = 256 * i / nThreads;
+            int nEnd = 256 * (i + 1) / nThreads;
+            threads.create_thread(boost::bind(&LoadBlockIndexRange, this, nBegin, nEnd, nCheckHashInterval, &vRecords[i], &vErrors[i]));
+        }
+        try {
+            threads.join_all();
+        } catch (const boost::thread_interrupted&) {
+            // The loaders write into vRecords, stop them before it goes away
+            threads.interrupt_all();
+            {
+                boost::this_thread::disable_interruption di;
+                threads.join_all();
+            }
+            for (int i = 0; i < nThreads; i++) {
+                BOOST_FOREACH (const CBlockIndexRecord& record, vRecords[i])
+                    delete record.pindex;
+            }
+            throw;
+        }
+    }
+
+    size_t nRecords = 0;
+    bool fError = false;
+    for (int i = 0; i < nThreads; i++) {
+        nRecords += vRecords[i].size();
+        if (!vErrors[i].empty())
+            fError = error("LoadBlockIndexGuts() : %s", vErrors[i]);
+    }
+    if (fError) {
+        for (int i = 0; i < nThreads; i++) {
+            BOOST_FOREACH (const CBlockIndexRecord& record, vRecords[i])
+                delete record.pindex;
+        }
+        return false;
+    }
+    int64_t nDecoded = GetTimeMillis();
+
+    boost::this_thread::interruption_point();
+
+    // Index every entry before linking, so parents are found rather than
+    // created as placeholders, whatever order the partitions finished in.
+    mapBlockIndex.reserve(mapBlockIndex.size() + nRecords);
+    for (int i = 0; i < nThreads; i++) {
+        BOOST_FOREACH (const CBlockIndexRecord& record, vRecords[i]) {
+            BlockMap::iterator mi = mapBlockIndex.insert(make_pair(record.hash, record.pindex)).first;
+            record.pindex->phashBlock = &((*mi).first);
         }
     }
 
+    for (int i = 0; i < nThreads; i++) {
+        BOOST_FOREACH (const CBlockIndexRecord& record, vRecords[i]) {
+            CBlockIndex* pindexNew = record.pindex;
+            bool useLegacyCode = UseLegacyCode(pindexNew->nHeight);
+            pindexNew->pprev = InsertBlockIndex(record.hashPrev);
+            pindexNew->pnext = useLegacyCode ? NULL : InsertBlockIndex(record.hashNext);
+            bool isProofOfStake = pindexNew->IsProofOfStake();
+
+            if (!isProofOfStake && (pindexNew->nStatus & BLOCK_HAVE_DATA)) {
+                if (useLegacyCode) {
+                    if (!CheckProofOfWork_Legacy(pindexNew->GetBlockHash(), pindexNew->nBits))
+                        return error("LoadBlockIndexGuts() : CheckProofOfWork failed: %s", pindexNew->ToString());
+                } else {
+                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
+                        return error("LoadBlockIndexGuts() : CheckProofOfWork failed: %s", pindexNew->ToString());
+                }
+            }
+            // ppcoin: build setStakeSeen
+            if (!useLegacyCode && isProofOfStake)
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
+    }
+
+    LogPrintf("%s: loaded %u block index entries on %d threads in %dms (decode %dms, link %dms)\n", __func__,
+        nRecords, nThreads, GetTimeMillis() - nStart, nDecoded - nStart, GetTimeMillis() - nDecoded);
+
     return true;
 }
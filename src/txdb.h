@@ -14,6 +14,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/thread.hpp>
+
 class CCoins;
 class uint256;
 
@@ -23,6 +25,14 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -dbcompression default
+static const bool DEFAULT_DB_COMPRESSION = false;
+//! -dbmaxopenfiles default, per database
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+//! -chainstateprofile default
+static const char* const DEFAULT_CHAINSTATE_PROFILE = "default";
+//! -blockindexprofile default
+static const char* const DEFAULT_BLOCKINDEX_PROFILE = "default";
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -31,20 +41,65 @@ protected:
     CLevelDBWrapper db;
 
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBProfile& profile = CLevelDBProfile());
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const;
+    bool HaveCoins(const uint256& txid) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool GetStats(CCoinsStats& stats) const;
+
+    //! Write the dirty entries of mapCoins without consuming the map
+    bool WriteSnapshot(const CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! Read one of LevelDB's internal properties of the chainstate database
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+    //! See CLevelDBWrapper::GetMemoryLimit
+    size_t GetMemoryLimit() const { return db.GetMemoryLimit(); }
+};
+
+/**
+ * Writes coin cache flushes to the coin database from a background thread.
+ * BatchWrite takes over the flushed entries and returns immediately; until
+ * the write completes, reads are answered from those entries so the layers
+ * above see a consistent view. The coins and the best block go out in one
+ * atomic batch, so an interrupted flush leaves the database at the previous
+ * best block and the blocks after it are connected again at startup.
+ */
+class CCoinsViewFlusher : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB* pdb;
+    mutable boost::mutex cs;
+    CCoinsMap mapFlushing;
+    size_t nFlushingUsage;
+    uint256 hashFlushing;
+    bool fFlushing;
+    bool fFailed;
+    boost::thread threadFlush;
+
+    void ThreadFlush();
+
+public:
+    CCoinsViewFlusher(CCoinsViewDB* pdbIn);
+    ~CCoinsViewFlusher();
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Wait for the flush in progress, if any. Returns false if it failed.
+    bool Sync();
+    //! Memory held by the entries still being written, which count against -dbcache along with the cache above
+    size_t DynamicMemoryUsage() const;
 };
 
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBProfile& profile = CLevelDBProfile());
 
 private:
     CBlockTreeDB(const CBlockTreeDB&);
@@ -64,6 +119,8 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list);
     bool ReadAddrIndex(uint160 addrid, std::vector<CExtDiskTxPos>& list);
     bool AddAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxPos> >& list);
+    //! Point the address index entries of blocks in nFile at their new positions (old block position -> new)
+    bool MoveAddrIndex(int nFile, const std::map<CDiskBlockPos, CDiskBlockPos>& mapMoved);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
     bool WriteInt(const std::string& name, int nValue);
@@ -19,6 +19,8 @@
 #include "utilstrencodings.h"
 #include "utiltime.h"
 
+#include <atomic>
+#include <memory>
 #include <regex>
 #include <stdarg.h>
 
@@ -193,11 +195,52 @@ static void DebugPrintInit()
 
     boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
     fileout = fopen(pathDebug.string().c_str(), "a");
-    if (fileout) setbuf(fileout, NULL); // unbuffered
+    if (fileout) setbuf(fileout, NULL); // unbuffered, every batch is a single write()
 
     mutexDebugLog = new boost::mutex();
 }
 
+/**
+ * Per -debug category budget of messages for the current second. Categories
+ * are hashed onto a fixed table, those sharing a slot share the budget. All
+ * of it is plain atomics with static storage, so it stays usable from global
+ * destructors.
+ */
+static const unsigned int LOG_RATE_SLOTS = 256;
+struct CLogRateSlot {
+    std::atomic<const char*> pszCategory;
+    std::atomic<int64_t> nSecond;
+    std::atomic<int> nCount;
+    std::atomic<unsigned int> nSuppressed;
+};
+static CLogRateSlot logRateSlots[LOG_RATE_SLOTS];
+static std::atomic<unsigned int> nLogSuppressed(0);
+static std::atomic<unsigned int> nLogDropped(0);
+int nLogRateLimit = DEFAULT_LOG_RATE;
+
+bool LogRateAccept(const char* category, int64_t nNow)
+{
+    if (nLogRateLimit <= 0)
+        return true;
+
+    uint32_t nHash = 2166136261U;
+    for (const char* p = category; *p; p++)
+        nHash = (nHash ^ (unsigned char)*p) * 16777619U;
+    CLogRateSlot& slot = logRateSlots[nHash % LOG_RATE_SLOTS];
+
+    int64_t nSecond = slot.nSecond.load(std::memory_order_relaxed);
+    if (nSecond != nNow && slot.nSecond.compare_exchange_strong(nSecond, nNow))
+        slot.nCount.store(0, std::memory_order_relaxed);
+    if (slot.nCount.fetch_add(1, std::memory_order_relaxed) < nLogRateLimit)
+        return true;
+
+    // category is always a string literal, so keeping the pointer is safe
+    slot.pszCategory.store(category, std::memory_order_relaxed);
+    slot.nSuppressed++;
+    nLogSuppressed++;
+    return false;
+}
+
 bool LogAcceptCategory(const char* category)
 {
     if (category != NULL) {
@@ -219,10 +262,203 @@ bool LogAcceptCategory(const char* category)
         if (setCategories.count(string("")) == 0 &&
             setCategories.count(string(category)) == 0)
             return false;
+
+        if (!LogRateAccept(category, GetTimeMillis() / 1000))
+            return false;
+    }
+    return true;
+}
+
+CLogRing::CLogRing(size_t nSizePow2) : slots(new Slot[nSizePow2]), nMask(nSizePow2 - 1), nHead(0), nTail(0)
+{
+    for (size_t i = 0; i < nSizePow2; i++)
+        slots[i].nSeq.store(i, std::memory_order_relaxed);
+}
+
+bool CLogRing::Push(int64_t nTime, const std::string& str)
+{
+    size_t nPos = nHead.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots[nPos & nMask];
+        size_t nSeq = slot->nSeq.load(std::memory_order_acquire);
+        intptr_t nDiff = (intptr_t)nSeq - (intptr_t)nPos;
+        if (nDiff == 0) {
+            if (nHead.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+                break;
+        } else if (nDiff < 0) {
+            return false;
+        } else {
+            nPos = nHead.load(std::memory_order_relaxed);
+        }
     }
+    slot->nTime = nTime;
+    slot->str = str;
+    slot->nSeq.store(nPos + 1, std::memory_order_release);
+    return true;
+}
+
+bool CLogRing::Pop(int64_t& nTime, std::string& str)
+{
+    Slot& slot = slots[nTail & nMask];
+    if (slot.nSeq.load(std::memory_order_acquire) != nTail + 1)
+        return false;
+    nTime = slot.nTime;
+    str = std::move(slot.str);
+    slot.str = std::string();
+    slot.nSeq.store(nTail + nMask + 1, std::memory_order_release);
+    nTail++;
     return true;
 }
 
+bool CLogRing::Ready() const
+{
+    return slots[nTail & nMask].nSeq.load(std::memory_order_acquire) == nTail + 1;
+}
+
+//! Bytes the writer thread collects before issuing a write()
+static const size_t LOG_WRITE_BATCH = 64 * 1024;
+static CLogRing* pLogRing = NULL;
+static boost::thread* pLogWriter = NULL;
+static std::atomic<bool> fLogAsync(false);
+static std::atomic<bool> fLogWriterStop(false);
+//! The writer thread waits on condLogWriter while it has nothing to write
+static CWaitableCriticalSection csLogWriter;
+static CConditionVariable condLogWriter;
+//! Set while the writer thread is about to wait or waiting, so producers know to wake it
+static std::atomic<bool> fLogWriterIdle(false);
+
+/** Append str to strOut, timestamped as nTime when it starts a line. Requires mutexDebugLog. */
+static void FormatLogStr(std::string& strOut, int64_t nTime, const std::string& str)
+{
+    static bool fStartedNewLine = true;
+    static int64_t nCachedTime = -1;
+    static std::string strCachedTime;
+
+    // Debug print useful for profiling
+    if (fLogTimestamps && fStartedNewLine) {
+        if (nTime != nCachedTime) {
+            nCachedTime = nTime;
+            strCachedTime = DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTime) + " ";
+        }
+        strOut += strCachedTime;
+    }
+    if (!str.empty() && str[str.size() - 1] == '\n')
+        fStartedNewLine = true;
+    else
+        fStartedNewLine = false;
+
+    strOut += str;
+}
+
+/** Append a line accounting for messages lost since the last one, at most once a second. Requires mutexDebugLog. */
+static void FormatLogLosses(std::string& strOut, int64_t nNow)
+{
+    static int64_t nLastReport = 0;
+    if (nNow == nLastReport || (nLogSuppressed.load() == 0 && nLogDropped.load() == 0))
+        return;
+    nLastReport = nNow;
+
+    std::string strLine;
+    unsigned int nSuppressed = nLogSuppressed.exchange(0);
+    if (nSuppressed > 0) {
+        std::string strCategories;
+        for (unsigned int i = 0; i < LOG_RATE_SLOTS; i++) {
+            unsigned int n = logRateSlots[i].nSuppressed.exchange(0);
+            if (n > 0)
+                strCategories += strprintf("%s%s: %u", strCategories.empty() ? "" : ", ", logRateSlots[i].pszCategory.load(), n);
+        }
+        strLine += strprintf("%u messages over -lograte=%d suppressed (%s)", nSuppressed, nLogRateLimit, strCategories);
+    }
+    unsigned int nDropped = nLogDropped.exchange(0);
+    if (nDropped > 0)
+        strLine += strprintf("%s%u messages dropped, log buffer full", strLine.empty() ? "" : "; ", nDropped);
+    FormatLogStr(strOut, nNow, "Log: " + strLine + "\n");
+}
+
+/** Requires mutexDebugLog */
+static int WriteDebugLog(const std::string& str)
+{
+    // reopen the log file, if requested
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(), "a", fileout) != NULL)
+            setbuf(fileout, NULL); // unbuffered
+    }
+
+    return fwrite(str.data(), 1, str.size(), fileout);
+}
+
+static void ThreadDebugLogWriter()
+{
+    RenameThread("kore-logwriter");
+
+    std::string strBatch;
+    std::string str;
+    int64_t nTime;
+    while (true) {
+        bool fStop = fLogWriterStop.load();
+        {
+            boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+            strBatch.clear();
+            while (strBatch.size() < LOG_WRITE_BATCH && pLogRing->Pop(nTime, str))
+                FormatLogStr(strBatch, nTime, str);
+            FormatLogLosses(strBatch, GetTime());
+            if (!strBatch.empty())
+                WriteDebugLog(strBatch);
+        }
+        if (strBatch.size() >= LOG_WRITE_BATCH)
+            continue;
+        // Only stop once the ring has been seen empty after the stop request
+        if (fStop)
+            break;
+
+        boost::unique_lock<boost::mutex> lock(csLogWriter);
+        fLogWriterIdle = true;
+        // Pairs with the fence in LogPrintStr: either the producer sees the flag, or this sees its message
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!pLogRing->Ready() && !fLogWriterStop.load())
+            condLogWriter.wait(lock);
+        fLogWriterIdle = false;
+    }
+}
+
+void StartDebugLogWriter(size_t nMessages)
+{
+    if (nMessages == 0 || fPrintToConsole || !fPrintToDebugLog || pLogWriter != NULL)
+        return;
+
+    boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+    if (fileout == NULL)
+        return;
+
+    size_t nSize = 1;
+    while (nSize < nMessages)
+        nSize <<= 1;
+    pLogRing = new CLogRing(nSize);
+    fLogWriterStop = false;
+    pLogWriter = new boost::thread(&ThreadDebugLogWriter);
+    fLogAsync = true;
+}
+
+void StopDebugLogWriter()
+{
+    if (pLogWriter == NULL)
+        return;
+
+    fLogAsync = false;
+    {
+        boost::unique_lock<boost::mutex> lock(csLogWriter);
+        fLogWriterStop = true;
+    }
+    condLogWriter.notify_all();
+    pLogWriter->join();
+    delete pLogWriter;
+    pLogWriter = NULL;
+    // The ring is left in place, a message racing with the stop request may still land in it
+}
+
 int LogPrintStr(const std::string& str)
 {
     int ret = 0; // Returns total number of characters written
@@ -230,8 +466,19 @@ int LogPrintStr(const std::string& str)
         // print to console
         ret = fwrite(str.data(), 1, str.size(), stdout);
         fflush(stdout);
+    } else if (fLogAsync.load(std::memory_order_relaxed)) {
+        // Never block the caller, the writer thread formats and writes the message
+        if (!pLogRing->Push(GetTime(), str)) {
+            nLogDropped++;
+            return ret;
+        }
+        ret = str.size();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (fLogWriterIdle.load(std::memory_order_relaxed)) {
+            boost::unique_lock<boost::mutex> lock(csLogWriter);
+            condLogWriter.notify_one();
+        }
     } else if (fPrintToDebugLog && AreBaseParamsConfigured()) {
-        static bool fStartedNewLine = true;
         boost::call_once(&DebugPrintInit, debugPrintInitFlag);
 
         if (fileout == NULL)
@@ -239,23 +486,11 @@ int LogPrintStr(const std::string& str)
 
         boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
 
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(), "a", fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
-        }
-
-        // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (!str.empty() && str[str.size() - 1] == '\n')
-            fStartedNewLine = true;
-        else
-            fStartedNewLine = false;
-
-        ret = fwrite(str.data(), 1, str.size(), fileout);
+        int64_t nTime = GetTime();
+        std::string strOut;
+        FormatLogLosses(strOut, nTime);
+        FormatLogStr(strOut, nTime, str);
+        ret = WriteDebugLog(strOut);
     }
 
     return ret;
@@ -20,8 +20,10 @@
 #include "tinyformat.h"
 #include "utiltime.h"
 
+#include <atomic>
 #include <exception>
 #include <map>
+#include <memory>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -39,14 +41,62 @@ extern std::string strMiscWarning;
 extern bool fLogTimestamps;
 extern bool fLogIPs;
 extern volatile bool fReopenDebugLog;
+extern int nLogRateLimit;
+
+//! -logbuffer default: messages queued for the debug.log writer thread
+static const unsigned int DEFAULT_LOG_BUFFER = 8192;
+//! -lograte default: messages per second and -debug category
+static const int DEFAULT_LOG_RATE = 1000;
 
 void SetupEnvironment();
 bool SetupNetworking();
 
 /** Return true if log accepts specified category */
 bool LogAcceptCategory(const char* category);
+/**
+ * Count a message of category (a string literal) against the -lograte budget
+ * of second nSecond; false once the budget is used up. Categories are hashed
+ * onto a fixed table, those sharing a slot share the budget.
+ */
+bool LogRateAccept(const char* category, int64_t nSecond);
+
+/**
+ * Bounded multi-producer, single-consumer ring of log messages (the bounded
+ * queue of Dmitry Vyukov). Every slot carries a sequence number telling
+ * producers whether it is free for the lap they are on, so pushing is one
+ * compare-and-swap and never waits; a full ring makes Push() fail instead.
+ * Messages of one producer come out in the order it pushed them.
+ */
+class CLogRing
+{
+private:
+    struct Slot {
+        std::atomic<size_t> nSeq;
+        int64_t nTime;
+        std::string str;
+    };
+    std::unique_ptr<Slot[]> slots;
+    const size_t nMask;
+    std::atomic<size_t> nHead;
+    size_t nTail; // only touched by the consumer
+
+public:
+    //! nSizePow2 must be a power of two
+    explicit CLogRing(size_t nSizePow2);
+
+    bool Push(int64_t nTime, const std::string& str);
+    //! Consumer only
+    bool Pop(int64_t& nTime, std::string& str);
+    //! Consumer only: whether Pop would return a message
+    bool Ready() const;
+};
+
 /** Send a string to the log output */
 int LogPrintStr(const std::string& str);
+/** Hand debug.log writes to a background thread, queueing up to nMessages */
+void StartDebugLogWriter(size_t nMessages);
+/** Write out what is still queued and go back to writing from the logging thread */
+void StopDebugLogWriter();
 
 #define LogPrintf(...) LogPrint(NULL, __VA_ARGS__)
 
@@ -34,6 +34,8 @@ class CValidationInterface {
 protected:
 // XX42    virtual void EraseFromWallet(const uint256& hash){};
     virtual void UpdatedBlockTip(const CBlockIndex *pindex) {}
+    virtual void BlockConnected(const CBlock &block, const CBlockIndex *pindex) {}
+    virtual void BlockDisconnected(const CBlock &block, const CBlockIndex *pindex) {}
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
     virtual void NotifyTransactionLock(const CTransaction &tx) {}
     virtual void SetBestChain(const CBlockLocator &locator) {}
@@ -53,6 +55,10 @@ struct CMainSignals {
 // XX42    boost::signals2::signal<void(const uint256&)> EraseTransaction;
     /** Notifies listeners of updated block chain tip */
     boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
+    /** Notifies listeners of a block connected to the active chain, with the block as it was validated */
+    boost::signals2::signal<void (const CBlock &, const CBlockIndex *)> BlockConnected;
+    /** Notifies listeners of a block disconnected from the active chain */
+    boost::signals2::signal<void (const CBlock &, const CBlockIndex *)> BlockDisconnected;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
     /** Notifies listeners of an updated transaction lock without new data. */
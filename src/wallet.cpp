@@ -42,6 +42,8 @@ unsigned int nTxConfirmTarget = 1;
 bool bdisableSystemnotifications = false; // Those bubbles can be annoying and slow down the UI when you get lots of trx
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
+int nWalletArchiveDepth = DEFAULT_WALLET_ARCHIVE_DEPTH;
+int64_t nWalletMaintenanceBudget = DEFAULT_WALLET_MAINTENANCE_BUDGET;
 int64_t nStartupTime = GetTime(); //!< Client startup time for use with automint
 
 static CAmount GetStakeCombineThreshold_Legacy() { return 980 * COIN; }
@@ -84,6 +86,30 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
     return &(it->second);
 }
 
+const CArchivedWalletTx* CWallet::GetArchivedTx(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    std::map<uint256, CArchivedWalletTx>::const_iterator it = mapArchived.find(hash);
+    if (it == mapArchived.end())
+        return NULL;
+    return &(it->second);
+}
+
+const CTxOut* CWallet::GetWalletTxOut(const COutPoint& outpoint) const
+{
+    AssertLockHeld(cs_wallet);
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi != mapWallet.end()) {
+        if (outpoint.n < mi->second.vout.size())
+            return &mi->second.vout[outpoint.n];
+        return NULL;
+    }
+    std::map<uint256, CArchivedWalletTx>::const_iterator ai = mapArchived.find(outpoint.hash);
+    if (ai != mapArchived.end() && outpoint.n < ai->second.vout.size())
+        return &ai->second.vout[outpoint.n];
+    return NULL;
+}
+
 CPubKey CWallet::GenerateNewKey()
 {
     AssertLockHeld(cs_wallet);                                 // mapKeyMetadata
@@ -93,12 +119,18 @@ CPubKey CWallet::GenerateNewKey()
     CKey secret;
     secret.MakeNewKey(fCompressed);
 
-    // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
-        SetMinVersion(FEATURE_COMPRPUBKEY);
-
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
+    return AddGeneratedKey(secret, pubkey);
+}
+
+CPubKey CWallet::AddGeneratedKey(const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (secret.IsCompressed())
+        SetMinVersion(FEATURE_COMPRPUBKEY, pwalletdbKeyBatch);
 
     // Create new metadata
     int64_t nCreationTime = GetTime();
@@ -106,12 +138,21 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
-    if (!AddKeyPubKey(secret, pubkey))
+    // A fresh key owns nothing yet, so cached amounts stay valid
+    if (!SaveKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
     return pubkey;
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet);
+    bool fSaved = SaveKeyPubKey(secret, pubkey);
+    MarkDirty();
+    return fSaved;
+}
+
+bool CWallet::SaveKeyPubKey(const CKey& secret, const CPubKey& pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
@@ -126,6 +167,8 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbKeyBatch)
+            return pwalletdbKeyBatch->WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
@@ -144,6 +187,8 @@ bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                 vchCryptedSecret,
                 mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbKeyBatch)
+            return pwalletdbKeyBatch->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
         else
             return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
     }
@@ -169,6 +214,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    MarkDirty();
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript.begin(), redeemScript.end()), redeemScript);
@@ -195,6 +241,7 @@ bool CWallet::AddWatchOnly(const CScript& dest)
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
+    MarkDirty();
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
@@ -446,17 +493,21 @@ void CWallet::SyncMetaData(pair<TxSpends::iterator, TxSpends::iterator> range)
     int nMinOrderPos = std::numeric_limits<int>::max();
     const CWalletTx* copyFrom = NULL;
     for (TxSpends::iterator it = range.first; it != range.second; ++it) {
-        const uint256& hash = it->second;
-        int n = mapWallet[hash].nOrderPos;
+        std::map<uint256, CWalletTx>::iterator mit = mapWallet.find(it->second);
+        if (mit == mapWallet.end())
+            continue; // archived
+        int n = mit->second.nOrderPos;
         if (n < nMinOrderPos) {
             nMinOrderPos = n;
-            copyFrom = &mapWallet[hash];
+            copyFrom = &mit->second;
         }
     }
     // Now copy data from copyFrom to rest:
     for (TxSpends::iterator it = range.first; it != range.second; ++it) {
-        const uint256& hash = it->second;
-        CWalletTx* copyTo = &mapWallet[hash];
+        std::map<uint256, CWalletTx>::iterator mit = mapWallet.find(it->second);
+        if (mit == mapWallet.end())
+            continue;
+        CWalletTx* copyTo = &mit->second;
         if (copyFrom == copyTo) continue;
         copyTo->mapValue = copyFrom->mapValue;
         copyTo->vOrderForm = copyFrom->vOrderForm;
@@ -475,21 +526,52 @@ void CWallet::SyncMetaData(pair<TxSpends::iterator, TxSpends::iterator> range)
  */
 bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 {
+    LOCK(cs_wallet);
     const COutPoint outpoint(hash, n);
+    SpendStateMap::iterator its = mapSpendState.find(outpoint);
+    if (its == mapSpendState.end())
+        return false; // No wallet transaction spends it
+    if (its->second == SPEND_CONFIRMED)
+        return true;
+
+    int nState = SPEND_CONFLICTED;
     pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
         const uint256& wtxid = it->second;
         std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
-        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 0)
-            return true; // Spent
+        if (mit == mapWallet.end()) {
+            if (mapArchived.count(wtxid)) {
+                nState = SPEND_CONFIRMED; // Spent by an archived transaction
+                break;
+            }
+            continue;
+        }
+        int nDepth = mit->second.GetDepthInMainChain();
+        if (nDepth > 0) {
+            nState = SPEND_CONFIRMED;
+            break;
+        }
+        if (nDepth == 0)
+            nState = SPEND_UNCONFIRMED;
+    }
+    its->second = nState;
+    return nState != SPEND_CONFLICTED;
+}
+
+void CWallet::MarkSpendsDirty(const CTransaction& tx)
+{
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        SpendStateMap::iterator its = mapSpendState.find(txin.prevout);
+        if (its != mapSpendState.end())
+            its->second = SPEND_UNKNOWN;
     }
-    return false;
 }
 
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    mapSpendState[outpoint] = SPEND_UNKNOWN;
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
@@ -597,6 +679,63 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
     return true;
 }
 
+void CHistoryCounts::Clear()
+{
+    vCount.clear();
+    vTree.clear();
+    nTotal = 0;
+}
+
+void CHistoryCounts::Rebuild()
+{
+    vTree.assign(vCount.size(), 0);
+    for (size_t i = 0; i < vCount.size(); i++) {
+        vTree[i] += vCount[i];
+        size_t j = i | (i + 1);
+        if (j < vTree.size())
+            vTree[j] += vTree[i];
+    }
+}
+
+void CHistoryCounts::Add(int64_t nPos, int nDelta)
+{
+    assert(nPos >= 0);
+    if (nPos >= Size()) {
+        // Positions only grow, double the capacity to keep rebuilds rare
+        vCount.resize(std::max<int64_t>(nPos + 1, 2 * Size()), 0);
+        Rebuild();
+    }
+    vCount[nPos] += nDelta;
+    nTotal += nDelta;
+    for (int64_t i = nPos; i < Size(); i |= i + 1)
+        vTree[i] += nDelta;
+}
+
+int64_t CHistoryCounts::Prefix(int64_t nPos) const
+{
+    int64_t nSum = 0;
+    for (int64_t i = std::min(nPos, Size() - 1); i >= 0; i = (i & (i + 1)) - 1)
+        nSum += vTree[i];
+    return nSum;
+}
+
+/**
+ * listtransactions entries of a transaction for all accounts and spendable
+ * outputs, as long as its received entries show; those are counted in
+ * nReceived as well.
+ */
+template <typename WalletTx>
+static int HistoryEntries(const WalletTx& wtx, int& nReceived)
+{
+    CAmount nFee;
+    std::string strSentAccount;
+    std::list<COutputEntry> listReceived;
+    std::list<COutputEntry> listSent;
+    wtx.GetAmounts(listReceived, listSent, nFee, strSentAccount, ISMINE_SPENDABLE);
+    nReceived = listReceived.size();
+    return listSent.size() + listReceived.size();
+}
+
 int64_t CWallet::IncOrderPosNext(CWalletDB* pwalletdb)
 {
     AssertLockHeld(cs_wallet); // nOrderPosNext
@@ -609,16 +748,138 @@ int64_t CWallet::IncOrderPosNext(CWalletDB* pwalletdb)
     return nRet;
 }
 
+void CWallet::MarkDirty()
+{
+    LOCK(cs_wallet);
+    for (std::map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        it->second.MarkDirty();
+    fHistoryCountsValid = false;
+    setHistoryUnconfirmed.clear();
+}
+
+void CWallet::BuildHistoryCounts()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    historyCounts.Clear();
+    setHistoryUnconfirmed.clear();
+    fHistoryCountsValid = false;
+
+    int nReceived;
+    for (TxItems::const_iterator it = wtxOrdered.begin(); it != wtxOrdered.end(); ++it) {
+        if (it->first < 0)
+            return; // not reordered yet
+        const CWalletTx* pwtx = it->second.first;
+        if (pwtx) {
+            historyCounts.Add(it->first, HistoryEntries(*pwtx, nReceived));
+            if (pwtx->GetDepthInMainChain() <= 0)
+                setHistoryUnconfirmed.insert(std::make_pair(it->first, pwtx));
+        } else {
+            historyCounts.Add(it->first, 1);
+        }
+    }
+    for (ArchivedItems::const_iterator it = archivedOrdered.begin(); it != archivedOrdered.end(); ++it) {
+        if (it->first < 0)
+            return;
+        historyCounts.Add(it->first, HistoryEntries(*it->second, nReceived));
+    }
+    fHistoryCountsValid = true;
+}
+
+void CWallet::HistoryAddTx(int64_t nOrderPos, const CWalletTx& wtx, int nSign)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fHistoryCountsValid)
+        return;
+    if (nOrderPos < 0) {
+        fHistoryCountsValid = false;
+        return;
+    }
+    int nReceived;
+    historyCounts.Add(nOrderPos, nSign * HistoryEntries(wtx, nReceived));
+    if (nSign < 0)
+        setHistoryUnconfirmed.erase(std::make_pair(nOrderPos, &wtx));
+}
+
+//! Not in a block as of its last sync: unconfirmed in the history, and pending until that changes
+static bool IsUnconfirmedSync(const CMerkleTx& tx)
+{
+    return tx.hashUnset() || tx.nIndex == -1;
+}
+
+void CWallet::HistorySetUnconfirmed(const CWalletTx& wtx, bool fUnconfirmed)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fHistoryCountsValid)
+        return;
+    if (fUnconfirmed)
+        setHistoryUnconfirmed.insert(std::make_pair(wtx.nOrderPos, &wtx));
+    else
+        setHistoryUnconfirmed.erase(std::make_pair(wtx.nOrderPos, &wtx));
+}
+
+//! Entries at positions <= nPos, less the hidden ones; vHidden holds running totals by position
+static int64_t HistoryShownUpTo(const CHistoryCounts& counts, const std::vector<std::pair<int64_t, int64_t> >& vHidden, int64_t nPos)
+{
+    std::vector<std::pair<int64_t, int64_t> >::const_iterator it = std::upper_bound(vHidden.begin(), vHidden.end(), std::make_pair(nPos, std::numeric_limits<int64_t>::max()));
+    return counts.Prefix(nPos) - (it == vHidden.begin() ? 0 : (it - 1)->second);
+}
+
+bool CWallet::SeekHistory(int nSkip, int64_t& nOrderPos, int& nSkipAtPos)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (!fHistoryCountsValid)
+        BuildHistoryCounts();
+    if (!fHistoryCountsValid)
+        return false;
+
+    // Received entries of transactions that are neither in the chain nor in
+    // the mempool don't show, running total by position
+    std::vector<std::pair<int64_t, int64_t> > vHidden;
+    int64_t nHidden = 0;
+    for (std::set<std::pair<int64_t, const CWalletTx*> >::const_iterator it = setHistoryUnconfirmed.begin(); it != setHistoryUnconfirmed.end(); ++it) {
+        if (it->second->GetDepthInMainChain() >= 0)
+            continue;
+        int nReceived;
+        HistoryEntries(*it->second, nReceived);
+        if (nReceived == 0)
+            continue;
+        nHidden += nReceived;
+        vHidden.push_back(std::make_pair(it->first, nHidden));
+    }
+
+    int64_t nShown = historyCounts.Total() - nHidden;
+    if (nSkip >= nShown) {
+        nOrderPos = -1;
+        nSkipAtPos = 0;
+        return true;
+    }
+
+    // Lowest position that, with everything before it, holds the entries
+    // left after skipping the nSkip newest ones
+    int64_t nTarget = nShown - nSkip;
+    int64_t nLow = 0;
+    int64_t nHigh = historyCounts.Size() - 1;
+    while (nLow < nHigh) {
+        int64_t nMid = nLow + (nHigh - nLow) / 2;
+        if (HistoryShownUpTo(historyCounts, vHidden, nMid) >= nTarget)
+            nHigh = nMid;
+        else
+            nLow = nMid + 1;
+    }
+    nOrderPos = nLow;
+    nSkipAtPos = nSkip - (nShown - HistoryShownUpTo(historyCounts, vHidden, nLow));
+    return true;
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
 
     if (fFromLoadWallet) {
         mapWallet[hash] = wtxIn;
-        CWalletTx& wtx = mapWallet[hash];
-        wtx.BindWallet(this);
-        wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
-        AddToSpends(hash);
+        LoadToWallet(hash);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -633,10 +894,29 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
             wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
             wtx.nTimeSmart = ComputeTimeSmart(wtx);
             AddToSpends(hash);
+
+            // Wallet transactions spending this one, seen before it, now debit us
+            bool fDirtySpenders = false;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+                std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+                for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+                    std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(it->second);
+                    if (mi != mapWallet.end()) {
+                        mi->second.MarkDirty();
+                        fDirtySpenders = true;
+                    }
+                }
+            }
+            if (fDirtySpenders)
+                fHistoryCountsValid = false;
+            HistoryAddTx(wtx.nOrderPos, wtx);
         }
 
         bool fUpdated = false;
         if (!fInsertedNew) {
+            // Synced again: confirmed, disconnected or conflicted
+            MarkSpendsDirty(wtx);
+
             // Merge
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock) {
                 wtx.hashBlock = wtxIn.hashBlock;
@@ -652,6 +932,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                 fUpdated = true;
             }
         }
+        const bool fUnconfirmed = IsUnconfirmedSync(wtxIn);
+        HistorySetUnconfirmed(wtx, fUnconfirmed);
+        SetPending(wtx, fUnconfirmed);
 
         //// debug print
         if (fDebug)
@@ -676,6 +959,147 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
     return true;
 }
 
+void CWallet::LoadToWallet(const uint256& hash)
+{
+    CWalletTx& wtx = mapWallet[hash];
+    wtx.BindWallet(this);
+    wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+    AddToSpends(hash);
+    SetPending(wtx, IsUnconfirmedSync(wtx));
+}
+
+void CWallet::SetPending(CWalletTx& wtx, bool fPending)
+{
+    AssertLockHeld(cs_wallet);
+    // Never relayed, see RelayWalletTransaction
+    if (wtx.IsCoinBase() || wtx.IsCoinStake())
+        return;
+    if (fPending)
+        setPendingTxs.insert(std::make_pair(wtx.nTimeReceived, &wtx));
+    else
+        setPendingTxs.erase(std::make_pair(wtx.nTimeReceived, &wtx));
+}
+
+bool CWallet::LoadArchivedTx(const CArchivedWalletTx& atx)
+{
+    std::pair<std::map<uint256, CArchivedWalletTx>::iterator, bool> ret = mapArchived.insert(make_pair(atx.GetHash(), atx));
+    if (!ret.second)
+        return false;
+    CArchivedWalletTx& entry = ret.first->second;
+    entry.BindWallet(this);
+    archivedOrdered.insert(make_pair(entry.nOrderPos, &entry));
+
+    // Its spends keep the parents' outputs spent; when it was archived in
+    // this session they are still in mapTxSpends
+    const uint256& hash = entry.GetHash();
+    BOOST_FOREACH (const COutPoint& outpoint, entry.vSpent) {
+        bool fKnown = false;
+        pair<TxSpends::iterator, TxSpends::iterator> range = mapTxSpends.equal_range(outpoint);
+        for (TxSpends::iterator it = range.first; it != range.second && !fKnown; ++it)
+            fKnown = (it->second == hash);
+        if (!fKnown)
+            AddToSpends(outpoint, hash);
+        // Archived spenders are deeper than any reorganization
+        mapSpendState[outpoint] = SPEND_CONFIRMED;
+    }
+
+    if (fHistoryCountsValid) {
+        int nReceived;
+        historyCounts.Add(entry.nOrderPos, HistoryEntries(entry, nReceived));
+    }
+    return true;
+}
+
+bool CWallet::IsArchivable(const CWalletTx& wtx, int nMinDepth) const
+{
+    AssertLockHeld(cs_wallet);
+    if (wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < nMinDepth)
+        return false;
+
+    // Every output of ours must be spent by a transaction that is itself
+    // out of reach of a reorganization
+    const uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+        bool fSpentDeep = false;
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second && !fSpentDeep; ++it) {
+            std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            if (mit != mapWallet.end())
+                fSpentDeep = mit->second.GetDepthInMainChain() >= nMinDepth;
+            else
+                fSpentDeep = mapArchived.count(it->second) != 0;
+        }
+        if (!fSpentDeep)
+            return false;
+    }
+    return true;
+}
+
+int CWallet::ArchiveSpentTransactions()
+{
+    if (nWalletArchiveDepth <= 0 || !fFileBacked)
+        return 0;
+    // Never archive anything a reorganization could still touch
+    int nMinDepth = std::max(nWalletArchiveDepth, Params().GetMaxReorganizationDepth() + 1);
+    int64_t nStart = GetTimeMillis();
+
+    LOCK2(cs_main, cs_wallet);
+    std::vector<CArchivedWalletTx> vArchive;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        const CWalletTx& wtx = it->second;
+        if (IsArchivable(wtx, nMinDepth))
+            vArchive.push_back(CArchivedWalletTx(wtx, mapBlockIndex[wtx.hashBlock]->nHeight));
+    }
+    if (vArchive.empty())
+        return 0;
+
+    // Swap the records in one database transaction so a crash leaves either
+    // the full transaction or its summary on disk, never neither
+    CWalletDB walletdb(strWalletFile);
+    if (!walletdb.TxnBegin())
+        return 0;
+    BOOST_FOREACH (const CArchivedWalletTx& atx, vArchive) {
+        if (!walletdb.WriteArchivedTx(atx.GetHash(), atx) || !walletdb.EraseTx(atx.GetHash())) {
+            walletdb.TxnAbort();
+            LogPrintf("ArchiveSpentTransactions : failed to archive %s\n", atx.GetHash().ToString());
+            return 0;
+        }
+    }
+    if (!walletdb.TxnCommit())
+        return 0;
+
+    BOOST_FOREACH (const CArchivedWalletTx& atx, vArchive) {
+        const uint256& hash = atx.GetHash();
+        CWalletTx* pwtx = &mapWallet[hash];
+        HistoryAddTx(pwtx->nOrderPos, *pwtx, -1);
+        SetPending(*pwtx, false);
+        pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+        for (TxItems::iterator it = range.first; it != range.second; ++it) {
+            if (it->second.first == pwtx) {
+                wtxOrdered.erase(it);
+                break;
+            }
+        }
+        // Spends of our outputs only answered IsSpent for this transaction;
+        // spends by it stay, they still mark its parents' outputs as spent.
+        TxSpends::iterator iter = mapTxSpends.lower_bound(COutPoint(hash, 0));
+        while (iter != mapTxSpends.end() && iter->first.hash == hash)
+            mapTxSpends.erase(iter++);
+        for (unsigned int i = 0; i < atx.vout.size(); i++)
+            mapSpendState.erase(COutPoint(hash, i));
+        mapWallet.erase(hash);
+        mapRequestCount.erase(hash);
+        LoadArchivedTx(atx);
+        NotifyTransactionChanged(this, hash, CT_DELETED);
+    }
+
+    LogPrintf("ArchiveSpentTransactions : archived %u transactions (%u live, %u archived)  %dms\n",
+        vArchive.size(), mapWallet.size(), mapArchived.size(), GetTimeMillis() - nStart);
+    return vArchive.size();
+}
+
 bool CWallet::AddToWallet_Legacy(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
@@ -746,6 +1170,9 @@ bool CWallet::AddToWallet_Legacy(const CWalletTx& wtxIn, bool fFromLoadWallet, C
 
         bool fUpdated = false;
         if (!fInsertedNew) {
+            // Synced again: confirmed, disconnected or conflicted
+            MarkSpendsDirty(wtx);
+
             // Merge
             if (!wtxIn.hashUnset() && wtxIn.hashBlock != wtx.hashBlock) {
                 wtx.hashBlock = wtxIn.hashBlock;
@@ -800,6 +1227,8 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
         AssertLockHeld(cs_wallet);
         bool fExisted = mapWallet.count(tx.GetHash()) != 0;
         if (fExisted && !fUpdate) return false;
+        if (mapArchived.count(tx.GetHash()))
+            return false; // Already final, see ArchiveSpentTransactions
         if (fExisted || IsMine(tx) || IsFromMe(tx)) {
             CWalletTx wtx(this, tx);
 
@@ -856,10 +1285,13 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.hashBlock = hashBlock;
             wtx.WriteToDisk(&walletdb);
+            MarkSpendsDirty(wtx);
+            HistorySetUnconfirmed(wtx, true);
+            SetPending(wtx, false);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
             while (iter != mapTxSpends.end() && iter->first.hash == now) {
-                if (!done.count(iter->second)) {
+                if (!done.count(iter->second) && mapWallet.count(iter->second)) {
                     todo.insert(iter->second);
                 }
                 iter++;
@@ -881,8 +1313,23 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end()) {
+            CWalletTx* pwtx = &mi->second;
+            HistorySetUnconfirmed(*pwtx, false);
+            SetPending(*pwtx, false);
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it) {
+                if (it->second.first == pwtx) {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            }
+            mapWallet.erase(mi);
+            // Its spenders no longer debit us
+            MarkDirty();
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -892,12 +1339,9 @@ isminetype CWallet::IsMine(const CTxIn& txin) const
 {
     {
         LOCK(cs_wallet);
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
-        if (mi != mapWallet.end()) {
-            const CWalletTx& prev = (*mi).second;
-            if (txin.prevout.n < prev.vout.size())
-                return IsMine(prev.vout[txin.prevout.n]);
-        }
+        const CTxOut* prevout = GetWalletTxOut(txin.prevout);
+        if (prevout)
+            return IsMine(*prevout);
     }
     return ISMINE_NO;
 }
@@ -906,13 +1350,9 @@ CAmount CWallet::GetDebit(const CTxIn& txin, const isminefilter& filter) const
 {
     {
         LOCK(cs_wallet);
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
-        if (mi != mapWallet.end()) {
-            const CWalletTx& prev = (*mi).second;
-            if (txin.prevout.n < prev.vout.size())
-                if (IsMine(prev.vout[txin.prevout.n]) & filter)
-                    return prev.vout[txin.prevout.n].nValue;
-        }
+        const CTxOut* prevout = GetWalletTxOut(txin.prevout);
+        if (prevout && (IsMine(*prevout) & filter))
+            return prevout->nValue;
     }
     return 0;
 }
@@ -1205,10 +1645,18 @@ void CWalletTx::GetAmounts(list<COutputEntry>& listReceived,
     string& strSentAccount,
     const isminefilter& filter) const
 {
+    strSentAccount = strFromAccount;
+    std::map<isminefilter, CachedAmounts>::const_iterator mi = mapAmountsCached.find(filter);
+    if (mi != mapAmountsCached.end()) {
+        listReceived = mi->second.listReceived;
+        listSent = mi->second.listSent;
+        nFee = mi->second.nFee;
+        return;
+    }
+
     nFee = 0;
     listReceived.clear();
     listSent.clear();
-    strSentAccount = strFromAccount;
 
     // Compute fee:
     CAmount nDebit = GetDebit(filter);
@@ -1251,6 +1699,11 @@ void CWalletTx::GetAmounts(list<COutputEntry>& listReceived,
         if (fIsMine & filter)
             listReceived.push_back(output);
     }
+
+    CachedAmounts& cached = mapAmountsCached[filter];
+    cached.listReceived = listReceived;
+    cached.listSent = listSent;
+    cached.nFee = nFee;
 }
 
 void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived, CAmount& nSent, CAmount& nFee, const isminefilter& filter) const
@@ -1283,6 +1736,134 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
 }
 
 
+CArchivedWalletTx::CArchivedWalletTx(const CWalletTx& wtx, int nHeightIn)
+{
+    SetNull();
+    hash = wtx.GetHash();
+    hashBlock = wtx.hashBlock;
+    nHeight = nHeightIn;
+    nTime = wtx.nTimeSmart;
+    nTimeReceived = wtx.nTimeReceived;
+    nOrderPos = wtx.nOrderPos;
+    if (wtx.IsCoinBase())
+        nFlags |= FLAG_COINBASE;
+    if (wtx.IsCoinStake())
+        nFlags |= FLAG_COINSTAKE;
+    nDebitSpendable = wtx.GetDebit(ISMINE_SPENDABLE);
+    nDebitWatchOnly = wtx.GetDebit(ISMINE_WATCH_ONLY);
+    nDebitStake = wtx.GetDebit(ISMINE_STAKE);
+    strFromAccount = wtx.strFromAccount;
+    mapValue = wtx.mapValue;
+    vout = wtx.vout;
+    if (!wtx.IsCoinBase()) {
+        BOOST_FOREACH (const CTxIn& txin, wtx.vin)
+            vSpent.push_back(txin.prevout);
+    }
+}
+
+int CArchivedWalletTx::GetDepthInMainChain() const
+{
+    AssertLockHeld(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+        return 0;
+    return chainActive.Height() - mi->second->nHeight + 1;
+}
+
+CAmount CArchivedWalletTx::GetValueOut() const
+{
+    CAmount nValueOut = 0;
+    BOOST_FOREACH (const CTxOut& txout, vout)
+        nValueOut += txout.nValue;
+    return nValueOut;
+}
+
+CAmount CArchivedWalletTx::GetDebit(const isminefilter& filter) const
+{
+    CAmount debit = 0;
+    if (filter & ISMINE_SPENDABLE)
+        debit += nDebitSpendable;
+    if (filter & ISMINE_WATCH_ONLY)
+        debit += nDebitWatchOnly;
+    if (filter & ISMINE_STAKE)
+        debit += nDebitStake;
+    return debit;
+}
+
+CAmount CArchivedWalletTx::GetCredit(const isminefilter& filter) const
+{
+    CAmount credit = 0;
+    BOOST_FOREACH (const CTxOut& txout, vout)
+        credit += pwallet->GetCredit(txout, filter);
+    return credit;
+}
+
+void CArchivedWalletTx::GetAmounts(list<COutputEntry>& listReceived,
+    list<COutputEntry>& listSent,
+    CAmount& nFee,
+    string& strSentAccount,
+    const isminefilter& filter) const
+{
+    nFee = 0;
+    listReceived.clear();
+    listSent.clear();
+    strSentAccount = strFromAccount;
+
+    CAmount nDebit = GetDebit(filter);
+    if (nDebit > 0)
+        nFee = nDebit - GetValueOut();
+
+    // Same rules as CWalletTx::GetAmounts
+    for (unsigned int i = 0; i < vout.size(); ++i) {
+        const CTxOut& txout = vout[i];
+        isminetype fIsMine = pwallet->IsMine(txout);
+        if (nDebit > 0) {
+            if (pwallet->IsChange(txout))
+                continue;
+        } else if (!(fIsMine & filter))
+            continue;
+
+        CTxDestination address;
+        if (!ExtractDestination(txout.scriptPubKey, address))
+            address = CNoDestination();
+
+        COutputEntry output = {address, txout.nValue, (int)i};
+        if (nDebit > 0)
+            listSent.push_back(output);
+        if (fIsMine & filter)
+            listReceived.push_back(output);
+    }
+}
+
+void CArchivedWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived, CAmount& nSent, CAmount& nFee, const isminefilter& filter) const
+{
+    nReceived = nSent = nFee = 0;
+
+    CAmount allFee;
+    string strSentAccount;
+    list<COutputEntry> listReceived;
+    list<COutputEntry> listSent;
+    GetAmounts(listReceived, listSent, allFee, strSentAccount, filter);
+
+    if (strAccount == strSentAccount) {
+        BOOST_FOREACH (const COutputEntry& s, listSent)
+            nSent += s.amount;
+        nFee = allFee;
+    }
+    {
+        LOCK(pwallet->cs_wallet);
+        BOOST_FOREACH (const COutputEntry& r, listReceived) {
+            map<CTxDestination, CAddressBookData>::const_iterator mi = pwallet->mapAddressBook.find(r.destination);
+            if (mi != pwallet->mapAddressBook.end()) {
+                if ((*mi).second.name == strAccount)
+                    nReceived += r.amount;
+            } else if (strAccount.empty()) {
+                nReceived += r.amount;
+            }
+        }
+    }
+}
+
 bool CWalletTx::WriteToDisk(CWalletDB* pwalletdb)
 {
     return pwalletdb->WriteTx(GetHash(), *this);
@@ -1365,7 +1946,7 @@ bool CWalletTx::InMempool() const
     return false;
 }
 
-void CWalletTx::RelayWalletTransaction()
+bool CWalletTx::RelayWalletTransaction()
 {
     if (!IsCoinBase()) {
         if (GetDepthInMainChain() == 0) {
@@ -1374,8 +1955,10 @@ void CWalletTx::RelayWalletTransaction()
                 LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             RelayTransaction((CTransaction) * this);
+            return true;
         }
     }
+    return false;
 }
 
 set<uint256> CWalletTx::GetConflicts() const
@@ -1405,23 +1988,35 @@ void CWallet::ResendWalletTransactions()
         return;
     nLastResend = GetTime();
 
-    // Rebroadcast any of our txes that aren't in a block yet    
-    {
-        LOCK(cs_wallet);
-        // Sort them in chronological order
-        multimap<unsigned int, CWalletTx*> mapSorted;
-        BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet) {
-            CWalletTx& wtx = item.second;
-            // Don't rebroadcast until it's had plenty of time that
-            // it should have gotten in already by now.
-            if (nTimeBestReceived - (int64_t)wtx.nTimeReceived > 5 * 60)
-                mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
-        }
-        BOOST_FOREACH (PAIRTYPE(const unsigned int, CWalletTx*) & item, mapSorted) {
-            CWalletTx& wtx = *item.second;
-            wtx.RelayWalletTransaction();
-        }
+    // Don't rebroadcast until it's had plenty of time that
+    // it should have gotten in already by now.
+    LOCK2(cs_main, cs_wallet);
+    ResendWalletTransactionsBefore(nTimeBestReceived - 5 * 60);
+}
+
+std::vector<uint256> CWallet::ResendWalletTransactionsBefore(int64_t nTime)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    std::vector<uint256> result;
+    // Rebroadcast any of our txes that aren't in a block yet, in
+    // chronological order; the rest is newer.
+    BOOST_FOREACH (const PAIRTYPE(unsigned int, CWalletTx*) & item, setPendingTxs) {
+        if ((int64_t)item.first >= nTime)
+            break;
+        if (item.second->RelayWalletTransaction())
+            result.push_back(item.second->GetHash());
     }
+    return result;
+}
+
+bool CWallet::IsPendingTx(const uint256& hash) const
+{
+    AssertLockHeld(cs_wallet);
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return false;
+    return setPendingTxs.count(std::make_pair(mi->second.nTimeReceived, const_cast<CWalletTx*>(&mi->second))) != 0;
 }
 
 /** @} */ // end of mapWallet
@@ -1634,13 +2229,17 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
 
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
 
+    // Keep the total work bounded for wallets with very many small coins
+    if (!vValue.empty())
+        iterations = std::max<int64_t>(1, std::min<int64_t>(iterations, KNAPSACK_MAX_WORK / vValue.size()));
+
     seed_insecure_rand();
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
@@ -1673,6 +2272,79 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
     }
 }
 
+bool SelectCoinsBnB(const std::vector<CInputCoin>& vUTXOPool, const CAmount& nTargetValue, const CAmount& nCostOfChange, std::vector<CInputCoin>& vSelectionRet, CAmount& nValueRet, size_t nMaxTries)
+{
+    vSelectionRet.clear();
+    nValueRet = 0;
+
+    CAmount nCurrAvailable = 0;
+    BOOST_FOREACH (const CInputCoin& coin, vUTXOPool) {
+        assert(coin.nEffectiveValue > 0);
+        nCurrAvailable += coin.nEffectiveValue;
+    }
+    if (nCurrAvailable < nTargetValue)
+        return false;
+
+    // vCurrSelection[k] tells whether vUTXOPool[k] is in the current branch
+    std::vector<char> vCurrSelection;
+    std::vector<char> vBestSelection;
+    vCurrSelection.reserve(vUTXOPool.size());
+    CAmount nCurrValue = 0;
+    CAmount nBestExcess = MAX_MONEY;
+
+    for (size_t nTries = 0; nTries < nMaxTries; ++nTries) {
+        bool fBacktrack = false;
+        if (nCurrValue + nCurrAvailable < nTargetValue || nCurrValue > nTargetValue + nCostOfChange) {
+            // Cannot reach the target any more, or already past the window
+            fBacktrack = true;
+        } else if (nCurrValue >= nTargetValue) {
+            CAmount nExcess = nCurrValue - nTargetValue;
+            if (nExcess <= nBestExcess) {
+                vBestSelection = vCurrSelection;
+                vBestSelection.resize(vUTXOPool.size(), false);
+                nBestExcess = nExcess;
+                if (nExcess == 0)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack) {
+            // Drop trailing omissions, then turn the last inclusion into an omission
+            while (!vCurrSelection.empty() && !vCurrSelection.back()) {
+                vCurrSelection.pop_back();
+                nCurrAvailable += vUTXOPool[vCurrSelection.size()].nEffectiveValue;
+            }
+            if (vCurrSelection.empty())
+                break; // Whole tree searched
+            vCurrSelection.back() = false;
+            nCurrValue -= vUTXOPool[vCurrSelection.size() - 1].nEffectiveValue;
+        } else {
+            const CInputCoin& coin = vUTXOPool[vCurrSelection.size()];
+            nCurrAvailable -= coin.nEffectiveValue;
+            // Including a coin equal to one just omitted only repeats a searched branch
+            if (!vCurrSelection.empty() && !vCurrSelection.back() &&
+                coin.nEffectiveValue == vUTXOPool[vCurrSelection.size() - 1].nEffectiveValue) {
+                vCurrSelection.push_back(false);
+            } else {
+                vCurrSelection.push_back(true);
+                nCurrValue += coin.nEffectiveValue;
+            }
+        }
+    }
+
+    if (vBestSelection.empty())
+        return false;
+
+    for (size_t i = 0; i < vUTXOPool.size(); i++) {
+        if (vBestSelection[i]) {
+            vSelectionRet.push_back(vUTXOPool[i]);
+            nValueRet += vUTXOPool[i].nValue;
+        }
+    }
+    return true;
+}
+
 bool SortOutputsByValueDesc(COutput i, COutput j)
 {
     return (i.Value() > j.Value());
@@ -1752,7 +2424,7 @@ bool CWallet::MintableCoins()
     return false;
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -1764,13 +2436,19 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Shuffle pointers rather than copying the outputs for every tier
+    vector<const COutput*> vShuffled;
+    vShuffled.reserve(vCoins.size());
+    BOOST_FOREACH (const COutput& output, vCoins)
+        vShuffled.push_back(&output);
+    random_shuffle(vShuffled.begin(), vShuffled.end(), GetRandInt);
 
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++) {
         vValue.clear();
         nTotalLower = 0;
-        BOOST_FOREACH (const COutput& output, vCoins) {
+        BOOST_FOREACH (const COutput* poutput, vShuffled) {
+            const COutput& output = *poutput;
             if (!output.fSpendable)
                 continue;
 
@@ -1847,13 +2525,16 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     return true;
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type) const
+bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, const CFeeRate* pEffectiveFeeRate, CAmount nNotInputFees, bool* pfChangeless) const
 {
     // Note: this function should never be used for "always free" tx types like dstx
 
     vector<COutput> vCoins;
     AvailableCoins(vCoins, true, coinControl, false, coin_type);
 
+    if (pfChangeless)
+        *pfChangeless = false;
+
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected()) {
         BOOST_FOREACH (const COutput& out, vCoins) {
@@ -1866,9 +2547,48 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, Params().GetCoinMaturity(), vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet));
+    const int vConfMine[] = {1, 1, 0};
+    const int vConfTheirs[] = {Params().GetCoinMaturity(), 1, 1};
+
+    // Coins by descending effective value, built and sorted once for all tiers
+    vector<CInputCoin> vPool;
+    CAmount nCostOfChange = 0;
+    if (pEffectiveFeeRate) {
+        CAmount nInputFee = pEffectiveFeeRate->GetFee(COIN_SELECTION_INPUT_SIZE);
+        nCostOfChange = pEffectiveFeeRate->GetFee(COIN_SELECTION_OUTPUT_SIZE) + nInputFee;
+        vPool.reserve(vCoins.size());
+        BOOST_FOREACH (const COutput& output, vCoins) {
+            if (!output.fSpendable)
+                continue;
+            CAmount nValue = output.tx->vout[output.i].nValue;
+            if (nValue - nInputFee > 0)
+                vPool.push_back(CInputCoin(output.tx, output.i, nValue, nValue - nInputFee, output.nDepth, output.tx->IsFromMe(ISMINE_ALL)));
+        }
+        std::sort(vPool.begin(), vPool.end(), std::greater<CInputCoin>());
+    }
+
+    vector<CInputCoin> vTierPool;
+    vector<CInputCoin> vSelection;
+    for (unsigned int nTier = 0; nTier < 3; nTier++) {
+        if (!vPool.empty()) {
+            vTierPool.clear();
+            BOOST_FOREACH (const CInputCoin& coin, vPool)
+                if (coin.nDepth >= (coin.fFromMe ? vConfMine[nTier] : vConfTheirs[nTier]))
+                    vTierPool.push_back(coin);
+            if (SelectCoinsBnB(vTierPool, nTargetValue + nNotInputFees, nCostOfChange, vSelection, nValueRet)) {
+                setCoinsRet.clear();
+                BOOST_FOREACH (const CInputCoin& coin, vSelection)
+                    setCoinsRet.insert(make_pair(coin.tx, coin.i));
+                if (pfChangeless)
+                    *pfChangeless = true;
+                return true;
+            }
+        }
+        // Fall back to the knapsack solver, which adds change
+        if (SelectCoinsMinConf(nTargetValue, vConfMine[nTier], vConfTheirs[nTier], vCoins, setCoinsRet, nValueRet))
+            return true;
+    }
+    return false;
 }
 
 bool CWallet::SelectCoins_Legacy(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX, bool fProofOfStake) const
@@ -2040,6 +2760,9 @@ bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend,
         {
             LOCK2(cs_main, cs_wallet);
             {
+                // Rate at which coin selection prices the inputs it adds
+                CFeeRate feeRateSelect(GetMinimumFee(1000, nTxConfirmTarget, mempool), 1000);
+
                 nFeeRet = 0;
                 while (true) {
                     int nChangePosInOut = -1;
@@ -2098,7 +2821,13 @@ bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend,
                     set<pair<const CWalletTx*, unsigned int> > setCoins;
                     CAmount nValueIn = 0;
 
-                    if (!SelectCoins(nValueToSelect, setCoins, nValueIn, coinControl, coin_type)) {
+                    // Look for a changeless selection on the first pass only: afterwards
+                    // nFeeRet already covers the inputs and effective values would count them twice
+                    bool fTryBnB = nFeeRet == 0 && nSubtractFeeFromAmount == 0 && !(coinControl && coinControl->HasSelected());
+                    CAmount nNotInputFees = feeRateSelect.GetFee(::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION));
+                    bool fChangeless = false;
+
+                    if (!SelectCoins(nValueToSelect, setCoins, nValueIn, coinControl, coin_type, fTryBnB ? &feeRateSelect : NULL, nNotInputFees, &fChangeless)) {
                         if (coin_type == ALL_COINS)
                             strFailReason = _("Insufficient funds.");
                         
@@ -2119,6 +2848,12 @@ bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend,
                     }
                     CAmount nChange = nValueIn - nValueToSelect;
 
+                    // Less than a change output would cost is left over: it goes to the fee
+                    if (fChangeless) {
+                        nFeeRet += nChange;
+                        nChange = 0;
+                    }
+
                     if (nChange > 0) {
                         // Fill a vout to ourself
                         // TODO: pass in scriptChange instead of reservekey so
@@ -2711,6 +3446,12 @@ bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& pwa
     laccentries.push_back(acentry);
     CAccountingEntry& entry = laccentries.back();
     wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    if (fHistoryCountsValid) {
+        if (entry.nOrderPos < 0)
+            fHistoryCountsValid = false;
+        else
+            historyCounts.Add(entry.nOrderPos, 1);
+    }
 
     return true;
 }
@@ -2811,6 +3552,8 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
         mapAddressBook[address].name = strName;
         if (!strPurpose.empty()) /* update purpose only if requested */
             mapAddressBook[address].purpose = strPurpose;
+        // What counts as change depends on the address book
+        MarkDirty();
     }
     NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address) != ISMINE_NO,
         strPurpose, (fUpdated ? CT_UPDATED : CT_NEW));
@@ -2834,6 +3577,7 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
             }
         }
         mapAddressBook.erase(address);
+        MarkDirty();
     }
 
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address) != ISMINE_NO, "", CT_DELETED);
@@ -2870,7 +3614,7 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64_t nKeys = max(GetArg("-keypool", 1000), (int64_t)0);
+        int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
         for (int i = 0; i < nKeys; i++) {
             int64_t nIndex = i + 1;
             walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
@@ -2884,39 +3628,151 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
+
+    unsigned int nMissing;
+    bool fCompressed;
     {
         LOCK(cs_wallet);
-
         if (IsLocked())
             return false;
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        nMissing = nTargetSize + 1 - setKeyPool.size();
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    }
 
-        CWalletDB walletdb(strWalletFile);
-
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
-
-        while (setKeyPool.size() < (nTargetSize + 1)) {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            if (fDebug)
-                LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
+    // Making the keys is the slow part, keep the wallet usable meanwhile
+    RandAddSeedPerfmon();
+    std::vector<std::pair<CKey, CPubKey> > vKeys;
+    vKeys.reserve(nMissing);
+    for (unsigned int i = 0; i < nMissing; i++) {
+        boost::this_thread::interruption_point();
+        CKey secret;
+        secret.MakeNewKey(fCompressed);
+        CPubKey pubkey = secret.GetPubKey();
+        assert(secret.VerifyPubKey(pubkey));
+        vKeys.push_back(std::make_pair(secret, pubkey));
+        if (i % 100 == 99) {
+            double dProgress = 100.f * (i + 1) / nMissing;
             std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
             uiInterface.InitMessage(strMsg);
         }
     }
+
+    {
+        LOCK(cs_wallet);
+        // Locked again, or filled up by someone else, in the meantime
+        if (IsLocked())
+            return false;
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        vKeys.resize(nTargetSize + 1 - setKeyPool.size());
+
+        int64_t nEnd = 1;
+        if (!setKeyPool.empty())
+            nEnd = *(--setKeyPool.end()) + 1;
+
+        // Write keys and pool entries in one database transaction, so the
+        // whole batch costs a single log flush
+        CWalletDB walletdb(strWalletFile);
+        if (!walletdb.TxnBegin())
+            throw runtime_error("TopUpKeyPool() : couldn't begin database transaction");
+        pwalletdbKeyBatch = &walletdb;
+        bool fOk = true;
+        try {
+            for (unsigned int i = 0; i < vKeys.size() && fOk; i++)
+                fOk = walletdb.WritePool(nEnd + i, CKeyPool(AddGeneratedKey(vKeys[i].first, vKeys[i].second)));
+        } catch (...) {
+            pwalletdbKeyBatch = NULL;
+            walletdb.TxnAbort();
+            throw;
+        }
+        pwalletdbKeyBatch = NULL;
+        if (!fOk || !walletdb.TxnCommit()) {
+            walletdb.TxnAbort();
+            throw runtime_error("TopUpKeyPool() : writing generated key failed");
+        }
+
+        for (unsigned int i = 0; i < vKeys.size(); i++)
+            setKeyPool.insert(nEnd + i);
+        if (fDebug)
+            LogPrintf("keypool added keys %d to %d, size=%u\n", nEnd, nEnd + vKeys.size() - 1, setKeyPool.size());
+    }
     return true;
 }
 
+/** -keypoolmin, by default half of -keypool */
+static unsigned int GetKeyPoolLowWatermark()
+{
+    int64_t nKeyPoolSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
+    return max(GetArg("-keypoolmin", nKeyPoolSize / 2), (int64_t)0);
+}
+
+void CWallet::KeepKeyPoolFilled()
+{
+    LOCK(cs_wallet);
+    if (IsLocked())
+        return;
+
+    bool fRefillThread;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_keypoolrefill);
+        fRefillThread = fKeyPoolRefillThread;
+    }
+    if (!fRefillThread) {
+        TopUpKeyPool();
+        return;
+    }
+
+    // Only make a key on the spot when there is none to hand out
+    if (setKeyPool.empty())
+        TopUpKeyPool(1);
+    if (setKeyPool.size() < GetKeyPoolLowWatermark()) {
+        boost::unique_lock<boost::mutex> lock(cs_keypoolrefill);
+        fKeyPoolRefillRequested = true;
+        condKeyPoolRefill.notify_one();
+    }
+}
+
+void CWallet::ThreadKeyPoolRefill()
+{
+    RenameThread("kore-keypool");
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs_keypoolrefill);
+        fKeyPoolRefillThread = true;
+        // Catch up on anything used while the wallet was loading
+        fKeyPoolRefillRequested = true;
+    }
+
+    try {
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(cs_keypoolrefill);
+                while (!fKeyPoolRefillRequested)
+                    condKeyPoolRefill.wait(lock);
+                fKeyPoolRefillRequested = false;
+            }
+            try {
+                TopUpKeyPool();
+            } catch (const std::exception& e) {
+                LogPrintf("ThreadKeyPoolRefill : %s\n", e.what());
+            }
+        }
+    } catch (...) {
+        // Whatever ends the thread, callers go back to topping up inline
+        boost::unique_lock<boost::mutex> lock(cs_keypoolrefill);
+        fKeyPoolRefillThread = false;
+        throw;
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -2924,8 +3780,7 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        KeepKeyPoolFilled();
 
         // Get the oldest key
         if (setKeyPool.empty())
@@ -3050,7 +3905,7 @@ set<set<CTxDestination> > CWallet::GetAddressGroupings()
                 CTxDestination address;
                 if (!IsMine(txin)) /* If this input isn't mine, ignore it */
                     continue;
-                if (!ExtractDestination(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
+                if (!ExtractDestination(GetWalletTxOut(txin.prevout)->scriptPubKey, address))
                     continue;
                 grouping.insert(address);
                 any_mine = true;
@@ -3343,8 +4198,7 @@ unsigned int CWallet::ComputeTimeSmart(const CWalletTx& wtx) const
             {
                 // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                 int64_t latestTolerated = latestNow + 300;
-                TxItems txOrdered = wtxOrdered;
-                for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
+                for (TxItems::const_reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it) {
                     CWalletTx* const pwtx = (*it).second.first;
                     if (pwtx == &wtx)
                         continue;
@@ -3413,174 +4267,284 @@ bool CWallet::GetDestData(const CTxDestination& dest, const std::string& key, st
     return false;
 }
 
-void CWallet::AutoCombineDust()
+void CWallet::RunMaintenance()
 {
-    if (IsInitialBlockDownload() || IsLocked()) {
+    if (!fCombineDust && !isMultiSendEnabled())
         return;
+
+    if (IsInitialBlockDownload() || IsLocked())
+        return;
+
+    CWalletMaintenanceStats stats = GetMaintenanceStats();
+    int64_t nStart = GetTimeMillis();
+    int64_t nDeadline = nStart + nWalletMaintenanceBudget;
+    {
+        // Consolidation is never urgent: rather than queue behind block processing
+        // or the staker, give this pass up and try again on the next one
+        TRY_LOCK(cs_main, lockMain);
+        TRY_LOCK(cs_wallet, lockWallet);
+        if (!lockMain || !lockWallet) {
+            LOCK(cs_maintenance);
+            maintenanceStats.nSkippedBusy++;
+            return;
+        }
+
+        stats.nRuns++;
+        stats.nLastRun = GetTime();
+        stats.fBudgetExhausted = false;
+        stats.nCombineTxs = stats.nCombineInputs = stats.nCombineAddresses = 0;
+        stats.nMultiSendTxs = stats.nMultiSendStakes = 0;
+        stats.strLastError.clear();
+
+        // One scan of the wallet serves both tasks
+        vector<COutput> vCoins;
+        AvailableCoins(vCoins, true);
+
+        if (isMultiSendEnabled())
+            MultiSend(vCoins, nDeadline, stats);
+
+        if (fCombineDust && !stats.fBudgetExhausted)
+            AutoCombineDust(vCoins, nDeadline, stats);
     }
+    stats.nLastDurationMs = GetTimeMillis() - nStart;
 
-    map<CBitcoinAddress, vector<COutput> > mapCoinsByAddress = AvailableCoinsByAddress(true, nAutoCombineThreshold * COIN);
+    if (stats.nCombineTxs > 0 || stats.nMultiSendTxs > 0 || stats.fBudgetExhausted)
+        LogPrint("kore", "%s : %d combine txs (%d inputs, %d addresses), %d multisend txs (%d stakes) in %dms%s\n", __func__,
+            stats.nCombineTxs, stats.nCombineInputs, stats.nCombineAddresses, stats.nMultiSendTxs, stats.nMultiSendStakes,
+            stats.nLastDurationMs, stats.fBudgetExhausted ? ", budget exhausted" : "");
 
-    //coins are sectioned by address. This combination code only wants to combine inputs that belong to the same address
-    for (map<CBitcoinAddress, vector<COutput> >::iterator it = mapCoinsByAddress.begin(); it != mapCoinsByAddress.end(); it++) {
-        vector<COutput> vCoins, vRewardCoins;
-        vCoins = it->second;
+    LOCK(cs_maintenance);
+    stats.nSkippedBusy = maintenanceStats.nSkippedBusy;
+    maintenanceStats = stats;
+}
 
-        // We don't want the tx to be refused for being too large
-        // we use 50 bytes as a base tx size (2 output: 2*34 + overhead: 10 -> 90 to be certain)
-        unsigned int txSizeEstimate = 90;
+CWalletMaintenanceStats CWallet::GetMaintenanceStats() const
+{
+    LOCK(cs_maintenance);
+    return maintenanceStats;
+}
+
+bool CWallet::CombineDustBatch(const vector<pair<CBitcoinAddress, vector<COutput> > >& vBatch, bool fRequireFree, CWalletMaintenanceStats& stats)
+{
+    // Every address gets its own dust back in a single output, and the fee is
+    // shared among those outputs, so no change output is needed
+    CCoinControl coinControl;
+    vector<CRecipient> vecSend;
+    int nInputs = 0;
+    for (unsigned int i = 0; i < vBatch.size(); i++) {
+        CAmount nValue = 0;
+        BOOST_FOREACH (const COutput& out, vBatch[i].second) {
+            coinControl.Select(COutPoint(out.tx->GetHash(), out.i));
+            nValue += out.Value();
+            nInputs++;
+        }
+        CRecipient recipient = {GetScriptForDestination(vBatch[i].first.Get()), nValue, true};
+        vecSend.push_back(recipient);
+    }
+    coinControl.destChange = vBatch[0].first.Get();
+
+    CWalletTx wtx;
+    CReserveKey keyChange(this); // this change address does not end up being used, because change is returned with coin control switch
+    string strErr;
+    CAmount nFeeRet = 0;
+    if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, &coinControl, ALL_COINS)) {
+        stats.strLastError = "AutoCombineDust: " + strErr;
+        if (fDebug)
+            LogPrintf("AutoCombineDust createtransaction failed, reason: %s\n", strErr);
+        return false;
+    }
 
-        //find rewards that need to be combined
-        CCoinControl* coinControl = new CCoinControl();
+    //we don't combine below the threshold unless the fees are 0 to avoid paying fees over fees over fees
+    if (fRequireFree && nFeeRet > 0)
+        return false;
+
+    if (!CommitTransaction(wtx, keyChange)) {
+        stats.strLastError = "AutoCombineDust: transaction commit failed";
+        if (fDebug)
+            LogPrintf("AutoCombineDust transaction commit failed\n");
+        return false;
+    }
+
+    stats.nCombineTxs++;
+    stats.nCombineInputs += nInputs;
+    stats.nCombineAddresses += vBatch.size();
+    if (fDebug)
+        LogPrintf("AutoCombineDust sent transaction combining %d inputs of %u addresses\n", nInputs, vBatch.size());
+
+    return true;
+}
+
+void CWallet::AutoCombineDust(const vector<COutput>& vCoins, int64_t nDeadline, CWalletMaintenanceStats& stats)
+{
+    const CAmount nThreshold = nAutoCombineThreshold * COIN;
+
+    //coins are sectioned by address. Each address only has its own inputs combined, back to itself
+    map<CBitcoinAddress, vector<COutput> > mapCoinsByAddress;
+    BOOST_FOREACH (const COutput& out, vCoins) {
+        if (!out.fSpendable || out.tx->vout[out.i].nValue > nThreshold)
+            continue;
+
+        // MultiSend may have spent it earlier in this pass
+        if (IsSpent(out.tx->GetHash(), out.i))
+            continue;
+
+        //no coins should get this far if they dont have proper maturity, this is double checking
+        if (out.tx->IsLegacyCoinStake() && out.nDepth < Params().GetCoinMaturity() + 1)
+            continue;
+        else if (out.tx->IsCoinStake() && !out.tx->IsStakeSpendable())
+            continue;
+
+        CTxDestination address;
+        if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+            continue;
+
+        mapCoinsByAddress[CBitcoinAddress(address)].push_back(out);
+    }
+
+    // Addresses that reach the threshold are combined whatever the fee; the
+    // rest only ride along in transactions that turn out to be free
+    vector<pair<CBitcoinAddress, vector<COutput> > > vAbove, vBelow;
+    for (map<CBitcoinAddress, vector<COutput> >::iterator it = mapCoinsByAddress.begin(); it != mapCoinsByAddress.end(); it++) {
+        vector<COutput> vRewardCoins;
         CAmount nTotalRewardsValue = 0;
-        BOOST_FOREACH (const COutput& out, vCoins) {
-            if (!out.fSpendable)
-                continue;
-            //no coins should get this far if they dont have proper maturity, this is double checking
-            if (out.tx->IsLegacyCoinStake() && out.tx->GetDepthInMainChain() < Params().GetCoinMaturity() + 1)
-                continue;
-            else if (out.tx->IsCoinStake() && !out.tx->IsStakeSpendable())
-                continue;
 
-            COutPoint outpt(out.tx->GetHash(), out.i);
-            coinControl->Select(outpt);
+        // Around 180 bytes per input. We use 190 to be certain; a lone address
+        // must still fit in a transaction of its own
+        unsigned int txSizeEstimate = 90;
+        BOOST_FOREACH (const COutput& out, it->second) {
             vRewardCoins.push_back(out);
             nTotalRewardsValue += out.Value();
 
             // Combine to the threshold and not way above
-            if (nTotalRewardsValue > nAutoCombineThreshold * COIN)
+            if (nTotalRewardsValue > nThreshold)
                 break;
 
-            // Around 180 bytes per input. We use 190 to be certain
             txSizeEstimate += 190;
             if (txSizeEstimate >= MAX_STANDARD_TX_SIZE - 200)
                 break;
         }
 
-        //if no inputs found then return
-        if (!coinControl->HasSelected())
-            continue;
-
         //we cannot combine one coin with itself
         if (vRewardCoins.size() <= 1)
             continue;
 
-        vector<CRecipient> vecSend;
-        CScript scriptPubKey = GetScriptForDestination(it->first.Get());
-        CRecipient recipient = {scriptPubKey, nTotalRewardsValue, false};
-        vecSend.push_back(recipient);
-
-        //Send change to same address
-        CTxDestination destMyAddress;
-        if (!ExtractDestination(scriptPubKey, destMyAddress)) {
-            if (fDebug)
-                LogPrintf("AutoCombineDust: failed to extract destination\n");
-            continue;
-        }
-        coinControl->destChange = destMyAddress;
-
-        // Create the transaction and commit it to the network
-        CWalletTx wtx;
-        CReserveKey keyChange(this); // this change address does not end up being used, because change is returned with coin control switch
-        string strErr;
-        CAmount nFeeRet = 0;
-
-        // 10% safety margin to avoid "Insufficient funds" errors
-        vecSend[0].nAmount = nTotalRewardsValue - (nTotalRewardsValue / 10);
-
-        if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, coinControl, ALL_COINS, false)) {
-            if (fDebug)
-                LogPrintf("AutoCombineDust createtransaction failed, reason: %s\n", strErr);
-            
-            continue;
-        }
-
-        //we don't combine below the threshold unless the fees are 0 to avoid paying fees over fees over fees
-        if (nTotalRewardsValue < nAutoCombineThreshold * COIN && nFeeRet > 0)
-            continue;
+        if (nTotalRewardsValue > nThreshold)
+            vAbove.push_back(make_pair(it->first, vRewardCoins));
+        else
+            vBelow.push_back(make_pair(it->first, vRewardCoins));
+    }
 
-        if (!CommitTransaction(wtx, keyChange)) {
-            if (fDebug)
-                LogPrintf("AutoCombineDust transaction commit failed\n");
-            
-            continue;
+    for (int nPass = 0; nPass < 2; nPass++) {
+        const vector<pair<CBitcoinAddress, vector<COutput> > >& vGroups = nPass == 0 ? vAbove : vBelow;
+
+        // Pack as many addresses as fit into each transaction: 190 bytes per input, 34 per output and 10 of overhead
+        vector<pair<CBitcoinAddress, vector<COutput> > > vBatch;
+        unsigned int txSizeEstimate = 10;
+        for (unsigned int i = 0; i <= vGroups.size(); i++) {
+            unsigned int nGroupSize = i < vGroups.size() ? 34 + 190 * vGroups[i].second.size() : 0;
+            bool fFlush = i == vGroups.size() || vBatch.size() >= MAX_COMBINE_ADDRESSES_PER_TX ||
+                          txSizeEstimate + nGroupSize >= MAX_STANDARD_TX_SIZE - 200;
+            if (fFlush && !vBatch.empty()) {
+                if (GetTimeMillis() >= nDeadline) {
+                    stats.fBudgetExhausted = true;
+                    return;
+                }
+                CombineDustBatch(vBatch, nPass == 1, stats);
+                vBatch.clear();
+                txSizeEstimate = 10;
+            }
+            if (i < vGroups.size()) {
+                vBatch.push_back(vGroups[i]);
+                txSizeEstimate += nGroupSize;
+            }
         }
-
-        if (fDebug)
-            LogPrintf("AutoCombineDust sent transaction\n");
-
-        delete coinControl;
     }
 }
 
-bool CWallet::MultiSend()
+bool CWallet::MultiSend(const vector<COutput>& vCoins, int64_t nDeadline, CWalletMaintenanceStats& stats)
 {
-    if (IsInitialBlockDownload() || IsLocked()) {
+    const int nTipHeight = chainActive.Height();
+    if (nTipHeight <= nLastMultiSendHeight)
         return false;
-    }
 
-    if (chainActive.Tip()->nHeight <= nLastMultiSendHeight) {
-        if (fDebug)
-            LogPrintf("Multisend: lastmultisendheight is higher than current best height\n");
-        
+    // Wallets enabled before the height was recorded start from the tip
+    // rather than forward every stake in their history
+    if (nLastMultiSendHeight == 0) {
+        nLastMultiSendHeight = nTipHeight;
         return false;
     }
 
-    std::vector<COutput> vCoins;
-    AvailableCoins(vCoins);
-    bool stakeSent = false;
-    bool mnSent = false;
-    for (const COutput& out : vCoins) {
-        //need output with precise confirm count - this is how we identify which is the output to send
-        if (out.tx->GetDepthInMainChain() != Params().GetCoinMaturity() + 1)
+    // The pass no longer runs on every block, so rather than look for stakes
+    // with exactly maturity + 1 confirmations, take every stake that has
+    // matured since the height recorded by the previous pass
+    const int nMaturity = Params().GetCoinMaturity();
+    map<CBitcoinAddress, vector<const COutput*> > mapStakesByAddress;
+    BOOST_FOREACH (const COutput& out, vCoins) {
+        if (!(fMultiSendStake && out.tx->IsCoinStake()))
             continue;
 
-        if (!(fMultiSendStake && out.tx->IsCoinStake()))
+        if (out.nDepth < nMaturity + 1 || nTipHeight - out.nDepth + 1 + nMaturity <= nLastMultiSendHeight)
             continue;
 
         CTxDestination destMyAddress;
         if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, destMyAddress)) {
             if (fDebug)
                 LogPrintf("Multisend: failed to extract destination\n");
-            
+
             continue;
         }
 
         //Disabled Addresses won't send MultiSend transactions
-        if (vDisabledAddresses.size() > 0) {
-            for (unsigned int i = 0; i < vDisabledAddresses.size(); i++) {
-                if (vDisabledAddresses[i] == CBitcoinAddress(destMyAddress).ToString()) {
-                    if (fDebug) 
-                        LogPrintf("Multisend: disabled address preventing multisend\n");
-                    
-                    return false;
-                }
-            }
+        CBitcoinAddress address(destMyAddress);
+        if (std::find(vDisabledAddresses.begin(), vDisabledAddresses.end(), address.ToString()) != vDisabledAddresses.end()) {
+            if (fDebug)
+                LogPrintf("Multisend: disabled address preventing multisend\n");
+
+            continue;
+        }
+
+        mapStakesByAddress[address].push_back(&out);
+    }
+
+    // All the matured stakes of an address go out in one transaction, change back to that address
+    bool fSent = false;
+    bool fFailed = false;
+    for (map<CBitcoinAddress, vector<const COutput*> >::iterator it = mapStakesByAddress.begin(); it != mapStakesByAddress.end(); it++) {
+        if (GetTimeMillis() >= nDeadline) {
+            // leave nLastMultiSendHeight alone so the next pass picks up the rest
+            stats.fBudgetExhausted = true;
+            return fSent;
         }
 
-        // create new coin control, populate it with the selected utxo, create sending vector
+        // create new coin control, populate it with the selected utxos, create sending vector
         CCoinControl cControl;
-        COutPoint outpt(out.tx->GetHash(), out.i);
-        cControl.Select(outpt);
-        cControl.destChange = destMyAddress;
+        cControl.destChange = it->first.Get();
 
-        CWalletTx wtx;
-        CReserveKey keyChange(this); // this change address does not end up being used, because change is returned with coin control switch
-        CAmount nFeeRet = 0;
-        vector<CRecipient> vecSend;
+        // A stake can be split over several outputs, its reward only counts once
+        const isminefilter filter = ISMINE_SPENDABLE;
+        CAmount nReward = 0;
+        set<uint256> setStakes;
+        BOOST_FOREACH (const COutput* pout, it->second) {
+            cControl.Select(COutPoint(pout->tx->GetHash(), pout->i));
+            if (setStakes.insert(pout->tx->GetHash()).second)
+                nReward += pout->tx->GetCredit(filter) - pout->tx->GetDebit(filter);
+        }
 
         // loop through multisend vector and add amounts and addresses to the sending vector
-        const isminefilter filter = ISMINE_SPENDABLE;
-        CAmount nAmount = 0;
+        vector<CRecipient> vecSend;
         for (unsigned int i = 0; i < vMultiSend.size(); i++) {
             // MultiSend vector is a pair of 1)Address as a std::string 2) Percent of stake to send as an int
-            nAmount = ((out.tx->GetCredit(filter) - out.tx->GetDebit(filter)) * vMultiSend[i].second) / 100;
+            CAmount nAmount = (nReward * vMultiSend[i].second) / 100;
             CBitcoinAddress strAddSend(vMultiSend[i].first);
-            CScript scriptPubKey;
-            scriptPubKey = GetScriptForDestination(strAddSend.Get());
-            CRecipient recipient = {scriptPubKey, nAmount, false};
+            CRecipient recipient = {GetScriptForDestination(strAddSend.Get()), nAmount, false};
             vecSend.push_back(recipient);
         }
+        if (vecSend.empty())
+            break;
+
+        CWalletTx wtx;
+        CReserveKey keyChange(this); // this change address does not end up being used, because change is returned with coin control switch
+        CAmount nFeeRet = 0;
 
         //get the fee amount
         CWalletTx wtxdummy;
@@ -3588,47 +4552,67 @@ bool CWallet::MultiSend()
         CreateTransaction(vecSend, wtxdummy, keyChange, nFeeRet, strErr, &cControl, ALL_COINS, false);
         CAmount nLastSendAmount = vecSend[vecSend.size() - 1].nAmount;
         if (nLastSendAmount < nFeeRet + 500) {
+            stats.strLastError = strprintf("MultiSend: fee of %d is too large to insert into last output", nFeeRet + 500);
             if (fDebug)
                 LogPrintf("%s: fee of %d is too large to insert into last output\n", __func__, nFeeRet + 500);
-            
-            return false;
+
+            fFailed |= RetryMultiSend(it->first.ToString());
+            continue;
         }
         vecSend[vecSend.size() - 1].nAmount = nLastSendAmount - nFeeRet - 500;
 
         // Create the transaction and commit it to the network
-        if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, &cControl, ALL_COINS, false)) {
+        if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, &cControl, ALL_COINS)) {
+            stats.strLastError = "MultiSend: " + strErr;
             if (fDebug)
                 LogPrintf("MultiSend createtransaction failed\n");
-            
-            return false;
+
+            fFailed |= RetryMultiSend(it->first.ToString());
+            continue;
         }
 
         if (!CommitTransaction(wtx, keyChange)) {
+            stats.strLastError = "MultiSend: transaction commit failed";
             if (fDebug)
                 LogPrintf("MultiSend transaction commit failed\n");
-            
-            return false;
-        } else
-            fMultiSendNotify = true;
 
-        //write nLastMultiSendHeight to DB
-        CWalletDB walletdb(strWalletFile);
-        nLastMultiSendHeight = chainActive.Tip()->nHeight;
-        if (!walletdb.WriteMSettings(fMultiSendStake, nLastMultiSendHeight) && fDebug)
-            LogPrintf("Failed to write MultiSend setting to DB\n");
+            fFailed |= RetryMultiSend(it->first.ToString());
+            continue;
+        }
 
+        mapMultiSendFailures.erase(it->first.ToString());
+        fMultiSendNotify = true;
+        fSent = true;
+        stats.nMultiSendTxs++;
+        stats.nMultiSendStakes += setStakes.size();
         if (fDebug)
-            LogPrintf("MultiSend successfully sent\n");
-        //set which MultiSend triggered
-        if (fMultiSendStake && out.tx->IsCoinStake())
-            stakeSent = true;
+            LogPrintf("MultiSend successfully sent %u stakes of %s\n", setStakes.size(), it->first.ToString());
+    }
 
-        //stop iterating if we are done
-        if (stakeSent)
-            return true;
+    // Leave the window open while an address still has stakes to forward
+    if (fFailed)
+        return fSent;
+    nLastMultiSendHeight = nTipHeight;
+    mapMultiSendFailures.clear();
+
+    //write nLastMultiSendHeight to DB
+    if (fFileBacked) {
+        CWalletDB walletdb(strWalletFile);
+        if (!walletdb.WriteMSettings(fMultiSendStake, nLastMultiSendHeight) && fDebug)
+            LogPrintf("Failed to write MultiSend setting to DB\n");
     }
 
-    return true;
+    return fSent;
+}
+
+bool CWallet::RetryMultiSend(const std::string& strAddress)
+{
+    // Failures like a fee larger than the forwarded share repeat on every
+    // pass, so an address only holds the window for a few of them
+    if (++mapMultiSendFailures[strAddress] < MULTISEND_MAX_ATTEMPTS)
+        return true;
+    LogPrintf("MultiSend: giving up on the stakes of %s after %d failed passes\n", strAddress, MULTISEND_MAX_ATTEMPTS);
+    return false;
 }
 
 CKeyPool::CKeyPool()
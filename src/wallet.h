@@ -32,6 +32,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 /**
  * Settings
  */
@@ -41,6 +43,8 @@ extern unsigned int nTxConfirmTarget;
 extern bool bdisableSystemnotifications;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern int nWalletArchiveDepth;
+extern int64_t nWalletMaintenanceBudget;
 
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -63,8 +67,30 @@ static const bool DEFAULT_SPEND_ZEROCONF_CHANGE = true;
 
 //! -txconfirmtarget default
 static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 2;
+//! -walletarchivedepth default (0 keeps every transaction in mapWallet)
+static const int DEFAULT_WALLET_ARCHIVE_DEPTH = 0;
+//! Seconds between two passes of CWallet::ArchiveSpentTransactions
+static const int64_t WALLET_ARCHIVE_INTERVAL = 15 * 60;
+//! Seconds between two passes of CWallet::RunMaintenance (MultiSend and AutoCombineDust)
+static const int64_t WALLET_MAINTENANCE_INTERVAL = 60;
+//! Passes a MultiSend address may fail before its stakes stop holding the window
+static const int MULTISEND_MAX_ATTEMPTS = 3;
+//! -walletmaintenancebudget default, in milliseconds of work per maintenance pass
+static const int64_t DEFAULT_WALLET_MAINTENANCE_BUDGET = 250;
+//! Most addresses whose dust AutoCombineDust consolidates in one transaction
+static const unsigned int MAX_COMBINE_ADDRESSES_PER_TX = 20;
+//! Branch and bound gives up after visiting this many nodes of its search tree
+static const size_t BNB_MAX_TRIES = 100000;
+//! Upper bound on coins visited by ApproximateBestSubset over all its iterations
+static const int64_t KNAPSACK_MAX_WORK = 10000000;
+//! Estimated serialized size of a signed P2PKH input and of a P2PKH output, for effective values
+static const unsigned int COIN_SELECTION_INPUT_SIZE = 148;
+static const unsigned int COIN_SELECTION_OUTPUT_SIZE = 34;
+//! -keypool default
+static const unsigned int DEFAULT_KEYPOOL_SIZE = 1000;
 
 class CAccountingEntry;
+class CArchivedWalletTx;
 class CCoinControl;
 class COutput;
 class CReserveKey;
@@ -140,6 +166,60 @@ struct CRecipient {
     bool fSubtractFeeFromAmount;
 };
 
+/** What the scheduled wallet maintenance pass did, as reported by getwalletmaintenanceinfo */
+struct CWalletMaintenanceStats {
+    int nRuns;
+    int nSkippedBusy; // passes given up because cs_main or cs_wallet was held
+    int64_t nLastRun;
+    int64_t nLastDurationMs;
+    bool fBudgetExhausted;
+    int nCombineTxs;
+    int nCombineInputs;
+    int nCombineAddresses;
+    int nMultiSendTxs;
+    int nMultiSendStakes;
+    std::string strLastError;
+
+    CWalletMaintenanceStats()
+    {
+        nRuns = 0;
+        nSkippedBusy = 0;
+        nLastRun = 0;
+        nLastDurationMs = 0;
+        fBudgetExhausted = false;
+        nCombineTxs = 0;
+        nCombineInputs = 0;
+        nCombineAddresses = 0;
+        nMultiSendTxs = 0;
+        nMultiSendStakes = 0;
+    }
+};
+
+/**
+ * Counts per wallet history position, kept as a Fenwick tree so the sum over
+ * positions [0, nPos] costs O(log n) to read and to update.
+ */
+class CHistoryCounts
+{
+private:
+    std::vector<int> vCount;
+    std::vector<int64_t> vTree;
+    int64_t nTotal;
+
+    void Rebuild();
+
+public:
+    CHistoryCounts() : nTotal(0) {}
+
+    void Clear();
+    void Add(int64_t nPos, int nDelta);
+    //! Sum of the counts at positions <= nPos
+    int64_t Prefix(int64_t nPos) const;
+    int64_t Total() const { return nTotal; }
+    //! One past the highest position
+    int64_t Size() const { return vCount.size(); }
+};
+
 /**
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -147,7 +227,7 @@ struct CRecipient {
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS) const;
+    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, const CFeeRate* pEffectiveFeeRate = NULL, CAmount nNotInputFees = 0, bool* pfChangeless = NULL) const;
     bool SelectCoins_Legacy(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX, bool fProofOfStake) const;
 
     CWalletDB* pwalletdbEncryption;
@@ -162,6 +242,15 @@ private:
     int64_t nLastResend;
     bool fBroadcastTransactions;
 
+    /**
+     * Transactions that weren't in a block when last synced, oldest received
+     * first: all ResendWalletTransactions has to look at. Confirmed,
+     * conflicted and archived transactions leave it.
+     */
+    typedef std::set<std::pair<unsigned int, CWalletTx*> > PendingTxs;
+    PendingTxs setPendingTxs;
+    void SetPending(CWalletTx& wtx, bool fPending);
+
     /**
      * Used to keep track of spent outpoints, and
      * detect and report conflicts (double-spends or
@@ -172,18 +261,91 @@ private:
     void AddToSpends(const COutPoint& outpoint, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    /**
+     * Spent state of every outpoint that has an entry in mapTxSpends, so
+     * IsSpent answers from one hash lookup. SPEND_CONFIRMED holds until a
+     * spender is synced again (its block was disconnected) or marked
+     * conflicted; the other states still consult the spenders, as mempool
+     * membership can change without the wallet being told.
+     */
+    enum SpendState {
+        SPEND_UNKNOWN,
+        SPEND_CONFLICTED,
+        SPEND_UNCONFIRMED,
+        SPEND_CONFIRMED
+    };
+    typedef boost::unordered_map<COutPoint, unsigned char, SaltedOutpointHasher> SpendStateMap;
+    mutable SpendStateMap mapSpendState;
+    //! Forget the cached state of the outpoints spent by tx
+    void MarkSpendsDirty(const CTransaction& tx);
+
     /* Mark a transaction (and its in-wallet descendants) as conflicting with a particular block. */
     void MarkConflicted(const uint256& hashBlock, const uint256& hashTx);
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    //! Output of a wallet transaction, live or archived; NULL if unknown
+    const CTxOut* GetWalletTxOut(const COutPoint& outpoint) const;
+    bool IsArchivable(const CWalletTx& wtx, int nMinDepth) const;
+
+    //! Guards maintenanceStats, so it can be reported while the wallet is busy
+    mutable CCriticalSection cs_maintenance;
+    CWalletMaintenanceStats maintenanceStats;
+    void AutoCombineDust(const std::vector<COutput>& vCoins, int64_t nDeadline, CWalletMaintenanceStats& stats);
+    bool CombineDustBatch(const std::vector<std::pair<CBitcoinAddress, std::vector<COutput> > >& vBatch, bool fRequireFree, CWalletMaintenanceStats& stats);
+
+    //! Adds a key to the store and saves it to disk, leaving cached amounts alone
+    bool SaveKeyPubKey(const CKey& key, const CPubKey& pubkey);
+
+    //! Failed MultiSend passes per address since the window last moved
+    std::map<std::string, int> mapMultiSendFailures;
+    //! Count a failed pass for strAddress; false once it failed MULTISEND_MAX_ATTEMPTS times
+    bool RetryMultiSend(const std::string& strAddress);
+
 public:
+    /**
+     * Forward the stakes in vCoins that matured after nLastMultiSendHeight.
+     * The height only moves to the tip once every address was handled, so a
+     * failed address is retried on the next pass; stakes already forwarded
+     * are spent by then and not sent twice. An address that keeps failing,
+     * e.g. because the fee exceeds its share, is given up on after
+     * MULTISEND_MAX_ATTEMPTS passes so the window still advances.
+     */
+    bool MultiSend(const std::vector<COutput>& vCoins, int64_t nDeadline, CWalletMaintenanceStats& stats);
     bool MintableCoins();
     bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount, map<string, CAmount>& stakeableBalance, map<string, CAmount>& maxStakeableBalance);
     int CountInputsWithAmount(CAmount nInputAmount);
 
     bool SelectCoinsCollateral(std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet) const;
 
+    /**
+     * listtransactions entries of the whole history (all accounts, spendable
+     * outputs) by order position, built by the first SeekHistory and kept up
+     * to date as transactions come and go. Live transactions not known to be
+     * in the active chain are also kept in setHistoryUnconfirmed: their
+     * received entries only show while they are in the mempool, so
+     * SeekHistory checks those when it is called.
+     */
+    CHistoryCounts historyCounts;
+    bool fHistoryCountsValid;
+    std::set<std::pair<int64_t, const CWalletTx*> > setHistoryUnconfirmed;
+    void BuildHistoryCounts();
+    void HistoryAddTx(int64_t nOrderPos, const CWalletTx& wtx, int nSign = 1);
+    void HistorySetUnconfirmed(const CWalletTx& wtx, bool fUnconfirmed);
+
+    /**
+     * Open database transaction keys are written through while TopUpKeyPool
+     * adds a batch, so a second handle doesn't wait on the locks it holds.
+     */
+    CWalletDB* pwalletdbKeyBatch;
+    //! Adds a key made by GenerateNewKey or TopUpKeyPool, with its metadata
+    CPubKey AddGeneratedKey(const CKey& secret, const CPubKey& pubkey);
+
+    //! Wakes ThreadKeyPoolRefill once the pool is below -keypoolmin
+    CWaitableCriticalSection cs_keypoolrefill;
+    CConditionVariable condKeyPoolRefill;
+    bool fKeyPoolRefillRequested;
+    bool fKeyPoolRefillThread;
 
     string GetUniqueWalletBackupName() const;
 
@@ -245,7 +407,11 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbKeyBatch = NULL;
+        fKeyPoolRefillRequested = false;
+        fKeyPoolRefillThread = false;
         nOrderPosNext = 0;
+        fHistoryCountsValid = false;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
@@ -271,6 +437,14 @@ public:
         return fMultiSendStake;
     }
 
+    //! Stakes that matured before MultiSend was switched on are not forwarded
+    void setMultiSendEnabled()
+    {
+        if (!fMultiSendStake)
+            nLastMultiSendHeight = chainActive.Height();
+        fMultiSendStake = true;
+    }
+
     void setMultiSendDisabled()
     {
         fMultiSendStake = false;
@@ -283,6 +457,11 @@ public:
     typedef std::multimap<int64_t, TxPair> TxItems;
     TxItems wtxOrdered;
 
+    //! Fully spent, deeply buried transactions moved out of mapWallet
+    std::map<uint256, CArchivedWalletTx> mapArchived;
+    typedef std::multimap<int64_t, const CArchivedWalletTx*> ArchivedItems;
+    ArchivedItems archivedOrdered;
+
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -295,6 +474,7 @@ public:
     int64_t nTimeFirstKey;
 
     const CWalletTx* GetWalletTx(const uint256& hash) const;
+    const CArchivedWalletTx* GetArchivedTx(const uint256& hash) const;
 
     //! check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf)
@@ -305,7 +485,7 @@ public:
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed = true, const CCoinControl* coinControl = NULL, bool fIncludeZeroValue = false, AvailableCoinsType nCoinType = ALL_COINS, int nWatchonlyConfig = 1) const;
     std::map<CBitcoinAddress, std::vector<COutput> > AvailableCoinsByAddress(bool fConfirmed = true, CAmount maxCoinValue = 0);
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -320,7 +500,7 @@ public:
     // Generate a new key
     CPubKey GenerateNewKey();
 
-    //! Adds a key to the store, and saves it to disk.
+    //! Adds a key to the store, and saves it to disk. Marks the wallet dirty, the key may own existing outputs.
     bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key, const CPubKey& pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
@@ -339,6 +519,7 @@ public:
     bool AddCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret);
     //! Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
     bool LoadCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret);
+    //! Adds a script to the store, and saves it to disk. Marks the wallet dirty.
     bool AddCScript(const CScript& redeemScript);
     bool LoadCScript(const CScript& redeemScript);
 
@@ -351,7 +532,7 @@ public:
     //! Look up a destination data tuple in the store, return true if found false otherwise
     bool GetDestData(const CTxDestination& dest, const std::string& key, std::string* value) const;
 
-    //! Adds a watch-only address to the store, and saves it to disk.
+    //! Adds a watch-only address to the store, and saves it to disk. Marks the wallet dirty.
     bool AddWatchOnly(const CScript& dest);
     bool RemoveWatchOnly(const CScript& dest);
     //! Adds a watch-only address to the store, without saving it to disk (used by LoadWallet)
@@ -376,7 +557,31 @@ public:
      */
     int64_t IncOrderPosNext(CWalletDB* pwalletdb = NULL);
 
+    /**
+     * Where a newest-first listtransactions walk over all accounts and
+     * spendable outputs has to start to skip nSkip entries: the walk starts
+     * with the entries at order position nOrderPos and below, of which it
+     * still skips nSkipAtPos. nOrderPos is -1 when the history has fewer
+     * entries than nSkip. Returns false if the history can't be indexed
+     * (transactions without an order position), then the walk has to start
+     * from the newest entry.
+     */
+    bool SeekHistory(int nSkip, int64_t& nOrderPos, int& nSkipAtPos);
+
+    //! Forget cached transaction amounts, after keys, scripts or address book entries changed. Imported keys, scripts and watch-only addresses do this themselves.
+    void MarkDirty();
+
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
+    //! Index a transaction that was deserialized in place into mapWallet[hash] while loading
+    void LoadToWallet(const uint256& hash);
+    //! Index an archived transaction record (used by LoadWallet)
+    bool LoadArchivedTx(const CArchivedWalletTx& atx);
+    /**
+     * Move transactions whose own outputs are all spent, and that are buried
+     * deeper than -walletarchivedepth, from mapWallet into mapArchived.
+     * @return number of transactions archived
+     */
+    int ArchiveSpentTransactions();
     bool AddToWallet_Legacy(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
@@ -384,6 +589,10 @@ public:
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions(bool isLoadingTx = false);
     void ResendWalletTransactions();
+    //! Relay the pending transactions received before nTime, oldest first; returns those relayed
+    std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
+    //! Whether ResendWalletTransactions still looks at hash
+    bool IsPendingTx(const uint256& hash) const;
     CAmount GetBalance() const;
     CAmount GetStakedBalance() const;
     CAmount GetImmatureZerocoinBalance() const;
@@ -402,14 +611,27 @@ public:
     bool ConvertList(std::vector<CTxIn> vCoins, std::vector<int64_t>& vecAmounts);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, CMutableTransaction& txLock, unsigned int& nTxNewTime, bool fProofOfStake);
     bool CreateCoinStake_Legacy(const CKeyStore& keystore, CBlock* pblock, int64_t nSearchInterval, int64_t nFees, CMutableTransaction& txNew, CKey& key);
-    bool MultiSend();
-    void AutoCombineDust();
+    //! Run MultiSend and AutoCombineDust within the -walletmaintenancebudget, off the block processing path
+    void RunMaintenance();
+    CWalletMaintenanceStats GetMaintenanceStats() const;
 
     static CFeeRate minTxFee;
     static CAmount GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarget, const CTxMemPool& pool);
 
     bool NewKeyPool();
+    /**
+     * Fill the key pool up to kpSize keys (-keypool when 0). The keys are
+     * made before cs_wallet is taken and written in one database transaction.
+     */
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    /**
+     * Make sure the pool can hand out a key now, and leave filling it up to
+     * ThreadKeyPoolRefill once it drops below -keypoolmin. Without that
+     * thread the pool is topped up right here.
+     */
+    void KeepKeyPoolFilled();
+    //! Refills the key pool in the background whenever KeepKeyPoolFilled asks for it
+    void ThreadKeyPoolRefill();
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -699,6 +921,14 @@ class CWalletTx : public CMerkleTx
 private:
     const CWallet* pwallet;
 
+    struct CachedAmounts {
+        std::list<COutputEntry> listReceived;
+        std::list<COutputEntry> listSent;
+        CAmount nFee;
+    };
+    //! GetAmounts results by filter, until MarkDirty
+    mutable std::map<isminefilter, CachedAmounts> mapAmountsCached;
+
 public:
     mapValue_t mapValue;
     std::vector<std::pair<std::string, std::string> > vOrderForm;
@@ -740,6 +970,12 @@ public:
         fFromMe = false;
         strFromAccount.clear();
         nOrderPos = -1;
+        MarkDirty();
+    }
+
+    void MarkDirty()
+    {
+        mapAmountsCached.clear();
     }
 
     ADD_SERIALIZE_METHODS;
@@ -857,12 +1093,126 @@ public:
 
     int64_t GetTxTime() const;
     int GetRequestCount() const;
-    void RelayWalletTransaction();
+    bool RelayWalletTransaction();
 
     std::set<uint256> GetConflicts() const;
 };
 
 
+/**
+ * What the wallet keeps of a transaction once ArchiveSpentTransactions has
+ * moved it out of mapWallet. The input scripts and merkle branch are
+ * dropped; the outpoints it spends are kept so its parents' outputs stay
+ * spent after a restart, the outputs so later transactions spending them
+ * still resolve their debit, and the debit of the transaction itself is
+ * stored per ismine type. Database key is archtx<txid>.
+ */
+class CArchivedWalletTx
+{
+private:
+    const CWallet* pwallet;
+
+public:
+    static const int CURRENT_VERSION = 1;
+    static const char FLAG_COINBASE = 0x01;
+    static const char FLAG_COINSTAKE = 0x02;
+
+    int nVersion;
+    uint256 hash; //! not serialized, part of the key
+    uint256 hashBlock;
+    int nHeight;
+    unsigned int nTime; //! smart time of the transaction
+    unsigned int nTimeReceived;
+    int64_t nOrderPos;
+    char nFlags;
+    CAmount nDebitSpendable;
+    CAmount nDebitWatchOnly;
+    CAmount nDebitStake;
+    std::string strFromAccount;
+    mapValue_t mapValue;
+    std::vector<CTxOut> vout;
+    std::vector<COutPoint> vSpent; //! outpoints spent by the inputs
+
+    CArchivedWalletTx()
+    {
+        SetNull();
+    }
+
+    CArchivedWalletTx(const CWalletTx& wtx, int nHeightIn);
+
+    void SetNull()
+    {
+        pwallet = NULL;
+        nVersion = CURRENT_VERSION;
+        hash = 0;
+        hashBlock = 0;
+        nHeight = -1;
+        nTime = 0;
+        nTimeReceived = 0;
+        nOrderPos = -1;
+        nFlags = 0;
+        nDebitSpendable = 0;
+        nDebitWatchOnly = 0;
+        nDebitStake = 0;
+        strFromAccount.clear();
+        mapValue.clear();
+        vout.clear();
+        vSpent.clear();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(this->nVersion);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nTime);
+        READWRITE(nTimeReceived);
+        READWRITE(nOrderPos);
+        READWRITE(nFlags);
+        READWRITE(nDebitSpendable);
+        READWRITE(nDebitWatchOnly);
+        READWRITE(nDebitStake);
+        READWRITE(LIMITED_STRING(strFromAccount, 65536));
+        READWRITE(mapValue);
+        READWRITE(vout);
+        READWRITE(vSpent);
+    }
+
+    void BindWallet(const CWallet* pwalletIn)
+    {
+        pwallet = pwalletIn;
+    }
+
+    const uint256& GetHash() const { return hash; }
+    bool IsCoinBase() const { return (nFlags & FLAG_COINBASE) != 0; }
+    bool IsCoinStake() const { return (nFlags & FLAG_COINSTAKE) != 0; }
+    //! Archived transactions are always mature
+    int GetBlocksToMaturity() const { return 0; }
+    int64_t GetTxTime() const { return nTime ? nTime : nTimeReceived; }
+
+    int GetDepthInMainChain() const;
+    CAmount GetValueOut() const;
+    CAmount GetDebit(const isminefilter& filter) const;
+    CAmount GetCredit(const isminefilter& filter) const;
+
+    bool IsFromMe(const isminefilter& filter) const
+    {
+        return (GetDebit(filter) > 0);
+    }
+
+    void GetAmounts(std::list<COutputEntry>& listReceived,
+        std::list<COutputEntry>& listSent,
+        CAmount& nFee,
+        std::string& strSentAccount,
+        const isminefilter& filter) const;
+
+    void GetAccountAmounts(const std::string& strAccount, CAmount& nReceived, CAmount& nSent, CAmount& nFee, const isminefilter& filter) const;
+};
+
+
 class COutput
 {
 public:
@@ -901,6 +1251,35 @@ public:
 };
 
 
+/** A spendable output as seen by branch and bound coin selection. */
+struct CInputCoin {
+    const CWalletTx* tx;
+    unsigned int i;
+    CAmount nValue;
+    //! nValue less the fee for spending it at the selection fee rate
+    CAmount nEffectiveValue;
+    int nDepth;
+    bool fFromMe;
+
+    CInputCoin(const CWalletTx* txIn, unsigned int iIn, CAmount nValueIn, CAmount nEffectiveValueIn, int nDepthIn = 0, bool fFromMeIn = false)
+        : tx(txIn), i(iIn), nValue(nValueIn), nEffectiveValue(nEffectiveValueIn), nDepth(nDepthIn), fFromMe(fFromMeIn) {}
+
+    bool operator>(const CInputCoin& other) const
+    {
+        return nEffectiveValue > other.nEffectiveValue;
+    }
+};
+
+/**
+ * Depth first search for the set of coins whose effective values add up to
+ * between nTargetValue and nTargetValue + nCostOfChange, i.e. a transaction
+ * that needs no change output, preferring the smallest excess.
+ * vUTXOPool must be sorted by descending effective value and only hold
+ * positive effective values. Gives up after nMaxTries nodes.
+ */
+bool SelectCoinsBnB(const std::vector<CInputCoin>& vUTXOPool, const CAmount& nTargetValue, const CAmount& nCostOfChange, std::vector<CInputCoin>& vSelectionRet, CAmount& nValueRet, size_t nMaxTries = BNB_MAX_TRIES);
+
+
 /** Private key that includes an expiration date in case it never gets used. */
 class CWalletKey
 {
@@ -16,6 +16,7 @@
 #include "wallet.h"
 #include "walletdb.h"
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -27,6 +28,13 @@ using namespace std;
 
 static uint64_t nAccountingEntryNumber = 0;
 
+//! Size of the buffer LoadWallet reads records into with DB_MULTIPLE_KEY
+static const size_t WALLET_LOAD_BULK_BUFFER_SIZE = 4 << 20;
+//! Most threads used to decode transactions while loading
+static const size_t WALLET_LOAD_MAX_THREADS = 8;
+//! Fewest transactions per decoding thread worth starting it for
+static const size_t WALLET_LOAD_MIN_TXS_PER_THREAD = 256;
+
 //
 // CWalletDB
 //
@@ -69,6 +77,12 @@ bool CWalletDB::EraseTx(uint256 hash)
     return Erase(std::make_pair(std::string("tx"), hash));
 }
 
+bool CWalletDB::WriteArchivedTx(uint256 hash, const CArchivedWalletTx& atx)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("archtx"), hash), atx);
+}
+
 bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata& keyMeta)
 {
     nWalletDBUpdated++;
@@ -409,6 +423,41 @@ public:
     }
 };
 
+/**
+ * Deserialize the value of a "tx" record into wtx and check it against the
+ * hash from its key. Touches nothing but its arguments, so records can be
+ * decoded on several threads at once.
+ */
+static bool DecodeWalletTx(CDataStream& ssValue, const uint256& hash, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    fUpgraded = false;
+    try {
+        ssValue >> wtx;
+        CValidationState state;
+        if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            return false;
+
+        // Undo serialize changes in 31600
+        if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
+            if (!ssValue.empty()) {
+                char fTmp;
+                char fUnused;
+                ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                    wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+                wtx.fTimeReceivedIsTxTime = fTmp;
+            } else {
+                strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+                wtx.fTimeReceivedIsTxTime = 0;
+            }
+            fUpgraded = true;
+        }
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
 bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CWalletScanState& wss, string& strType, string& strErr)
 {
     try {
@@ -428,31 +477,21 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             uint256 hash;
             ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!DecodeWalletTx(ssValue, hash, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
-                if (!ssValue.empty()) {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                        wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                } else {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
+            if (fUpgraded)
                 wss.vWalletUpgrade.push_back(hash);
-            }
 
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
 
             pwallet->AddToWallet(wtx, true, NULL);
+        } else if (strType == "archtx") {
+            CArchivedWalletTx atx;
+            ssKey >> atx.hash;
+            ssValue >> atx;
+            pwallet->LoadArchivedTx(atx);
         } else if (strType == "acentry") {
             string strAccount;
             ssKey >> strAccount;
@@ -658,6 +697,43 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** A "tx" record read in bulk and decoded in place into its mapWallet entry */
+struct CWalletTxLoad {
+    const Dbt* pValue;
+    uint256 hash;
+    CWalletTx* pwtx;
+    bool fValid;
+    bool fUpgraded;
+    string strErr;
+};
+
+static void DecodeWalletTxRange(std::vector<CWalletTxLoad>* pvLoad, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        CWalletTxLoad& load = (*pvLoad)[i];
+        const char* pch = (const char*)load.pValue->get_data();
+        CDataStream ssValue(pch, pch + load.pValue->get_size(), SER_DISK, CLIENT_VERSION);
+        load.fValid = DecodeWalletTx(ssValue, load.hash, *load.pwtx, load.fUpgraded, load.strErr);
+    }
+}
+
+/** Decode a batch of "tx" records, split over a few threads when it is large enough to pay off */
+static void DecodeWalletTxs(std::vector<CWalletTxLoad>& vLoad)
+{
+    size_t nThreads = std::min<size_t>(std::max(boost::thread::hardware_concurrency(), 1u), WALLET_LOAD_MAX_THREADS);
+    nThreads = std::min(nThreads, vLoad.size() / WALLET_LOAD_MIN_TXS_PER_THREAD);
+    if (nThreads <= 1) {
+        DecodeWalletTxRange(&vLoad, 0, vLoad.size());
+        return;
+    }
+    boost::thread_group threads;
+    size_t nPerThread = (vLoad.size() + nThreads - 1) / nThreads;
+    for (size_t nBegin = nPerThread; nBegin < vLoad.size(); nBegin += nPerThread)
+        threads.create_thread(boost::bind(&DecodeWalletTxRange, &vLoad, nBegin, std::min(nBegin + nPerThread, vLoad.size())));
+    DecodeWalletTxRange(&vLoad, 0, nPerThread);
+    threads.join_all();
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -681,11 +757,16 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        int64_t nStart = GetTimeMillis();
+        // Holds raw key records; wiped when freed, on the error paths and when it grows too
+        CSerializeData vchBuffer(WALLET_LOAD_BULK_BUFFER_SIZE);
+        std::vector<std::pair<Dbt, Dbt> > vRecords;
+        std::vector<CWalletTxLoad> vLoad;
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         while (true) {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            // Read the next run of records
+            int ret = ReadAtCursorBulk(pcursor, vchBuffer, vRecords);
             if (ret == DB_NOTFOUND)
                 break;
             else if (ret != 0) {
@@ -693,25 +774,73 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr)) {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+            vLoad.clear();
+            for (size_t i = 0; i < vRecords.size(); i++) {
+                const char* pchKey = (const char*)vRecords[i].first.get_data();
+                const char* pchValue = (const char*)vRecords[i].second.get_data();
+                ssKey.clear();
+                ssKey.write(pchKey, vRecords[i].first.get_size());
+
+                // Transactions are decoded below, straight into their mapWallet slot
+                string strType;
+                try {
+                    ssKey >> strType;
+                    if (strType == "tx") {
+                        CWalletTxLoad load;
+                        load.pValue = &vRecords[i].second;
+                        ssKey >> load.hash;
+                        if (!pwallet->mapWallet.count(load.hash)) {
+                            load.pwtx = &pwallet->mapWallet[load.hash];
+                            vLoad.push_back(load);
+                            continue;
+                        }
+                    }
+                } catch (...) {
                 }
+                ssKey.clear();
+                ssKey.write(pchKey, vRecords[i].first.get_size());
+                ssValue.clear();
+                ssValue.write(pchValue, vRecords[i].second.get_size());
+
+                // Try to be tolerant of single corrupt records:
+                string strErr;
+                if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr)) {
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
+                }
+                if (!strErr.empty())
+                    LogPrintf("%s\n", strErr);
+            }
+
+            DecodeWalletTxs(vLoad);
+            BOOST_FOREACH (CWalletTxLoad& load, vLoad) {
+                if (!load.strErr.empty())
+                    LogPrintf("%s\n", load.strErr);
+                if (!load.fValid) {
+                    pwallet->mapWallet.erase(load.hash);
+                    fNoncriticalErrors = true;
+                    // Rescan if there is a bad transaction record:
+                    SoftSetBoolArg("-rescan", true);
+                    continue;
+                }
+                if (load.fUpgraded)
+                    wss.vWalletUpgrade.push_back(load.hash);
+                if (load.pwtx->nOrderPos == -1)
+                    wss.fAnyUnordered = true;
+                pwallet->LoadToWallet(load.hash);
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+        LogPrint("db", "%s: read %u transactions in %dms\n", __func__, pwallet->mapWallet.size(), GetTimeMillis() - nStart);
     } catch (boost::thread_interrupted) {
         throw;
     } catch (...) {
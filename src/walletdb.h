@@ -20,6 +20,7 @@
 
 class CAccount;
 class CAccountingEntry;
+class CArchivedWalletTx;
 struct CBlockLocator;
 class CKeyPool;
 class CMasterKey;
@@ -89,6 +90,7 @@ public:
 
     bool WriteTx(uint256 hash, const CWalletTx& wtx);
     bool EraseTx(uint256 hash);
+    bool WriteArchivedTx(uint256 hash, const CArchivedWalletTx& atx);
 
     bool WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata& keyMeta);
     bool WriteCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret, const CKeyMetadata& keyMeta);
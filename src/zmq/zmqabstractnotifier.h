@@ -10,12 +10,15 @@
 class CBlockIndex;
 class CZMQAbstractNotifier;
 
+//! Default outgoing queue limit of a publisher socket, in messages (ZMQ_SNDHWM)
+static const int DEFAULT_ZMQ_SNDHWM = 1000;
+
 typedef CZMQAbstractNotifier* (*CZMQNotifierFactory)();
 
 class CZMQAbstractNotifier
 {
 public:
-    CZMQAbstractNotifier() : psocket(0) { }
+    CZMQAbstractNotifier() : psocket(0), nSendHighWaterMark(DEFAULT_ZMQ_SNDHWM) { }
     virtual ~CZMQAbstractNotifier();
 
     template <typename T>
@@ -28,18 +31,26 @@ public:
     void SetType(const std::string &t) { type = t; }
     std::string GetAddress() const { return address; }
     void SetAddress(const std::string &a) { address = a; }
+    int GetSendHighWaterMark() const { return nSendHighWaterMark; }
+    void SetSendHighWaterMark(int n) { nSendHighWaterMark = n; }
 
     virtual bool Initialize(void *pcontext) = 0;
     virtual void Shutdown() = 0;
 
-    virtual bool NotifyBlock(const CBlockIndex *pindex);
+    //! A block was connected to the active chain, block is its in-memory copy
+    virtual bool NotifyBlock(const CBlockIndex *pindex, const CBlock &block);
+    virtual bool NotifyBlockDisconnected(const CBlockIndex *pindex);
     virtual bool NotifyTransaction(const CTransaction &transaction);
     virtual bool NotifyTransactionLock(const CTransaction &transaction);
+    //! Mempool additions and removals, with the mempool sequence number of the change
+    virtual bool NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence);
+    virtual bool NotifyTransactionRemoval(const CTransaction &transaction, uint64_t nMempoolSequence);
 
 protected:
     void *psocket;
     std::string type;
     std::string address;
+    int nSendHighWaterMark;
 };
 
 #endif // BITCOIN_ZMQ_ZMQABSTRACTNOTIFIER_H
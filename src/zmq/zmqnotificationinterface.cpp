@@ -8,14 +8,18 @@
 #include "version.h"
 #include "main.h"
 #include "streams.h"
+#include "txmempool.h"
 #include "util.h"
 
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
 void zmqError(const char *str)
 {
     LogPrint("zmq", "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
 }
 
-CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL)
+CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL), fPublishBlockData(false), fPublishMempool(false), nQueuedBytes(0), fStopping(false)
 {
 }
 
@@ -41,6 +45,7 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
     factories["pubrawtxlock"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionLockNotifier>;
+    factories["pubsequence"] = CZMQAbstractNotifier::Create<CZMQPublishSequenceNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -52,6 +57,9 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
             CZMQAbstractNotifier *notifier = factory();
             notifier->SetType(i->first);
             notifier->SetAddress(address);
+            std::map<std::string, std::string>::const_iterator k = args.find("-zmq" + i->first + "hwm");
+            if (k!=args.end())
+                notifier->SetSendHighWaterMark(std::max(0, atoi(k->second)));
             notifiers.push_back(notifier);
         }
     }
@@ -105,6 +113,22 @@ bool CZMQNotificationInterface::Initialize()
         return false;
     }
 
+    for (i=notifiers.begin(); i!=notifiers.end(); ++i)
+    {
+        if ((*i)->GetType() == "pubrawblock")
+            fPublishBlockData = true;
+        if ((*i)->GetType() == "pubsequence")
+            fPublishMempool = true;
+    }
+
+    // Mempool changes are only published on the sequence topic, don't queue them otherwise
+    if (fPublishMempool)
+    {
+        mempool.NotifyEntryAdded.connect(boost::bind(&CZMQNotificationInterface::TransactionAddedToMempool, this, _1, _2));
+        mempool.NotifyEntryRemoved.connect(boost::bind(&CZMQNotificationInterface::TransactionRemovedFromMempool, this, _1, _2));
+    }
+    threadPublisher = boost::thread(boost::bind(&CZMQNotificationInterface::ThreadPublish, this));
+
     return true;
 }
 
@@ -114,6 +138,21 @@ void CZMQNotificationInterface::Shutdown()
     LogPrint("zmq", "zmq: Shutdown notification interface\n");
     if (pcontext)
     {
+        if (threadPublisher.joinable())
+        {
+            if (fPublishMempool)
+            {
+                mempool.NotifyEntryAdded.disconnect(boost::bind(&CZMQNotificationInterface::TransactionAddedToMempool, this, _1, _2));
+                mempool.NotifyEntryRemoved.disconnect(boost::bind(&CZMQNotificationInterface::TransactionRemovedFromMempool, this, _1, _2));
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(cs_queue);
+                fStopping = true;
+            }
+            condQueue.notify_all();
+            // Whatever is still queued gets published first
+            threadPublisher.join();
+        }
         for (std::list<CZMQAbstractNotifier*>::iterator i=notifiers.begin(); i!=notifiers.end(); ++i)
         {
             CZMQAbstractNotifier *notifier = *i;
@@ -126,53 +165,99 @@ void CZMQNotificationInterface::Shutdown()
     }
 }
 
-void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
+void CZMQNotificationInterface::Enqueue(const Notification &notification, size_t nSize)
+{
+    boost::unique_lock<boost::mutex> lock(cs_queue);
+    // Hold the caller up rather than drop notifications when publishing falls behind;
+    // a notification larger than the byte limit still goes through once the queue is empty
+    while (!queue.empty() && (queue.size() >= ZMQ_MAX_QUEUED_NOTIFICATIONS || nQueuedBytes + nSize > ZMQ_MAX_QUEUED_BYTES) && !fStopping)
+        condQueue.wait(lock);
+    if (fStopping)
+        return;
+    queue.push_back(std::make_pair(notification, nSize));
+    nQueuedBytes += nSize;
+    condQueue.notify_all();
+}
+
+void CZMQNotificationInterface::ThreadPublish()
 {
-    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    RenameThread("kore-zmqpub");
+
+    while (true)
     {
-        CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyBlock(pindex))
+        Notification notification;
         {
-            i++;
+            boost::unique_lock<boost::mutex> lock(cs_queue);
+            while (queue.empty() && !fStopping)
+                condQueue.wait(lock);
+            if (queue.empty())
+                return;
+            notification = queue.front().first;
+            nQueuedBytes -= queue.front().second;
+            queue.pop_front();
+            condQueue.notify_all();
         }
-        else
+
+        for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
         {
-            notifier->Shutdown();
-            i = notifiers.erase(i);
+            CZMQAbstractNotifier *notifier = *i;
+            // If this thread died, Enqueue would block validation under cs_main for good,
+            // so a notifier that throws is dropped like one that fails
+            bool fOk = false;
+            try {
+                fOk = notification(notifier);
+            } catch (const std::exception& e) {
+                LogPrintf("zmq: Notifier %s at %s threw: %s\n", notifier->GetType(), notifier->GetAddress(), e.what());
+            } catch (...) {
+                LogPrintf("zmq: Notifier %s at %s threw an unknown exception\n", notifier->GetType(), notifier->GetAddress());
+            }
+            if (fOk)
+            {
+                i++;
+            }
+            else
+            {
+                notifier->Shutdown();
+                i = notifiers.erase(i);
+            }
         }
     }
 }
 
+static bool NotifyBlockConnected(CZMQAbstractNotifier *notifier, const CBlockIndex *pindex, const boost::shared_ptr<const CBlock> &pblock)
+{
+    return notifier->NotifyBlock(pindex, *pblock);
+}
+
+void CZMQNotificationInterface::BlockConnected(const CBlock &block, const CBlockIndex *pindex)
+{
+    // One copy shared by all notifiers, only made when somebody publishes the contents
+    boost::shared_ptr<const CBlock> pblock(fPublishBlockData ? new CBlock(block) : new CBlock());
+    size_t nSize = fPublishBlockData ? ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) : 0;
+    Enqueue(boost::bind(&NotifyBlockConnected, _1, pindex, pblock), nSize);
+}
+
+void CZMQNotificationInterface::BlockDisconnected(const CBlock &block, const CBlockIndex *pindex)
+{
+    Enqueue(boost::bind(&CZMQAbstractNotifier::NotifyBlockDisconnected, _1, pindex), 0);
+}
+
 void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
 {
-    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
-    {
-        CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyTransaction(tx))
-        {
-            i++;
-        }
-        else
-        {
-            notifier->Shutdown();
-            i = notifiers.erase(i);
-        }
-    }
+    Enqueue(boost::bind(&CZMQAbstractNotifier::NotifyTransaction, _1, tx), ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
 }
 
 void CZMQNotificationInterface::NotifyTransactionLock(const CTransaction &tx)
 {
-    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
-    {
-        CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyTransactionLock(tx))
-        {
-            i++;
-        }
-        else
-        {
-            notifier->Shutdown();
-            i = notifiers.erase(i);
-        }
-    }
+    Enqueue(boost::bind(&CZMQAbstractNotifier::NotifyTransactionLock, _1, tx), ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+}
+
+void CZMQNotificationInterface::TransactionAddedToMempool(const CTransaction &tx, uint64_t nMempoolSequence)
+{
+    Enqueue(boost::bind(&CZMQAbstractNotifier::NotifyTransactionAcceptance, _1, tx, nMempoolSequence), ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+}
+
+void CZMQNotificationInterface::TransactionRemovedFromMempool(const CTransaction &tx, uint64_t nMempoolSequence)
+{
+    Enqueue(boost::bind(&CZMQAbstractNotifier::NotifyTransactionRemoval, _1, tx, nMempoolSequence), ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
 }
@@ -5,13 +5,24 @@
 #ifndef BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 #define BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 
+#include "sync.h"
 #include "validationinterface.h"
+#include <deque>
+#include <list>
 #include <string>
 #include <map>
 
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
 class CBlockIndex;
 class CZMQAbstractNotifier;
 
+//! Notifications waiting for the publisher thread before the validation thread is held up
+static const size_t ZMQ_MAX_QUEUED_NOTIFICATIONS = 10000;
+//! Bytes of blocks and transactions copied for those notifications before the validation thread is held up
+static const size_t ZMQ_MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
 class CZMQNotificationInterface : public CValidationInterface
 {
 public:
@@ -25,14 +36,41 @@ protected:
 
     // CValidationInterface
     void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
-    void UpdatedBlockTip(const CBlockIndex *pindex);
+    void BlockConnected(const CBlock &block, const CBlockIndex *pindex);
+    void BlockDisconnected(const CBlock &block, const CBlockIndex *pindex);
     void NotifyTransactionLock(const CTransaction &tx);
 
+    // CTxMemPool
+    void TransactionAddedToMempool(const CTransaction &tx, uint64_t nMempoolSequence);
+    void TransactionRemovedFromMempool(const CTransaction &tx, uint64_t nMempoolSequence);
+
 private:
     CZMQNotificationInterface();
 
+    /** A call to make on every notifier, false shuts the notifier down */
+    typedef boost::function<bool(CZMQAbstractNotifier*)> Notification;
+
+    /**
+     * Hand a notification to the publisher thread, waiting while the queue is
+     * full. nSize is what it holds on to, a block or transaction copy.
+     */
+    void Enqueue(const Notification &notification, size_t nSize);
+    void ThreadPublish();
+
     void *pcontext;
+    //! Only touched by the publisher thread while it runs
     std::list<CZMQAbstractNotifier*> notifiers;
+    //! Whether any notifier publishes block contents, otherwise blocks aren't copied
+    bool fPublishBlockData;
+    //! Whether a sequence notifier is set up, otherwise mempool signals aren't connected
+    bool fPublishMempool;
+
+    CWaitableCriticalSection cs_queue;
+    CConditionVariable condQueue;
+    std::deque<std::pair<Notification, size_t> > queue;
+    size_t nQueuedBytes;
+    bool fStopping;
+    boost::thread threadPublisher;
 };
 
 #endif // BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
@@ -16,6 +16,7 @@ static const char *MSG_HASHTXLOCK = "hashtxlock";
 static const char *MSG_RAWBLOCK   = "rawblock";
 static const char *MSG_RAWTX      = "rawtx";
 static const char *MSG_RAWTXLOCK = "rawtxlock";
+static const char *MSG_SEQUENCE   = "sequence";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -73,7 +74,16 @@ bool CZMQAbstractPublishNotifier::Initialize(void *pcontext)
             return false;
         }
 
-        int rc = zmq_bind(psocket, address.c_str());
+        // must be set before binding, with a shared socket the first notifier's setting applies
+        int rc = zmq_setsockopt(psocket, ZMQ_SNDHWM, &nSendHighWaterMark, sizeof(nSendHighWaterMark));
+        if (rc!=0)
+        {
+            zmqError("Failed to set outbound message high water mark");
+            zmq_close(psocket);
+            return false;
+        }
+
+        rc = zmq_bind(psocket, address.c_str());
         if (rc!=0)
         {
             zmqError("Failed to bind address");
@@ -143,7 +153,7 @@ bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const void* d
     return true;
 }
 
-bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock &/*block*/)
 {
     uint256 hash = pindex->GetBlockHash();
     LogPrint("zmq", "zmq: Publish hashblock %s\n", hash.GetHex());
@@ -173,24 +183,14 @@ bool CZMQPublishHashTransactionLockNotifier::NotifyTransactionLock(const CTransa
     return SendMessage(MSG_HASHTXLOCK, data, 32);
 }
 
-bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock &block)
 {
     LogPrint("zmq", "zmq: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
-// XX42    const Consensus::Params& consensusParams = Params().GetConsensus();
+    // The block as it was connected, no need to go back to disk for it
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    {
-        LOCK(cs_main);
-        CBlock block;
-// XX42        if(!ReadBlockFromDisk(block, pindex, consensusParams))
-        if(!ReadBlockFromDisk(block, pindex))
-        {
-            zmqError("Can't read block from disk");
-            return false;
-        }
-
-        ss << block;
-    }
+    ss.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    ss << block;
 
     return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
 }
@@ -212,3 +212,46 @@ bool CZMQPublishRawTransactionLockNotifier::NotifyTransactionLock(const CTransac
     ss << transaction;
     return SendMessage(MSG_RAWTXLOCK, &(*ss.begin()), ss.size());
 }
+
+static bool SendSequenceMessage(CZMQAbstractPublishNotifier &notifier, const uint256 &hash, char label, const uint64_t *pnMempoolSequence = NULL)
+{
+    unsigned char data[32 + 1 + sizeof(uint64_t)];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+    data[32] = label;
+    size_t size = 33;
+    if (pnMempoolSequence)
+    {
+        WriteLE64(&data[33], *pnMempoolSequence);
+        size += sizeof(uint64_t);
+    }
+    return notifier.SendMessage(MSG_SEQUENCE, data, size);
+}
+
+bool CZMQPublishSequenceNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock &/*block*/)
+{
+    uint256 hash = pindex->GetBlockHash();
+    LogPrint("zmq", "zmq: Publish sequence block connect %s\n", hash.GetHex());
+    return SendSequenceMessage(*this, hash, 'C');
+}
+
+bool CZMQPublishSequenceNotifier::NotifyBlockDisconnected(const CBlockIndex *pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    LogPrint("zmq", "zmq: Publish sequence block disconnect %s\n", hash.GetHex());
+    return SendSequenceMessage(*this, hash, 'D');
+}
+
+bool CZMQPublishSequenceNotifier::NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence mempool acceptance %s\n", hash.GetHex());
+    return SendSequenceMessage(*this, hash, 'A', &nMempoolSequence);
+}
+
+bool CZMQPublishSequenceNotifier::NotifyTransactionRemoval(const CTransaction &transaction, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence mempool removal %s\n", hash.GetHex());
+    return SendSequenceMessage(*this, hash, 'R', &nMempoolSequence);
+}
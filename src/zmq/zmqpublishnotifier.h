@@ -15,6 +15,7 @@ private:
     uint32_t nSequence; // upcounting per message sequence number
 
 public:
+    CZMQAbstractPublishNotifier() : nSequence(0) { }
 
     /* send zmq multipart message
        parts:
@@ -31,7 +32,7 @@ public:
 class CZMQPublishHashBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock &block);
 };
 
 class CZMQPublishHashTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -49,7 +50,7 @@ public:
 class CZMQPublishRawBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock &block);
 };
 
 class CZMQPublishRawTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -64,4 +65,20 @@ public:
     bool NotifyTransactionLock(const CTransaction &transaction);
 };
 
+/**
+ * Chain and mempool changes in the order they happened, so a subscriber can
+ * keep a copy of the mempool in sync: 32 byte hash followed by
+ * 'C' (block connected), 'D' (block disconnected), 'A' (transaction added to
+ * the mempool) or 'R' (transaction removed from the mempool); A and R carry
+ * the LE 8 byte mempool sequence number of the change.
+ */
+class CZMQPublishSequenceNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock &block);
+    bool NotifyBlockDisconnected(const CBlockIndex *pindex);
+    bool NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence);
+    bool NotifyTransactionRemoval(const CTransaction &transaction, uint64_t nMempoolSequence);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H